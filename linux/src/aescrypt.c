@@ -24,1118 +24,1565 @@
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>  // getopt
+#include <getopt.h>  // getopt_long
 #include <stdlib.h>  // malloc
 #include <time.h>    // time
 #include <errno.h>   // errno
+#include <limits.h>  // LLONG_MAX
 
 #include "aescrypt.h"
 #include "password.h"
 #include "keyfile.h"
 #include "version.h"
 #include "util.h"
+#include "workers.h"
+#include "stream.h"
+#include "rekey.h"
+#include "reencrypt.h"
+#include "reader.h"
+#include "merkle.h"
+#include "split.h"
+#include "chunked.h"
+#include "checkpoint.h"
+#include "follow.h"
+#include "archive.h"
+#include "compress.h"
+#include "digest.h"
+#include "stats.h"
+#include "probes.h"
+#include "progress.h"
+#include "info.h"
+#include "keyring.h"
+#include "session.h"
+#include "provider.h"
+
+// Values returned by getopt_long() for options having no short form
+enum {
+    OPT_REKEY = 256,
+    OPT_REENCRYPT,
+    OPT_NEW_PASSWORD,
+    OPT_NEW_KEYFILE,
+    OPT_OFFSET,
+    OPT_LENGTH,
+    OPT_VERIFY,
+    OPT_MERKLE,
+    OPT_SPLIT,
+    OPT_JOIN,
+    OPT_CHUNKED,
+    OPT_CHECKPOINT,
+    OPT_CHECKPOINT_INTERVAL,
+    OPT_RESUME,
+    OPT_APPEND,
+    OPT_FOLLOW,
+    OPT_LIST,
+    OPT_EXTRACT,
+    OPT_DIGEST_PLAIN,
+    OPT_DIGEST_CIPHER,
+    OPT_MANIFEST,
+    OPT_STATS,
+    OPT_PROGRESS,
+    OPT_INFO,
+    OPT_KEYRING,
+    OPT_ITERATIONS,
+    OPT_PROVIDER
+};
+
+static const struct option long_options[] =
+{
+    {"help",         no_argument,       NULL, 'h'},
+    {"version",      no_argument,       NULL, 'v'},
+    {"decrypt",      no_argument,       NULL, 'd'},
+    {"encrypt",      no_argument,       NULL, 'e'},
+    {"keyfile",      required_argument, NULL, 'k'},
+    {"password",     required_argument, NULL, 'p'},
+    {"output",       required_argument, NULL, 'o'},
+    {"jobs",         required_argument, NULL, 'j'},
+    {"rekey",        no_argument,       NULL, OPT_REKEY},
+    {"reencrypt",    no_argument,       NULL, OPT_REENCRYPT},
+    {"new-password", required_argument, NULL, OPT_NEW_PASSWORD},
+    {"new-keyfile",  required_argument, NULL, OPT_NEW_KEYFILE},
+    {"offset",       required_argument, NULL, OPT_OFFSET},
+    {"length",       required_argument, NULL, OPT_LENGTH},
+    {"verify",       no_argument,       NULL, OPT_VERIFY},
+    {"merkle",       optional_argument, NULL, OPT_MERKLE},
+    {"split",        required_argument, NULL, OPT_SPLIT},
+    {"join",         no_argument,       NULL, OPT_JOIN},
+    {"chunked",      optional_argument, NULL, OPT_CHUNKED},
+    {"checkpoint",   required_argument, NULL, OPT_CHECKPOINT},
+    {"checkpoint-interval", required_argument, NULL, OPT_CHECKPOINT_INTERVAL},
+    {"resume",       no_argument,       NULL, OPT_RESUME},
+    {"append",       no_argument,       NULL, OPT_APPEND},
+    {"follow",       optional_argument, NULL, OPT_FOLLOW},
+    {"archive",      no_argument,       NULL, 'a'},
+    {"compress",     required_argument, NULL, 'z'},
+    {"list",         no_argument,       NULL, OPT_LIST},
+    {"extract",      required_argument, NULL, OPT_EXTRACT},
+    {"digest-plain", required_argument, NULL, OPT_DIGEST_PLAIN},
+    {"digest-cipher", required_argument, NULL, OPT_DIGEST_CIPHER},
+    {"manifest",     required_argument, NULL, OPT_MANIFEST},
+    {"stats",        optional_argument, NULL, OPT_STATS},
+    {"progress",     optional_argument, NULL, OPT_PROGRESS},
+    {"info",         no_argument,       NULL, OPT_INFO},
+    {"keyring",      required_argument, NULL, OPT_KEYRING},
+    {"iterations",   required_argument, NULL, OPT_ITERATIONS},
+    {"provider",     required_argument, NULL, OPT_PROVIDER},
+    {NULL,           0,                 NULL, 0}
+};
 
 /*
- *  encrypt_stream
+ *  usage
  *
  *  Description:
- *      This function is called to encrypt the input data stream.
+ *      Displays the program usage to the user.
  *
  *  Parameters:
- *      infp [in]
- *          The input file stream to encrypt.
- *
- *      outfp [in]
- *          The output file stream into which encrypted data is written.
- *
- *      passwd [in]
- *          The UTF-16LE encoded password used for encryption.
- *
- *      passlen [in]
- *          The length of the password in octets.
+ *      progname [in]
+ *          The name of the program to display in the usage string.
  *
  *  Returns:
- *      0 if successful, otherwise there was an error.
+ *      Nothing.
  *
  *  Comments:
  *      None.
  */
-int encrypt_stream(FILE *infp, FILE *outfp, unsigned char* passwd, int passlen)
+void usage(const char *progname)
 {
-    aes_context aes_ctx;
-    sha256_context sha_ctx;
-    aescrypt_hdr aeshdr;
-    sha256_t digest;
-    unsigned char IV[16];
-    unsigned char iv_key[48];
-    unsigned i, j;
-    size_t bytes_read;
-    unsigned char buffer[32];
-    unsigned char ipad[64], opad[64];
-    time_t current_time;
-    pid_t process_id;
-    FILE *randfp = NULL;
-    unsigned char tag_buffer[256];
-
-    // Open the source for random data.  Note that while the entropy
-    // might be lower with /dev/urandom than /dev/random, it will not
-    // fail to produce something.  Also, we're going to hash the result
-    // anyway.
-    if ((randfp = fopen("/dev/urandom", "r")) == NULL)
-    {
-        perror("Error open /dev/urandom:");
-        return -1;
-    }
-
-    // Create the 16-octet IV and 32-octet encryption key
-    // used for encrypting the plaintext file.  We do
-    // not trust the rand() function, so we improve on
-    // that by also hashing the random digits and using
-    // only a portion of the hash.  This IV and key
-    // generation could be replaced with any good random
-    // source of data.
-    memset(iv_key, 0, 48);
-    for (i=0; i<48; i+=16)
-    {
-        memset(buffer, 0, 32);
-        sha256_starts(&sha_ctx);
-        for (j = 0; j < 256; j++)
-        {
-            if ((bytes_read = fread(buffer, 1, 32, randfp)) != 32)
-            {
-                fprintf(stderr, "Error: Couldn't read from /dev/urandom : %u\n",
-                        (unsigned) bytes_read);
-                fclose(randfp);
-                return -1;
-            }
-            sha256_update(&sha_ctx, buffer, 32);
-        }
-        sha256_finish(&sha_ctx, digest);
-        memcpy(iv_key+i, digest, 16);
-    }
-
-    // Write an AES signature at the head of the file, along
-    // with the AES file format version number.
-    buffer[0] = 'A';
-    buffer[1] = 'E';
-    buffer[2] = 'S';
-    buffer[3] = (unsigned char) 0x02;   // Version 2
-    buffer[4] = '\0';                   // Reserved for version 0
-    if (fwrite(buffer, 1, 5, outfp) != 5)
-    {
-        fprintf(stderr, "Error: Could not write out header data\n");
-        fclose(randfp);
-        return -1;
-    }
-
-    // Write out the CREATED-BY tag
-    j = 11 +                   // "CREATED-BY\0"
-        strlen(PROG_NAME) +    // Program name
-        1 +                    // Space
-        strlen(PROG_VERSION);  // Program version ID
-
-    // Our extension buffer is only 256 octets long, so
-    // let's not write an extension if it is too big
-    if (j < 256)
-    {
-        buffer[0] = '\0';
-        buffer[1] = (unsigned char) (j & 0xff);
-        if (fwrite(buffer, 1, 2, outfp) != 2)
-        {
-            fprintf(stderr, "Error: Could not write tag to AES file (1)\n");
-            fclose(randfp);
-            return -1;
-        }
-
-        strncpy((char *)tag_buffer, "CREATED_BY", 255);
-        tag_buffer[255] = '\0';
-        if (fwrite(tag_buffer, 1, 11, outfp) != 11)
-        {
-            fprintf(stderr, "Error: Could not write tag to AES file (2)\n");
-            fclose(randfp);
-            return -1;
-        }
-
-        sprintf((char *)tag_buffer, "%s %s", PROG_NAME, PROG_VERSION);
-        j = strlen((char *)tag_buffer);
-        if (fwrite(tag_buffer, 1, j, outfp) != j)
-        {
-            fprintf(stderr, "Error: Could not write tag to AES file (3)\n");
-            fclose(randfp);
-            return -1;
-        }
-    }
+    const char* progname_real; // contains the real name of the program
+                               //  (without path)
 
-    // Write out the "container" extension
-    buffer[0] = '\0';
-    buffer[1] = (unsigned char) 128;
-    if (fwrite(buffer, 1, 2, outfp) != 2)
-    {
-        fprintf(stderr, "Error: Could not write tag to AES file (4)\n");
-        fclose(randfp);
-        return -1;
-    }
-    memset(tag_buffer, 0, 128);
-    if (fwrite(tag_buffer, 1, 128, outfp) != 128)
-    {
-        fprintf(stderr, "Error: Could not write tag to AES file (5)\n");
-        fclose(randfp);
-        return -1;
-    }
+    progname_real = strrchr(progname, '/');
 
-    // Write out 0x0000 to indicate that no more extensions exist
-    buffer[0] = '\0';
-    buffer[1] = '\0';
-    if (fwrite(buffer, 1, 2, outfp) != 2)
+    if (progname_real == NULL) //no path in progname: use progname
     {
-        fprintf(stderr, "Error: Could not write tag to AES file (6)\n");
-        fclose(randfp);
-        return -1;
+        progname_real = progname;
     }
-
-    // We will use an initialization vector comprised of the current time
-    // process ID, and random data, all hashed together with SHA-256.
-    sha256_starts(  &sha_ctx);
-
-    current_time = time(NULL);
-    sha256_update(  &sha_ctx,
-                    (unsigned char *)&current_time,
-                    sizeof(current_time));
-
-    process_id = getpid();
-    sha256_update(  &sha_ctx, (unsigned char *)&process_id, sizeof(process_id));
-
-    for (i=0; i<256; i++)
+    else
     {
-        if (fread(buffer, 1, 32, randfp) != 32)
-        {
-            fprintf(stderr, "Error: Couldn't read from /dev/random\n");
-            fclose(randfp);
-            return -1;
-        }
-        sha256_update(&sha_ctx, buffer, 32);
+        progname_real++;
     }
 
-    sha256_finish(&sha_ctx, digest);
+    fprintf(stderr,
+            "usage: %s {-e|-d} [ { -p <password> | -k <keyfile> } ] "
+            "[-o <output filename>] [<file> ...]\n"
+            "       %s --rekey [ { -p <password> | -k <keyfile> } ] "
+            "[ { --new-password <password> | --new-keyfile <keyfile> } ] "
+            "[-j <jobs>] <file> ...\n"
+            "       %s --reencrypt [ { -p <password> | -k <keyfile> } ] "
+            "[ { --new-password <password> | --new-keyfile <keyfile> } ] "
+            "[-o <output filename>] [-j <jobs>] <file> ...\n"
+            "       %s -d [ { -p <password> | -k <keyfile> } ] "
+            "--offset <offset> [--length <length>] [--verify] "
+            "[-o <output filename>] <file>\n"
+            "       %s -d [ { -p <password> | -k <keyfile> } ] --verify "
+            "[-j <jobs>] <file> ...\n"
+            "       %s -e --split <size> [ { -p <password> | -k <keyfile> } ] "
+            "[-o <base filename>] [-j <jobs>] <file>\n"
+            "       %s -d --join [ { -p <password> | -k <keyfile> } ] "
+            "[-o <output filename>] [-j <jobs>] <base filename>\n"
+            "       %s -e --checkpoint <file> [--checkpoint-interval <size>] "
+            "[--resume] [ { -p <password> | -k <keyfile> } ] "
+            "-o <output filename> <file>\n"
+            "       %s -e --append [ { -p <password> | -k <keyfile> } ] "
+            "-o <output filename> <file>\n"
+            "       %s -e --follow[=<seconds>] [--split <size>] "
+            "[ { -p <password> | -k <keyfile> } ] "
+            "[-o <base filename>] <file>\n"
+            "       %s -e -a [--chunked[=<chunk size>]] "
+            "[ { -p <password> | -k <keyfile> } ] "
+            "[-o <output filename>] [-j <jobs>] <path> ...\n"
+            "       %s -d -a [ { -p <password> | -k <keyfile> } ] "
+            "[-o <directory>] <file>\n"
+            "       %s -d -a { --list | --extract <path> } [--verify] "
+            "[ { -p <password> | -k <keyfile> } ] "
+            "[-o <directory>] <file>\n"
+            "       %s --info [-j <jobs>] <file or directory> ...\n"
+            "  Use --merkle[=<chunk size>] with -e to add a Merkle tree.\n"
+            "  Use --chunked[=<chunk size>] with -e to write a chunked "
+            "stream.\n"
+            "  Use -z <level> with -e to compress before encrypting.\n"
+            "  Use --iterations <count> with -e to write a version 3 "
+            "stream (PBKDF2-HMAC-SHA512).\n"
+            "  Use --digest-plain <alg> and --digest-cipher <alg> with -e "
+            "to hash the\n  input and output, written to stderr or "
+            "appended to --manifest <file>.\n"
+            "  Use --stats[=json] with -e or -d to report the time taken "
+            "by each file.\n"
+            "  Send SIGUSR1 to report progress, or use --progress[=<seconds>] "
+            "to report it\n  every <seconds> (default %d).\n"
+            "  Give -p or -k more than once, or --keyring <file>, with -d "
+            "to try each key.\n"
+            "  Use --provider <name> to choose the AES and HMAC "
+            "implementation.\n",
+            progname_real,
+            progname_real,
+            progname_real,
+            progname_real,
+            progname_real,
+            progname_real,
+            progname_real,
+            progname_real,
+            progname_real,
+            progname_real,
+            progname_real,
+            progname_real,
+            progname_real,
+            progname_real,
+            PROGRESS_DEFAULT_INTERVAL);
+}
 
-    memcpy(IV, digest, 16);
+/*
+ *  version
+ *
+ *  Description:
+ *      Displays the program version to the user.
+ *
+ *  Parameters:
+ *      progname [in]
+ *          The name of the program to display in the version string.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void version(const char *progname)
+{
+    const char* progname_real; // contains the real name of the program
+                               //  (without path)
 
-    // We're finished collecting random data
-    fclose(randfp);
+    progname_real = strrchr(progname, '/');
 
-    // Write the initialization vector to the file
-    if (fwrite(IV, 1, 16, outfp) != 16)
+    if (progname_real == NULL) //no path in progname: use progname
     {
-        fprintf(stderr, "Error: Could not write out initialization vector\n");
-        return -1;
+        progname_real = progname;
     }
-
-    // Hash the IV and password 8192 times
-    memset(digest, 0, 32);
-    memcpy(digest, IV, 16);
-    for (i = 0; i < 8192; i++)
+    else
     {
-        sha256_starts(&sha_ctx);
-        sha256_update(&sha_ctx, digest, 32);
-        sha256_update(&sha_ctx, passwd, (unsigned long) passlen);
-        sha256_finish(&sha_ctx, digest);
+        progname_real++;
     }
 
-    // Set the AES encryption key
-    aes_set_key(&aes_ctx, digest, 256);
+    fprintf(stderr,
+            "%s version %s (%s)\n",
+            progname_real,
+            PROG_VERSION,
+            PROG_DATE);
+}
 
-    // Set the ipad and opad arrays with values as
-    // per RFC 2104 (HMAC).  HMAC is defined as
-    //   H(K XOR opad, H(K XOR ipad, text))
-    memset(ipad, 0x36, 64);
-    memset(opad, 0x5C, 64);
+/*
+ *  cleanup
+ *
+ *  Description:
+ *      Removes output files that are not fully and properly created.
+ *
+ *  Parameters:
+ *      outfile [in]
+ *          The name of the file to remove.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void cleanup(const char *outfile)
+{
+    if (strcmp(outfile,"-") && outfile[0] != '\0') unlink(outfile);
+}
 
-    for (i = 0; i < 32; i++)
-    {
-        ipad[i] ^= digest[i];
-        opad[i] ^= digest[i];
-    }
+/*
+ *  prompt_password
+ *
+ *  Description:
+ *      Prompt the user for a password and convert it to UTF-16LE.
+ *
+ *  Parameters:
+ *      pass [out]
+ *          A buffer of at least MAX_PASSWD_BUF octets to hold the
+ *          UTF-16LE encoded password.
+ *
+ *      mode [in]
+ *          The operating mode, which determines whether the password must
+ *          be entered twice for confirmation.
+ *
+ *  Returns:
+ *      The length of the password in octets or a negative value if there
+ *      was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+int prompt_password(unsigned char *pass, encryptmode_t mode)
+{
+    unsigned char pass_input[MAX_PASSWD_BUF];
+    int passlen;
 
-    sha256_starts(&sha_ctx);
-    sha256_update(&sha_ctx, ipad, 64);
+    passlen = read_password(pass_input, mode);
 
-    // Encrypt the IV and key used to encrypt the plaintext file,
-    // writing that encrypted text to the output file.
-    for (i = 0; i < 48; i += 16)
+    switch (passlen)
     {
-        // Place the next 16 octets of IV and key buffer into
-        // the input buffer.
-        memcpy(buffer, iv_key+i, 16);
-
-        // XOR plain text block with previous encrypted
-        // output (i.e., use CBC)
-        for (j = 0; j < 16; j++) buffer[j] ^= IV[j];
-
-        // Encrypt the contents of the buffer
-        aes_encrypt(&aes_ctx, buffer, buffer);
-
-        // Concatenate the "text" as we compute the HMAC
-        sha256_update(&sha_ctx, buffer, 16);
+        case AESCRYPT_READPWD_NONE:
+        case AESCRYPT_READPWD_FOPEN:
+        case AESCRYPT_READPWD_FILENO:
+        case AESCRYPT_READPWD_TCGETATTR:
+        case AESCRYPT_READPWD_TCSETATTR:
+        case AESCRYPT_READPWD_FGETC:
+        case AESCRYPT_READPWD_TOOLONG:
+            fprintf(stderr, "Error reading password: %s.\n",
+                    read_password_error(passlen));
+            return -1;
 
-        // Write the encrypted block
-        if (fwrite(buffer, 1, 16, outfp) != 16)
-        {
-            fprintf(stderr, "Error: Could not write iv_key data\n");
+        case AESCRYPT_READPWD_NOMATCH:
+            fprintf(stderr, "Error: Passwords don't match.\n");
             return -1;
-        }
 
-        // Update the IV (CBC mode)
-        memcpy(IV, buffer, 16);
+        default:
+            // Proceed, any other error codes will be caught below
+            break;
     }
 
-    // Write the HMAC
-    sha256_finish(&sha_ctx, digest);
-    sha256_starts(&sha_ctx);
-    sha256_update(&sha_ctx, opad, 64);
-    sha256_update(&sha_ctx, digest, 32);
-    sha256_finish(&sha_ctx, digest);
-
-    // Write the encrypted block
-    if (fwrite(digest, 1, 32, outfp) != 32)
+    // If there was any other error, exit
+    if (passlen <= 0)
     {
-        fprintf(stderr, "Error: Could not write iv_key HMAC\n");
+        fprintf(stderr, "Error: Unknown error reading the password.\n");
         return -1;
     }
 
-    // Re-load the IV and encryption key with the IV and
-    // key to now encrypt the datafile.  Also, reset the HMAC
-    // computation.
-    memcpy(IV, iv_key, 16);
+    passlen = passwd_to_utf16(pass_input,
+                              strlen((char *) pass_input),
+                              MAX_PASSWD_LEN,
+                              pass);
 
-    // Set the AES encryption key
-    aes_set_key(&aes_ctx, iv_key+16, 256);
-
-    // Set the ipad and opad arrays with values as
-    // per RFC 2104 (HMAC).  HMAC is defined as
-    //   H(K XOR opad, H(K XOR ipad, text))
-    memset(ipad, 0x36, 64);
-    memset(opad, 0x5C, 64);
+    // For security reasons, erase the password
+    secure_erase(pass_input, MAX_PASSWD_BUF);
 
-    for (i = 0; i < 32; i++)
-    {
-        ipad[i] ^= iv_key[i+16];
-        opad[i] ^= iv_key[i+16];
-    }
+    return passlen;
+}
 
-    // Wipe the IV and encryption key from memory
-    secure_erase(iv_key, 48);
+/*
+ *  parse_number
+ *
+ *  Description:
+ *      Parse a decimal number given on the command line.
+ *
+ *  Parameters:
+ *      string [in]
+ *          The number string.
+ *
+ *      max [in]
+ *          The largest value accepted.
+ *
+ *      value [out]
+ *          The number.
+ *
+ *      suffix [out]
+ *          Set to the first character after the digits, or NULL if no
+ *          characters may follow the digits.
+ *
+ *  Returns:
+ *      0 if successful, otherwise the number is invalid.
+ *
+ *  Comments:
+ *      Only digits are accepted, so empty strings, signs, and white space
+ *      are rejected, as are values that overflow or exceed the maximum.
+ */
+int parse_number(const char *string,
+                 unsigned long long max,
+                 unsigned long long *value,
+                 const char **suffix)
+{
+    char *endptr;
 
-    sha256_starts(&sha_ctx);
-    sha256_update(&sha_ctx, ipad, 64);
+    if ((*string < '0') || (*string > '9')) return -1;
 
-    // Initialize the last_block_size value to 0
-    aeshdr.last_block_size = 0;
+    errno = 0;
+    *value = strtoull(string, &endptr, 10);
+    if (errno || (*value > max)) return -1;
 
-    while ((bytes_read = fread(buffer, 1, 16, infp)) > 0)
+    if (suffix != NULL)
     {
-        // XOR plain text block with previous encrypted
-        // output (i.e., use CBC)
-        for (i = 0; i < 16; i++) buffer[i] ^= IV[i];
-
-        // Encrypt the contents of the buffer
-        aes_encrypt(&aes_ctx, buffer, buffer);
-
-        // Concatenate the "text" as we compute the HMAC
-        sha256_update(&sha_ctx, buffer, 16);
-
-        // Write the encrypted block
-        if (fwrite(buffer, 1, 16, outfp) != 16)
-        {
-            fprintf(stderr, "Error: Could not write to output file\n");
-            return -1;
-        }
-
-        // Update the IV (CBC mode)
-        memcpy(IV, buffer, 16);
-
-        // Assume this number of octets is the file modulo
-        aeshdr.last_block_size = bytes_read;
+        *suffix = endptr;
     }
-
-    // Check to see if we had a read error
-    if (ferror(infp))
+    else if (*endptr != '\0')
     {
-        fprintf(stderr, "Error: Couldn't read input file\n");
         return -1;
     }
 
-    // Write the file size modulo
-    buffer[0] = (char) (aeshdr.last_block_size & 0x0F);
-    if (fwrite(buffer, 1, 1, outfp) != 1)
+    return 0;
+}
+
+/*
+ *  parse_size
+ *
+ *  Description:
+ *      Parse a size given on the command line, which may have a suffix
+ *      of K, M, G, or T for multiples of 1024.
+ *
+ *  Parameters:
+ *      string [in]
+ *          The size string.
+ *
+ *      size [out]
+ *          The size in octets.
+ *
+ *  Returns:
+ *      0 if successful, otherwise the size is invalid.
+ *
+ *  Comments:
+ *      A size of zero is considered invalid.
+ */
+int parse_size(const char *string, off_t *size)
+{
+    const char *endptr;
+    unsigned long long value;
+    unsigned shift = 0;
+
+    if (parse_number(string, LLONG_MAX, &value, &endptr) || !value)
     {
-        fprintf(stderr, "Error: Could not write the file size modulo\n");
         return -1;
     }
 
-    // Write the HMAC
-    sha256_finish(&sha_ctx, digest);
-    sha256_starts(&sha_ctx);
-    sha256_update(&sha_ctx, opad, 64);
-    sha256_update(&sha_ctx, digest, 32);
-    sha256_finish(&sha_ctx, digest);
-
-    if (fwrite(digest, 1, 32, outfp) != 32)
+    switch (*endptr)
     {
-        fprintf(stderr, "Error: Could not write the file HMAC\n");
-        return -1;
+        case 'k': case 'K': shift = 10; endptr++; break;
+        case 'm': case 'M': shift = 20; endptr++; break;
+        case 'g': case 'G': shift = 30; endptr++; break;
+        case 't': case 'T': shift = 40; endptr++; break;
+        default: break;
     }
 
-    // Flush the output buffer to ensure all data is written to disk
-    if (fflush(outfp))
+    if ((*endptr != '\0') || (value > ((unsigned long long) LLONG_MAX >>
+                                        shift)))
     {
-        fprintf(stderr, "Error: Could not flush output file buffer\n");
         return -1;
     }
 
+    *size = (off_t) value << shift;
+
     return 0;
 }
 
 /*
- *  decrypt_stream
+ *  write_digests
  *
  *  Description:
- *      This function is called to decrypt the input data stream.
+ *      Report the digests computed while encrypting.
  *
  *  Parameters:
- *      infp [in]
- *          The input file stream to decrypt.
+ *      manifest [in]
+ *          The file to append the digests to, or NULL for stderr.
  *
- *      outfp [in]
- *          The output file stream into which decrypted data is written.
+ *      digests [in]
+ *          The digests.
  *
- *      passwd [in]
- *          The UTF-16LE encoded password used for encryption.
+ *      plain_name [in]
+ *          The name of the plaintext, or "-" for stdin.
  *
- *      passlen [in]
- *          The length of the password in octets.
+ *      cipher_name [in]
+ *          The name of the output file, or "-" for stdout.
  *
  *  Returns:
- *      0 if successful, otherwise there was an error.
+ *      0 if successful, otherwise -1.
  *
  *  Comments:
- *      None.
+ *      The digests are written in the form accepted by "sha256sum -c".
  */
-int decrypt_stream(FILE *infp, FILE *outfp, unsigned char* passwd, int passlen)
+int write_digests(const char *manifest,
+                  const stream_digests *digests,
+                  const char *plain_name,
+                  const char *cipher_name)
 {
-    aes_context aes_ctx;
-    sha256_context sha_ctx;
-    aescrypt_hdr aeshdr;
-    sha256_t digest;
-    unsigned char IV[16];
-    unsigned char iv_key[48];
-    unsigned i, j, n;
-    size_t bytes_read;
-    unsigned char buffer[64], buffer2[32];
-    unsigned char *head, *tail;
-    unsigned char ipad[64], opad[64];
-    int reached_eof = 0;
-
-    // Read the file header
-    if ((bytes_read = fread(&aeshdr, 1, sizeof(aeshdr), infp)) !=
-         sizeof(aescrypt_hdr))
-    {
-        if (feof(infp))
-        {
-            fprintf(stderr, "Error: Input file is too short.\n");
-        }
-        else
-        {
-            perror("Error reading the file header:");
-        }
-        return -1;
-    }
-
-    if (!(aeshdr.aes[0] == 'A' && aeshdr.aes[1] == 'E' &&
-          aeshdr.aes[2] == 'S'))
-    {
-        fprintf(stderr,
-                "Error: Bad file header (not aescrypt file or is corrupted? "
-                "[%x, %x, %x])\n",
-                aeshdr.aes[0],
-                aeshdr.aes[1],
-                aeshdr.aes[2]);
-        return -1;
-    }
+    FILE *fp = stderr;
+    int rc = 0;
 
-    // Validate the version number and take any version-specific actions
-    if (aeshdr.version == 0)
-    {
-        // Let's just consider the least significant nibble to determine
-        // the size of the last block
-        aeshdr.last_block_size = (aeshdr.last_block_size & 0x0F);
-    }
-    else if (aeshdr.version > 0x02)
+    if ((manifest != NULL) && ((fp = fopen(manifest, "a")) == NULL))
     {
-        fprintf(stderr, "Error: Unsupported AES file version: %d\n",
-                aeshdr.version);
+        fprintf(stderr, "Error opening manifest file %s : ", manifest);
+        perror("");
         return -1;
     }
 
-    // Skip over extensions present v2 and later files
-    if (aeshdr.version >= 0x02)
-    {
-        do
-        {
-            if ((bytes_read = fread(buffer, 1, 2, infp)) != 2)
-            {
-                if (feof(infp))
-                {
-                    fprintf(stderr, "Error: Input file is too short.\n");
-                }
-                else
-                {
-                    perror("Error reading the file extensions:");
-                }
-                return -1;
-            }
-            // Determine the extension length, zero means no more extensions
-            i = j = (((int)buffer[0]) << 8) | (int)buffer[1];
-            while (i--)
-            {
-                if ((bytes_read = fread(buffer, 1, 1, infp)) != 1)
-                {
-                    if (feof(infp))
-                    {
-                        fprintf(stderr, "Error: Input file is too short.\n");
-                    }
-                    else
-                    {
-                        perror("Error reading the file extensions:");
-                    }
-                    return -1;
-                }
-            }
-        } while (j);
-    }
-
-    // Read the initialization vector from the file
-    if ((bytes_read = fread(IV, 1, 16, infp)) != 16)
+    if ((digests->plain_algorithm != NULL) &&
+        digest_print(fp, digests->plain_algorithm, digests->plain, plain_name))
     {
-        if (feof(infp))
-        {
-            fprintf(stderr, "Error: Input file is too short.\n");
-        }
-        else
-        {
-            perror("Error reading the initialization vector:");
-        }
-        return -1;
+        rc = -1;
     }
 
-    // Hash the IV and password 8192 times
-    memset(digest, 0, 32);
-    memcpy(digest, IV, 16);
-    for (i = 0; i < 8192; i++)
+    if ((digests->cipher_algorithm != NULL) &&
+        digest_print(fp,
+                     digests->cipher_algorithm,
+                     digests->cipher,
+                     cipher_name))
     {
-        sha256_starts(&sha_ctx);
-        sha256_update(&sha_ctx, digest, 32);
-        sha256_update(&sha_ctx, passwd, passlen);
-        sha256_finish(&sha_ctx, digest);
+        rc = -1;
     }
 
-    // Set the AES encryption key
-    aes_set_key(&aes_ctx, digest, 256);
+    if ((fp != stderr) && fclose(fp)) rc = -1;
 
-    // Set the ipad and opad arrays with values as
-    // per RFC 2104 (HMAC).  HMAC is defined as
-    //   H(K XOR opad, H(K XOR ipad, text))
-    memset(ipad, 0x36, 64);
-    memset(opad, 0x5C, 64);
+    if (rc) fprintf(stderr, "Error: Could not write the digests\n");
 
-    for (i = 0; i < 32; i++)
-    {
-        ipad[i] ^= digest[i];
-        opad[i] ^= digest[i];
-    }
-
-    sha256_starts(&sha_ctx);
-    sha256_update(&sha_ctx, ipad, 64);
+    return rc;
+}
 
-    // If this is a version 1 or later file, then read the IV and key
-    // for decrypting the bulk of the file.
-    if (aeshdr.version >= 0x01)
-    {
-        for (i = 0; i < 48; i += 16)
-        {
-            if ((bytes_read = fread(buffer, 1, 16, infp)) != 16)
-            {
-                if (feof(infp))
-                {
-                    fprintf(stderr, "Error: Input file is too short.\n");
-                }
-                else
-                {
-                    perror("Error reading input file IV and key:");
+/*
+ *  main
+ *
+ *  Description:
+ *      Main entry routing for the command-line AES Crypt program.
+ *
+ *  Parameters:
+ *      argc [in]
+ *          A count of the arguments passed to the program.
+ *
+ *      argv [in]
+ *          A vector of argument strings passed to the program.
+ *
+ *  Returns:
+ *      0 if successful, non-zero if there was a failure.
+ *
+ *  Comments:
+ *      None.
+ */
+int main(int argc, char *argv[])
+{
+    int rc=0;
+    int passlen=0;
+    FILE *infp = NULL;
+    FILE *outfp = NULL;
+    encryptmode_t mode=UNINIT;
+    char *infile = NULL;
+    unsigned char pass[MAX_PASSWD_BUF];
+    unsigned char new_pass[MAX_PASSWD_BUF];
+    int new_passlen = 0;
+    int file_count = 0;
+    char outfile[AES_CRYPT_MAX_PATH];
+    int password_acquired = 0;
+    unsigned jobs = 0;
+    unsigned long long number;
+    off_t range_offset = 0;
+    off_t range_length = -1;
+    int range_requested = 0;
+    int verify = 0;
+    stream_options options;
+    char sidecar[AES_CRYPT_MAX_PATH];
+    FILE *sidecar_fp = NULL;
+    off_t split_size = 0;
+    int join = 0;
+    int resume = 0;
+    int append = 0;
+    int update = 0;
+    int follow = 0;
+    unsigned long follow_interval = FOLLOW_DEFAULT_INTERVAL;
+    int archive = 0;
+    int list = 0;
+    const char *member = NULL;
+    const char *output_name = NULL;
+    stream_digests digests;
+    const char *manifest = NULL;
+    char plain_name[AES_CRYPT_MAX_PATH];
+    int stats = 0;
+    unsigned long progress_interval = 0;
+
+    memset(&options, 0, sizeof(options));
+    memset(&digests, 0, sizeof(digests));
+
+    // Initialize the output filename
+    outfile[0] = '\0';
+
+    while ((rc = getopt_long(argc,
+                             argv,
+                             "?hvdek:p:o:j:az:",
+                             long_options,
+                             NULL)) != -1)
+    {
+        switch (rc)
+        {
+            case '?':
+            case 'h':
+                usage(argv[0]);
+                return 0;
+
+            case 'v':
+                version(argv[0]);
+                return 0;
+
+            case 'd':
+                if (mode != UNINIT)
+                {
+                    fprintf(stderr,
+                            "Error: only specify one operating mode\n");
+                    cleanup(outfile);
+                    return -1;
                 }
-                return -1;
-            }
+                mode = DEC;
+                break;
 
-            memcpy(buffer2, buffer, 16);
+            case 'e':
+                if (mode != UNINIT)
+                {
+                    fprintf(stderr,
+                            "Error: only specify one operating mode\n");
+                    cleanup(outfile);
+                    return -1;
+                }
+                mode = ENC;
+                break;
 
-            sha256_update(&sha_ctx, buffer, 16);
-            aes_decrypt(&aes_ctx, buffer, buffer);
+            case OPT_REKEY:
+                if (mode != UNINIT)
+                {
+                    fprintf(stderr,
+                            "Error: only specify one operating mode\n");
+                    cleanup(outfile);
+                    return -1;
+                }
+                mode = REKEY;
+                break;
 
-            // XOR plain text block with previous encrypted
-            // output (i.e., use CBC)
-            for (j = 0; j < 16; j++) iv_key[i + j] = (buffer[j] ^ IV[j]);
+            case OPT_REENCRYPT:
+                if (mode != UNINIT)
+                {
+                    fprintf(stderr,
+                            "Error: only specify one operating mode\n");
+                    cleanup(outfile);
+                    return -1;
+                }
+                mode = REENCRYPT;
+                break;
 
-            // Update the IV (CBC mode)
-            memcpy(IV, buffer2, 16);
-        }
+            case OPT_KEYRING:
+                if (keyring_load(optarg))
+                {
+                    cleanup(outfile);
+                    return -1;
+                }
+                break;
 
-        // Verify that the HMAC is correct
-        sha256_finish(&sha_ctx, digest);
-        sha256_starts(&sha_ctx);
-        sha256_update(&sha_ctx, opad, 64);
-        sha256_update(&sha_ctx, digest, 32);
-        sha256_finish(&sha_ctx, digest);
+            case OPT_INFO:
+                if (mode != UNINIT)
+                {
+                    fprintf(stderr,
+                            "Error: only specify one operating mode\n");
+                    cleanup(outfile);
+                    return -1;
+                }
+                mode = INFO;
+                break;
 
-        if ((bytes_read = fread(buffer, 1, 32, infp)) != 32)
-        {
-            if (feof(infp))
-            {
-                fprintf(stderr, "Error: Input file is too short.\n");
-            }
-            else
-            {
-                perror("Error reading input file digest:");
-            }
-            return -1;
-        }
+            case OPT_NEW_KEYFILE:
+            case OPT_NEW_PASSWORD:
+                if (new_passlen)
+                {
+                    fprintf(stderr, "Error: new password supplied twice\n");
+                    cleanup(outfile);
+                    return -1;
+                }
+                if (rc == OPT_NEW_KEYFILE)
+                {
+                    new_passlen = ReadKeyFile(optarg, new_pass);
+                }
+                else
+                {
+                    new_passlen = passwd_to_utf16((unsigned char*) optarg,
+                                                  strlen((char *)optarg),
+                                                  MAX_PASSWD_LEN,
+                                                  new_pass);
+                }
+                if (new_passlen <= 0)
+                {
+                    fprintf(stderr, "Error: invalid new password\n");
+                    cleanup(outfile);
+                    return -1;
+                }
+                break;
 
-        if (memcmp(digest, buffer, 32))
-        {
-            fprintf(stderr,
-                    "Error: Message has been altered or password is "
-                    "incorrect\n");
-            return -1;
-        }
+            case OPT_OFFSET:
+            case OPT_LENGTH:
+                if (parse_number(optarg, LLONG_MAX, &number, NULL))
+                {
+                    fprintf(stderr, "Error: invalid range '%s'\n", optarg);
+                    cleanup(outfile);
+                    return -1;
+                }
+                if (rc == OPT_OFFSET)
+                {
+                    range_offset = (off_t) number;
+                }
+                else
+                {
+                    range_length = (off_t) number;
+                }
+                range_requested = 1;
+                break;
 
-        // Re-load the IV and encryption key with the IV and
-        // key to now encrypt the datafile.  Also, reset the HMAC
-        // computation.
-        memcpy(IV, iv_key, 16);
+            case OPT_VERIFY:
+                verify = 1;
+                break;
 
-        // Set the AES encryption key
-        aes_set_key(&aes_ctx, iv_key+16, 256);
+            case OPT_MERKLE:
+                options.merkle_chunk_size = MERKLE_DEFAULT_CHUNK_SIZE;
+                if (optarg != NULL)
+                {
+                    if (parse_number(optarg,
+                                     MERKLE_MAX_CHUNK_SIZE,
+                                     &number,
+                                     NULL) ||
+                        (number < MERKLE_MIN_CHUNK_SIZE) || (number % 16))
+                    {
+                        fprintf(stderr,
+                                "Error: Merkle chunk size must be a multiple "
+                                "of 16 from %u to %u\n",
+                                MERKLE_MIN_CHUNK_SIZE,
+                                MERKLE_MAX_CHUNK_SIZE);
+                        cleanup(outfile);
+                        return -1;
+                    }
+                    options.merkle_chunk_size = (unsigned) number;
+                }
+                break;
 
-        // Set the ipad and opad arrays with values as
-        // per RFC 2104 (HMAC).  HMAC is defined as
-        //   H(K XOR opad, H(K XOR ipad, text))
-        memset(ipad, 0x36, 64);
-        memset(opad, 0x5C, 64);
+            case OPT_CHUNKED:
+                options.chunk_size = CHUNKED_DEFAULT_CHUNK_SIZE;
+                if (optarg != NULL)
+                {
+                    if (parse_number(optarg,
+                                     CHUNKED_MAX_CHUNK_SIZE,
+                                     &number,
+                                     NULL) ||
+                        (number < CHUNKED_MIN_CHUNK_SIZE) || (number % 16))
+                    {
+                        fprintf(stderr,
+                                "Error: chunk size must be a multiple of 16 "
+                                "from %u to %u\n",
+                                CHUNKED_MIN_CHUNK_SIZE,
+                                CHUNKED_MAX_CHUNK_SIZE);
+                        cleanup(outfile);
+                        return -1;
+                    }
+                    options.chunk_size = (unsigned) number;
+                }
+                break;
 
-        for (i = 0; i < 32; i++)
-        {
-            ipad[i] ^= iv_key[i+16];
-            opad[i] ^= iv_key[i+16];
-        }
+            case OPT_ITERATIONS:
+                if (parse_number(optarg,
+                                 AES_CRYPT_V3_MAX_ITERATIONS,
+                                 &number,
+                                 NULL) ||
+                    (number < 1))
+                {
+                    fprintf(stderr,
+                            "Error: iterations must be from 1 to %d\n",
+                            AES_CRYPT_V3_MAX_ITERATIONS);
+                    cleanup(outfile);
+                    return -1;
+                }
+                options.kdf_iterations = (unsigned long) number;
+                break;
 
-        // Wipe the IV and encryption key from memory
-        secure_erase(iv_key, 48);
+            case OPT_PROVIDER:
+                if (provider_select(optarg))
+                {
+                    cleanup(outfile);
+                    return -1;
+                }
+                break;
 
-        sha256_starts(&sha_ctx);
-        sha256_update(&sha_ctx, ipad, 64);
-    }
+            case OPT_CHECKPOINT:
+                options.checkpoint = optarg;
+                break;
 
-    // Decrypt the balance of the file
+            case OPT_CHECKPOINT_INTERVAL:
+                if (parse_size(optarg, &options.checkpoint_interval))
+                {
+                    fprintf(stderr,
+                            "Error: invalid checkpoint interval '%s'\n",
+                            optarg);
+                    cleanup(outfile);
+                    return -1;
+                }
+                break;
 
-    // Attempt to initialize the ring buffer with contents from the file.
-    // Attempt to read 48 octets of the file into the ring buffer.
-    if ((bytes_read = fread(buffer, 1, 48, infp)) < 48)
-    {
-        if (!feof(infp))
-        {
-            perror("Error reading input file ring:");
-            return -1;
-        }
-        else
-        {
-            // If there are less than 48 octets, the only valid count
-            // is 32 for version 0 (HMAC) and 33 for version 1 or
-            // greater files ( file size modulo + HMAC)
-            if ((aeshdr.version == 0x00 && bytes_read != 32) ||
-                (aeshdr.version >= 0x01 && bytes_read != 33))
-            {
-                fprintf(stderr, "Error: Input file is corrupt (1:%u).\n",
-                        (unsigned) bytes_read);
-                return -1;
-            }
-            else
-            {
-                // Version 0 files would have the last block size
-                // read as part of the header, so let's grab that
-                // value now for version 1 files.
-                if (aeshdr.version >= 0x01)
+            case OPT_RESUME:
+                resume = 1;
+                break;
+
+            case OPT_APPEND:
+                append = 1;
+                break;
+
+            case OPT_FOLLOW:
+                follow = 1;
+                if (optarg != NULL)
                 {
-                    // The first octet must be the indicator of the
-                    // last block size.
-                    aeshdr.last_block_size = (buffer[0] & 0x0F);
+                    if (parse_number(optarg, UINT_MAX, &number, NULL))
+                    {
+                        fprintf(stderr,
+                                "Error: invalid follow interval '%s'\n",
+                                optarg);
+                        cleanup(outfile);
+                        return -1;
+                    }
+                    follow_interval = (unsigned long) number;
                 }
-                // If this initial read indicates there is no encrypted
-                // data, then there should be 0 in the last_block_size field
-                if (aeshdr.last_block_size != 0)
+                break;
+
+            case OPT_SPLIT:
+                if (parse_size(optarg, &split_size))
                 {
-                    fprintf(stderr, "Error: Input file is corrupt (2).\n");
+                    fprintf(stderr,
+                            "Error: invalid volume size '%s'\n",
+                            optarg);
+                    cleanup(outfile);
                     return -1;
                 }
-            }
-            reached_eof = 1;
-        }
-    }
-    head = buffer + 48;
-    tail = buffer;
+                break;
 
-    while (!reached_eof)
-    {
-        // Check to see if the head of the buffer is past the ring buffer
-        if (head == (buffer + 64))
-        {
-            head = buffer;
-        }
+            case OPT_JOIN:
+                join = 1;
+                break;
 
-        if ((bytes_read = fread(head, 1, 16, infp)) < 16)
-        {
-            if (!feof(infp))
-            {
-                perror("Error reading input file:");
-                return -1;
-            }
-            else
-            {
-                // The last block for v0 must be 16 and for v1 it must be 1
-                if ((aeshdr.version == 0x00 && bytes_read > 0) ||
-                    (aeshdr.version >= 0x01 && bytes_read != 1))
+            case 'z':
+                if (parse_number(optarg, COMPRESS_MAX_LEVEL, &number, NULL) ||
+                    (number < COMPRESS_MIN_LEVEL))
                 {
-                    fprintf(stderr, "Error: Input file is corrupt (3:%u).\n",
-                            (unsigned) bytes_read);
+                    fprintf(stderr,
+                            "Error: compression level must be from %d to "
+                            "%d\n",
+                            COMPRESS_MIN_LEVEL,
+                            COMPRESS_MAX_LEVEL);
+                    cleanup(outfile);
+                    return -1;
+                }
+                options.compression_level = (int) number;
+                break;
+
+            case 'j':
+                if (parse_number(optarg, UINT_MAX, &number, NULL) ||
+                    (number == 0))
+                {
+                    fprintf(stderr, "Error: invalid job count '%s'\n", optarg);
+                    cleanup(outfile);
                     return -1;
                 }
+                jobs = (unsigned) number;
+                break;
 
-                // If this is a v1 file, then the file modulo is located
-                // in the ring buffer at tail + 16 (with consideration
-                // given to wrapping around the ring, in which case
-                // it would be at buffer[0])
-                if (aeshdr.version >= 0x01)
+            case 'k':
+                if (optarg != 0)
                 {
-                    if ((tail + 16) < (buffer + 64))
+                    if (!strcmp("-",optarg))
                     {
-                        aeshdr.last_block_size = (tail[16] & 0x0F);
+                        fprintf(stderr,
+                                "Error: keyfile cannot be read from stdin\n");
+                        cleanup(outfile);
+                        return -1;
                     }
-                    else
+
+                    // Further key files form a key ring
+                    if (password_acquired)
+                    {
+                        if (keyring_add_keyfile(optarg))
+                        {
+                            cleanup(outfile);
+                            return -1;
+                        }
+                        break;
+                    }
+
+                    passlen = ReadKeyFile(optarg, pass);
+                    if (passlen < 0)
                     {
-                        aeshdr.last_block_size = (buffer[0] & 0x0F);
+                        cleanup(outfile);
+                        return -1;
                     }
+                    password_acquired = 1;
                 }
+                break;
 
-                // Indicate that we've reached the end of the file
-                reached_eof = 1;
-            }
-        }
+            case 'p':
+                if (password_acquired && (optarg != 0))
+                {
+                    // Further passwords form a key ring
+                    if (keyring_add_password(optarg))
+                    {
+                        cleanup(outfile);
+                        return -1;
+                    }
+                }
+                else if (optarg != 0)
+                {
+                    passlen = passwd_to_utf16((unsigned char*) optarg,
+                                              strlen((char *)optarg),
+                                              MAX_PASSWD_LEN,
+                                              pass);
+                    if (passlen < 0)
+                    {
+                        cleanup(outfile);
+                        return -1;
+                    }
+                    password_acquired = 1;
+                }
+                break;
 
-        // Process data that has been read.  Note that if the last
-        // read operation returned no additional data, there is still
-        // one one ciphertext block for us to process if this is a v0 file.
-        if ((bytes_read > 0) || (aeshdr.version == 0x00))
-        {
-            // Advance the head of the buffer forward
-            if (bytes_read > 0) head += 16;
+            case 'o':
+                // outfile argument, opened once all options are known
+                output_name = optarg;
+                break;
 
-            memcpy(buffer2, tail, 16);
+            case 'a':
+                archive = 1;
+                break;
 
-            sha256_update(&sha_ctx, tail, 16);
-            aes_decrypt(&aes_ctx, tail, tail);
+            case OPT_LIST:
+                list = 1;
+                break;
 
-            // XOR plain text block with previous encrypted
-            // output (i.e., use CBC)
-            for (i = 0; i < 16; i++) tail[i] ^= IV[i];
+            case OPT_EXTRACT:
+                member = optarg;
+                break;
 
-            // Update the IV (CBC mode)
-            memcpy(IV, buffer2, 16);
+            case OPT_DIGEST_PLAIN:
+            case OPT_DIGEST_CIPHER:
+                if (((rc == OPT_DIGEST_PLAIN) ?
+                        (digests.plain_algorithm = digest_find(optarg)) :
+                        (digests.cipher_algorithm = digest_find(optarg))) ==
+                    NULL)
+                {
+                    fprintf(stderr,
+                            "Error: Unsupported digest algorithm '%s'\n",
+                            optarg);
+                    cleanup(outfile);
+                    return -1;
+                }
+                options.digests = &digests;
+                break;
 
-            // If this is the final block, then we may
-            // write less than 16 octets
-            n = ((!reached_eof) ||
-                 (aeshdr.last_block_size == 0)) ? 16 : aeshdr.last_block_size;
+            case OPT_MANIFEST:
+                manifest = optarg;
+                break;
 
-            // Write the decrypted block
-            if ((i = fwrite(tail, 1, n, outfp)) != n)
-            {
-                perror("Error writing decrypted block:");
-                return -1;
-            }
+            case OPT_STATS:
+                if ((optarg != NULL) && strcmp(optarg, "json") &&
+                    strcmp(optarg, "text"))
+                {
+                    fprintf(stderr,
+                            "Error: Invalid statistics format '%s'\n",
+                            optarg);
+                    cleanup(outfile);
+                    return -1;
+                }
+                stats = ((optarg != NULL) && !strcmp(optarg, "json")) ?
+                            STATS_REPORT_JSON : STATS_REPORT_TEXT;
+                break;
+
+            case OPT_PROGRESS:
+                progress_interval = PROGRESS_DEFAULT_INTERVAL;
+                if (optarg != NULL)
+                {
+                    if (parse_number(optarg, UINT_MAX, &number, NULL))
+                    {
+                        fprintf(stderr,
+                                "Error: invalid progress interval '%s'\n",
+                                optarg);
+                        cleanup(outfile);
+                        return -1;
+                    }
+                    progress_interval = (unsigned long) number;
+                }
+                break;
 
-            // Move the tail of the ring buffer forward
-            tail += 16;
-            if (tail == (buffer+64)) tail = buffer;
+            default:
+                fprintf(stderr, "Error: Unknown option '%c'\n", rc);
+                cleanup(outfile);
+                return -1;
         }
     }
 
-    // Verify that the HMAC is correct
-    sha256_finish(&sha_ctx, digest);
-    sha256_starts(&sha_ctx);
-    sha256_update(&sha_ctx, opad, 64);
-    sha256_update(&sha_ctx, digest, 32);
-    sha256_finish(&sha_ctx, digest);
-
-    // Copy the HMAC read from the file into buffer2
-    if (aeshdr.version == 0x00)
+    // Several passwords and key files form a key ring, from which the one
+    // that decrypts each file is chosen
+    if (keyring_count())
     {
-        memcpy(buffer2, tail, 16);
-        tail += 16;
-        if (tail == (buffer + 64)) tail = buffer;
-        memcpy(buffer2 + 16, tail, 16);
+        if (password_acquired && keyring_add(pass, passlen))
+        {
+            cleanup(outfile);
+            return -1;
+        }
+        passlen = keyring_get(0, pass);
     }
-    else
+
+    // Files are only described, on stdout, when given --info
+    if ((mode == INFO) && (output_name != NULL))
     {
-        memcpy(buffer2, tail+1, 15);
-        tail += 16;
-        if (tail == (buffer + 64)) tail = buffer;
-        memcpy(buffer2 + 15, tail, 16);
-        tail += 16;
-        if (tail == (buffer + 64)) tail = buffer;
-        memcpy(buffer2+31, tail, 1);
+        fprintf(stderr, "Error: --info writes to stdout and takes no -o\n");
+        return -1;
     }
 
-    if (memcmp(digest, buffer2, 32))
+    // Open the output file; when resuming or appending, an existing
+    // output file is updated in place.  When extracting an archive, the
+    // output name is the directory into which to extract.  Re-encryption
+    // writes its output itself, replacing it only once the input has been
+    // verified.
+    if ((output_name != NULL) && !(archive && (mode == DEC)) &&
+        (mode != REKEY) && (mode != REENCRYPT))
     {
-        if (aeshdr.version == 0x00)
+        if (!strncmp("-", output_name, 2))
         {
-            fprintf(stderr,
-                    "Error: Message has been altered or password is "
-                    "incorrect\n");
+            // if '-' is outfile name then out to stdout
+            outfp = stdout;
         }
-        else
+        else if ((resume || append) &&
+                 ((outfp = fopen(output_name, "r+")) != NULL))
         {
-            fprintf(stderr,
-                    "Error: Message has been altered and should not be "
-                    "trusted\n");
+            update = 1;
+        }
+        // Appending to a file that does not exist yet creates it
+        else if ((resume || (append && (errno != ENOENT))) ||
+                 ((outfp = fopen(output_name, "w")) == NULL))
+        {
+            fprintf(stderr, "Error opening output file %s:", output_name);
+            perror("");
+            return -1;
         }
 
-        return -1;
+        // Output updated in place is never named for removal on error
+        if (!update)
+        {
+            strncpy(outfile, output_name, AES_CRYPT_MAX_PATH);
+            outfile[AES_CRYPT_MAX_PATH - 1] = '\0';
+        }
     }
 
-    // Flush the output buffer to ensure all data is written to disk
-    if (fflush(outfp))
+    if (optind >= argc)
     {
-        fprintf(stderr, "Error: Could not flush output file buffer\n");
+        fprintf(stderr, "Error: No file argument specified\n");
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+        cleanup(outfile);
         return -1;
     }
 
-    return 0;
-}
-
-/*
- *  usage
- *
- *  Description:
- *      Displays the program usage to the user.
- *
- *  Parameters:
- *      progname [in]
- *          The name of the program to display in the usage string.
- *
- *  Returns:
- *      Nothing.
- *
- *  Comments:
- *      None.
- */
-void usage(const char *progname)
-{
-    const char* progname_real; // contains the real name of the program
-                               //  (without path)
+    if (mode == UNINIT)
+    {
+        fprintf(stderr, "Error: -e or -d not specified\n");
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+        cleanup(outfile);
+        return -1;
+    }
 
-    progname_real = strrchr(progname, '/');
+    if (range_requested && ((mode != DEC) || (argc - optind > 1) ||
+                            !strcmp(argv[optind], "-")))
+    {
+        fprintf(stderr,
+                "Error: --offset and --length require -d and a single "
+                "input file\n");
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+        cleanup(outfile);
+        return -1;
+    }
 
-    if (progname_real == NULL) //no path in progname: use progname
+    if (verify && ((mode != DEC) || !strcmp(argv[optind], "-")))
     {
-        progname_real = progname;
+        fprintf(stderr, "Error: --verify requires -d and an input file\n");
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+        cleanup(outfile);
+        return -1;
     }
-    else
+
+    if (options.merkle_chunk_size && (mode != ENC))
     {
-        progname_real++;
+        fprintf(stderr, "Error: --merkle may only be used with -e\n");
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+        cleanup(outfile);
+        return -1;
     }
 
-    fprintf(stderr,
-            "usage: %s {-e|-d} [ { -p <password> | -k <keyfile> } ] "
-            "[-o <output filename>] [<file> ...]\n",
-            progname_real);
-}
+    if (options.chunk_size && ((mode != ENC) || options.merkle_chunk_size))
+    {
+        fprintf(stderr,
+                "Error: --chunked may only be used with -e and without "
+                "--merkle\n");
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+        cleanup(outfile);
+        return -1;
+    }
+    options.jobs = jobs;
 
-/*
- *  version
- *
- *  Description:
- *      Displays the program version to the user.
- *
- *  Parameters:
- *      progname [in]
- *          The name of the program to display in the version string.
- *
- *  Returns:
- *      Nothing.
- *
- *  Comments:
- *      None.
- */
-void version(const char *progname)
-{
-    const char* progname_real; // contains the real name of the program
-                               //  (without path)
+    if (options.compression_level &&
+        ((mode != ENC) || options.merkle_chunk_size || split_size ||
+         follow || append || (options.checkpoint != NULL)))
+    {
+        fprintf(stderr,
+                "Error: -z may only be used with -e and without --merkle, "
+                "--split, --follow, --append, or --checkpoint\n");
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+        cleanup(outfile);
+        return -1;
+    }
 
-    progname_real = strrchr(progname, '/');
+    if ((options.digests != NULL || (manifest != NULL)) &&
+        ((options.digests == NULL) || (mode != ENC) ||
+         options.merkle_chunk_size || split_size || follow || append ||
+         (options.checkpoint != NULL)))
+    {
+        fprintf(stderr,
+                "Error: --digest-plain, --digest-cipher, and --manifest "
+                "require -e and may not be used with --merkle, --split, "
+                "--follow, --append, or --checkpoint\n");
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+        cleanup(outfile);
+        return -1;
+    }
 
-    if (progname_real == NULL) //no path in progname: use progname
+    if ((options.checkpoint != NULL || resume) &&
+        ((mode != ENC) || (options.checkpoint == NULL) ||
+         (outfp == NULL) || (outfp == stdout) || (argc - optind > 1) ||
+         !strcmp(argv[optind], "-") || options.merkle_chunk_size ||
+         options.chunk_size || split_size))
     {
-        progname_real = progname;
+        fprintf(stderr,
+                "Error: --checkpoint and --resume require -e, a single "
+                "input file, and an output file given with -o\n");
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+        cleanup(outfile);
+        return -1;
     }
-    else
+    if (append && ((mode != ENC) || (outfp == NULL) || (outfp == stdout) ||
+                   (argc - optind > 1) || options.merkle_chunk_size ||
+                   options.chunk_size || split_size ||
+                   (options.checkpoint != NULL)))
     {
-        progname_real++;
+        fprintf(stderr,
+                "Error: --append requires -e, a single input, and an "
+                "output file given with -o\n");
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+        cleanup(outfile);
+        return -1;
     }
 
-    fprintf(stderr,
-            "%s version %s (%s)\n",
-            progname_real,
-            PROG_VERSION,
-            PROG_DATE);
-}
-
-/*
- *  cleanup
- *
- *  Description:
- *      Removes output files that are not fully and properly created.
- *
- *  Parameters:
- *      outfile [in]
- *          The name of the file to remove.
- *
- *  Returns:
- *      Nothing.
- *
- *  Comments:
- *      None.
- */
-void cleanup(const char *outfile)
-{
-    if (strcmp(outfile,"-") && outfile[0] != '\0') unlink(outfile);
-}
-
-/*
- *  main
- *
- *  Description:
- *      Main entry routing for the command-line AES Crypt program.
- *
- *  Parameters:
- *      argc [in]
- *          A count of the arguments passed to the program.
- *
- *      argv [in]
- *          A vector of argument strings passed to the program.
- *
- *  Returns:
- *      0 if successful, non-zero if there was a failure.
- *
- *  Comments:
- *      None.
- */
-int main(int argc, char *argv[])
-{
-    int rc=0;
-    int passlen=0;
-    FILE *infp = NULL;
-    FILE *outfp = NULL;
-    encryptmode_t mode=UNINIT;
-    char *infile = NULL;
-    unsigned char pass_input[MAX_PASSWD_BUF];
-    unsigned char pass[MAX_PASSWD_BUF];
-    int file_count = 0;
-    char outfile[AES_CRYPT_MAX_PATH];
-    int password_acquired = 0;
-
-    // Initialize the output filename
-    outfile[0] = '\0';
-
-    while ((rc = getopt(argc, argv, "?hvdek:p:o:")) != -1)
+    if (options.kdf_iterations &&
+        (((mode != ENC) && (mode != REENCRYPT)) ||
+         options.merkle_chunk_size || options.chunk_size ||
+         split_size || follow || append || (options.checkpoint != NULL)))
     {
-        switch (rc)
-        {
-            case '?':
-            case 'h':
-                usage(argv[0]);
-                return 0;
-
-            case 'v':
-                version(argv[0]);
-                return 0;
+        fprintf(stderr,
+                "Error: --iterations may only be used with -e or "
+                "--reencrypt and without --merkle, --chunked, --split, "
+                "--follow, --append, or --checkpoint\n");
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+        cleanup(outfile);
+        return -1;
+    }
 
-            case 'd':
-                if (mode != UNINIT)
-                {
-                    fprintf(stderr, "Error: only specify one of -d or -e\n");
-                    cleanup(outfile);
-                    return -1;
-                }
-                mode = DEC;
-                break;
+    // Resuming the running HMAC needs the state of the built-in provider
+    if (strcmp(provider_selected()->name, PROVIDER_BUILTIN) &&
+        (append || (options.checkpoint != NULL)))
+    {
+        fprintf(stderr,
+                "Error: --append and --checkpoint require --provider %s\n",
+                PROVIDER_BUILTIN);
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+        cleanup(outfile);
+        return -1;
+    }
 
-            case 'e':
-                if (mode != UNINIT)
-                {
-                    fprintf(stderr, "Error: only specify one of -d or -e\n");
-                    cleanup(outfile);
-                    return -1;
-                }
-                mode = ENC;
-                break;
+    if (options.checkpoint_interval == 0)
+    {
+        options.checkpoint_interval = CHECKPOINT_DEFAULT_INTERVAL;
+    }
 
-            case 'k':
-                if (password_acquired)
-                {
-                    fprintf(stderr, "Error: password supplied twice\n");
-                    cleanup(outfile);
-                    return -1;
-                }
-                if (optarg != 0)
-                {
-                    if (!strcmp("-",optarg))
-                    {
-                        fprintf(stderr,
-                                "Error: keyfile cannot be read from stdin\n");
-                        cleanup(outfile);
-                        return -1;
-                    }
+    if (split_size && ((mode != ENC) || (argc - optind > 1) ||
+                       (outfp == stdout) || options.merkle_chunk_size ||
+                       options.chunk_size))
+    {
+        fprintf(stderr,
+                "Error: --split requires -e, a single input file, and "
+                "volumes that are not written to stdout\n");
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+        cleanup(outfile);
+        return -1;
+    }
 
-                    passlen = ReadKeyFile(optarg, pass);
-                    if (passlen < 0)
-                    {
-                        cleanup(outfile);
-                        return -1;
-                    }
-                    password_acquired = 1;
-                }
-                break;
+    if (follow && ((mode != ENC) || (argc - optind > 1) ||
+                   (outfp == stdout) || options.merkle_chunk_size ||
+                   options.chunk_size || (options.checkpoint != NULL) ||
+                   append))
+    {
+        fprintf(stderr,
+                "Error: --follow requires -e, a single input file, and "
+                "volumes that are not written to stdout\n");
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+        cleanup(outfile);
+        return -1;
+    }
 
-            case 'p':
-                if (password_acquired)
-                {
-                    fprintf(stderr, "Error: password supplied twice\n");
-                    cleanup(outfile);
-                    return -1;
-                }
-                if (optarg != 0)
-                {
-                    passlen = passwd_to_utf16((unsigned char*) optarg,
-                                              strlen((char *)optarg),
-                                              MAX_PASSWD_LEN,
-                                              pass);
-                    if (passlen < 0)
-                    {
-                        cleanup(outfile);
-                        return -1;
-                    }
-                    password_acquired = 1;
-                }
-                break;
+    if (join && ((mode != DEC) || (argc - optind > 1) ||
+                 verify || range_requested))
+    {
+        fprintf(stderr, "Error: --join requires -d and a single base name\n");
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+        cleanup(outfile);
+        return -1;
+    }
 
-            case 'o':
-                // outfile argument
-                if (!strncmp("-", optarg, 2))
-                {
-                    // if '-' is outfile name then out to stdout
-                    outfp = stdout;
-                }
-                else if ((outfp = fopen(optarg, "w")) == NULL)
-                {
-                    fprintf(stderr, "Error opening output file %s:", optarg);
-                    perror("");
-                    cleanup(outfile);
-                    return -1;
-                }
-                strncpy(outfile, optarg, AES_CRYPT_MAX_PATH);
-                outfile[AES_CRYPT_MAX_PATH - 1] = '\0';
-                break;
+    if (archive && (((mode != ENC) && (mode != DEC)) ||
+                    ((mode == DEC) && (argc - optind > 1)) ||
+                    options.merkle_chunk_size || split_size || follow ||
+                    append || (options.checkpoint != NULL) || join ||
+                    (verify && !list && (member == NULL)) ||
+                    range_requested))
+    {
+        fprintf(stderr,
+                "Error: -a requires -e or -d and may not be combined with "
+                "other modes; a single archive may be extracted\n");
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+        cleanup(outfile);
+        return -1;
+    }
 
-            default:
-                fprintf(stderr, "Error: Unknown option '%c'\n", rc);
-                cleanup(outfile);
-                return -1;
-        }
+    if ((list || (member != NULL)) &&
+        (!archive || (mode != DEC) || (list && (member != NULL)) ||
+         !strcmp(argv[optind], "-")))
+    {
+        fprintf(stderr,
+                "Error: --list and --extract require -d -a and an archive "
+                "file\n");
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+        cleanup(outfile);
+        return -1;
     }
 
-    if (optind >= argc)
+    if (stats && (((mode != ENC) && (mode != DEC)) || split_size || join ||
+                  follow || archive))
     {
-        fprintf(stderr, "Error: No file argument specified\n");
+        fprintf(stderr,
+                "Error: --stats requires -e or -d and may not be used with "
+                "--split, --join, --follow, or -a\n");
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
         cleanup(outfile);
         return -1;
     }
+    if (stats) stats_init(stats);
 
-    if (mode == UNINIT)
+    if ((keyring_count() > 1) &&
+        ((mode != DEC) || archive || join || !strcmp(argv[optind], "-")))
     {
-        fprintf(stderr, "Error: -e or -d not specified\n");
+        fprintf(stderr,
+                "Error: several passwords or key files may only be given "
+                "with -d and input files, and not with -a or --join\n");
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
         cleanup(outfile);
         return -1;
     }
 
+    // Describe files from their headers alone, needing no password
+    if (mode == INFO)
+    {
+        return info_files(argv + optind, argc - optind, jobs);
+    }
+
     // Prompt for password if not provided on the command line
     if (passlen == 0)
     {
-        passlen = read_password(pass_input, mode);
-
-        switch (passlen)
+        passlen = prompt_password(pass, mode);
+        if (passlen < 0)
         {
-            case AESCRYPT_READPWD_NONE:
-            case AESCRYPT_READPWD_FOPEN:
-            case AESCRYPT_READPWD_FILENO:
-            case AESCRYPT_READPWD_TCGETATTR:
-            case AESCRYPT_READPWD_TCSETATTR:
-            case AESCRYPT_READPWD_FGETC:
-            case AESCRYPT_READPWD_TOOLONG:
-                fprintf(stderr, "Error reading password: %s.\n",
-                        read_password_error(passlen));
-                cleanup(outfile);
-                return -1;
+            if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+            cleanup(outfile);
 
-            case AESCRYPT_READPWD_NOMATCH:
-                fprintf(stderr, "Error: Passwords don't match.\n");
-                cleanup(outfile);
-                return -1;
+            // For security reasons, erase the password
+            secure_erase(pass, MAX_PASSWD_BUF);
 
-            default:
-                // Proceed, any other error codes will be caught below
-                break;
+            return -1;
         }
+    }
+
+    // Report progress from its own thread, created before any other, when
+    // signaled and, if asked, periodically
+    if (progress_start((unsigned) progress_interval))
+    {
+        if ((outfp != stdout) && (outfp != NULL)) fclose(outfp);
+        cleanup(outfile);
+        secure_erase(pass, MAX_PASSWD_BUF);
+        return -1;
+    }
 
-        // If there was any other error, exit
-        if (passlen <= 0)
+    // Change the password of, or re-encrypt, each of the given files
+    if ((mode == REKEY) || (mode == REENCRYPT))
+    {
+        if ((output_name != NULL) &&
+            ((mode == REKEY) || (argc - optind > 1)))
         {
-            fprintf(stderr, "Error: Unknown error reading the password.\n");
-            cleanup(outfile);
+            fprintf(stderr,
+                    (mode == REKEY) ?
+                        "Error: An output file may not be specified with "
+                        "--rekey.\n" :
+                        "Error: A single output file may not be specified "
+                        "with multiple input files.\n");
+            secure_erase(pass, MAX_PASSWD_BUF);
             return -1;
         }
 
-        passlen = passwd_to_utf16(pass_input,
-                                  strlen((char *) pass_input),
-                                  MAX_PASSWD_LEN,
-                                  pass);
+        if (new_passlen == 0)
+        {
+            fprintf(stderr, "Provide the new password.\n");
+            new_passlen = prompt_password(new_pass, ENC);
+        }
 
-        if (passlen < 0)
+        if (new_passlen <= 0)
         {
-            cleanup(outfile);
+            rc = -1;
+        }
+        else if (mode == REKEY)
+        {
+            rc = rekey_files(argv + optind,
+                             argc - optind,
+                             jobs,
+                             pass,
+                             passlen,
+                             new_pass,
+                             new_passlen);
+        }
+        else
+        {
+            rc = reencrypt_files(argv + optind,
+                                 argc - optind,
+                                 jobs,
+                                 output_name,
+                                 pass,
+                                 passlen,
+                                 new_pass,
+                                 new_passlen,
+                                 options.kdf_iterations);
+        }
 
-            // For security reasons, erase the password
-            secure_erase(pass_input, MAX_PASSWD_BUF);
-            secure_erase(pass, MAX_PASSWD_BUF);
+        // For security reasons, erase the passwords
+        secure_erase(pass, MAX_PASSWD_BUF);
+        secure_erase(new_pass, MAX_PASSWD_BUF);
 
-            return -1;
+        return rc;
+    }
+
+    // Encrypt into, or decrypt from, a series of volumes
+    if (split_size || join || follow)
+    {
+        infile = argv[optind];
+        rc = 0;
+
+        if (split_size || follow)
+        {
+            // The output file name is only the base for the volume names
+            if (outfp != NULL)
+            {
+                fclose(outfp);
+                cleanup(outfile);
+            }
+            else if (!strcmp(infile, "-") ||
+                     (snprintf(outfile,
+                               AES_CRYPT_MAX_PATH,
+                               "%s%s",
+                               infile,
+                               AES_CRYPT_EXTENSION) >= AES_CRYPT_MAX_PATH))
+            {
+                fprintf(stderr,
+                        "Error: Unable to determine the volume names; "
+                        "use -o\n");
+                rc = -1;
+            }
+
+            if (!rc && follow)
+            {
+                rc = follow_file(infile,
+                                 outfile,
+                                 split_size,
+                                 (unsigned) follow_interval,
+                                 pass,
+                                 passlen);
+            }
+            else if (!rc)
+            {
+                rc = split_file(infile, outfile, split_size, jobs, pass,
+                                passlen);
+            }
+
+            // The volumes were already removed on failure
+            outfile[0] = '\0';
+        }
+        else
+        {
+            if (outfp == NULL)
+            {
+                // Strip the .aes extension from the base name
+                size_t length = strlen(infile);
+                if ((length <= AES_CRYPT_EXTENSION_LEN) ||
+                    (length >= AES_CRYPT_MAX_PATH) ||
+                    strcmp(infile + length - AES_CRYPT_EXTENSION_LEN,
+                           AES_CRYPT_EXTENSION))
+                {
+                    fprintf(stderr,
+                            "Base filename does not end in %s; use -o\n",
+                            AES_CRYPT_EXTENSION);
+                    rc = -1;
+                }
+                else
+                {
+                    memcpy(outfile, infile, length - AES_CRYPT_EXTENSION_LEN);
+                    outfile[length - AES_CRYPT_EXTENSION_LEN] = '\0';
+                    if ((outfp = fopen(outfile, "w")) == NULL)
+                    {
+                        fprintf(stderr,
+                                "Error opening output file %s : ",
+                                outfile);
+                        perror("");
+                        outfile[0] = '\0';
+                        rc = -1;
+                    }
+                }
+            }
+
+            if (!rc)
+            {
+                rc = join_volumes(infile,
+                                  outfp,
+                                  (outfp != stdout) ? outfile : NULL,
+                                  jobs,
+                                  pass,
+                                  passlen);
+            }
+
+            if ((outfp != stdout) && (outfp != NULL) && fclose(outfp) && !rc)
+            {
+                fprintf(stderr,
+                        "Error: Could not properly close output file\n");
+                rc = -1;
+            }
+        }
+
+        if (rc) cleanup(outfile);
+
+        // For security reasons, erase the password
+        secure_erase(pass, MAX_PASSWD_BUF);
+
+        return rc;
+    }
+
+    // Encrypt the given trees as an archive, or extract an archive
+    if (archive)
+    {
+        rc = 0;
+        infile = argv[optind];
+
+        if ((mode == ENC) && (outfp == NULL))
+        {
+            // Name the archive after a single tree
+            size_t length = strlen(infile);
+            while ((length > 1) && (infile[length - 1] == '/')) length--;
+            if ((argc - optind > 1) ||
+                !strcmp(infile, "-") ||
+                (length >= AES_CRYPT_MAX_PATH) ||
+                (snprintf(outfile,
+                          AES_CRYPT_MAX_PATH,
+                          "%.*s%s%s",
+                          (int) length,
+                          infile,
+                          ARCHIVE_EXTENSION,
+                          AES_CRYPT_EXTENSION) >= AES_CRYPT_MAX_PATH))
+            {
+                fprintf(stderr,
+                        "Error: Unable to determine the archive name; "
+                        "use -o\n");
+                outfile[0] = '\0';
+                rc = -1;
+            }
+            else if ((outfp = fopen(outfile, "w")) == NULL)
+            {
+                fprintf(stderr, "Error opening output file %s : ", outfile);
+                perror("");
+                outfile[0] = '\0';
+                rc = -1;
+            }
+        }
+
+        if (!rc && (mode == ENC))
+        {
+            rc = archive_create(argv + optind,
+                                argc - optind,
+                                outfp,
+                                jobs,
+                                pass,
+                                passlen,
+                                &options);
+            if ((outfp != stdout) && fclose(outfp) && !rc)
+            {
+                fprintf(stderr,
+                        "Error: Could not properly close output file\n");
+                rc = -1;
+            }
+
+            // The plaintext is the archive that decryption produces
+            if (!rc && (options.digests != NULL))
+            {
+                snprintf(plain_name, sizeof(plain_name), "%s", outfile);
+                if (outfp == stdout)
+                {
+                    strcpy(plain_name, "-");
+                }
+                else if ((strlen(plain_name) > AES_CRYPT_EXTENSION_LEN) &&
+                         !strcmp(plain_name + strlen(plain_name) -
+                                     AES_CRYPT_EXTENSION_LEN,
+                                 AES_CRYPT_EXTENSION))
+                {
+                    plain_name[strlen(plain_name) -
+                               AES_CRYPT_EXTENSION_LEN] = '\0';
+                }
+                rc = write_digests(manifest,
+                                   &digests,
+                                   plain_name,
+                                   (outfp == stdout) ? "-" : outfile);
+            }
+            if (rc) cleanup(outfile);
+        }
+        else if (!rc && list)
+        {
+            // Only the member index is decrypted
+            rc = archive_list(infile, stdout, pass, passlen, verify, jobs);
+        }
+        else if (!rc && (member != NULL))
+        {
+            rc = archive_extract_member(infile,
+                                        member,
+                                        (output_name != NULL) ?
+                                            output_name : ".",
+                                        pass,
+                                        passlen,
+                                        verify,
+                                        jobs);
+        }
+        else if (!rc)
+        {
+            if (!strcmp(infile, "-"))
+            {
+                infp = stdin;
+            }
+            else if ((infp = fopen(infile, "r")) == NULL)
+            {
+                fprintf(stderr, "Error opening input file %s : ", infile);
+                perror("");
+                rc = -1;
+            }
+
+            if (!rc)
+            {
+                rc = archive_extract(infp,
+                                     (output_name != NULL) ? output_name : ".",
+                                     pass,
+                                     passlen);
+                if (infp != stdin) fclose(infp);
+            }
         }
+
+        // For security reasons, erase the password
+        secure_erase(pass, MAX_PASSWD_BUF);
+
+        return rc;
     }
 
     file_count = argc - optind;
@@ -1159,6 +1606,7 @@ int main(int argc, char *argv[])
     while (optind < argc)
     {
         infile = argv[optind++];
+        if (stats) stats_begin_file();
 
         if(!strncmp("-", infile, 2))
         {
@@ -1193,6 +1641,11 @@ int main(int argc, char *argv[])
                 fclose(outfp);
             }
             cleanup(outfile);
+            if (stats)
+            {
+                stats_end_file(infile, -1);
+                stats_report();
+            }
 
             // For security reasons, erase the password
             secure_erase(pass, MAX_PASSWD_BUF);
@@ -1200,7 +1653,15 @@ int main(int argc, char *argv[])
             return -1;
         }
 
-        if (mode == ENC)
+        AESCRYPT_PROBE1(file_open, infile);
+
+        // Choose the password for the file from the key ring
+        if ((keyring_count() > 1) &&
+            ((passlen = keyring_select(infile, pass)) < 0))
+        {
+            rc = -1;
+        }
+        else if (mode == ENC)
         {
             if (outfp == NULL)
             {
@@ -1235,7 +1696,69 @@ int main(int argc, char *argv[])
                 }
             }
 
-            rc = encrypt_stream(infp, outfp, pass, passlen);
+            // Write the Merkle tree leaves alongside the output file
+            rc = 0;
+            if (options.merkle_chunk_size)
+            {
+                if ((outfp == stdout) ||
+                    (snprintf(sidecar,
+                              AES_CRYPT_MAX_PATH,
+                              "%s%s",
+                              outfile,
+                              MERKLE_SIDECAR_EXTENSION) >= AES_CRYPT_MAX_PATH) ||
+                    ((sidecar_fp = fopen(sidecar, "w")) == NULL))
+                {
+                    fprintf(stderr,
+                            "Error: Unable to create the Merkle tree sidecar "
+                            "for %s\n",
+                            infile);
+                    rc = -1;
+                }
+                options.merkle_sidecar = sidecar_fp;
+            }
+
+            if (!rc && resume)
+            {
+                rc = resume_stream(infp, outfp, pass, passlen, &options);
+            }
+            else if (!rc && update)
+            {
+                rc = append_stream(infp,
+                                   outfp,
+                                   output_name,
+                                   pass,
+                                   passlen,
+                                   &options);
+            }
+            else if (!rc)
+            {
+                rc = encrypt_stream(infp, outfp, pass, passlen, &options);
+                if (!rc && (options.digests != NULL))
+                {
+                    rc = write_digests(manifest,
+                                       &digests,
+                                       infile,
+                                       (outfp == stdout) ? "-" : outfile);
+                }
+            }
+
+            if (sidecar_fp != NULL)
+            {
+                if (fclose(sidecar_fp) && !rc)
+                {
+                    fprintf(stderr,
+                            "Error: Could not properly close %s\n",
+                            sidecar);
+                    rc = -1;
+                }
+                if (rc) unlink(sidecar);
+                sidecar_fp = NULL;
+            }
+        }
+        else if ((mode == DEC) && verify && !range_requested)
+        {
+            // Verify the file without producing any output
+            rc = verify_file(infile, pass, passlen, jobs);
         }
         else if (mode == DEC)
         {
@@ -1314,7 +1837,23 @@ int main(int argc, char *argv[])
 
             // should probably test against ascii, utf-16le, and utf-16be
             // encodings
-            rc = decrypt_stream(infp, outfp, pass, passlen);
+            if (range_requested)
+            {
+                // Note that the range is not authenticated unless the
+                // entire file is verified first
+                rc = decrypt_range(infile,
+                                   outfp,
+                                   pass,
+                                   passlen,
+                                   range_offset,
+                                   range_length,
+                                   verify,
+                                   jobs);
+            }
+            else
+            {
+                rc = decrypt_stream(infp, outfp, pass, passlen);
+            }
         }
 
         if ((infp != stdin) && (infp != NULL))
@@ -1334,7 +1873,24 @@ int main(int argc, char *argv[])
             }
         }
 
-        // If there was an error, remove the output file
+        AESCRYPT_PROBE2(file_close, infile, rc);
+        if (stats)
+        {
+            stats_end_file(infile, rc);
+            if (rc) stats_report();
+        }
+
+        // If there was an error, remove the output file unless it can be
+        // resumed from a checkpoint
+        if (rc && (options.checkpoint != NULL) &&
+            !access(options.checkpoint, F_OK))
+        {
+            fprintf(stderr,
+                    "Encryption of %s may be continued using --resume\n",
+                    infile);
+            secure_erase(pass, MAX_PASSWD_BUF);
+            return -1;
+        }
         if (rc)
         {
             cleanup(outfile);
@@ -1351,6 +1907,8 @@ int main(int argc, char *argv[])
         outfp = NULL;
     }
 
+    if (stats) stats_report();
+
     // For security reasons, erase the password
     secure_erase(pass, MAX_PASSWD_BUF);
 
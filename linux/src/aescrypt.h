@@ -30,4 +30,7 @@ typedef unsigned char sha256_t[32];
 #define AES_CRYPT_EXTENSION ".aes"
 #define AES_CRYPT_EXTENSION_LEN 4
 
+// Version number of the chunked stream format (see chunked.c)
+#define AES_CRYPT_CHUNKED_VERSION 0x80
+
 #endif // AESCRYPT_H
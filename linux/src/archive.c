@@ -0,0 +1,2652 @@
+/*
+ *  archive.c
+ *
+ *  Archive Mode for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to encrypt a ustar/pax archive of directory trees and to
+ *      extract such an archive while it is decrypted, without running tar
+ *      or passing the archive through a pipe.
+ *
+ *      When creating an archive, the trees are walked first to list the
+ *      members.  Worker threads then stat and open the members and read
+ *      the start of each file ahead of time, while the archive itself is
+ *      produced in order as encrypt_stream() reads it through a stdio
+ *      stream.  The workers may only run a fixed number of members ahead
+ *      of the archive, so the read-ahead buffers form a bounded reorder
+ *      queue; the balance of a large file is read directly as the archive
+ *      reaches it.  Members are ustar entries, preceded by a pax extended
+ *      header when a name, link target, size, or other field does not fit.
+ *
+ *      When extracting, decrypt_stream() writes the archive to a stdio
+ *      stream that parses it and writes each member as it arrives.  Member
+ *      names are made relative to the target directory and names with ".."
+ *      components are refused.  Symbolic links are only created, and the
+ *      modes and times of directories only set, once everything else has
+ *      been extracted, so no member is written through a link from the
+ *      archive.  Only chunked streams are authenticated as they are
+ *      decrypted; other streams are authenticated at their end, after the
+ *      members have been written.
+ *
+ *      An index of the members, giving the offset and size of the data of
+ *      each, follows the zero blocks that end the archive, where tar and
+ *      archive_extract() ignore it, and a fixed-size footer at the very
+ *      end of the plaintext locates the index.  Since any range of the
+ *      plaintext can be decrypted without the rest, the members can be
+ *      listed by decrypting only the index, and a single member extracted
+ *      by decrypting only its data.
+ *
+ *  Portability Issues:
+ *      Requires POSIX threads and fopencookie().
+ */
+
+#define _GNU_SOURCE    // fopencookie
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "aescrypt.h"
+#include "stream.h"
+#include "workers.h"
+#include "reader.h"
+#include "util.h"
+#include "archive.h"
+
+// Entry states
+#define ENTRY_PENDING               0
+#define ENTRY_READY                 1
+#define ENTRY_SKIPPED               2
+#define ENTRY_FAILED                3
+
+// Phases of producing or parsing the archive
+#define PHASE_NEXT                  0
+#define PHASE_HEADER                1
+#define PHASE_DATA                  2
+#define PHASE_PAD                   3
+#define PHASE_TRAILER               4
+#define PHASE_INDEX                 5
+#define PHASE_END                   6
+
+// The longest symbolic link target archived
+#define ARCHIVE_MAX_LINK            4095
+
+// The largest extended header data accepted
+#define ARCHIVE_MAX_EXTENDED        1048576
+
+// The member index: records, then a footer locating the records
+//
+//     record = data offset (8) || size (8) || mtime (8) || mode (4) ||
+//              typeflag (1) || name || 0x00 || link target || 0x00
+//     footer = "AESCRYPT-INDEX" || 0x00 || version (1) ||
+//              index offset (8) || member count (8)
+#define ARCHIVE_INDEX_MAGIC         "AESCRYPT-INDEX\0\1"
+#define ARCHIVE_INDEX_RECORD_LEN    29
+#define ARCHIVE_INDEX_FOOTER_LEN    32
+
+// The largest values that fit the ustar numeric fields
+#define USTAR_MAX_ID                07777777LL
+#define USTAR_MAX_SIZE              077777777777LL
+
+typedef struct {
+    char *path;                     // Path of the member
+    struct stat st;                 // Status of the member
+    int fd;                         // Open regular file, or -1
+    char *link;                     // Target of a symbolic link
+    size_t prefetched;              // Octets read ahead
+    int shrank;                     // The file became shorter
+    int state;                      // ENTRY_*
+} archive_entry;
+
+typedef struct {
+    archive_entry *entries;         // Members in archive order
+    unsigned count;
+    unsigned capacity;
+    unsigned char *buffers;         // Read-ahead buffers (slots of them)
+    unsigned slots;
+    unsigned consumed;              // Members written to the archive
+    int aborted;                    // The archive will not be completed
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned jobs;
+    unsigned failures;              // Members that could not be read
+    int phase;                      // PHASE_*
+    unsigned char *header;          // Header octets of the current member
+    size_t header_length;
+    size_t header_capacity;
+    size_t header_offset;
+    off_t data_offset;              // Data octets of the member written
+    off_t archive_offset;           // Octets of the archive produced
+    unsigned char *index;           // Member index and footer
+    size_t index_length;
+    size_t index_capacity;
+    size_t index_offset;            // Octets of the index produced
+    unsigned long long index_count; // Members in the index
+} archive_writer;
+
+typedef struct {
+    char *path;                     // Path of a directory entry
+    int directory;                  // 1 if a directory, -1 if unknown
+} directory_child;
+
+typedef struct {
+    char *name;                     // Member name
+    char *link;                     // Link target, for symbolic links
+    mode_t mode;
+    struct timespec times[2];       // Access and modification times
+} deferred_entry;
+
+typedef struct {
+    int dirfd;                      // Target directory
+    int phase;                      // PHASE_*
+    unsigned char block[ARCHIVE_BLOCK_SIZE];
+    size_t block_length;
+    unsigned zero_blocks;           // Consecutive zero blocks seen
+    char typeflag;                  // Type of the current member
+    char *name;                     // Name of the current member
+    char *link;                     // Link target of the current member
+    char *next_name;                // Name from a pax or GNU long header
+    char *next_link;
+    off_t next_size;                // Size from a pax header, or -1
+    off_t remaining;                // Data octets of the member to come
+    off_t padding;                  // Padding octets to come
+    char *data;                     // Data of pax and GNU long headers
+    size_t data_length;
+    int fd;                         // Regular file being written, or -1
+    mode_t mode;
+    struct timespec times[2];
+    deferred_entry *deferred;       // Links and directories to finish
+    unsigned deferred_count;
+    unsigned deferred_capacity;
+    int failed;                     // A member could not be extracted
+    int corrupt;                    // The archive is malformed
+} archive_reader;
+
+/*
+ *  add_entry
+ *
+ *  Description:
+ *      Add a member to the list of members to archive.
+ *
+ *  Parameters:
+ *      w [in/out]
+ *          The archive writer.
+ *
+ *      path [in]
+ *          The path of the member, which is copied.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static int add_entry(archive_writer *w, const char *path)
+{
+    archive_entry *entries;
+
+    if (w->count == w->capacity)
+    {
+        w->capacity = w->capacity ? w->capacity * 2 : 256;
+        entries = realloc(w->entries, w->capacity * sizeof(archive_entry));
+        if (entries == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            return -1;
+        }
+        w->entries = entries;
+    }
+
+    memset(&w->entries[w->count], 0, sizeof(archive_entry));
+    w->entries[w->count].fd = -1;
+    if ((w->entries[w->count].path = strdup(path)) == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        return -1;
+    }
+    w->count++;
+
+    return 0;
+}
+
+/*
+ *  compare_children
+ *
+ *  Description:
+ *      Order directory entries by name for qsort().
+ *
+ *  Parameters:
+ *      a [in], b [in]
+ *          The entries to compare.
+ *
+ *  Returns:
+ *      Less than, equal to, or greater than 0 as a sorts before, with, or
+ *      after b.
+ *
+ *  Comments:
+ *      None.
+ */
+static int compare_children(const void *a, const void *b)
+{
+    return strcmp(((const directory_child *) a)->path,
+                  ((const directory_child *) b)->path);
+}
+
+/*
+ *  walk_tree
+ *
+ *  Description:
+ *      Add a path and, if it is a directory, everything below it to the
+ *      list of members to archive.
+ *
+ *  Parameters:
+ *      w [in/out]
+ *          The archive writer.
+ *
+ *      path [in]
+ *          The path to add.
+ *
+ *      directory [in]
+ *          1 if the path is known to be a directory, 0 if it is known not
+ *          to be, or -1 if that is unknown.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Directory entries are sorted so that archives are reproducible.
+ *      A member is only examined here if its directory entry does not
+ *      give its type; members are otherwise examined by the workers.
+ */
+static int walk_tree(archive_writer *w, const char *path, int directory)
+{
+    struct stat st;
+    struct dirent *dirent;
+    DIR *dir;
+    directory_child *children = NULL;
+    directory_child *grown;
+    size_t count = 0, capacity = 0, i;
+    size_t length;
+    int rc = 0;
+
+    if (add_entry(w, path)) return -1;
+
+    if (directory < 0)
+    {
+        directory = !lstat(path, &st) && S_ISDIR(st.st_mode);
+    }
+    if (!directory) return 0;
+
+    // If the directory cannot be read, the worker reports the problem
+    if ((dir = opendir(path)) == NULL) return 0;
+
+    while ((dirent = readdir(dir)) != NULL)
+    {
+        if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
+        {
+            continue;
+        }
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            grown = realloc(children, capacity * sizeof(directory_child));
+            if (grown == NULL)
+            {
+                fprintf(stderr, "Error: Unable to allocate memory\n");
+                rc = -1;
+                break;
+            }
+            children = grown;
+        }
+
+        length = strlen(path) + strlen(dirent->d_name) + 2;
+        if ((children[count].path = malloc(length)) == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            rc = -1;
+            break;
+        }
+        snprintf(children[count].path,
+                 length,
+                 "%s%s%s",
+                 path,
+                 (path[strlen(path) - 1] == '/') ? "" : "/",
+                 dirent->d_name);
+        children[count].directory = (dirent->d_type == DT_UNKNOWN) ?
+                                        -1 : (dirent->d_type == DT_DIR);
+        count++;
+    }
+    closedir(dir);
+
+    if (!rc) qsort(children, count, sizeof(directory_child), compare_children);
+
+    for (i = 0; i < count; i++)
+    {
+        if (!rc) rc = walk_tree(w, children[i].path, children[i].directory);
+        free(children[i].path);
+    }
+    free(children);
+
+    return rc;
+}
+
+/*
+ *  prefetch_member
+ *
+ *  Description:
+ *      Examine a member and read the start of it ahead of time.
+ *
+ *  Parameters:
+ *      context [in]
+ *          The archive writer.
+ *
+ *      item [in]
+ *          The index of the member.
+ *
+ *  Returns:
+ *      0.  Members that cannot be read are counted as failures.
+ *
+ *  Comments:
+ *      Workers wait rather than run more than the number of read-ahead
+ *      slots ahead of the archive.
+ */
+static int prefetch_member(void *context, unsigned item)
+{
+    archive_writer *w = (archive_writer *) context;
+    archive_entry *e = &w->entries[item];
+    unsigned char *buffer;
+    size_t wanted;
+    ssize_t n;
+    int state = ENTRY_READY;
+    int aborted;
+
+    pthread_mutex_lock(&w->mutex);
+    while (!w->aborted && (item >= w->consumed + w->slots))
+    {
+        pthread_cond_wait(&w->cond, &w->mutex);
+    }
+    aborted = w->aborted;
+    pthread_mutex_unlock(&w->mutex);
+    if (aborted) return 0;
+
+    if (lstat(e->path, &e->st))
+    {
+        fprintf(stderr, "Error examining %s : ", e->path);
+        perror("");
+        state = ENTRY_FAILED;
+    }
+    else if (S_ISREG(e->st.st_mode))
+    {
+        if ((e->fd = open(e->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+        {
+            fprintf(stderr, "Error opening %s : ", e->path);
+            perror("");
+            state = ENTRY_FAILED;
+        }
+
+        buffer = w->buffers + (size_t) (item % w->slots) *
+                                 ARCHIVE_PREFETCH_SIZE;
+        wanted = ARCHIVE_PREFETCH_SIZE;
+        if (e->st.st_size < (off_t) wanted) wanted = e->st.st_size;
+        while ((state == ENTRY_READY) && (e->prefetched < wanted))
+        {
+            n = read(e->fd,
+                     buffer + e->prefetched,
+                     wanted - e->prefetched);
+            if (n < 0)
+            {
+                if (errno == EINTR) continue;
+                fprintf(stderr, "Error reading %s : ", e->path);
+                perror("");
+                state = ENTRY_FAILED;
+            }
+            if (n <= 0) break;
+            e->prefetched += n;
+        }
+    }
+    else if (S_ISLNK(e->st.st_mode))
+    {
+        if ((e->link = malloc(ARCHIVE_MAX_LINK + 1)) == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            state = ENTRY_FAILED;
+        }
+        else if (((n = readlink(e->path, e->link, ARCHIVE_MAX_LINK + 1)) <
+                      0) ||
+                 (n > ARCHIVE_MAX_LINK))
+        {
+            fprintf(stderr, "Error reading link %s\n", e->path);
+            state = ENTRY_FAILED;
+        }
+        else
+        {
+            e->link[n] = '\0';
+        }
+    }
+    else if (!S_ISDIR(e->st.st_mode))
+    {
+        fprintf(stderr, "%s: special file not archived\n", e->path);
+        state = ENTRY_SKIPPED;
+    }
+
+    if ((state == ENTRY_FAILED) && (e->fd >= 0))
+    {
+        close(e->fd);
+        e->fd = -1;
+    }
+
+    pthread_mutex_lock(&w->mutex);
+    e->state = state;
+    if (state == ENTRY_FAILED) w->failures++;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+
+    return 0;
+}
+
+/*
+ *  prefetch_thread
+ *
+ *  Description:
+ *      Run the workers that examine and read ahead the members.
+ *
+ *  Parameters:
+ *      context [in]
+ *          The archive writer.
+ *
+ *  Returns:
+ *      NULL.
+ *
+ *  Comments:
+ *      Members are handed to the workers in archive order.
+ */
+static void *prefetch_thread(void *context)
+{
+    archive_writer *w = (archive_writer *) context;
+
+    run_workers(w->jobs, w->count, prefetch_member, w);
+
+    return NULL;
+}
+
+/*
+ *  put_number
+ *
+ *  Description:
+ *      Store a number in a ustar header field as NUL-terminated octal.
+ *
+ *  Parameters:
+ *      field [out]
+ *          The header field.
+ *
+ *      size [in]
+ *          The size of the field, including the terminating NUL.
+ *
+ *      value [in]
+ *          The value, which must fit the field.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void put_number(unsigned char *field,
+                       size_t size,
+                       unsigned long long value)
+{
+    snprintf((char *) field, size, "%0*llo", (int) (size - 1), value);
+}
+
+/*
+ *  add_pax_record
+ *
+ *  Description:
+ *      Append a "length key=value" record to pax extended header data.
+ *
+ *  Parameters:
+ *      pax [in/out]
+ *          The extended header data, reallocated as needed.
+ *
+ *      pax_length [in/out]
+ *          The length of the data.
+ *
+ *      key [in]
+ *          The keyword.
+ *
+ *      value [in]
+ *          The value.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      The length of a record includes the digits of the length itself.
+ */
+static int add_pax_record(char **pax,
+                          size_t *pax_length,
+                          const char *key,
+                          const char *value)
+{
+    char digits[24];
+    size_t base = strlen(key) + strlen(value) + 3;
+    size_t length = base + 1;
+    char *grown;
+
+    while (base + (size_t) snprintf(digits, sizeof(digits), "%zu", length) !=
+           length)
+    {
+        length = base + strlen(digits);
+    }
+
+    if ((grown = realloc(*pax, *pax_length + length + 1)) == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        return -1;
+    }
+    *pax = grown;
+    snprintf(*pax + *pax_length,
+             length + 1,
+             "%zu %s=%s\n",
+             length,
+             key,
+             value);
+    *pax_length += length;
+
+    return 0;
+}
+
+/*
+ *  fill_header
+ *
+ *  Description:
+ *      Fill in a ustar header block and its checksum.
+ *
+ *  Parameters:
+ *      block [out]
+ *          The header block.
+ *
+ *      name [in], prefix [in]
+ *          The name and prefix fields, truncated to fit.
+ *
+ *      st [in]
+ *          The status whose mode, owner, and time are recorded.
+ *
+ *      size [in]
+ *          The size field.
+ *
+ *      typeflag [in]
+ *          The type of member.
+ *
+ *      link [in]
+ *          The link target, truncated to fit, or NULL.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      Values that do not fit are stored as the largest that does; the
+ *      caller records the actual values in a pax extended header.
+ */
+static void fill_header(unsigned char block[ARCHIVE_BLOCK_SIZE],
+                        const char *name,
+                        const char *prefix,
+                        const struct stat *st,
+                        unsigned long long size,
+                        char typeflag,
+                        const char *link)
+{
+    unsigned long long mtime;
+    unsigned checksum = 0;
+    unsigned i;
+
+    memset(block, 0, ARCHIVE_BLOCK_SIZE);
+    strncpy((char *) block, name, 100);
+    put_number(block + 100, 8, st->st_mode & 07777);
+    put_number(block + 108,
+               8,
+               (st->st_uid > USTAR_MAX_ID) ? USTAR_MAX_ID : st->st_uid);
+    put_number(block + 116,
+               8,
+               (st->st_gid > USTAR_MAX_ID) ? USTAR_MAX_ID : st->st_gid);
+    put_number(block + 124,
+               12,
+               (size > USTAR_MAX_SIZE) ? USTAR_MAX_SIZE : size);
+    mtime = (st->st_mtime < 0) ? 0 : (unsigned long long) st->st_mtime;
+    put_number(block + 136,
+               12,
+               (mtime > USTAR_MAX_SIZE) ? USTAR_MAX_SIZE : mtime);
+    block[156] = typeflag;
+    if (link != NULL) strncpy((char *) block + 157, link, 100);
+    memcpy(block + 257, "ustar\0" "00", 8);
+    strncpy((char *) block + 345, prefix, 155);
+
+    // The checksum is computed with the checksum field set to spaces
+    memset(block + 148, ' ', 8);
+    for (i = 0; i < ARCHIVE_BLOCK_SIZE; i++) checksum += block[i];
+    snprintf((char *) block + 148, 8, "%06o", checksum);
+}
+
+/*
+ *  put_index_number
+ *
+ *  Description:
+ *      Store a number in the member index in big endian order.
+ *
+ *  Parameters:
+ *      buffer [out]
+ *          Where the number is stored.
+ *
+ *      value [in]
+ *          The number.
+ *
+ *      octets [in]
+ *          The number of octets to store.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void put_index_number(unsigned char *buffer,
+                             unsigned long long value,
+                             unsigned octets)
+{
+    while (octets-- > 0)
+    {
+        buffer[octets] = (unsigned char) (value & 0xFF);
+        value >>= 8;
+    }
+}
+
+/*
+ *  add_index_record
+ *
+ *  Description:
+ *      Add a member to the member index.
+ *
+ *  Parameters:
+ *      w [in/out]
+ *          The archive writer.
+ *
+ *      e [in]
+ *          The member.
+ *
+ *      name [in]
+ *          The member name as archived.
+ *
+ *      typeflag [in]
+ *          The ustar type of the member.
+ *
+ *      size [in]
+ *          The number of data octets archived.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      The member data starts after the header being built, which is
+ *      header_length octets long.
+ */
+static int add_index_record(archive_writer *w,
+                            const archive_entry *e,
+                            const char *name,
+                            char typeflag,
+                            unsigned long long size)
+{
+    size_t name_length = strlen(name) + 1;
+    size_t link_length = (e->link != NULL) ? strlen(e->link) + 1 : 1;
+    size_t length = ARCHIVE_INDEX_RECORD_LEN + name_length + link_length;
+    unsigned char *record;
+    unsigned char *grown;
+
+    // Leave room for the footer as well
+    if (w->index_length + length + ARCHIVE_INDEX_FOOTER_LEN >
+        w->index_capacity)
+    {
+        w->index_capacity = 2 * (w->index_length + length +
+                                 ARCHIVE_INDEX_FOOTER_LEN);
+        if ((grown = realloc(w->index, w->index_capacity)) == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            return -1;
+        }
+        w->index = grown;
+    }
+
+    record = w->index + w->index_length;
+    put_index_number(record, w->archive_offset + w->header_length, 8);
+    put_index_number(record + 8, size, 8);
+    put_index_number(record + 16, (unsigned long long) e->st.st_mtime, 8);
+    put_index_number(record + 24, e->st.st_mode & 07777, 4);
+    record[28] = (unsigned char) typeflag;
+    memcpy(record + ARCHIVE_INDEX_RECORD_LEN, name, name_length);
+    memcpy(record + ARCHIVE_INDEX_RECORD_LEN + name_length,
+           (e->link != NULL) ? e->link : "",
+           link_length);
+    w->index_length += length;
+    w->index_count++;
+
+    return 0;
+}
+
+/*
+ *  build_header
+ *
+ *  Description:
+ *      Build the header of the next member, including a pax extended
+ *      header if one is needed.
+ *
+ *  Parameters:
+ *      w [in/out]
+ *          The archive writer.
+ *
+ *      e [in]
+ *          The member.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Leading slashes are removed from member names.  The member is also
+ *      added to the member index.
+ */
+static int build_header(archive_writer *w, const archive_entry *e)
+{
+    unsigned char ustar[ARCHIVE_BLOCK_SIZE];
+    char number[24];
+    char *name = NULL;
+    char *pax = NULL;
+    char *split = NULL;
+    const char *base;
+    size_t pax_length = 0;
+    size_t length;
+    size_t padded;
+    unsigned long long size = 0;
+    unsigned char *grown;
+    char typeflag = '0';
+    int rc = 0;
+
+    if (S_ISDIR(e->st.st_mode)) typeflag = '5';
+    if (S_ISLNK(e->st.st_mode)) typeflag = '2';
+    if (S_ISREG(e->st.st_mode)) size = e->st.st_size;
+
+    // Directory names end with a slash
+    base = e->path;
+    while (*base == '/') base++;
+    length = strlen(base);
+    if ((name = malloc(length + 3)) == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        return -1;
+    }
+    strcpy(name, (length > 0) ? base : ".");
+    length = strlen(name);
+    if ((typeflag == '5') && (name[length - 1] != '/'))
+    {
+        name[length++] = '/';
+        name[length] = '\0';
+    }
+
+    // Use the prefix field if that makes the name fit
+    if (length > 100)
+    {
+        split = name + length - 1;
+        if (*split == '/') split--;
+        while ((split > name) &&
+               ((*split != '/') || (name + length - split - 1 > 100)))
+        {
+            split--;
+        }
+        if ((split <= name) || (split - name > 155) ||
+            (name + length - split - 1 > 100) ||
+            (*split != '/'))
+        {
+            split = NULL;
+        }
+    }
+
+    if ((length > 100) && (split == NULL))
+    {
+        rc = add_pax_record(&pax, &pax_length, "path", name);
+    }
+    if (!rc && (e->link != NULL) && (strlen(e->link) > 100))
+    {
+        rc = add_pax_record(&pax, &pax_length, "linkpath", e->link);
+    }
+    if (!rc && (size > USTAR_MAX_SIZE))
+    {
+        snprintf(number, sizeof(number), "%llu", size);
+        rc = add_pax_record(&pax, &pax_length, "size", number);
+    }
+    if (!rc && (e->st.st_uid > USTAR_MAX_ID))
+    {
+        snprintf(number, sizeof(number), "%lu", (unsigned long) e->st.st_uid);
+        rc = add_pax_record(&pax, &pax_length, "uid", number);
+    }
+    if (!rc && (e->st.st_gid > USTAR_MAX_ID))
+    {
+        snprintf(number, sizeof(number), "%lu", (unsigned long) e->st.st_gid);
+        rc = add_pax_record(&pax, &pax_length, "gid", number);
+    }
+    if (!rc && ((e->st.st_mtime < 0) || (e->st.st_mtime > USTAR_MAX_SIZE)))
+    {
+        snprintf(number, sizeof(number), "%lld", (long long) e->st.st_mtime);
+        rc = add_pax_record(&pax, &pax_length, "mtime", number);
+    }
+
+    // Room for the extended header, its data, and the ustar header
+    padded = (pax_length + ARCHIVE_BLOCK_SIZE - 1) &
+             ~((size_t) ARCHIVE_BLOCK_SIZE - 1);
+    w->header_length = (pax_length ? ARCHIVE_BLOCK_SIZE + padded : 0) +
+                       ARCHIVE_BLOCK_SIZE;
+    if (!rc) rc = add_index_record(w, e, name, typeflag, size);
+    if (!rc && (w->header_length > w->header_capacity))
+    {
+        if ((grown = realloc(w->header, w->header_length)) == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            rc = -1;
+        }
+        else
+        {
+            w->header = grown;
+            w->header_capacity = w->header_length;
+        }
+    }
+
+    if (!rc && pax_length)
+    {
+        // The extended header is named after the member
+        base = strrchr(name, '/');
+        base = ((base != NULL) && (base[1] != '\0')) ? base + 1 : name;
+        snprintf((char *) ustar, 101, "PaxHeader/%.90s", base);
+        fill_header(w->header,
+                    (char *) ustar,
+                    "",
+                    &e->st,
+                    pax_length,
+                    'x',
+                    NULL);
+        memset(w->header + ARCHIVE_BLOCK_SIZE, 0, padded);
+        memcpy(w->header + ARCHIVE_BLOCK_SIZE, pax, pax_length);
+    }
+
+    if (!rc)
+    {
+        if (split != NULL)
+        {
+            *split = '\0';
+            fill_header(ustar, split + 1, name, &e->st, size, typeflag,
+                        e->link);
+        }
+        else
+        {
+            fill_header(ustar, name, "", &e->st, size, typeflag, e->link);
+        }
+        memcpy(w->header + w->header_length - ARCHIVE_BLOCK_SIZE,
+               ustar,
+               ARCHIVE_BLOCK_SIZE);
+        w->header_offset = 0;
+    }
+
+    free(name);
+    free(pax);
+
+    return rc;
+}
+
+/*
+ *  release_member
+ *
+ *  Description:
+ *      Finish with the member at the head of the archive and let the
+ *      workers read further ahead.
+ *
+ *  Parameters:
+ *      w [in/out]
+ *          The archive writer.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void release_member(archive_writer *w)
+{
+    archive_entry *e = &w->entries[w->consumed];
+
+    if (e->fd >= 0)
+    {
+        close(e->fd);
+        e->fd = -1;
+    }
+    free(e->link);
+    e->link = NULL;
+
+    pthread_mutex_lock(&w->mutex);
+    w->consumed++;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+
+    w->phase = PHASE_NEXT;
+}
+
+/*
+ *  add_index_footer
+ *
+ *  Description:
+ *      Complete the member index with the footer that locates it.
+ *
+ *  Parameters:
+ *      w [in/out]
+ *          The archive writer.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Called before the zero blocks that end the archive are produced;
+ *      the index follows them.
+ */
+static int add_index_footer(archive_writer *w)
+{
+    unsigned char *footer;
+    unsigned char *grown;
+
+    if (w->index_length + ARCHIVE_INDEX_FOOTER_LEN > w->index_capacity)
+    {
+        w->index_capacity = w->index_length + ARCHIVE_INDEX_FOOTER_LEN;
+        if ((grown = realloc(w->index, w->index_capacity)) == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            return -1;
+        }
+        w->index = grown;
+    }
+
+    footer = w->index + w->index_length;
+    memcpy(footer, ARCHIVE_INDEX_MAGIC, 16);
+    put_index_number(footer + 16,
+                     w->archive_offset + 2 * ARCHIVE_BLOCK_SIZE,
+                     8);
+    put_index_number(footer + 24, w->index_count, 8);
+    w->index_length += ARCHIVE_INDEX_FOOTER_LEN;
+    w->index_offset = 0;
+
+    return 0;
+}
+
+/*
+ *  archive_read
+ *
+ *  Description:
+ *      The read function of the stdio stream given to encrypt_stream(),
+ *      producing the archive in order.
+ *
+ *  Parameters:
+ *      cookie [in]
+ *          The archive writer.
+ *
+ *      buffer [out]
+ *          Where the archive is placed.
+ *
+ *      size [in]
+ *          The size of the buffer.
+ *
+ *  Returns:
+ *      The number of octets produced, 0 at the end of the archive, or -1
+ *      if there was an error.
+ *
+ *  Comments:
+ *      A file that shrinks while it is archived is padded with zeros; one
+ *      that grows is truncated to the size it had when examined.
+ */
+static ssize_t archive_read(void *cookie, char *buffer, size_t size)
+{
+    archive_writer *w = (archive_writer *) cookie;
+    archive_entry *e;
+    size_t produced = 0;
+    size_t n;
+    ssize_t bytes_read;
+    off_t total, padded;
+
+    while ((produced < size) && (w->phase != PHASE_END))
+    {
+        e = (w->consumed < w->count) ? &w->entries[w->consumed] : NULL;
+
+        switch (w->phase)
+        {
+            case PHASE_NEXT:
+                // The archive ends with two zero blocks
+                if (e == NULL)
+                {
+                    if (add_index_footer(w)) return -1;
+                    memset(w->header, 0, 2 * ARCHIVE_BLOCK_SIZE);
+                    w->header_length = 2 * ARCHIVE_BLOCK_SIZE;
+                    w->header_offset = 0;
+                    w->phase = PHASE_TRAILER;
+                    break;
+                }
+
+                pthread_mutex_lock(&w->mutex);
+                while (e->state == ENTRY_PENDING)
+                {
+                    pthread_cond_wait(&w->cond, &w->mutex);
+                }
+                pthread_mutex_unlock(&w->mutex);
+
+                if (e->state != ENTRY_READY)
+                {
+                    release_member(w);
+                    break;
+                }
+
+                if (build_header(w, e)) return -1;
+                w->data_offset = 0;
+                w->phase = PHASE_HEADER;
+                break;
+
+            case PHASE_HEADER:
+            case PHASE_TRAILER:
+                // Headers, or the zero blocks at the end of the archive
+                n = w->header_length - w->header_offset;
+                if (n > size - produced) n = size - produced;
+                memcpy(buffer + produced, w->header + w->header_offset, n);
+                produced += n;
+                w->header_offset += n;
+                w->archive_offset += n;
+                if (w->header_offset == w->header_length)
+                {
+                    w->phase = (w->phase == PHASE_TRAILER) ? PHASE_INDEX :
+                                                             PHASE_DATA;
+                }
+                break;
+
+            case PHASE_INDEX:
+                // The member index follows the end of the archive
+                n = w->index_length - w->index_offset;
+                if (n > size - produced) n = size - produced;
+                memcpy(buffer + produced, w->index + w->index_offset, n);
+                produced += n;
+                w->index_offset += n;
+                if (w->index_offset == w->index_length)
+                {
+                    w->phase = PHASE_END;
+                }
+                break;
+
+            case PHASE_DATA:
+                total = S_ISREG(e->st.st_mode) ? e->st.st_size : 0;
+                padded = (total + ARCHIVE_BLOCK_SIZE - 1) &
+                         ~((off_t) ARCHIVE_BLOCK_SIZE - 1);
+                if (w->data_offset == padded)
+                {
+                    release_member(w);
+                    break;
+                }
+
+                n = size - produced;
+                if (w->data_offset < (off_t) e->prefetched)
+                {
+                    // Data read ahead by a worker
+                    if (n > e->prefetched - w->data_offset)
+                    {
+                        n = e->prefetched - w->data_offset;
+                    }
+                    memcpy(buffer + produced,
+                           w->buffers + (size_t) (w->consumed % w->slots) *
+                                            ARCHIVE_PREFETCH_SIZE +
+                                        w->data_offset,
+                           n);
+                }
+                else if (w->data_offset < total)
+                {
+                    if ((off_t) n > total - w->data_offset)
+                    {
+                        n = total - w->data_offset;
+                    }
+                    bytes_read = 0;
+                    if (!e->shrank)
+                    {
+                        bytes_read = read(e->fd, buffer + produced, n);
+                    }
+                    if ((bytes_read < 0) && (errno == EINTR)) break;
+                    if (bytes_read < 0)
+                    {
+                        fprintf(stderr, "Error reading %s : ", e->path);
+                        perror("");
+                        return -1;
+                    }
+                    if (bytes_read == 0)
+                    {
+                        if (!e->shrank)
+                        {
+                            fprintf(stderr,
+                                    "%s: file shrank; padding with zeros\n",
+                                    e->path);
+                            e->shrank = 1;
+                        }
+                        memset(buffer + produced, 0, n);
+                    }
+                    else
+                    {
+                        n = bytes_read;
+                    }
+                }
+                else
+                {
+                    // Padding to the end of the block
+                    if ((off_t) n > padded - w->data_offset)
+                    {
+                        n = padded - w->data_offset;
+                    }
+                    memset(buffer + produced, 0, n);
+                }
+                produced += n;
+                w->data_offset += n;
+                w->archive_offset += n;
+                break;
+        }
+    }
+
+    return produced;
+}
+
+/*
+ *  archive_create
+ *
+ *  Description:
+ *      Encrypt a ustar/pax archive of the given paths.
+ *
+ *  Parameters:
+ *      paths [in]
+ *          The files and directory trees to archive.
+ *
+ *      count [in]
+ *          The number of paths.
+ *
+ *      outfp [in]
+ *          The output file stream into which encrypted data is written.
+ *
+ *      jobs [in]
+ *          The number of members to examine and read concurrently, or 0
+ *          for the default.
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *      options [in]
+ *          Optional encryption behavior, or NULL for the defaults.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.  A member that
+ *      cannot be read is left out of the archive and is an error.
+ *
+ *  Comments:
+ *      Since reading members is bound by I/O rather than processing, at
+ *      least ARCHIVE_DEFAULT_JOBS workers are used by default.
+ */
+int archive_create(char *const paths[],
+                   unsigned count,
+                   FILE *outfp,
+                   unsigned jobs,
+                   const unsigned char *passwd,
+                   int passlen,
+                   const stream_options *options)
+{
+    archive_writer w;
+    cookie_io_functions_t functions = {archive_read, NULL, NULL, NULL};
+    pthread_t thread;
+    FILE *infp;
+    unsigned i;
+    int stripped = 0;
+    int rc = 0;
+
+    memset(&w, 0, sizeof(w));
+    pthread_mutex_init(&w.mutex, NULL);
+    pthread_cond_init(&w.cond, NULL);
+
+    for (i = 0; !rc && (i < count); i++)
+    {
+        if (!strcmp(paths[i], "-") || (paths[i][0] == '\0'))
+        {
+            fprintf(stderr, "Error: Standard input cannot be archived\n");
+            rc = -1;
+        }
+        else
+        {
+            if ((paths[i][0] == '/') && !stripped)
+            {
+                fprintf(stderr, "Removing leading '/' from member names\n");
+                stripped = 1;
+            }
+            rc = walk_tree(&w, paths[i], -1);
+        }
+    }
+
+    if (jobs == 0)
+    {
+        jobs = default_worker_count();
+        if (jobs < ARCHIVE_DEFAULT_JOBS) jobs = ARCHIVE_DEFAULT_JOBS;
+    }
+    w.jobs = jobs;
+    w.slots = jobs * ARCHIVE_SLOTS_PER_JOB;
+    w.header_capacity = 2 * ARCHIVE_BLOCK_SIZE;
+
+    if (!rc &&
+        (((w.buffers = malloc((size_t) w.slots *
+                              ARCHIVE_PREFETCH_SIZE)) == NULL) ||
+         ((w.header = malloc(w.header_capacity)) == NULL)))
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        rc = -1;
+    }
+
+    if (!rc && pthread_create(&thread, NULL, prefetch_thread, &w))
+    {
+        fprintf(stderr, "Error: Unable to start worker threads\n");
+        rc = -1;
+    }
+
+    if (!rc)
+    {
+        if ((infp = fopencookie(&w, "r", functions)) == NULL)
+        {
+            perror("Error creating archive stream");
+            rc = -1;
+        }
+        else
+        {
+            rc = encrypt_stream(infp,
+                                outfp,
+                                (unsigned char *) passwd,
+                                passlen,
+                                options);
+            fclose(infp);
+        }
+
+        // Stop any workers still waiting to read ahead
+        pthread_mutex_lock(&w.mutex);
+        w.aborted = 1;
+        pthread_cond_broadcast(&w.cond);
+        pthread_mutex_unlock(&w.mutex);
+        pthread_join(thread, NULL);
+    }
+
+    if (!rc && w.failures)
+    {
+        fprintf(stderr,
+                "Error: %u member(s) could not be archived\n",
+                w.failures);
+        rc = -1;
+    }
+
+    for (i = 0; i < w.count; i++)
+    {
+        if (w.entries[i].fd >= 0) close(w.entries[i].fd);
+        free(w.entries[i].link);
+        free(w.entries[i].path);
+    }
+    free(w.entries);
+    free(w.buffers);
+    free(w.header);
+    free(w.index);
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.mutex);
+
+    return rc;
+}
+
+/*
+ *  get_number
+ *
+ *  Description:
+ *      Load a number from a ustar header field.
+ *
+ *  Parameters:
+ *      field [in]
+ *          The header field.
+ *
+ *      size [in]
+ *          The size of the field.
+ *
+ *  Returns:
+ *      The value of the field.
+ *
+ *  Comments:
+ *      Fields are octal, or base-256 if the first octet has its high bit
+ *      set, as written by GNU tar for values too large for octal.
+ */
+static unsigned long long get_number(const unsigned char *field, size_t size)
+{
+    unsigned long long value = 0;
+    size_t i = 0;
+
+    if (field[0] & 0x80)
+    {
+        value = field[0] & 0x3F;
+        for (i = 1; i < size; i++) value = (value << 8) | field[i];
+        return value;
+    }
+
+    while ((i < size) && (field[i] == ' ')) i++;
+    while ((i < size) && (field[i] >= '0') && (field[i] <= '7'))
+    {
+        value = (value << 3) | (field[i++] - '0');
+    }
+
+    return value;
+}
+
+/*
+ *  safe_name
+ *
+ *  Description:
+ *      Make a member name relative to the target directory.
+ *
+ *  Parameters:
+ *      name [in/out]
+ *          The member name; leading and trailing slashes are removed.
+ *
+ *  Returns:
+ *      The relative name, or NULL if the name is empty or has a ".."
+ *      component and must not be extracted.
+ *
+ *  Comments:
+ *      None.
+ */
+static char *safe_name(char *name)
+{
+    char *component;
+    size_t length;
+
+    while (*name == '/') name++;
+    length = strlen(name);
+    while ((length > 0) && (name[length - 1] == '/')) name[--length] = '\0';
+
+    for (component = name; component != NULL; )
+    {
+        if (!strncmp(component, "..", 2) &&
+            ((component[2] == '/') || (component[2] == '\0')))
+        {
+            return NULL;
+        }
+        if ((component = strchr(component, '/')) != NULL) component++;
+    }
+
+    return (*name != '\0' && strcmp(name, ".")) ? name : NULL;
+}
+
+/*
+ *  make_parents
+ *
+ *  Description:
+ *      Create any missing directories above a member.
+ *
+ *  Parameters:
+ *      dirfd [in]
+ *          The target directory.
+ *
+ *      name [in/out]
+ *          The relative member name, which is restored on return.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static int make_parents(int dirfd, char *name)
+{
+    char *slash;
+
+    for (slash = strchr(name, '/'); slash != NULL; slash = strchr(slash, '/'))
+    {
+        *slash = '\0';
+        if (mkdirat(dirfd, name, 0755) && (errno != EEXIST))
+        {
+            fprintf(stderr, "Error creating directory %s : ", name);
+            perror("");
+            *slash = '/';
+            return -1;
+        }
+        *slash++ = '/';
+    }
+
+    return 0;
+}
+
+/*
+ *  defer_entry
+ *
+ *  Description:
+ *      Remember a symbolic link to create, or a directory whose mode and
+ *      times to set, once everything else is extracted.
+ *
+ *  Parameters:
+ *      r [in/out]
+ *          The archive reader.
+ *
+ *      name [in]
+ *          The relative member name.
+ *
+ *      link [in]
+ *          The link target, or NULL for a directory.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static int defer_entry(archive_reader *r, const char *name, const char *link)
+{
+    deferred_entry *grown;
+    deferred_entry *d;
+
+    if (r->deferred_count == r->deferred_capacity)
+    {
+        r->deferred_capacity = r->deferred_capacity ?
+                                   r->deferred_capacity * 2 : 64;
+        grown = realloc(r->deferred,
+                        r->deferred_capacity * sizeof(deferred_entry));
+        if (grown == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            return -1;
+        }
+        r->deferred = grown;
+    }
+
+    d = &r->deferred[r->deferred_count];
+    d->name = strdup(name);
+    d->link = (link != NULL) ? strdup(link) : NULL;
+    d->mode = r->mode;
+    d->times[0] = r->times[0];
+    d->times[1] = r->times[1];
+    if ((d->name == NULL) || ((link != NULL) && (d->link == NULL)))
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        free(d->name);
+        free(d->link);
+        return -1;
+    }
+    r->deferred_count++;
+
+    return 0;
+}
+
+/*
+ *  begin_member
+ *
+ *  Description:
+ *      Start extracting the member whose header was just read.
+ *
+ *  Parameters:
+ *      r [in/out]
+ *          The archive reader.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error that stops the
+ *      extraction.  Members that cannot be extracted are reported and
+ *      skipped.
+ *
+ *  Comments:
+ *      None.
+ */
+static int begin_member(archive_reader *r)
+{
+    char *name = safe_name(r->name);
+    char *target;
+
+    if (name == NULL)
+    {
+        if (strcmp(r->name, ".") && (r->name[0] != '\0'))
+        {
+            fprintf(stderr, "%s: unsafe member name not extracted\n",
+                    r->name);
+            r->failed = 1;
+        }
+        return 0;
+    }
+
+    if (make_parents(r->dirfd, name))
+    {
+        r->failed = 1;
+        return 0;
+    }
+
+    switch (r->typeflag)
+    {
+        case '0':
+        case '7':
+            r->fd = openat(r->dirfd,
+                           name,
+                           O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW |
+                               O_CLOEXEC,
+                           r->mode);
+            if ((r->fd < 0) && (errno == ELOOP))
+            {
+                // Replace a symbolic link rather than write through it
+                unlinkat(r->dirfd, name, 0);
+                r->fd = openat(r->dirfd,
+                               name,
+                               O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW |
+                                   O_CLOEXEC,
+                               r->mode);
+            }
+            if (r->fd < 0)
+            {
+                fprintf(stderr, "Error creating %s : ", name);
+                perror("");
+                r->failed = 1;
+            }
+            break;
+
+        case '5':
+            if (mkdirat(r->dirfd, name, 0700) && (errno != EEXIST))
+            {
+                fprintf(stderr, "Error creating directory %s : ", name);
+                perror("");
+                r->failed = 1;
+                break;
+            }
+            return defer_entry(r, name, NULL);
+
+        case '2':
+            return defer_entry(r, name, r->link);
+
+        case '1':
+            if ((target = safe_name(r->link)) == NULL)
+            {
+                fprintf(stderr, "%s: unsafe link target not extracted\n",
+                        name);
+                r->failed = 1;
+                break;
+            }
+            unlinkat(r->dirfd, name, 0);
+            if (linkat(r->dirfd, target, r->dirfd, name, 0))
+            {
+                fprintf(stderr, "Error linking %s to %s : ", name, target);
+                perror("");
+                r->failed = 1;
+            }
+            break;
+
+        default:
+            fprintf(stderr,
+                    "%s: member of type '%c' not extracted\n",
+                    name,
+                    r->typeflag);
+            break;
+    }
+
+    return 0;
+}
+
+/*
+ *  finish_data
+ *
+ *  Description:
+ *      Finish with the data of the current member.
+ *
+ *  Parameters:
+ *      r [in/out]
+ *          The archive reader.
+ *
+ *  Returns:
+ *      0 if successful, otherwise the archive is corrupt.
+ *
+ *  Comments:
+ *      The data of pax extended headers and GNU long name headers apply
+ *      to the member that follows.
+ */
+static int finish_data(archive_reader *r)
+{
+    char *record, *end, *key, *value, *next;
+    unsigned long long length;
+
+    if (r->fd >= 0)
+    {
+        if (futimens(r->fd, r->times) || close(r->fd))
+        {
+            perror("Error finishing extracted file");
+            r->failed = 1;
+        }
+        r->fd = -1;
+    }
+
+    if (r->data == NULL) return 0;
+    r->data[r->data_length] = '\0';
+
+    if ((r->typeflag == 'L') || (r->typeflag == 'K'))
+    {
+        free((r->typeflag == 'L') ? r->next_name : r->next_link);
+        if (r->typeflag == 'L') r->next_name = r->data;
+        else r->next_link = r->data;
+        r->data = NULL;
+        return 0;
+    }
+
+    // Parse "length key=value\n" records
+    for (record = r->data;
+         (r->typeflag == 'x') && (record < r->data + r->data_length);
+         record = next)
+    {
+        length = strtoull(record, &key, 10);
+        next = record + length;
+        if ((*key != ' ') || (length == 0) ||
+            (next > r->data + r->data_length) || (next[-1] != '\n') ||
+            ((end = memchr(key, '=', next - key)) == NULL))
+        {
+            fprintf(stderr, "Error: Archive is corrupt (pax header)\n");
+            return -1;
+        }
+        key++;
+        *end = '\0';
+        value = end + 1;
+        next[-1] = '\0';
+
+        if (!strcmp(key, "path"))
+        {
+            free(r->next_name);
+            r->next_name = strdup(value);
+        }
+        else if (!strcmp(key, "linkpath"))
+        {
+            free(r->next_link);
+            r->next_link = strdup(value);
+        }
+        else if (!strcmp(key, "size"))
+        {
+            r->next_size = (off_t) strtoull(value, NULL, 10);
+        }
+    }
+
+    free(r->data);
+    r->data = NULL;
+
+    return 0;
+}
+
+/*
+ *  parse_header
+ *
+ *  Description:
+ *      Interpret a header block.
+ *
+ *  Parameters:
+ *      r [in/out]
+ *          The archive reader.
+ *
+ *  Returns:
+ *      0 if successful, otherwise the archive is corrupt or there was an
+ *      error that stops the extraction.
+ *
+ *  Comments:
+ *      None.
+ */
+static int parse_header(archive_reader *r)
+{
+    unsigned char *block = r->block;
+    unsigned checksum = 0;
+    unsigned long long size;
+    char name[257];
+    size_t length;
+    unsigned i;
+
+    for (i = 0; (i < ARCHIVE_BLOCK_SIZE) && (block[i] == 0); i++);
+    if (i == ARCHIVE_BLOCK_SIZE)
+    {
+        if (++r->zero_blocks == 2) r->phase = PHASE_END;
+        return 0;
+    }
+    r->zero_blocks = 0;
+
+    for (i = 0; i < ARCHIVE_BLOCK_SIZE; i++)
+    {
+        checksum += ((i >= 148) && (i < 156)) ? ' ' : block[i];
+    }
+    if (checksum != get_number(block + 148, 8))
+    {
+        fprintf(stderr, "Error: Archive is corrupt (header checksum)\n");
+        return -1;
+    }
+
+    r->typeflag = block[156] ? (char) block[156] : '0';
+    size = get_number(block + 124, 12);
+    if ((r->next_size >= 0) && (r->typeflag != 'x') &&
+        (r->typeflag != 'g'))
+    {
+        size = r->next_size;
+    }
+    r->remaining = (off_t) size;
+    r->padding = (ARCHIVE_BLOCK_SIZE - size % ARCHIVE_BLOCK_SIZE) %
+                 ARCHIVE_BLOCK_SIZE;
+    r->phase = PHASE_DATA;
+
+    // Extended headers carry data for the member that follows
+    if ((r->typeflag == 'x') || (r->typeflag == 'g') ||
+        (r->typeflag == 'L') || (r->typeflag == 'K'))
+    {
+        if (size > ARCHIVE_MAX_EXTENDED)
+        {
+            fprintf(stderr, "Error: Archive is corrupt (extended header)\n");
+            return -1;
+        }
+        if ((r->typeflag != 'g') &&
+            ((r->data = malloc((size_t) size + 1)) == NULL))
+        {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            return -1;
+        }
+        r->data_length = 0;
+        return 0;
+    }
+
+    // The name is the prefix and name fields unless given separately
+    free(r->name);
+    free(r->link);
+    if (r->next_name != NULL)
+    {
+        r->name = r->next_name;
+    }
+    else
+    {
+        name[0] = '\0';
+        if (!memcmp(block + 257, "ustar\0", 6) && block[345])
+        {
+            snprintf(name, sizeof(name), "%.155s/", (char *) block + 345);
+        }
+        length = strlen(name);
+        snprintf(name + length,
+                 sizeof(name) - length,
+                 "%.100s",
+                 (char *) block);
+        r->name = strdup(name);
+    }
+    if (r->next_link != NULL)
+    {
+        r->link = r->next_link;
+    }
+    else
+    {
+        snprintf(name, sizeof(name), "%.100s", (char *) block + 157);
+        r->link = strdup(name);
+    }
+    r->next_name = NULL;
+    r->next_link = NULL;
+    r->next_size = -1;
+    if ((r->name == NULL) || (r->link == NULL))
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        return -1;
+    }
+
+    r->mode = (mode_t) get_number(block + 100, 8) & 07777;
+    r->times[0].tv_sec = (time_t) get_number(block + 136, 12);
+    r->times[0].tv_nsec = 0;
+    r->times[1] = r->times[0];
+
+    return begin_member(r);
+}
+
+/*
+ *  archive_write
+ *
+ *  Description:
+ *      The write function of the stdio stream given to decrypt_stream(),
+ *      extracting the archive as it arrives.
+ *
+ *  Parameters:
+ *      cookie [in]
+ *          The archive reader.
+ *
+ *      buffer [in]
+ *          The next part of the archive.
+ *
+ *      size [in]
+ *          The number of octets in the buffer.
+ *
+ *  Returns:
+ *      The number of octets consumed, or -1 if there was an error that
+ *      stops the extraction.
+ *
+ *  Comments:
+ *      Anything after the end of the archive is ignored.
+ */
+static ssize_t archive_write(void *cookie, const char *buffer, size_t size)
+{
+    archive_reader *r = (archive_reader *) cookie;
+    size_t used = 0;
+    size_t n;
+    ssize_t written;
+
+    while ((used < size) && (r->phase != PHASE_END))
+    {
+        switch (r->phase)
+        {
+            case PHASE_HEADER:
+                n = ARCHIVE_BLOCK_SIZE - r->block_length;
+                if (n > size - used) n = size - used;
+                memcpy(r->block + r->block_length, buffer + used, n);
+                used += n;
+                r->block_length += n;
+                if (r->block_length < ARCHIVE_BLOCK_SIZE) break;
+
+                r->block_length = 0;
+                if (parse_header(r))
+                {
+                    r->corrupt = 1;
+                    return -1;
+                }
+                break;
+
+            case PHASE_DATA:
+                n = size - used;
+                if ((off_t) n > r->remaining) n = r->remaining;
+
+                if (r->fd >= 0)
+                {
+                    if ((written = write(r->fd, buffer + used, n)) < 0)
+                    {
+                        if (errno == EINTR) break;
+                        perror("Error writing extracted file");
+                        close(r->fd);
+                        r->fd = -1;
+                        r->failed = 1;
+                    }
+                    else
+                    {
+                        n = written;
+                    }
+                }
+                else if (r->data != NULL)
+                {
+                    memcpy(r->data + r->data_length, buffer + used, n);
+                    r->data_length += n;
+                }
+                used += n;
+                r->remaining -= n;
+                break;
+
+            case PHASE_PAD:
+                n = size - used;
+                if ((off_t) n > r->padding) n = r->padding;
+                used += n;
+                r->padding -= n;
+                break;
+        }
+
+        // Move on once the data and padding of a member are consumed
+        if ((r->phase == PHASE_DATA) && (r->remaining == 0))
+        {
+            if (finish_data(r))
+            {
+                r->corrupt = 1;
+                return -1;
+            }
+            r->phase = PHASE_PAD;
+        }
+        if ((r->phase == PHASE_PAD) && (r->padding == 0))
+        {
+            r->phase = PHASE_HEADER;
+        }
+    }
+
+    return size;
+}
+
+/*
+ *  finish_deferred
+ *
+ *  Description:
+ *      Create the symbolic links and set the modes and times of the
+ *      directories extracted from the archive.
+ *
+ *  Parameters:
+ *      r [in/out]
+ *          The archive reader.
+ *
+ *  Returns:
+ *      Nothing.  Failures are reported and noted in the reader.
+ *
+ *  Comments:
+ *      Directories are finished last, deepest first, so that creating
+ *      their contents does not change their times.
+ */
+static void finish_deferred(archive_reader *r)
+{
+    deferred_entry *d;
+    unsigned i;
+    int fd;
+
+    for (i = 0; i < r->deferred_count; i++)
+    {
+        d = &r->deferred[i];
+        if (d->link == NULL) continue;
+
+        unlinkat(r->dirfd, d->name, 0);
+        if (symlinkat(d->link, r->dirfd, d->name) ||
+            utimensat(r->dirfd, d->name, d->times, AT_SYMLINK_NOFOLLOW))
+        {
+            fprintf(stderr, "Error creating link %s : ", d->name);
+            perror("");
+            r->failed = 1;
+        }
+    }
+
+    for (i = r->deferred_count; i-- > 0; )
+    {
+        d = &r->deferred[i];
+        if (d->link != NULL) continue;
+
+        fd = openat(r->dirfd,
+                    d->name,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if ((fd < 0) || fchmod(fd, d->mode) || futimens(fd, d->times))
+        {
+            fprintf(stderr, "Error setting attributes of %s : ", d->name);
+            perror("");
+            r->failed = 1;
+        }
+        if (fd >= 0) close(fd);
+    }
+}
+
+/*
+ *  archive_extract
+ *
+ *  Description:
+ *      Decrypt an archive and extract its members into a directory.
+ *
+ *  Parameters:
+ *      infp [in]
+ *          The encrypted archive.
+ *
+ *      directory [in]
+ *          The directory into which to extract, which is created if it
+ *          does not exist.
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.  A member that
+ *      cannot be extracted is reported, skipped, and is an error.
+ *
+ *  Comments:
+ *      Symbolic links are not created if the archive could not be
+ *      decrypted or authenticated.
+ */
+int archive_extract(FILE *infp,
+                    const char *directory,
+                    const unsigned char *passwd,
+                    int passlen)
+{
+    archive_reader r;
+    cookie_io_functions_t functions = {NULL, archive_write, NULL, NULL};
+    FILE *outfp;
+    unsigned i;
+    int rc = 0;
+
+    memset(&r, 0, sizeof(r));
+    r.fd = -1;
+    r.next_size = -1;
+    r.phase = PHASE_HEADER;
+
+    if (mkdir(directory, 0755) && (errno != EEXIST))
+    {
+        fprintf(stderr, "Error creating directory %s : ", directory);
+        perror("");
+        return -1;
+    }
+
+    if ((r.dirfd = open(directory,
+                        O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    {
+        fprintf(stderr, "Error opening directory %s : ", directory);
+        perror("");
+        return -1;
+    }
+
+    if ((outfp = fopencookie(&r, "w", functions)) == NULL)
+    {
+        perror("Error creating archive stream");
+        close(r.dirfd);
+        return -1;
+    }
+
+    rc = decrypt_stream(infp, outfp, (unsigned char *) passwd, passlen);
+    if (fclose(outfp)) rc = -1;
+
+    if (!rc && !r.corrupt &&
+        ((r.phase == PHASE_DATA) || (r.phase == PHASE_PAD) ||
+         (r.block_length != 0)))
+    {
+        fprintf(stderr, "Error: Archive is truncated\n");
+        rc = -1;
+    }
+
+    if (r.fd >= 0) close(r.fd);
+
+    if (!rc)
+    {
+        finish_deferred(&r);
+    }
+    else
+    {
+        fprintf(stderr,
+                "Error: Extraction into %s is incomplete\n",
+                directory);
+    }
+
+    if (!rc && r.failed)
+    {
+        fprintf(stderr, "Error: Some members could not be extracted\n");
+        rc = -1;
+    }
+
+    for (i = 0; i < r.deferred_count; i++)
+    {
+        free(r.deferred[i].name);
+        free(r.deferred[i].link);
+    }
+    free(r.deferred);
+    free(r.name);
+    free(r.link);
+    free(r.next_name);
+    free(r.next_link);
+    free(r.data);
+    close(r.dirfd);
+
+    return rc;
+}
+
+typedef struct {
+    off_t offset;                   // Offset of the member data
+    off_t size;                     // Octets of member data
+    time_t mtime;
+    mode_t mode;
+    char typeflag;
+    char *name;                     // Name, within the index
+    char *link;                     // Link target, within the index
+} index_record;
+
+/*
+ *  get_index_number
+ *
+ *  Description:
+ *      Load a big endian number from the member index.
+ *
+ *  Parameters:
+ *      buffer [in]
+ *          The number.
+ *
+ *      octets [in]
+ *          The number of octets in the number.
+ *
+ *  Returns:
+ *      The number.
+ *
+ *  Comments:
+ *      None.
+ */
+static unsigned long long get_index_number(const unsigned char *buffer,
+                                           unsigned octets)
+{
+    unsigned long long value = 0;
+    unsigned i;
+
+    for (i = 0; i < octets; i++) value = (value << 8) | buffer[i];
+
+    return value;
+}
+
+/*
+ *  load_index
+ *
+ *  Description:
+ *      Decrypt the member index of an archive.
+ *
+ *  Parameters:
+ *      reader [in]
+ *          The open archive.
+ *
+ *      index [out]
+ *          The records of the index, which the caller frees.
+ *
+ *      length [out]
+ *          The length of the records in octets.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Only the index and its footer are decrypted.
+ */
+static int load_index(aescrypt_reader *reader,
+                      unsigned char **index,
+                      size_t *length)
+{
+    unsigned char footer[ARCHIVE_INDEX_FOOTER_LEN];
+    off_t end = reader->plaintext_size - ARCHIVE_INDEX_FOOTER_LEN;
+    unsigned long long offset;
+
+    *index = NULL;
+
+    if ((end < 0) ||
+        (aescrypt_reader_pread(reader,
+                               footer,
+                               ARCHIVE_INDEX_FOOTER_LEN,
+                               end) != ARCHIVE_INDEX_FOOTER_LEN))
+    {
+        return -1;
+    }
+
+    if (memcmp(footer, ARCHIVE_INDEX_MAGIC, 16))
+    {
+        fprintf(stderr,
+                "Error: The archive has no member index; it may only be "
+                "extracted in full\n");
+        return -1;
+    }
+
+    offset = get_index_number(footer + 16, 8);
+    if (offset > (unsigned long long) end)
+    {
+        fprintf(stderr, "Error: Archive is corrupt (member index)\n");
+        return -1;
+    }
+    *length = (size_t) (end - offset);
+
+    if ((*index = malloc(*length + 1)) == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        return -1;
+    }
+
+    if (aescrypt_reader_pread(reader,
+                              *index,
+                              *length,
+                              (off_t) offset) != (ssize_t) *length)
+    {
+        free(*index);
+        *index = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  next_record
+ *
+ *  Description:
+ *      Parse the next record of the member index.
+ *
+ *  Parameters:
+ *      reader [in]
+ *          The open archive.
+ *
+ *      index [in]
+ *          The records of the index.
+ *
+ *      length [in]
+ *          The length of the records in octets.
+ *
+ *      position [in/out]
+ *          The offset of the next record, which is advanced.
+ *
+ *      record [out]
+ *          The record.
+ *
+ *  Returns:
+ *      1 if a record was parsed, 0 at the end of the index, or -1 if the
+ *      index is corrupt.
+ *
+ *  Comments:
+ *      The name and link of the record point into the index.
+ */
+static int next_record(aescrypt_reader *reader,
+                       unsigned char *index,
+                       size_t length,
+                       size_t *position,
+                       index_record *record)
+{
+    unsigned char *p = index + *position;
+    unsigned char *name_end;
+    unsigned char *link_end = NULL;
+
+    if (*position == length) return 0;
+
+    if ((length - *position > ARCHIVE_INDEX_RECORD_LEN) &&
+        ((name_end = memchr(p + ARCHIVE_INDEX_RECORD_LEN,
+                            '\0',
+                            length - *position -
+                                ARCHIVE_INDEX_RECORD_LEN)) != NULL))
+    {
+        link_end = memchr(name_end + 1, '\0', index + length - name_end - 1);
+    }
+
+    if (link_end != NULL)
+    {
+        record->offset = (off_t) get_index_number(p, 8);
+        record->size = (off_t) get_index_number(p + 8, 8);
+        record->mtime = (time_t) get_index_number(p + 16, 8);
+        record->mode = (mode_t) get_index_number(p + 24, 4) & 07777;
+        record->typeflag = (char) p[28];
+        record->name = (char *) p + ARCHIVE_INDEX_RECORD_LEN;
+        record->link = (char *) name_end + 1;
+        *position = link_end + 1 - index;
+    }
+
+    if ((link_end == NULL) || (record->offset < 0) || (record->size < 0) ||
+        (record->offset > reader->plaintext_size - record->size))
+    {
+        fprintf(stderr, "Error: Archive is corrupt (member index)\n");
+        return -1;
+    }
+
+    return 1;
+}
+
+/*
+ *  open_archive
+ *
+ *  Description:
+ *      Open an archive for random access and load its member index.
+ *
+ *  Parameters:
+ *      reader [out]
+ *          The open archive.
+ *
+ *      filename [in]
+ *          The encrypted archive.
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *      verify [in]
+ *          If non-zero, authenticate the entire archive first.
+ *
+ *      jobs [in]
+ *          The number of threads to use when verifying (0 for default).
+ *
+ *      index [out]
+ *          The records of the index, which the caller frees.
+ *
+ *      length [out]
+ *          The length of the records in octets.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error and the archive is
+ *      not open.
+ *
+ *  Comments:
+ *      None.
+ */
+static int open_archive(aescrypt_reader *reader,
+                        const char *filename,
+                        const unsigned char *passwd,
+                        int passlen,
+                        int verify,
+                        unsigned jobs,
+                        unsigned char **index,
+                        size_t *length)
+{
+    if (aescrypt_reader_open(reader, filename, passwd, passlen))
+    {
+        return -1;
+    }
+
+    if ((verify && aescrypt_reader_verify(reader, jobs)) ||
+        load_index(reader, index, length))
+    {
+        aescrypt_reader_close(reader);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  archive_list
+ *
+ *  Description:
+ *      List the members of an archive, in the manner of "tar -tv".
+ *
+ *  Parameters:
+ *      filename [in]
+ *          The encrypted archive.
+ *
+ *      outfp [in]
+ *          The stream to which the list is written.
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *      verify [in]
+ *          If non-zero, authenticate the entire archive first.
+ *
+ *      jobs [in]
+ *          The number of threads to use when verifying (0 for default).
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Only the member index is decrypted, and it is not authenticated
+ *      unless verify is requested or the archive is a chunked stream.
+ */
+int archive_list(const char *filename,
+                 FILE *outfp,
+                 const unsigned char *passwd,
+                 int passlen,
+                 int verify,
+                 unsigned jobs)
+{
+    static const char types[] = "-hlcbdp-";
+    aescrypt_reader reader;
+    index_record record;
+    unsigned char *index;
+    size_t length;
+    size_t position = 0;
+    char permissions[11];
+    char date[32];
+    struct tm tm;
+    unsigned i;
+    int rc;
+
+    if (open_archive(&reader,
+                     filename,
+                     passwd,
+                     passlen,
+                     verify,
+                     jobs,
+                     &index,
+                     &length))
+    {
+        return -1;
+    }
+
+    while ((rc = next_record(&reader,
+                             index,
+                             length,
+                             &position,
+                             &record)) > 0)
+    {
+        permissions[0] = ((record.typeflag >= '0') &&
+                          (record.typeflag <= '7')) ?
+                             types[record.typeflag - '0'] : '?';
+        for (i = 0; i < 9; i++)
+        {
+            permissions[i + 1] = (record.mode & (0400 >> i)) ?
+                                     "rwxrwxrwx"[i] : '-';
+        }
+        permissions[10] = '\0';
+
+        if (localtime_r(&record.mtime, &tm) == NULL)
+        {
+            memset(&tm, 0, sizeof(tm));
+        }
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &tm);
+
+        fprintf(outfp,
+                "%s %12lld %s %s%s%s\n",
+                permissions,
+                (long long) record.size,
+                date,
+                record.name,
+                (record.typeflag == '2') ? " -> " : "",
+                (record.typeflag == '2') ? record.link : "");
+    }
+
+    free(index);
+    aescrypt_reader_close(&reader);
+
+    if (!rc && fflush(outfp))
+    {
+        fprintf(stderr, "Error: Could not write the member list\n");
+        rc = -1;
+    }
+
+    return rc;
+}
+
+/*
+ *  member_matches
+ *
+ *  Description:
+ *      Determine whether a member is, or is within, the given path.
+ *
+ *  Parameters:
+ *      name [in]
+ *          The member name.
+ *
+ *      path [in]
+ *          The path requested.
+ *
+ *  Returns:
+ *      1 if the member matches, otherwise 0.
+ *
+ *  Comments:
+ *      Leading and trailing slashes are ignored.
+ */
+static int member_matches(const char *name, const char *path)
+{
+    size_t length;
+
+    while (*name == '/') name++;
+    while (*path == '/') path++;
+    length = strlen(path);
+    while ((length > 0) && (path[length - 1] == '/')) length--;
+
+    return !strncmp(name, path, length) &&
+           ((name[length] == '\0') || (name[length] == '/'));
+}
+
+/*
+ *  archive_extract_member
+ *
+ *  Description:
+ *      Extract one member of an archive, or the members within one
+ *      directory, decrypting only the data of those members.
+ *
+ *  Parameters:
+ *      filename [in]
+ *          The encrypted archive.
+ *
+ *      path [in]
+ *          The name of the member to extract.
+ *
+ *      directory [in]
+ *          The directory into which to extract, which is created if it
+ *          does not exist.
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *      verify [in]
+ *          If non-zero, authenticate the entire archive first.
+ *
+ *      jobs [in]
+ *          The number of threads to use when verifying (0 for default).
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.  It is an error if
+ *      no member matches.
+ *
+ *  Comments:
+ *      The members are not authenticated unless verify is requested or
+ *      the archive is a chunked stream.
+ */
+int archive_extract_member(const char *filename,
+                           const char *path,
+                           const char *directory,
+                           const unsigned char *passwd,
+                           int passlen,
+                           int verify,
+                           unsigned jobs)
+{
+    aescrypt_reader reader;
+    archive_reader r;
+    index_record record;
+    unsigned char buffer[65536];
+    unsigned char *index;
+    size_t length;
+    size_t position = 0;
+    unsigned matched = 0;
+    off_t offset;
+    ssize_t n, written, result;
+    unsigned i;
+    int rc;
+
+    if (open_archive(&reader,
+                     filename,
+                     passwd,
+                     passlen,
+                     verify,
+                     jobs,
+                     &index,
+                     &length))
+    {
+        return -1;
+    }
+
+    memset(&r, 0, sizeof(r));
+    r.fd = -1;
+
+    if (mkdir(directory, 0755) && (errno != EEXIST))
+    {
+        fprintf(stderr, "Error creating directory %s : ", directory);
+        perror("");
+        r.dirfd = -1;
+        rc = -1;
+    }
+    else if ((r.dirfd = open(directory,
+                             O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    {
+        fprintf(stderr, "Error opening directory %s : ", directory);
+        perror("");
+        rc = -1;
+    }
+    else
+    {
+        rc = 1;
+    }
+
+    while ((rc > 0) &&
+           ((rc = next_record(&reader,
+                              index,
+                              length,
+                              &position,
+                              &record)) > 0))
+    {
+        if (!member_matches(record.name, path)) continue;
+        matched++;
+
+        // Extract the member as archive_extract() would
+        r.typeflag = record.typeflag;
+        r.mode = record.mode;
+        r.times[0].tv_sec = record.mtime;
+        r.times[0].tv_nsec = 0;
+        r.times[1] = r.times[0];
+        r.name = record.name;
+        r.link = record.link;
+        if (begin_member(&r))
+        {
+            rc = -1;
+            break;
+        }
+
+        for (offset = 0; (r.fd >= 0) && (offset < record.size); )
+        {
+            n = sizeof(buffer);
+            if ((off_t) n > record.size - offset)
+            {
+                n = record.size - offset;
+            }
+            if ((n = aescrypt_reader_pread(&reader,
+                                           buffer,
+                                           n,
+                                           record.offset + offset)) <= 0)
+            {
+                rc = -1;
+                break;
+            }
+            for (written = 0; written < n; written += result)
+            {
+                result = write(r.fd, buffer + written, n - written);
+                if ((result < 0) && (errno == EINTR)) result = 0;
+                if (result < 0) break;
+            }
+            if (written < n)
+            {
+                perror("Error writing extracted file");
+                r.failed = 1;
+                break;
+            }
+            offset += n;
+        }
+        finish_data(&r);
+        if (rc < 0) break;
+    }
+    secure_erase(buffer, sizeof(buffer));
+
+    if (r.fd >= 0) close(r.fd);
+
+    if (!rc && !matched)
+    {
+        fprintf(stderr, "%s: not found in archive\n", path);
+        rc = -1;
+    }
+
+    if (!rc) finish_deferred(&r);
+
+    if (!rc && r.failed)
+    {
+        fprintf(stderr, "Error: Some members could not be extracted\n");
+        rc = -1;
+    }
+
+    for (i = 0; i < r.deferred_count; i++)
+    {
+        free(r.deferred[i].name);
+        free(r.deferred[i].link);
+    }
+    free(r.deferred);
+    if (r.dirfd >= 0) close(r.dirfd);
+    free(index);
+    aescrypt_reader_close(&reader);
+
+    return rc;
+}
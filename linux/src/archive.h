@@ -0,0 +1,56 @@
+/*
+ *  archive.h
+ *
+ *  Archive Mode for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to encrypt a ustar/pax archive of directory trees, to
+ *      extract such an archive while it is decrypted, and to list or
+ *      extract single members using the member index of the archive.
+ *
+ *  Portability Issues:
+ *      Requires POSIX threads and fopencookie().
+ */
+
+#ifndef AESCRYPT_ARCHIVE_H
+#define AESCRYPT_ARCHIVE_H
+
+#include <stdio.h>
+
+#include "stream.h"
+
+#define ARCHIVE_BLOCK_SIZE          512
+#define ARCHIVE_PREFETCH_SIZE       262144  /* Octets read ahead per file */
+#define ARCHIVE_SLOTS_PER_JOB       4       /* Files read ahead per job */
+#define ARCHIVE_DEFAULT_JOBS        4       /* Least jobs used by default */
+#define ARCHIVE_EXTENSION           ".tar"
+
+// Function prototypes
+int archive_create(char *const paths[],
+                   unsigned count,
+                   FILE *outfp,
+                   unsigned jobs,
+                   const unsigned char *passwd,
+                   int passlen,
+                   const stream_options *options);
+int archive_extract(FILE *infp,
+                    const char *directory,
+                    const unsigned char *passwd,
+                    int passlen);
+int archive_list(const char *filename,
+                 FILE *outfp,
+                 const unsigned char *passwd,
+                 int passlen,
+                 int verify,
+                 unsigned jobs);
+int archive_extract_member(const char *filename,
+                           const char *path,
+                           const char *directory,
+                           const unsigned char *passwd,
+                           int passlen,
+                           int verify,
+                           unsigned jobs);
+
+#endif // AESCRYPT_ARCHIVE_H
@@ -0,0 +1,218 @@
+#!/bin/bash
+#
+#  bench.sh
+#
+#  Throughput Benchmark for AES Crypt
+#  Copyright (C) 2022
+#  Paul E. Jones <paulej@packetizer.com>
+#
+#  Measures the time aescrypt takes to encrypt, decrypt, and verify files of
+#  several sizes, read from a file, standard input, or a pipe, with the input
+#  in the page cache ("hot") or dropped from it ("cold"), along with the time
+#  taken by key derivation alone.  Each measurement is repeated and the median
+#  is reported, both as a table and as JSON with one result per line.  If a
+#  baseline from an earlier run exists, each result is compared with it.
+#
+#  Settings are taken from the environment (or "make bench VAR=value"):
+#
+#      BENCH_SIZES     Input sizes, with an optional K, M, or G suffix
+#                      (default "0 4K 1M 64M"; add e.g. 1G 4G for large files)
+#      BENCH_RUNS      Runs per measurement (default 3)
+#      BENCH_MODES     Any of "file stdin pipe" (default all)
+#      BENCH_CACHE     Any of "hot cold" (default all)
+#      BENCH_FLAGS     Extra options given to aescrypt -e (e.g. "--chunked")
+#      BENCH_DIR       Directory for the test files (default ".")
+#      BENCH_OUTPUT    File to write the results to (default bench.json)
+#      BENCH_BASELINE  Results to compare with (default bench.baseline.json)
+#      AESCRYPT        The program to measure (default ./aescrypt)
+#
+#  To keep a run as the baseline for later comparisons, copy bench.json to
+#  bench.baseline.json.
+
+set -o pipefail
+
+SIZES=${BENCH_SIZES:-"0 4K 1M 64M"}
+RUNS=${BENCH_RUNS:-3}
+MODES=${BENCH_MODES:-"file stdin pipe"}
+CACHE=${BENCH_CACHE:-"hot cold"}
+FLAGS=${BENCH_FLAGS:-""}
+OUTPUT=${BENCH_OUTPUT:-bench.json}
+BASELINE=${BENCH_BASELINE:-bench.baseline.json}
+AESCRYPT=${AESCRYPT:-./aescrypt}
+PASSWORD="bench"
+KDF_OPS=10
+
+die ()
+{
+    echo "[ERROR]: $1" >&2
+    exit 1
+}
+
+# Convert a size with an optional K, M, or G suffix to octets
+to_bytes ()
+{
+    case "$1" in
+        *[kK]) echo $(( ${1%?} << 10 )) ;;
+        *[mM]) echo $(( ${1%?} << 20 )) ;;
+        *[gG]) echo $(( ${1%?} << 30 )) ;;
+        *)     echo $(( $1 )) ;;
+    esac
+}
+
+# Drop a file from the page cache so the next read comes from the disk
+drop_cache ()
+{
+    dd if="$1" iflag=nocache count=0 status=none 2>/dev/null
+}
+
+# Print the median of the numbers on standard input
+median ()
+{
+    sort -g | awk '{ v[NR] = $1 }
+                   END { if (NR % 2) print v[(NR + 1) / 2];
+                         else print (v[NR / 2] + v[NR / 2 + 1]) / 2 }'
+}
+
+# Run a command the given number of times, dropping the input from the page
+# cache first if it is cold, and print the median time in seconds
+measure ()
+{
+    local cache=$1 input=$2
+    local start end i
+    shift 2
+
+    # Warm the page cache and the program itself before hot runs
+    if [ "$cache" = "hot" ]; then
+        cat "$input" >/dev/null
+        "$@" || die "Command failed: $*"
+    fi
+
+    for (( i = 0; i < RUNS; i++ )); do
+        if [ "$cache" = "cold" ]; then
+            drop_cache "$input"
+        fi
+        start=$(date +%s%N)
+        "$@" || die "Command failed: $*"
+        end=$(date +%s%N)
+        echo $(( end - start ))
+    done | median | awk '{ printf "%.6f\n", $1 / 1e9 }'
+}
+
+# The commands measured, given the mode, input, and output
+encrypt_file ()  { "$AESCRYPT" -e -p "$PASSWORD" $FLAGS -o "$2" "$1"; }
+encrypt_stdin () { "$AESCRYPT" -e -p "$PASSWORD" $FLAGS - <"$1" >"$2"; }
+encrypt_pipe ()  { cat "$1" | "$AESCRYPT" -e -p "$PASSWORD" $FLAGS - |
+                   cat >"$2"; }
+decrypt_file ()  { "$AESCRYPT" -d -p "$PASSWORD" -o "$2" "$1"; }
+decrypt_stdin () { "$AESCRYPT" -d -p "$PASSWORD" - <"$1" >"$2"; }
+decrypt_pipe ()  { cat "$1" | "$AESCRYPT" -d -p "$PASSWORD" - |
+                   cat >"$2"; }
+verify_file ()   { "$AESCRYPT" -d -p "$PASSWORD" --verify "$1"; }
+
+# Derive the key for an empty file several times over
+kdf_ops ()
+{
+    local i
+    for (( i = 0; i < KDF_OPS; i++ )); do
+        "$AESCRYPT" -e -p "$PASSWORD" -o "$2" "$1" || return 1
+    done
+}
+
+# Print the baseline result for the same measurement, if there is one
+baseline_seconds ()
+{
+    [ -f "$BASELINE" ] || return
+    grep -F "\"operation\": \"$1\", \"mode\": \"$2\", \"cache\": \"$3\", \
+\"size\": $4," "$BASELINE" |
+        sed -e 's/.*"median_seconds": \([0-9.e+-]*\).*/\1/' | head -n 1
+}
+
+# Record one result as a line of JSON and as a line of the table
+report ()
+{
+    local operation=$1 mode=$2 cache=$3 size=$4 seconds=$5 ops=$6
+    local rate unit old change=""
+
+    if [ "$operation" = "kdf" ]; then
+        rate=$(awk -v s="$seconds" -v n="$ops" \
+               'BEGIN { printf "%.3f", (s > 0) ? n / s : 0 }')
+        unit="ops/s"
+    else
+        rate=$(awk -v s="$seconds" -v b="$size" \
+               'BEGIN { printf "%.3f", (s > 0) ? b / s / 1048576 : 0 }')
+        unit="MiB/s"
+    fi
+
+    old=$(baseline_seconds "$operation" "$mode" "$cache" "$size")
+    if [ -n "$old" ]; then
+        change=$(awk -v o="$old" -v n="$seconds" \
+                 'BEGIN { if (n > 0) printf "%+.1f%%", (o / n - 1) * 100 }')
+    fi
+
+    printf '%s{"operation": "%s", "mode": "%s", "cache": "%s", ' \
+           "$SEPARATOR" "$operation" "$mode" "$cache" >>"$OUTPUT"
+    printf '"size": %s, "runs": %s, "median_seconds": %s, "%s": %s}' \
+           "$size" "$RUNS" "$seconds" \
+           "$( [ "$unit" = "ops/s" ] && echo ops_per_second ||
+               echo mib_per_second )" \
+           "$rate" >>"$OUTPUT"
+    SEPARATOR=$',\n  '
+
+    printf '%-8s %-6s %-5s %12s %11.6f s %12s %s %s\n' \
+           "$operation" "$mode" "$cache" "$size" "$seconds" "$rate" "$unit" \
+           "$change"
+}
+
+[ -x "$AESCRYPT" ] || die "$AESCRYPT is not built"
+(( RUNS > 0 )) || die "BENCH_RUNS must be at least 1"
+
+WORKDIR=$(mktemp -d "${BENCH_DIR:-.}/bench.XXXXXX") ||
+    die "Unable to create a directory for the test files"
+trap 'rm -rf "$WORKDIR"' EXIT
+
+SEPARATOR=""
+printf '[\n  ' >"$OUTPUT"
+
+echo "$("$AESCRYPT" -v 2>&1), $RUNS runs per result${FLAGS:+, $FLAGS}"
+if [ -f "$BASELINE" ]; then
+    echo "Changes in throughput are relative to $BASELINE"
+fi
+printf '%-8s %-6s %-5s %12s %13s %18s\n' \
+       "op" "mode" "cache" "size" "median" "throughput"
+
+# Key derivation dominates the work for an empty file
+: >"$WORKDIR/empty"
+seconds=$(measure hot "$WORKDIR/empty" \
+          kdf_ops "$WORKDIR/empty" "$WORKDIR/empty.aes") || exit 1
+report kdf file hot 0 "$seconds" "$KDF_OPS"
+
+for size in $SIZES; do
+    bytes=$(to_bytes "$size") || die "Invalid size $size"
+    plain="$WORKDIR/plain.$bytes"
+    cipher="$WORKDIR/plain.$bytes.aes"
+
+    head -c "$bytes" /dev/urandom >"$plain"
+    encrypt_file "$plain" "$cipher" || die "Unable to encrypt $plain"
+
+    for cache in $CACHE; do
+        for mode in $MODES; do
+            seconds=$(measure "$cache" "$plain" \
+                      encrypt_$mode "$plain" "$WORKDIR/out.aes") || exit 1
+            report encrypt "$mode" "$cache" "$bytes" "$seconds"
+
+            seconds=$(measure "$cache" "$cipher" \
+                      decrypt_$mode "$cipher" "$WORKDIR/out") || exit 1
+            report decrypt "$mode" "$cache" "$bytes" "$seconds"
+            rm -f "$WORKDIR/out" "$WORKDIR/out.aes"
+        done
+
+        # Verification reads only the encrypted file
+        seconds=$(measure "$cache" "$cipher" verify_file "$cipher") || exit 1
+        report verify file "$cache" "$bytes" "$seconds"
+    done
+
+    rm -f "$plain" "$cipher"
+done
+
+printf '\n]\n' >>"$OUTPUT"
+echo "Results written to $OUTPUT"
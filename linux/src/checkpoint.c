@@ -0,0 +1,364 @@
+/*
+ *  checkpoint.c
+ *
+ *  Encryption Checkpoints for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to save and restore the state of an encryption in
+ *      progress so that an interrupted encryption can be resumed.
+ *
+ *      Since the header of the output already holds the password-wrapped
+ *      session key, the state needed to continue is small: the offsets
+ *      into the input and output, the last ciphertext block (the CBC
+ *      chaining value), and the inner hash of the running HMAC.  That
+ *      state is encrypted with AES-256-CBC and authenticated with
+ *      HMAC-SHA256 using keys derived from the password-derived key of
+ *      the output file, so a checkpoint is only usable with the output
+ *      file it belongs to.  A checkpoint file is:
+ *
+ *          "AES-CHECKPOINT" || 0x00 || version (1) ||
+ *          IV (16) || encrypted state (144) || HMAC (32)
+ *
+ *      Checkpoints are written to a temporary file that is renamed over
+ *      the previous checkpoint so that a checkpoint is never partial.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>    // mkstemp
+#include <string.h>
+#include <unistd.h>    // fsync
+
+#include "checkpoint.h"
+#include "hmac.h"
+#include "util.h"
+
+#define CHECKPOINT_MAGIC            "AES-CHECKPOINT\0\1"
+#define CHECKPOINT_STATE_LEN        144
+
+/*
+ *  derive_subkey
+ *
+ *  Description:
+ *      Derive a key for a particular purpose from the given key.
+ *
+ *  Parameters:
+ *      key [in]
+ *          The key from which to derive the subkey.
+ *
+ *      label [in]
+ *          The purpose of the subkey.
+ *
+ *      subkey [out]
+ *          The derived key.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void derive_subkey(const unsigned char key[32],
+                          const char *label,
+                          unsigned char subkey[32])
+{
+    hmac_sha256_context hmac_ctx;
+
+    hmac_sha256_starts(&hmac_ctx, key, 32);
+    hmac_sha256_update(&hmac_ctx,
+                       (const unsigned char *) label,
+                       strlen(label));
+    hmac_sha256_finish(&hmac_ctx, subkey);
+}
+
+/*
+ *  put_be / get_be
+ *
+ *  Description:
+ *      Store or load an unsigned integer in big-endian order.
+ *
+ *  Parameters:
+ *      buffer [in/out]
+ *          Where the integer is stored.
+ *
+ *      value [in]
+ *          The value to store.
+ *
+ *      length [in]
+ *          The number of octets.
+ *
+ *  Returns:
+ *      get_be() returns the value loaded.
+ *
+ *  Comments:
+ *      None.
+ */
+static void put_be(unsigned char *buffer,
+                   unsigned long long value,
+                   unsigned length)
+{
+    while (length-- > 0)
+    {
+        buffer[length] = (unsigned char) value;
+        value >>= 8;
+    }
+}
+
+static unsigned long long get_be(const unsigned char *buffer,
+                                 unsigned length)
+{
+    unsigned long long value = 0;
+
+    while (length-- > 0) value = (value << 8) | *buffer++;
+
+    return value;
+}
+
+/*
+ *  checkpoint_keys_init
+ *
+ *  Description:
+ *      Derive the keys protecting checkpoints from the password-derived
+ *      key of the output file.
+ *
+ *  Parameters:
+ *      keys [out]
+ *          The checkpoint keys.
+ *
+ *      key [in]
+ *          The key derived from the password and the IV of the output.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void checkpoint_keys_init(checkpoint_keys *keys, const unsigned char key[32])
+{
+    derive_subkey(key, "AES-CHECKPOINT-ENC", keys->enc_key);
+    derive_subkey(key, "AES-CHECKPOINT-MAC", keys->mac_key);
+}
+
+/*
+ *  save_checkpoint
+ *
+ *  Description:
+ *      Atomically replace the checkpoint file with the given state.
+ *
+ *  Parameters:
+ *      filename [in]
+ *          The checkpoint file.
+ *
+ *      keys [in]
+ *          The checkpoint keys.
+ *
+ *      state [in]
+ *          The state to save.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      The caller must ensure the output up to the saved output offset
+ *      is on disk before saving the checkpoint.
+ */
+int save_checkpoint(const char *filename,
+                    const checkpoint_keys *keys,
+                    const checkpoint_state *state)
+{
+    unsigned char buffer[CHECKPOINT_FILE_LEN];
+    unsigned char *iv = buffer + 16;
+    unsigned char *data = buffer + 32;
+    const unsigned char *chain;
+    char tmpfile[AES_CRYPT_MAX_PATH];
+    aes_context aes_ctx;
+    hmac_sha256_context hmac_ctx;
+    FILE *fp;
+    int fd;
+    unsigned i, j;
+    int rc = 0;
+
+    memset(buffer, 0, sizeof(buffer));
+    memcpy(buffer, CHECKPOINT_MAGIC, 16);
+
+    if (((fp = fopen("/dev/urandom", "r")) == NULL) ||
+        (fread(iv, 1, 16, fp) != 16))
+    {
+        perror("Error reading /dev/urandom");
+        if (fp != NULL) fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    // Serialize the state
+    put_be(data, state->input_offset, 8);
+    put_be(data + 8, state->output_offset, 8);
+    memcpy(data + 16, state->iv, 16);
+    put_be(data + 32, state->hmac_inner.total[0], 4);
+    put_be(data + 36, state->hmac_inner.total[1], 4);
+    for (i = 0; i < 8; i++)
+    {
+        put_be(data + 40 + i * 4, state->hmac_inner.state[i], 4);
+    }
+    memcpy(data + 72, state->hmac_inner.buffer, 64);
+
+    // Encrypt the state (CBC)
+    aes_set_key(&aes_ctx, (unsigned char *) keys->enc_key, 256);
+    for (i = 0, chain = iv; i < CHECKPOINT_STATE_LEN; i += 16)
+    {
+        for (j = 0; j < 16; j++) data[i + j] ^= chain[j];
+        aes_encrypt(&aes_ctx, data + i, data + i);
+        chain = data + i;
+    }
+    secure_erase(&aes_ctx, sizeof(aes_ctx));
+
+    hmac_sha256_starts(&hmac_ctx, keys->mac_key, 32);
+    hmac_sha256_update(&hmac_ctx, buffer, 32 + CHECKPOINT_STATE_LEN);
+    hmac_sha256_finish(&hmac_ctx, data + CHECKPOINT_STATE_LEN);
+
+    // Write a new checkpoint and rename it over the previous one
+    if (snprintf(tmpfile,
+                 AES_CRYPT_MAX_PATH,
+                 "%s.XXXXXX",
+                 filename) >= AES_CRYPT_MAX_PATH)
+    {
+        fprintf(stderr, "Checkpoint file pathname too long\n");
+        return -1;
+    }
+
+    if ((fd = mkstemp(tmpfile)) < 0)
+    {
+        fprintf(stderr, "Error creating checkpoint file %s : ", tmpfile);
+        perror("");
+        return -1;
+    }
+
+    if ((fp = fdopen(fd, "w")) == NULL)
+    {
+        perror("Error opening checkpoint file");
+        close(fd);
+        unlink(tmpfile);
+        return -1;
+    }
+
+    if ((fwrite(buffer, 1, sizeof(buffer), fp) != sizeof(buffer)) ||
+        fflush(fp) ||
+        fsync(fileno(fp)))
+    {
+        fprintf(stderr, "Error: Could not write checkpoint file\n");
+        rc = -1;
+    }
+    if (fclose(fp)) rc = -1;
+
+    if (!rc && rename(tmpfile, filename))
+    {
+        fprintf(stderr, "Error renaming %s to %s : ", tmpfile, filename);
+        perror("");
+        rc = -1;
+    }
+
+    if (rc) unlink(tmpfile);
+
+    secure_erase(buffer, sizeof(buffer));
+
+    return rc;
+}
+
+/*
+ *  load_checkpoint
+ *
+ *  Description:
+ *      Read, authenticate, and decrypt the checkpoint file.
+ *
+ *  Parameters:
+ *      filename [in]
+ *          The checkpoint file.
+ *
+ *      keys [in]
+ *          The checkpoint keys.
+ *
+ *      state [out]
+ *          The saved state.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error or the checkpoint
+ *      does not belong to the output file.
+ *
+ *  Comments:
+ *      None.
+ */
+int load_checkpoint(const char *filename,
+                    const checkpoint_keys *keys,
+                    checkpoint_state *state)
+{
+    unsigned char buffer[CHECKPOINT_FILE_LEN];
+    unsigned char *data = buffer + 32;
+    unsigned char chain[16], next[16];
+    unsigned char digest[32];
+    aes_context aes_ctx;
+    hmac_sha256_context hmac_ctx;
+    FILE *fp;
+    unsigned i, j;
+
+    if ((fp = fopen(filename, "r")) == NULL)
+    {
+        fprintf(stderr, "Error opening checkpoint file %s : ", filename);
+        perror("");
+        return -1;
+    }
+
+    if ((fread(buffer, 1, sizeof(buffer), fp) != sizeof(buffer)) ||
+        memcmp(buffer, CHECKPOINT_MAGIC, 16))
+    {
+        fprintf(stderr, "Error: %s is not a checkpoint file\n", filename);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    hmac_sha256_starts(&hmac_ctx, keys->mac_key, 32);
+    hmac_sha256_update(&hmac_ctx, buffer, 32 + CHECKPOINT_STATE_LEN);
+    hmac_sha256_finish(&hmac_ctx, digest);
+    if (memcmp(digest, data + CHECKPOINT_STATE_LEN, 32))
+    {
+        fprintf(stderr,
+                "Error: Checkpoint %s does not match the output file or "
+                "password\n",
+                filename);
+        return -1;
+    }
+
+    // Decrypt the state (CBC)
+    aes_set_key(&aes_ctx, (unsigned char *) keys->enc_key, 256);
+    memcpy(chain, buffer + 16, 16);
+    for (i = 0; i < CHECKPOINT_STATE_LEN; i += 16)
+    {
+        memcpy(next, data + i, 16);
+        aes_decrypt(&aes_ctx, data + i, data + i);
+        for (j = 0; j < 16; j++) data[i + j] ^= chain[j];
+        memcpy(chain, next, 16);
+    }
+    secure_erase(&aes_ctx, sizeof(aes_ctx));
+
+    state->input_offset = (off_t) get_be(data, 8);
+    state->output_offset = (off_t) get_be(data + 8, 8);
+    memcpy(state->iv, data + 16, 16);
+    state->hmac_inner.total[0] = (uint32) get_be(data + 32, 4);
+    state->hmac_inner.total[1] = (uint32) get_be(data + 36, 4);
+    for (i = 0; i < 8; i++)
+    {
+        state->hmac_inner.state[i] = (uint32) get_be(data + 40 + i * 4, 4);
+    }
+    memcpy(state->hmac_inner.buffer, data + 72, 64);
+
+    secure_erase(buffer, sizeof(buffer));
+
+    return 0;
+}
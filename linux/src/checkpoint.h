@@ -0,0 +1,47 @@
+/*
+ *  checkpoint.h
+ *
+ *  Encryption Checkpoints for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to save and restore the state of an encryption in
+ *      progress so that an interrupted encryption can be resumed.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#ifndef AESCRYPT_CHECKPOINT_H
+#define AESCRYPT_CHECKPOINT_H
+
+#include <sys/types.h>
+
+#include "aescrypt.h"
+
+#define CHECKPOINT_DEFAULT_INTERVAL 1073741824  /* Octets of input */
+#define CHECKPOINT_FILE_LEN         208
+
+typedef struct {
+    off_t input_offset;             // Octets of input encrypted
+    off_t output_offset;            // Octets of output written
+    unsigned char iv[16];           // Last ciphertext block (CBC chain)
+    sha256_context hmac_inner;      // Inner hash of the running HMAC
+} checkpoint_state;
+
+typedef struct {
+    unsigned char enc_key[32];      // Key protecting the saved state
+    unsigned char mac_key[32];      // Key authenticating the saved state
+} checkpoint_keys;
+
+// Function prototypes
+void checkpoint_keys_init(checkpoint_keys *keys, const unsigned char key[32]);
+int save_checkpoint(const char *filename,
+                    const checkpoint_keys *keys,
+                    const checkpoint_state *state);
+int load_checkpoint(const char *filename,
+                    const checkpoint_keys *keys,
+                    checkpoint_state *state);
+
+#endif // AESCRYPT_CHECKPOINT_H
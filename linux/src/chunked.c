@@ -0,0 +1,724 @@
+/*
+ *  chunked.c
+ *
+ *  Chunked Stream Format for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to encrypt and decrypt the body of a chunked AES Crypt
+ *      stream, in which fixed-size chunks are encrypted and authenticated
+ *      independently of one another.
+ *
+ *      A chunked stream (version AES_CRYPT_CHUNKED_VERSION) has the same
+ *      header, extensions, IV, and password-wrapped session IV and key as
+ *      a version 2 stream.  These are followed by the chunk size as a
+ *      4-octet big-endian integer and then the chunks.  Each chunk is the
+ *      AES-256-CTR encryption of up to chunk size octets of plaintext
+ *      followed by a 32-octet tag:
+ *
+ *          HMAC-SHA256(mac_key, index || final || chunk size || ciphertext)
+ *
+ *      where index is the 8-octet big-endian chunk number and final is
+ *      one octet that is 1 for the last chunk and 0 otherwise.  Every
+ *      chunk but the last holds exactly chunk size octets; the last chunk
+ *      always holds fewer (possibly none), which is how its end is found.
+ *      The tag binds each chunk to its position, so chunks cannot be
+ *      reordered, and the final flag prevents undetected truncation.
+ *
+ *      The counter block for each AES block is the session IV with the
+ *      chunk index XORed into octets 4 to 11 and the block number within
+ *      the chunk XORed into octets 12 to 15.  The MAC key is derived from
+ *      the session key so that the two keys are independent.
+ *
+ *      Chunks are processed in batches, with the chunks of each batch
+ *      encrypted or decrypted in parallel.  No plaintext is written until
+ *      the chunk holding it has been authenticated.
+ *
+ *  Portability Issues:
+ *      Requires POSIX threads.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>    // malloc
+#include <string.h>
+
+#include "chunked.h"
+#include "hmac.h"
+#include "probes.h"
+#include "stats.h"
+#include "util.h"
+#include "workers.h"
+
+// The number of chunks in each batch per worker
+#define CHUNKED_BATCH_PER_JOB       4
+
+typedef struct {
+    unsigned char *data;            // Chunk contents followed by the tag
+    size_t length;                  // Length of the contents
+    unsigned long long index;       // Chunk number
+    int final;                      // Non-zero for the last chunk
+} chunk_slot;
+
+typedef struct {
+    const chunked_keys *keys;
+    chunk_slot *slots;
+} chunk_batch;
+
+/*
+ *  chunked_keys_init
+ *
+ *  Description:
+ *      Prepare the keys used to encrypt and authenticate chunks.
+ *
+ *  Parameters:
+ *      keys [out]
+ *          The chunk keys.
+ *
+ *      iv_key [in]
+ *          The session IV and key.
+ *
+ *      chunk_size [in]
+ *          The chunk size, which is bound into every tag.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The keys should be erased with chunked_keys_erase() when done.
+ */
+void chunked_keys_init(chunked_keys *keys,
+                       const unsigned char iv_key[48],
+                       unsigned chunk_size)
+{
+    hmac_sha256_context hmac_ctx;
+
+    aes_set_key(&keys->aes_ctx, (unsigned char *) iv_key + 16, 256);
+    memcpy(keys->nonce, iv_key, 16);
+    keys->chunk_size = chunk_size;
+
+    hmac_sha256_starts(&hmac_ctx, iv_key + 16, 32);
+    hmac_sha256_update(&hmac_ctx,
+                       (const unsigned char *) "AESCRYPT-CHUNK-MAC",
+                       18);
+    hmac_sha256_finish(&hmac_ctx, keys->mac_key);
+}
+
+/*
+ *  chunked_keys_erase
+ *
+ *  Description:
+ *      Erase the keys used to encrypt and authenticate chunks.
+ *
+ *  Parameters:
+ *      keys [in]
+ *          The chunk keys.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void chunked_keys_erase(chunked_keys *keys)
+{
+    secure_erase(keys, sizeof(chunked_keys));
+}
+
+/*
+ *  chunked_crypt
+ *
+ *  Description:
+ *      Encrypt or decrypt the contents of a chunk in place.
+ *
+ *  Parameters:
+ *      keys [in]
+ *          The chunk keys.
+ *
+ *      index [in]
+ *          The chunk number.
+ *
+ *      data [in/out]
+ *          The chunk contents.
+ *
+ *      length [in]
+ *          The length of the contents, at most the chunk size.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      Since this is CTR mode, encryption and decryption are the same.
+ */
+void chunked_crypt(const chunked_keys *keys,
+                   unsigned long long index,
+                   unsigned char *data,
+                   size_t length)
+{
+    unsigned char counter[16];
+    unsigned char stream[16];
+    unsigned long block;
+    size_t i, n;
+
+    memcpy(counter, keys->nonce, 16);
+    for (i = 0; i < 8; i++)
+    {
+        counter[4 + i] ^= (unsigned char) (index >> (56 - 8 * i));
+    }
+
+    for (block = 0; length > 0; block++)
+    {
+        counter[12] = keys->nonce[12] ^ (unsigned char) (block >> 24);
+        counter[13] = keys->nonce[13] ^ (unsigned char) (block >> 16);
+        counter[14] = keys->nonce[14] ^ (unsigned char) (block >> 8);
+        counter[15] = keys->nonce[15] ^ (unsigned char) block;
+
+        aes_encrypt((aes_context *) &keys->aes_ctx, counter, stream);
+
+        n = (length < 16) ? length : 16;
+        for (i = 0; i < n; i++) data[i] ^= stream[i];
+
+        data += n;
+        length -= n;
+    }
+
+    secure_erase(stream, sizeof(stream));
+}
+
+/*
+ *  chunked_tag
+ *
+ *  Description:
+ *      Compute the tag over the ciphertext of a chunk.
+ *
+ *  Parameters:
+ *      keys [in]
+ *          The chunk keys.
+ *
+ *      index [in]
+ *          The chunk number.
+ *
+ *      final [in]
+ *          Non-zero if this is the last chunk.
+ *
+ *      ciphertext [in]
+ *          The chunk contents.
+ *
+ *      length [in]
+ *          The length of the contents.
+ *
+ *      tag [out]
+ *          The tag.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void chunked_tag(const chunked_keys *keys,
+                 unsigned long long index,
+                 int final,
+                 const unsigned char *ciphertext,
+                 size_t length,
+                 unsigned char tag[CHUNKED_TAG_LEN])
+{
+    hmac_sha256_context hmac_ctx;
+    unsigned char prefix[13];
+    unsigned i;
+
+    for (i = 0; i < 8; i++)
+    {
+        prefix[i] = (unsigned char) (index >> (56 - 8 * i));
+    }
+    prefix[8] = final ? 1 : 0;
+    prefix[9] = (unsigned char) (keys->chunk_size >> 24);
+    prefix[10] = (unsigned char) (keys->chunk_size >> 16);
+    prefix[11] = (unsigned char) (keys->chunk_size >> 8);
+    prefix[12] = (unsigned char) keys->chunk_size;
+
+    hmac_sha256_starts(&hmac_ctx, keys->mac_key, 32);
+    hmac_sha256_update(&hmac_ctx, prefix, sizeof(prefix));
+    hmac_sha256_update(&hmac_ctx, ciphertext, (unsigned long) length);
+    hmac_sha256_finish(&hmac_ctx, tag);
+}
+
+/*
+ *  chunked_parse_chunk_size
+ *
+ *  Description:
+ *      Parse and validate the chunk size that follows the session key.
+ *
+ *  Parameters:
+ *      buffer [in]
+ *          The 4-octet big-endian chunk size.
+ *
+ *      chunk_size [out]
+ *          The chunk size.
+ *
+ *  Returns:
+ *      0 if successful, otherwise the chunk size is invalid.
+ *
+ *  Comments:
+ *      None.
+ */
+int chunked_parse_chunk_size(const unsigned char buffer[4],
+                             unsigned *chunk_size)
+{
+    *chunk_size = ((unsigned) buffer[0] << 24) |
+                  ((unsigned) buffer[1] << 16) |
+                  ((unsigned) buffer[2] << 8) |
+                  (unsigned) buffer[3];
+
+    if ((*chunk_size < CHUNKED_MIN_CHUNK_SIZE) ||
+        (*chunk_size > CHUNKED_MAX_CHUNK_SIZE) ||
+        (*chunk_size % 16))
+    {
+        fprintf(stderr, "Error: Input file has an invalid chunk size\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  encrypt_chunk_worker
+ *
+ *  Description:
+ *      Worker pool function to encrypt one chunk of a batch and compute
+ *      its tag.
+ *
+ *  Parameters:
+ *      context [in]
+ *          The chunk_batch.
+ *
+ *      item [in]
+ *          Index of the chunk within the batch.
+ *
+ *  Returns:
+ *      0.
+ *
+ *  Comments:
+ *      None.
+ */
+static int encrypt_chunk_worker(void *context, unsigned item)
+{
+    chunk_batch *batch = (chunk_batch *) context;
+    chunk_slot *slot = &batch->slots[item];
+    double start = 0, now;
+
+    if (stats_enabled) start = stats_now();
+
+    chunked_crypt(batch->keys, slot->index, slot->data, slot->length);
+
+    if (stats_enabled)
+    {
+        now = stats_now();
+        stats_add(STATS_AES, now - start, 0);
+        start = now;
+    }
+
+    chunked_tag(batch->keys,
+                slot->index,
+                slot->final,
+                slot->data,
+                slot->length,
+                slot->data + slot->length);
+
+    if (stats_enabled) stats_add(STATS_HMAC, stats_now() - start, 0);
+
+    AESCRYPT_PROBE3(chunk_encrypt,
+                    slot->index,
+                    slot->length,
+                    slot->index * batch->keys->chunk_size);
+
+    return 0;
+}
+
+/*
+ *  decrypt_chunk_worker
+ *
+ *  Description:
+ *      Worker pool function to authenticate and decrypt one chunk of a
+ *      batch.
+ *
+ *  Parameters:
+ *      context [in]
+ *          The chunk_batch.
+ *
+ *      item [in]
+ *          Index of the chunk within the batch.
+ *
+ *  Returns:
+ *      0 if successful, otherwise the chunk is not authentic.
+ *
+ *  Comments:
+ *      None.
+ */
+static int decrypt_chunk_worker(void *context, unsigned item)
+{
+    chunk_batch *batch = (chunk_batch *) context;
+    chunk_slot *slot = &batch->slots[item];
+    unsigned char tag[CHUNKED_TAG_LEN];
+    double start = 0, now;
+    int authentic;
+
+    if (stats_enabled) start = stats_now();
+
+    chunked_tag(batch->keys,
+                slot->index,
+                slot->final,
+                slot->data,
+                slot->length,
+                tag);
+
+    authentic = !memcmp(tag, slot->data + slot->length, CHUNKED_TAG_LEN);
+    AESCRYPT_PROBE1(hmac_verify, authentic);
+    if (!authentic) return -1;
+
+    if (stats_enabled)
+    {
+        now = stats_now();
+        stats_add(STATS_HMAC, now - start, 0);
+        start = now;
+    }
+
+    chunked_crypt(batch->keys, slot->index, slot->data, slot->length);
+
+    if (stats_enabled) stats_add(STATS_AES, stats_now() - start, 0);
+
+    AESCRYPT_PROBE3(chunk_decrypt,
+                    slot->index,
+                    slot->length,
+                    slot->index * batch->keys->chunk_size);
+
+    return 0;
+}
+
+/*
+ *  alloc_slots
+ *
+ *  Description:
+ *      Allocate the chunk buffers for a batch.
+ *
+ *  Parameters:
+ *      count [in]
+ *          The number of chunks in a batch.
+ *
+ *      chunk_size [in]
+ *          The chunk size.
+ *
+ *  Returns:
+ *      The slots, or NULL if memory could not be allocated.
+ *
+ *  Comments:
+ *      The slots are released with free_slots().
+ */
+static chunk_slot *alloc_slots(unsigned count, unsigned chunk_size)
+{
+    chunk_slot *slots;
+    unsigned char *data;
+    unsigned i;
+
+    slots = malloc(count * sizeof(chunk_slot));
+    data = malloc((size_t) count * (chunk_size + CHUNKED_TAG_LEN));
+    if ((slots == NULL) || (data == NULL))
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        free(slots);
+        free(data);
+        return NULL;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        slots[i].data = data + (size_t) i * (chunk_size + CHUNKED_TAG_LEN);
+    }
+
+    return slots;
+}
+
+/*
+ *  free_slots
+ *
+ *  Description:
+ *      Erase and release the chunk buffers for a batch.
+ *
+ *  Parameters:
+ *      slots [in]
+ *          The slots returned by alloc_slots().
+ *
+ *      count [in]
+ *          The number of chunks in a batch.
+ *
+ *      chunk_size [in]
+ *          The chunk size.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void free_slots(chunk_slot *slots, unsigned count, unsigned chunk_size)
+{
+    secure_erase(slots[0].data, count * (chunk_size + CHUNKED_TAG_LEN));
+    free(slots[0].data);
+    free(slots);
+}
+
+/*
+ *  chunked_encrypt
+ *
+ *  Description:
+ *      Encrypt the input stream as the body of a chunked stream, starting
+ *      with the chunk size.
+ *
+ *  Parameters:
+ *      infp [in]
+ *          The input file stream to encrypt.
+ *
+ *      outfp [in]
+ *          The output file stream, positioned just after the session key.
+ *
+ *      iv_key [in]
+ *          The session IV and key.
+ *
+ *      chunk_size [in]
+ *          The chunk size.
+ *
+ *      input_limit [in]
+ *          Octets to read from infp, or 0 for all.
+ *
+ *      jobs [in]
+ *          The number of chunks to encrypt concurrently (0 for default).
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+int chunked_encrypt(FILE *infp,
+                    FILE *outfp,
+                    const unsigned char iv_key[48],
+                    unsigned chunk_size,
+                    off_t input_limit,
+                    unsigned jobs)
+{
+    chunked_keys keys;
+    chunk_batch batch;
+    chunk_slot *slots;
+    unsigned char buffer[4];
+    unsigned long long index = 0;
+    off_t remaining = input_limit;
+    size_t want;
+    unsigned count, n, i;
+    unsigned long long octets;
+    double start = 0;
+    int done = 0;
+    int rc = 0;
+
+    if (jobs == 0) jobs = default_worker_count();
+    count = jobs * CHUNKED_BATCH_PER_JOB;
+
+    buffer[0] = (unsigned char) (chunk_size >> 24);
+    buffer[1] = (unsigned char) (chunk_size >> 16);
+    buffer[2] = (unsigned char) (chunk_size >> 8);
+    buffer[3] = (unsigned char) chunk_size;
+    if (fwrite(buffer, 1, 4, outfp) != 4)
+    {
+        fprintf(stderr, "Error: Could not write the chunk size\n");
+        return -1;
+    }
+
+    if ((slots = alloc_slots(count, chunk_size)) == NULL) return -1;
+
+    chunked_keys_init(&keys, iv_key, chunk_size);
+    batch.keys = &keys;
+    batch.slots = slots;
+
+    while (!done && !rc)
+    {
+        if (stats_enabled) start = stats_now();
+
+        // Read a batch of chunks, stopping after the last chunk
+        for (n = 0, octets = 0; (n < count) && !done; n++)
+        {
+            want = chunk_size;
+            if (input_limit && (remaining < (off_t) want)) want = remaining;
+
+            slots[n].length = (want > 0) ? fread(slots[n].data, 1, want, infp)
+                                         : 0;
+            if (ferror(infp))
+            {
+                fprintf(stderr, "Error: Couldn't read input file\n");
+                rc = -1;
+                break;
+            }
+            if (input_limit) remaining -= slots[n].length;
+            octets += slots[n].length;
+
+            slots[n].index = index++;
+            slots[n].final = done = (slots[n].length < chunk_size);
+        }
+        if (rc) break;
+
+        if (stats_enabled) stats_add(STATS_READ, stats_now() - start, 0);
+        stats_count(STATS_READ, octets);
+
+        run_workers(jobs, n, encrypt_chunk_worker, &batch);
+
+        if (stats_enabled) start = stats_now();
+
+        for (i = 0, octets = 0; i < n; i++)
+        {
+            if (fwrite(slots[i].data,
+                       1,
+                       slots[i].length + CHUNKED_TAG_LEN,
+                       outfp) != slots[i].length + CHUNKED_TAG_LEN)
+            {
+                fprintf(stderr, "Error: Could not write to output file\n");
+                rc = -1;
+                break;
+            }
+            octets += slots[i].length + CHUNKED_TAG_LEN;
+        }
+
+        if (stats_enabled) stats_add(STATS_WRITE, stats_now() - start, 0);
+        stats_count(STATS_WRITE, octets);
+    }
+
+    chunked_keys_erase(&keys);
+    free_slots(slots, count, chunk_size);
+
+    return rc;
+}
+
+/*
+ *  chunked_decrypt
+ *
+ *  Description:
+ *      Decrypt the body of a chunked stream, starting with the chunk size.
+ *
+ *  Parameters:
+ *      infp [in]
+ *          The input file stream, positioned just after the session key.
+ *
+ *      outfp [in]
+ *          The output file stream into which decrypted data is written.
+ *
+ *      iv_key [in]
+ *          The session IV and key.
+ *
+ *      jobs [in]
+ *          The number of chunks to decrypt concurrently (0 for default).
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Each batch is written only once all of its chunks are authentic.
+ */
+int chunked_decrypt(FILE *infp,
+                    FILE *outfp,
+                    const unsigned char iv_key[48],
+                    unsigned jobs)
+{
+    chunked_keys keys;
+    chunk_batch batch;
+    chunk_slot *slots;
+    unsigned char buffer[4];
+    unsigned long long index = 0;
+    unsigned chunk_size;
+    size_t bytes_read;
+    unsigned count, n, i;
+    unsigned long long octets;
+    double start = 0;
+    int done = 0;
+    int rc = 0;
+
+    if (fread(buffer, 1, 4, infp) != 4)
+    {
+        fprintf(stderr, "Error: Input file is too short.\n");
+        return -1;
+    }
+    if (chunked_parse_chunk_size(buffer, &chunk_size)) return -1;
+
+    if (jobs == 0) jobs = default_worker_count();
+    count = jobs * CHUNKED_BATCH_PER_JOB;
+
+    if ((slots = alloc_slots(count, chunk_size)) == NULL) return -1;
+
+    chunked_keys_init(&keys, iv_key, chunk_size);
+    batch.keys = &keys;
+    batch.slots = slots;
+
+    while (!done && !rc)
+    {
+        if (stats_enabled) start = stats_now();
+
+        // Read a batch of chunks; only the last chunk is short
+        for (n = 0, octets = 0; (n < count) && !done; n++)
+        {
+            bytes_read = fread(slots[n].data,
+                               1,
+                               chunk_size + CHUNKED_TAG_LEN,
+                               infp);
+            if (ferror(infp))
+            {
+                perror("Error reading input file:");
+                rc = -1;
+                break;
+            }
+            if (bytes_read < CHUNKED_TAG_LEN)
+            {
+                fprintf(stderr, "Error: Input file is corrupt (4).\n");
+                rc = -1;
+                break;
+            }
+
+            slots[n].length = bytes_read - CHUNKED_TAG_LEN;
+            slots[n].index = index++;
+            slots[n].final = done = (slots[n].length < chunk_size);
+            octets += bytes_read;
+        }
+        if (rc) break;
+
+        if (stats_enabled) stats_add(STATS_READ, stats_now() - start, 0);
+        stats_count(STATS_READ, octets);
+
+        if (run_workers(jobs, n, decrypt_chunk_worker, &batch))
+        {
+            fprintf(stderr,
+                    "Error: Message has been altered and should not "
+                    "be trusted\n");
+            rc = -1;
+            break;
+        }
+
+        if (stats_enabled) start = stats_now();
+
+        for (i = 0, octets = 0; i < n; i++)
+        {
+            if (fwrite(slots[i].data, 1, slots[i].length, outfp) !=
+                slots[i].length)
+            {
+                perror("Error writing decrypted block:");
+                rc = -1;
+                break;
+            }
+            octets += slots[i].length;
+        }
+
+        if (stats_enabled) stats_add(STATS_WRITE, stats_now() - start, 0);
+        stats_count(STATS_WRITE, octets);
+    }
+
+    chunked_keys_erase(&keys);
+    free_slots(slots, count, chunk_size);
+
+    return rc;
+}
@@ -0,0 +1,65 @@
+/*
+ *  chunked.h
+ *
+ *  Chunked Stream Format for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to encrypt and decrypt the body of a chunked AES Crypt
+ *      stream, in which fixed-size chunks are encrypted and authenticated
+ *      independently of one another.
+ *
+ *  Portability Issues:
+ *      Requires POSIX threads.
+ */
+
+#ifndef AESCRYPT_CHUNKED_H
+#define AESCRYPT_CHUNKED_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "aescrypt.h"
+
+#define CHUNKED_DEFAULT_CHUNK_SIZE  65536
+#define CHUNKED_MIN_CHUNK_SIZE      4096
+#define CHUNKED_MAX_CHUNK_SIZE      16777216
+#define CHUNKED_TAG_LEN             32
+
+typedef struct {
+    aes_context aes_ctx;            // Key schedule for the chunk contents
+    unsigned char nonce[16];        // Base of each chunk's counter blocks
+    unsigned char mac_key[32];      // Key for each chunk's tag
+    unsigned chunk_size;            // Plaintext octets in each full chunk
+} chunked_keys;
+
+// Function prototypes
+void chunked_keys_init(chunked_keys *keys,
+                       const unsigned char iv_key[48],
+                       unsigned chunk_size);
+void chunked_keys_erase(chunked_keys *keys);
+void chunked_crypt(const chunked_keys *keys,
+                   unsigned long long index,
+                   unsigned char *data,
+                   size_t length);
+void chunked_tag(const chunked_keys *keys,
+                 unsigned long long index,
+                 int final,
+                 const unsigned char *ciphertext,
+                 size_t length,
+                 unsigned char tag[CHUNKED_TAG_LEN]);
+int chunked_parse_chunk_size(const unsigned char buffer[4],
+                             unsigned *chunk_size);
+int chunked_encrypt(FILE *infp,
+                    FILE *outfp,
+                    const unsigned char iv_key[48],
+                    unsigned chunk_size,
+                    off_t input_limit,
+                    unsigned jobs);
+int chunked_decrypt(FILE *infp,
+                    FILE *outfp,
+                    const unsigned char iv_key[48],
+                    unsigned jobs);
+
+#endif // AESCRYPT_CHUNKED_H
@@ -0,0 +1,1018 @@
+/*
+ *  compress.c
+ *
+ *  Compression for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to compress data ahead of encryption and to decompress
+ *      it as it is decrypted.
+ *
+ *      Compression is a stdio stream between the input and the encryption
+ *      engine, so it applies equally to version 2 and chunked streams.
+ *      The input is split into blocks that are compressed independently
+ *      and concurrently, a batch at a time, and written in order, each
+ *      preceded by an eight-octet block header:
+ *
+ *          payload length (4) || original length (4) || payload
+ *
+ *      The high bit of the payload length is set if the block is stored
+ *      uncompressed because it did not shrink.  A block header of zeros
+ *      ends the data.  The codec is libzstd when available at build time
+ *      and otherwise a built-in LZ77 codec in the style of LZ4; encrypted
+ *      files name the codec in the "COMPRESSION" extension.
+ *
+ *      The built-in codec encodes each block as a series of sequences:
+ *
+ *          token || [literal length] || literals ||
+ *          offset (2, little endian) || [match length]
+ *
+ *      The high four bits of the token are the number of literals and the
+ *      low four bits the match length less four; either value 15 is
+ *      followed by octets added to it up to and including one below 255.
+ *      The last sequence has only literals.
+ *
+ *  Portability Issues:
+ *      Requires POSIX threads and fopencookie().  The zstd codec requires
+ *      libzstd at build time (HAVE_ZSTD).
+ */
+
+#define _GNU_SOURCE    // fopencookie
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "workers.h"
+#include "util.h"
+#include "compress.h"
+
+#define BLOCK_HEADER_LEN            8
+#define BLOCK_STORED                0x80000000UL
+
+#define LZ_MIN_MATCH                4
+#define LZ_MAX_OFFSET               65535
+#define LZ_HASH_BITS                16
+#define LZ_MAX_DEPTH                16      /* Candidates tried per match */
+#define LZ_NONE                     UINT32_MAX
+
+typedef struct {
+    unsigned char *raw;             // Uncompressed block
+    size_t raw_length;
+    unsigned char *packed;          // Block header and payload
+    size_t packed_length;
+} compress_slot;
+
+typedef struct {
+    FILE *infp;
+    int level;
+    unsigned jobs;
+    compress_slot *slots;
+    unsigned count;                 // Slots in a batch
+    unsigned filled;                // Slots holding blocks in this batch
+    unsigned current;               // Slot being produced
+    size_t offset;                  // Octets of the current slot produced
+    size_t end_offset;              // Octets of the end marker produced
+    int done;                       // The input is exhausted
+} compress_reader;
+
+typedef struct {
+    FILE *outfp;
+    int zstd;                       // Use zstd rather than the built-in codec
+    unsigned char header[BLOCK_HEADER_LEN];
+    size_t header_length;
+    int stored;                     // The block is stored uncompressed
+    size_t payload_length;
+    size_t received;                // Octets of the payload received
+    size_t raw_length;
+    unsigned char *payload;
+    unsigned char *raw;
+    int ended;                      // The end marker was received
+    int failed;
+} decompress_writer;
+
+/*
+ *  compress_codec
+ *
+ *  Description:
+ *      Return the name of the codec used to compress.
+ *
+ *  Parameters:
+ *      None.
+ *
+ *  Returns:
+ *      The codec name recorded in the "COMPRESSION" extension.
+ *
+ *  Comments:
+ *      None.
+ */
+const char *compress_codec(void)
+{
+#ifdef HAVE_ZSTD
+    return COMPRESS_CODEC_ZSTD;
+#else
+    return COMPRESS_CODEC_LZ;
+#endif
+}
+
+#ifndef HAVE_ZSTD
+/*
+ *  lz_hash
+ *
+ *  Description:
+ *      Hash the four octets at the given position.
+ *
+ *  Parameters:
+ *      p [in]
+ *          The octets to hash.
+ *
+ *  Returns:
+ *      The hash, LZ_HASH_BITS long.
+ *
+ *  Comments:
+ *      None.
+ */
+static uint32_t lz_hash(const unsigned char *p)
+{
+    uint32_t value = (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+                     ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+
+    return (value * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ *  lz_emit
+ *
+ *  Description:
+ *      Append one sequence to the compressed block.
+ *
+ *  Parameters:
+ *      dst [out]
+ *          The compressed block.
+ *
+ *      capacity [in]
+ *          The size of dst.
+ *
+ *      out [in/out]
+ *          The length of the compressed block so far.
+ *
+ *      literals [in]
+ *          The literals of the sequence.
+ *
+ *      literal_length [in]
+ *          The number of literals.
+ *
+ *      offset [in]
+ *          The distance back to the match.
+ *
+ *      match_length [in]
+ *          The length of the match, or 0 for the last sequence.
+ *
+ *  Returns:
+ *      0 if successful, or -1 if the sequence does not fit.
+ *
+ *  Comments:
+ *      None.
+ */
+static int lz_emit(unsigned char *dst,
+                   size_t capacity,
+                   size_t *out,
+                   const unsigned char *literals,
+                   size_t literal_length,
+                   size_t offset,
+                   size_t match_length)
+{
+    size_t length;
+    size_t o = *out;
+
+    // The token, extended lengths, and offset never exceed this
+    if (capacity - o < literal_length + literal_length / 255 +
+                           match_length / 255 + 5)
+    {
+        return -1;
+    }
+
+    dst[o++] = (unsigned char) (((literal_length < 15) ?
+                                     literal_length : 15) << 4);
+    if (match_length)
+    {
+        length = match_length - LZ_MIN_MATCH;
+        dst[o - 1] |= (unsigned char) ((length < 15) ? length : 15);
+    }
+
+    if (literal_length >= 15)
+    {
+        for (length = literal_length - 15; length >= 255; length -= 255)
+        {
+            dst[o++] = 255;
+        }
+        dst[o++] = (unsigned char) length;
+    }
+    memcpy(dst + o, literals, literal_length);
+    o += literal_length;
+
+    if (match_length)
+    {
+        dst[o++] = (unsigned char) (offset & 0xFF);
+        dst[o++] = (unsigned char) (offset >> 8);
+        if (match_length - LZ_MIN_MATCH >= 15)
+        {
+            for (length = match_length - LZ_MIN_MATCH - 15;
+                 length >= 255;
+                 length -= 255)
+            {
+                dst[o++] = 255;
+            }
+            dst[o++] = (unsigned char) length;
+        }
+    }
+
+    *out = o;
+
+    return 0;
+}
+
+/*
+ *  lz_compress
+ *
+ *  Description:
+ *      Compress a block with the built-in codec.
+ *
+ *  Parameters:
+ *      src [in]
+ *          The block to compress.
+ *
+ *      length [in]
+ *          The length of the block.
+ *
+ *      dst [out]
+ *          The compressed block.
+ *
+ *      capacity [in]
+ *          The size of dst.
+ *
+ *      depth [in]
+ *          The number of earlier positions to try for each match.
+ *
+ *  Returns:
+ *      The length of the compressed block, or 0 if it does not fit or
+ *      memory could not be allocated.
+ *
+ *  Comments:
+ *      Positions having the same hash are chained together when more
+ *      than one candidate is tried.  Incompressible data is skipped over
+ *      increasingly quickly.
+ */
+static size_t lz_compress(const unsigned char *src,
+                          size_t length,
+                          unsigned char *dst,
+                          size_t capacity,
+                          unsigned depth)
+{
+    uint32_t *head;
+    uint32_t *chain = NULL;
+    uint32_t candidate, hash;
+    size_t pos = 0, anchor = 0, out = 0;
+    size_t match, best_length, best_offset, p;
+    unsigned misses = 0;
+    unsigned i;
+    int failed = 0;
+
+    head = malloc(sizeof(uint32_t) << LZ_HASH_BITS);
+    if ((depth > 1) && (head != NULL))
+    {
+        chain = malloc(length * sizeof(uint32_t));
+    }
+    if ((head == NULL) || ((depth > 1) && (chain == NULL)))
+    {
+        free(head);
+        return 0;
+    }
+    for (i = 0; i < (1U << LZ_HASH_BITS); i++) head[i] = LZ_NONE;
+
+    while (pos + LZ_MIN_MATCH <= length)
+    {
+        hash = lz_hash(src + pos);
+        candidate = head[hash];
+        head[hash] = (uint32_t) pos;
+        if (chain != NULL) chain[pos] = candidate;
+
+        best_length = 0;
+        best_offset = 0;
+        for (i = 0;
+             (i < depth) && (candidate != LZ_NONE) &&
+                 (pos - candidate <= LZ_MAX_OFFSET);
+             i++)
+        {
+            if (!memcmp(src + candidate, src + pos, LZ_MIN_MATCH))
+            {
+                match = LZ_MIN_MATCH;
+                while ((pos + match < length) &&
+                       (src[candidate + match] == src[pos + match]))
+                {
+                    match++;
+                }
+                if (match > best_length)
+                {
+                    best_length = match;
+                    best_offset = pos - candidate;
+                }
+            }
+            if (chain == NULL) break;
+            candidate = chain[candidate];
+        }
+
+        if (best_length == 0)
+        {
+            pos += 1 + (misses++ >> 6);
+            continue;
+        }
+
+        if (lz_emit(dst,
+                    capacity,
+                    &out,
+                    src + anchor,
+                    pos - anchor,
+                    best_offset,
+                    best_length))
+        {
+            failed = 1;
+            break;
+        }
+
+        // Chain the positions within the match for later matches
+        for (p = pos + 1;
+             (chain != NULL) && (p < pos + best_length) &&
+                 (p + LZ_MIN_MATCH <= length);
+             p++)
+        {
+            hash = lz_hash(src + p);
+            chain[p] = head[hash];
+            head[hash] = (uint32_t) p;
+        }
+
+        pos += best_length;
+        anchor = pos;
+        misses = 0;
+    }
+
+    // The last sequence holds the remaining literals
+    if (!failed &&
+        lz_emit(dst, capacity, &out, src + anchor, length - anchor, 0, 0))
+    {
+        failed = 1;
+    }
+
+    free(chain);
+    free(head);
+
+    return failed ? 0 : out;
+}
+
+#endif // HAVE_ZSTD
+
+/*
+ *  lz_decompress
+ *
+ *  Description:
+ *      Decompress a block compressed with the built-in codec.
+ *
+ *  Parameters:
+ *      src [in]
+ *          The compressed block.
+ *
+ *      length [in]
+ *          The length of the compressed block.
+ *
+ *      dst [out]
+ *          The decompressed block.
+ *
+ *      capacity [in]
+ *          The size of dst.
+ *
+ *  Returns:
+ *      The length of the decompressed block, or -1 if the compressed
+ *      block is malformed.
+ *
+ *  Comments:
+ *      None.
+ */
+static long lz_decompress(const unsigned char *src,
+                          size_t length,
+                          unsigned char *dst,
+                          size_t capacity)
+{
+    size_t ip = 0, op = 0;
+    size_t count, offset, i;
+    unsigned char token, c;
+
+    while (ip < length)
+    {
+        token = src[ip++];
+
+        count = token >> 4;
+        if (count == 15)
+        {
+            do
+            {
+                if (ip == length) return -1;
+                c = src[ip++];
+                count += c;
+            } while (c == 255);
+        }
+        if ((count > length - ip) || (count > capacity - op)) return -1;
+        memcpy(dst + op, src + ip, count);
+        ip += count;
+        op += count;
+
+        // The last sequence has no match
+        if (ip == length) break;
+
+        if (length - ip < 2) return -1;
+        offset = src[ip] | ((size_t) src[ip + 1] << 8);
+        ip += 2;
+        if ((offset == 0) || (offset > op)) return -1;
+
+        count = token & 0x0F;
+        if (count == 15)
+        {
+            do
+            {
+                if (ip == length) return -1;
+                c = src[ip++];
+                count += c;
+            } while (c == 255);
+        }
+        count += LZ_MIN_MATCH;
+        if (count > capacity - op) return -1;
+
+        // Matches may overlap the octets they produce
+        for (i = 0; i < count; i++) dst[op + i] = dst[op - offset + i];
+        op += count;
+    }
+
+    return (long) op;
+}
+
+/*
+ *  put_block_header
+ *
+ *  Description:
+ *      Store a block header.
+ *
+ *  Parameters:
+ *      header [out]
+ *          The block header.
+ *
+ *      payload_length [in]
+ *          The payload length, including the stored flag.
+ *
+ *      raw_length [in]
+ *          The original length of the block.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void put_block_header(unsigned char header[BLOCK_HEADER_LEN],
+                             unsigned long payload_length,
+                             unsigned long raw_length)
+{
+    unsigned i;
+
+    for (i = 0; i < 4; i++)
+    {
+        header[i] = (unsigned char) (payload_length >> (24 - i * 8));
+        header[i + 4] = (unsigned char) (raw_length >> (24 - i * 8));
+    }
+}
+
+/*
+ *  compress_worker
+ *
+ *  Description:
+ *      Compress one block of a batch.
+ *
+ *  Parameters:
+ *      context [in]
+ *          The compress_reader.
+ *
+ *      item [in]
+ *          The slot holding the block.
+ *
+ *  Returns:
+ *      0, since a block that cannot be compressed is stored.
+ *
+ *  Comments:
+ *      None.
+ */
+static int compress_worker(void *context, unsigned item)
+{
+    compress_reader *c = (compress_reader *) context;
+    compress_slot *slot = &c->slots[item];
+    size_t length = 0;
+#ifdef HAVE_ZSTD
+    size_t result;
+
+    result = ZSTD_compress(slot->packed + BLOCK_HEADER_LEN,
+                           slot->raw_length - 1,
+                           slot->raw,
+                           slot->raw_length,
+                           c->level);
+    if (!ZSTD_isError(result)) length = result;
+#else
+    length = lz_compress(slot->raw,
+                         slot->raw_length,
+                         slot->packed + BLOCK_HEADER_LEN,
+                         slot->raw_length - 1,
+                         (c->level < LZ_MAX_DEPTH) ? c->level : LZ_MAX_DEPTH);
+#endif
+
+    if ((length == 0) || (length >= slot->raw_length))
+    {
+        memcpy(slot->packed + BLOCK_HEADER_LEN,
+               slot->raw,
+               slot->raw_length);
+        put_block_header(slot->packed,
+                         BLOCK_STORED | slot->raw_length,
+                         slot->raw_length);
+        length = slot->raw_length;
+    }
+    else
+    {
+        put_block_header(slot->packed, length, slot->raw_length);
+    }
+    slot->packed_length = BLOCK_HEADER_LEN + length;
+
+    return 0;
+}
+
+/*
+ *  fill_batch
+ *
+ *  Description:
+ *      Read and compress the next batch of blocks.
+ *
+ *  Parameters:
+ *      c [in/out]
+ *          The compress_reader.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static int fill_batch(compress_reader *c)
+{
+    compress_slot *slot;
+
+    c->filled = 0;
+    c->current = 0;
+    c->offset = 0;
+
+    while ((c->filled < c->count) && !c->done)
+    {
+        slot = &c->slots[c->filled];
+        slot->raw_length = fread(slot->raw, 1, COMPRESS_BLOCK_SIZE, c->infp);
+        if (ferror(c->infp))
+        {
+            fprintf(stderr, "Error: Couldn't read input file\n");
+            return -1;
+        }
+        if (slot->raw_length < COMPRESS_BLOCK_SIZE) c->done = 1;
+        if (slot->raw_length > 0) c->filled++;
+    }
+
+    if (c->filled &&
+        run_workers(c->jobs, c->filled, compress_worker, c))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  compress_read
+ *
+ *  Description:
+ *      The read function of the stdio stream returned by compress_open().
+ *
+ *  Parameters:
+ *      cookie [in]
+ *          The compress_reader.
+ *
+ *      buffer [out]
+ *          Where the compressed data is placed.
+ *
+ *      size [in]
+ *          The size of the buffer.
+ *
+ *  Returns:
+ *      The number of octets produced, 0 at the end, or -1 if there was
+ *      an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static ssize_t compress_read(void *cookie, char *buffer, size_t size)
+{
+    compress_reader *c = (compress_reader *) cookie;
+    compress_slot *slot;
+    size_t produced = 0;
+    size_t n;
+
+    while (produced < size)
+    {
+        if ((c->current == c->filled) && !c->done && fill_batch(c))
+        {
+            return -1;
+        }
+
+        if (c->current < c->filled)
+        {
+            slot = &c->slots[c->current];
+            n = slot->packed_length - c->offset;
+            if (n > size - produced) n = size - produced;
+            memcpy(buffer + produced, slot->packed + c->offset, n);
+            produced += n;
+            c->offset += n;
+            if (c->offset == slot->packed_length)
+            {
+                c->current++;
+                c->offset = 0;
+            }
+        }
+        else
+        {
+            // The data ends with a block header of zeros
+            if (c->end_offset == BLOCK_HEADER_LEN) break;
+            n = BLOCK_HEADER_LEN - c->end_offset;
+            if (n > size - produced) n = size - produced;
+            memset(buffer + produced, 0, n);
+            produced += n;
+            c->end_offset += n;
+        }
+    }
+
+    return produced;
+}
+
+/*
+ *  compress_close
+ *
+ *  Description:
+ *      The close function of the stdio stream returned by compress_open().
+ *
+ *  Parameters:
+ *      cookie [in]
+ *          The compress_reader.
+ *
+ *  Returns:
+ *      0.
+ *
+ *  Comments:
+ *      The input stream is not closed.
+ */
+static int compress_close(void *cookie)
+{
+    compress_reader *c = (compress_reader *) cookie;
+    size_t slot_size = 2 * COMPRESS_BLOCK_SIZE + BLOCK_HEADER_LEN;
+
+    secure_erase(c->slots[0].raw, c->count * slot_size);
+    free(c->slots[0].raw);
+    free(c->slots);
+    free(c);
+
+    return 0;
+}
+
+/*
+ *  compress_open
+ *
+ *  Description:
+ *      Open a stream that reads the input compressed.
+ *
+ *  Parameters:
+ *      infp [in]
+ *          The input stream.
+ *
+ *      level [in]
+ *          The compression level, COMPRESS_MIN_LEVEL to
+ *          COMPRESS_MAX_LEVEL.
+ *
+ *      jobs [in]
+ *          The number of blocks to compress concurrently (0 for default).
+ *
+ *  Returns:
+ *      The stream, or NULL if there was an error.
+ *
+ *  Comments:
+ *      With the built-in codec, the level is the number of candidates
+ *      tried for each match, up to LZ_MAX_DEPTH.
+ */
+FILE *compress_open(FILE *infp, int level, unsigned jobs)
+{
+    cookie_io_functions_t functions = {compress_read,
+                                       NULL,
+                                       NULL,
+                                       compress_close};
+    size_t slot_size = 2 * COMPRESS_BLOCK_SIZE + BLOCK_HEADER_LEN;
+    compress_reader *c;
+    unsigned char *data = NULL;
+    unsigned i;
+    FILE *fp = NULL;
+
+    if ((c = calloc(1, sizeof(compress_reader))) != NULL)
+    {
+        c->infp = infp;
+        c->level = level;
+        c->jobs = jobs ? jobs : default_worker_count();
+        c->count = c->jobs * COMPRESS_BATCH_PER_JOB;
+        c->slots = malloc(c->count * sizeof(compress_slot));
+        data = malloc(c->count * slot_size);
+    }
+
+    if ((c == NULL) || (c->slots == NULL) || (data == NULL))
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        if (c != NULL) free(c->slots);
+        free(data);
+        free(c);
+        return NULL;
+    }
+
+    for (i = 0; i < c->count; i++)
+    {
+        c->slots[i].raw = data + i * slot_size;
+        c->slots[i].packed = c->slots[i].raw + COMPRESS_BLOCK_SIZE;
+    }
+
+    if ((fp = fopencookie(c, "r", functions)) == NULL)
+    {
+        perror("Error creating compression stream");
+        compress_close(c);
+    }
+
+    return fp;
+}
+
+/*
+ *  decompress_block
+ *
+ *  Description:
+ *      Decompress a complete block and write it to the output.
+ *
+ *  Parameters:
+ *      d [in/out]
+ *          The decompress_writer.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static int decompress_block(decompress_writer *d)
+{
+    unsigned char *block = d->payload;
+    long length = (long) d->payload_length;
+#ifdef HAVE_ZSTD
+    size_t result;
+#endif
+
+    if (!d->stored)
+    {
+#ifdef HAVE_ZSTD
+        if (d->zstd)
+        {
+            result = ZSTD_decompress(d->raw,
+                                     d->raw_length,
+                                     d->payload,
+                                     d->payload_length);
+            length = ZSTD_isError(result) ? -1 : (long) result;
+        }
+        else
+#endif
+        {
+            length = lz_decompress(d->payload,
+                                   d->payload_length,
+                                   d->raw,
+                                   d->raw_length);
+        }
+        block = d->raw;
+    }
+
+    if (length != (long) d->raw_length)
+    {
+        fprintf(stderr, "Error: Compressed data is corrupt\n");
+        return -1;
+    }
+
+    if (fwrite(block, 1, d->raw_length, d->outfp) != d->raw_length)
+    {
+        perror("Error writing decompressed block");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  decompress_write
+ *
+ *  Description:
+ *      The write function of the stdio stream returned by
+ *      decompress_open().
+ *
+ *  Parameters:
+ *      cookie [in]
+ *          The decompress_writer.
+ *
+ *      buffer [in]
+ *          The next compressed data.
+ *
+ *      size [in]
+ *          The number of octets in the buffer.
+ *
+ *  Returns:
+ *      The number of octets consumed, or -1 if there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static ssize_t decompress_write(void *cookie, const char *buffer, size_t size)
+{
+    decompress_writer *d = (decompress_writer *) cookie;
+    unsigned long payload_length;
+    size_t used = 0;
+    size_t n;
+
+    while ((used < size) && !d->failed)
+    {
+        if (d->ended)
+        {
+            fprintf(stderr, "Error: Data follows the compressed data\n");
+            d->failed = 1;
+            break;
+        }
+
+        if (d->header_length < BLOCK_HEADER_LEN)
+        {
+            n = BLOCK_HEADER_LEN - d->header_length;
+            if (n > size - used) n = size - used;
+            memcpy(d->header + d->header_length, buffer + used, n);
+            used += n;
+            d->header_length += n;
+            if (d->header_length < BLOCK_HEADER_LEN) break;
+
+            payload_length = ((unsigned long) d->header[0] << 24) |
+                             ((unsigned long) d->header[1] << 16) |
+                             ((unsigned long) d->header[2] << 8) |
+                             d->header[3];
+            d->raw_length = ((size_t) d->header[4] << 24) |
+                            ((size_t) d->header[5] << 16) |
+                            ((size_t) d->header[6] << 8) |
+                            d->header[7];
+            d->stored = (payload_length & BLOCK_STORED) != 0;
+            d->payload_length = payload_length & ~BLOCK_STORED;
+            d->received = 0;
+
+            if (!payload_length && !d->raw_length)
+            {
+                d->ended = 1;
+                continue;
+            }
+            if ((d->raw_length == 0) ||
+                (d->raw_length > COMPRESS_BLOCK_SIZE) ||
+                (d->payload_length == 0) ||
+                (d->payload_length > COMPRESS_BLOCK_SIZE) ||
+                (d->stored && (d->payload_length != d->raw_length)))
+            {
+                fprintf(stderr, "Error: Compressed data is corrupt\n");
+                d->failed = 1;
+                break;
+            }
+            continue;
+        }
+
+        n = d->payload_length - d->received;
+        if (n > size - used) n = size - used;
+        memcpy(d->payload + d->received, buffer + used, n);
+        used += n;
+        d->received += n;
+
+        if (d->received == d->payload_length)
+        {
+            if (decompress_block(d)) d->failed = 1;
+            d->header_length = 0;
+        }
+    }
+
+    return d->failed ? -1 : (ssize_t) size;
+}
+
+/*
+ *  decompress_close
+ *
+ *  Description:
+ *      The close function of the stdio stream returned by
+ *      decompress_open().
+ *
+ *  Parameters:
+ *      cookie [in]
+ *          The decompress_writer.
+ *
+ *  Returns:
+ *      0 if all of the compressed data was received and decompressed,
+ *      otherwise -1.
+ *
+ *  Comments:
+ *      The output stream is not closed.
+ */
+static int decompress_close(void *cookie)
+{
+    decompress_writer *d = (decompress_writer *) cookie;
+    int rc = (d->ended && !d->failed) ? 0 : -1;
+
+    secure_erase(d->payload, 2 * COMPRESS_BLOCK_SIZE);
+    free(d->payload);
+    free(d);
+
+    return rc;
+}
+
+/*
+ *  decompress_open
+ *
+ *  Description:
+ *      Open a stream that decompresses what is written to it into the
+ *      output.
+ *
+ *  Parameters:
+ *      outfp [in]
+ *          The output stream.
+ *
+ *      codec [in]
+ *          The codec named in the "COMPRESSION" extension.
+ *
+ *  Returns:
+ *      The stream, or NULL if there was an error.
+ *
+ *  Comments:
+ *      Closing the stream fails if the compressed data was incomplete.
+ */
+FILE *decompress_open(FILE *outfp, const char *codec)
+{
+    cookie_io_functions_t functions = {NULL,
+                                       decompress_write,
+                                       NULL,
+                                       decompress_close};
+    decompress_writer *d;
+    FILE *fp = NULL;
+    int zstd = !strcmp(codec, COMPRESS_CODEC_ZSTD);
+
+    if (!zstd && strcmp(codec, COMPRESS_CODEC_LZ))
+    {
+        fprintf(stderr, "Error: Unknown compression codec '%s'\n", codec);
+        return NULL;
+    }
+
+#ifndef HAVE_ZSTD
+    if (zstd)
+    {
+        fprintf(stderr,
+                "Error: This build of aescrypt cannot decompress zstd "
+                "data\n");
+        return NULL;
+    }
+#endif
+
+    if (((d = calloc(1, sizeof(decompress_writer))) == NULL) ||
+        ((d->payload = malloc(2 * COMPRESS_BLOCK_SIZE)) == NULL))
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        free(d);
+        return NULL;
+    }
+    d->raw = d->payload + COMPRESS_BLOCK_SIZE;
+    d->outfp = outfp;
+    d->zstd = zstd;
+
+    if ((fp = fopencookie(d, "w", functions)) == NULL)
+    {
+        perror("Error creating decompression stream");
+        free(d->payload);
+        free(d);
+    }
+
+    return fp;
+}
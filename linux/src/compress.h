@@ -0,0 +1,35 @@
+/*
+ *  compress.h
+ *
+ *  Compression for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to compress data ahead of encryption and to decompress
+ *      it as it is decrypted.
+ *
+ *  Portability Issues:
+ *      Requires POSIX threads and fopencookie().  The zstd codec requires
+ *      libzstd at build time (HAVE_ZSTD).
+ */
+
+#ifndef AESCRYPT_COMPRESS_H
+#define AESCRYPT_COMPRESS_H
+
+#include <stdio.h>
+
+#define COMPRESS_EXTENSION_ID       "COMPRESSION"
+#define COMPRESS_CODEC_LZ           "aescrypt-lz"
+#define COMPRESS_CODEC_ZSTD         "zstd"
+#define COMPRESS_BLOCK_SIZE         1048576
+#define COMPRESS_BATCH_PER_JOB      2
+#define COMPRESS_MIN_LEVEL          1
+#define COMPRESS_MAX_LEVEL          19
+
+// Function prototypes
+const char *compress_codec(void);
+FILE *compress_open(FILE *infp, int level, unsigned jobs);
+FILE *decompress_open(FILE *outfp, const char *codec);
+
+#endif // AESCRYPT_COMPRESS_H
@@ -0,0 +1,521 @@
+/*
+ *  digest.c
+ *
+ *  Stream Digests for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to compute a digest of the data read from or written to
+ *      a stream as it passes through, and to report it.
+ *
+ *      A digest stream is a stdio stream that reads from, or writes to,
+ *      another stream.  Each piece of data passing through is copied into
+ *      one of a few buffers that a separate thread hashes, so hashing
+ *      proceeds alongside encryption rather than adding to it.
+ *
+ *      Digests are reported in the tagged form accepted by "sha256sum -c"
+ *      and "sha512sum -c":
+ *
+ *          SHA256 (name) = hex digest
+ *
+ *  Portability Issues:
+ *      Requires POSIX threads and fopencookie().
+ */
+
+#define _GNU_SOURCE    // fopencookie
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "digest.h"
+
+typedef struct {
+    FILE *fp;
+    const digest_algorithm *algorithm;
+    digest_context ctx;
+    unsigned char *digest;          // Receives the digest on close
+    unsigned char *buffers[DIGEST_BUFFER_COUNT];
+    size_t lengths[DIGEST_BUFFER_COUNT];
+    unsigned head;                  // Next buffer to fill
+    unsigned tail;                  // Next buffer to hash
+    unsigned queued;                // Buffers filled and not yet hashed
+    int done;                       // No more data will be queued
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+} digest_stream;
+
+/*
+ *  sha256_starts_digest, sha256_update_digest, sha256_finish_digest
+ *
+ *  Description:
+ *      Adapt the SHA-256 functions to the digest_algorithm interface.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The digest context.
+ *
+ *      data [in], length [in]
+ *          The data to hash.
+ *
+ *      digest [out]
+ *          The resulting digest.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void sha256_starts_digest(digest_context *ctx)
+{
+    sha256_starts(&ctx->sha256);
+}
+
+static void sha256_update_digest(digest_context *ctx,
+                                 const unsigned char *data,
+                                 size_t length)
+{
+    sha256_update(&ctx->sha256, (unsigned char *) data, (uint32) length);
+}
+
+static void sha256_finish_digest(digest_context *ctx, unsigned char *digest)
+{
+    sha256_finish(&ctx->sha256, digest);
+}
+
+/*
+ *  sha512_starts_digest, sha512_update_digest, sha512_finish_digest
+ *
+ *  Description:
+ *      Adapt the SHA-512 functions to the digest_algorithm interface.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The digest context.
+ *
+ *      data [in], length [in]
+ *          The data to hash.
+ *
+ *      digest [out]
+ *          The resulting digest.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void sha512_starts_digest(digest_context *ctx)
+{
+    sha512_starts(&ctx->sha512);
+}
+
+static void sha512_update_digest(digest_context *ctx,
+                                 const unsigned char *data,
+                                 size_t length)
+{
+    sha512_update(&ctx->sha512, data, length);
+}
+
+static void sha512_finish_digest(digest_context *ctx, unsigned char *digest)
+{
+    sha512_finish(&ctx->sha512, digest);
+}
+
+static const digest_algorithm algorithms[] =
+{
+    {"sha256", "SHA256", 32,
+     sha256_starts_digest, sha256_update_digest, sha256_finish_digest},
+    {"sha512", "SHA512", 64,
+     sha512_starts_digest, sha512_update_digest, sha512_finish_digest}
+};
+
+/*
+ *  digest_find
+ *
+ *  Description:
+ *      Find a digest algorithm by name.
+ *
+ *  Parameters:
+ *      name [in]
+ *          The name of the algorithm, such as "sha256".
+ *
+ *  Returns:
+ *      The algorithm, or NULL if it is not supported.
+ *
+ *  Comments:
+ *      None.
+ */
+const digest_algorithm *digest_find(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++)
+    {
+        if (!strcmp(name, algorithms[i].name)) return &algorithms[i];
+    }
+
+    return NULL;
+}
+
+/*
+ *  digest_thread
+ *
+ *  Description:
+ *      Thread body that hashes the buffers queued to a digest stream.
+ *
+ *  Parameters:
+ *      arg [in]
+ *          The digest_stream.
+ *
+ *  Returns:
+ *      NULL.
+ *
+ *  Comments:
+ *      Returns once the stream is closed and every buffer is hashed.
+ */
+static void *digest_thread(void *arg)
+{
+    digest_stream *d = (digest_stream *) arg;
+    unsigned i;
+
+    pthread_mutex_lock(&d->mutex);
+    while (1)
+    {
+        while (!d->queued && !d->done)
+        {
+            pthread_cond_wait(&d->cond, &d->mutex);
+        }
+        if (!d->queued) break;
+
+        i = d->tail;
+        pthread_mutex_unlock(&d->mutex);
+
+        d->algorithm->update(&d->ctx, d->buffers[i], d->lengths[i]);
+
+        pthread_mutex_lock(&d->mutex);
+        d->tail = (d->tail + 1) % DIGEST_BUFFER_COUNT;
+        d->queued--;
+        pthread_cond_broadcast(&d->cond);
+    }
+    pthread_mutex_unlock(&d->mutex);
+
+    return NULL;
+}
+
+/*
+ *  queue_data
+ *
+ *  Description:
+ *      Queue data to be hashed by the digest thread.
+ *
+ *  Parameters:
+ *      d [in/out]
+ *          The digest_stream.
+ *
+ *      data [in]
+ *          The data to hash.
+ *
+ *      length [in]
+ *          The length of the data.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      Waits for a free buffer if the digest thread is behind.
+ */
+static void queue_data(digest_stream *d, const char *data, size_t length)
+{
+    size_t n;
+
+    while (length)
+    {
+        pthread_mutex_lock(&d->mutex);
+        while (d->queued == DIGEST_BUFFER_COUNT)
+        {
+            pthread_cond_wait(&d->cond, &d->mutex);
+        }
+        pthread_mutex_unlock(&d->mutex);
+
+        // The buffer at the head is not in use by the digest thread
+        n = (length > DIGEST_BUFFER_SIZE) ? DIGEST_BUFFER_SIZE : length;
+        memcpy(d->buffers[d->head], data, n);
+        d->lengths[d->head] = n;
+        data += n;
+        length -= n;
+
+        pthread_mutex_lock(&d->mutex);
+        d->head = (d->head + 1) % DIGEST_BUFFER_COUNT;
+        d->queued++;
+        pthread_cond_broadcast(&d->cond);
+        pthread_mutex_unlock(&d->mutex);
+    }
+}
+
+/*
+ *  digest_read
+ *
+ *  Description:
+ *      The read function of a stdio stream returned by digest_open().
+ *
+ *  Parameters:
+ *      cookie [in]
+ *          The digest_stream.
+ *
+ *      buffer [out]
+ *          The buffer to fill.
+ *
+ *      size [in]
+ *          The size of the buffer.
+ *
+ *  Returns:
+ *      The number of octets read, 0 at the end of the stream, or -1 if
+ *      there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static ssize_t digest_read(void *cookie, char *buffer, size_t size)
+{
+    digest_stream *d = (digest_stream *) cookie;
+    size_t n = fread(buffer, 1, size, d->fp);
+
+    if (!n && ferror(d->fp)) return -1;
+
+    queue_data(d, buffer, n);
+
+    return n;
+}
+
+/*
+ *  digest_write
+ *
+ *  Description:
+ *      The write function of a stdio stream returned by digest_open().
+ *
+ *  Parameters:
+ *      cookie [in]
+ *          The digest_stream.
+ *
+ *      buffer [in]
+ *          The data to write.
+ *
+ *      size [in]
+ *          The length of the data.
+ *
+ *  Returns:
+ *      The number of octets written, or -1 if there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static ssize_t digest_write(void *cookie, const char *buffer, size_t size)
+{
+    digest_stream *d = (digest_stream *) cookie;
+
+    if (fwrite(buffer, 1, size, d->fp) != size) return -1;
+
+    queue_data(d, buffer, size);
+
+    return size;
+}
+
+/*
+ *  free_stream
+ *
+ *  Description:
+ *      Release the memory of a digest stream.
+ *
+ *  Parameters:
+ *      d [in]
+ *          The digest_stream.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The buffers may hold plaintext, so they are erased.
+ */
+static void free_stream(digest_stream *d)
+{
+    unsigned i;
+
+    for (i = 0; i < DIGEST_BUFFER_COUNT; i++)
+    {
+        if (d->buffers[i] == NULL) continue;
+        secure_erase(d->buffers[i], DIGEST_BUFFER_SIZE);
+        free(d->buffers[i]);
+    }
+    secure_erase(&d->ctx, sizeof(d->ctx));
+    free(d);
+}
+
+/*
+ *  digest_close
+ *
+ *  Description:
+ *      The close function of a stdio stream returned by digest_open().
+ *
+ *  Parameters:
+ *      cookie [in]
+ *          The digest_stream.
+ *
+ *  Returns:
+ *      0 if successful, otherwise -1.
+ *
+ *  Comments:
+ *      The digest is stored once everything queued is hashed.  The
+ *      underlying stream is not closed.
+ */
+static int digest_close(void *cookie)
+{
+    digest_stream *d = (digest_stream *) cookie;
+
+    pthread_mutex_lock(&d->mutex);
+    d->done = 1;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->mutex);
+    pthread_join(d->thread, NULL);
+
+    d->algorithm->finish(&d->ctx, d->digest);
+
+    pthread_mutex_destroy(&d->mutex);
+    pthread_cond_destroy(&d->cond);
+    free_stream(d);
+
+    return 0;
+}
+
+/*
+ *  digest_open
+ *
+ *  Description:
+ *      Open a stream that hashes the data read from or written to another
+ *      stream.
+ *
+ *  Parameters:
+ *      fp [in]
+ *          The stream to read from or write to.
+ *
+ *      mode [in]
+ *          "r" to read from fp or "w" to write to it.
+ *
+ *      algorithm [in]
+ *          The digest algorithm.
+ *
+ *      digest [out]
+ *          Receives the digest when the stream is closed.
+ *
+ *  Returns:
+ *      The stream, or NULL if there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+FILE *digest_open(FILE *fp,
+                  const char *mode,
+                  const digest_algorithm *algorithm,
+                  unsigned char *digest)
+{
+    cookie_io_functions_t functions = {NULL, NULL, NULL, digest_close};
+    digest_stream *d;
+    FILE *stream;
+    unsigned i;
+
+    if ((d = calloc(1, sizeof(digest_stream))) == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        return NULL;
+    }
+
+    for (i = 0; i < DIGEST_BUFFER_COUNT; i++)
+    {
+        if ((d->buffers[i] = malloc(DIGEST_BUFFER_SIZE)) == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            free_stream(d);
+            return NULL;
+        }
+    }
+
+    d->fp = fp;
+    d->algorithm = algorithm;
+    d->digest = digest;
+    algorithm->starts(&d->ctx);
+    pthread_mutex_init(&d->mutex, NULL);
+    pthread_cond_init(&d->cond, NULL);
+
+    if (pthread_create(&d->thread, NULL, digest_thread, d))
+    {
+        fprintf(stderr, "Error: Unable to create digest thread\n");
+        pthread_mutex_destroy(&d->mutex);
+        pthread_cond_destroy(&d->cond);
+        free_stream(d);
+        return NULL;
+    }
+
+    if (*mode == 'r')
+    {
+        functions.read = digest_read;
+    }
+    else
+    {
+        functions.write = digest_write;
+    }
+
+    if ((stream = fopencookie(d, mode, functions)) == NULL)
+    {
+        perror("Error creating digest stream");
+        digest_close(d);
+        return NULL;
+    }
+    setvbuf(stream, NULL, _IOFBF, DIGEST_BUFFER_SIZE);
+
+    return stream;
+}
+
+/*
+ *  digest_print
+ *
+ *  Description:
+ *      Write a digest in the tagged form accepted by "sha256sum -c".
+ *
+ *  Parameters:
+ *      fp [in]
+ *          The stream to write to.
+ *
+ *      algorithm [in]
+ *          The digest algorithm.
+ *
+ *      digest [in]
+ *          The digest.
+ *
+ *      name [in]
+ *          The name of the file the digest is of, or "-" for a standard
+ *          stream.
+ *
+ *  Returns:
+ *      0 if successful, otherwise -1.
+ *
+ *  Comments:
+ *      None.
+ */
+int digest_print(FILE *fp,
+                 const digest_algorithm *algorithm,
+                 const unsigned char *digest,
+                 const char *name)
+{
+    size_t i;
+
+    fprintf(fp, "%s (%s) = ", algorithm->tag, name);
+    for (i = 0; i < algorithm->size; i++) fprintf(fp, "%02x", digest[i]);
+    fprintf(fp, "\n");
+
+    return ferror(fp) ? -1 : 0;
+}
@@ -0,0 +1,56 @@
+/*
+ *  digest.h
+ *
+ *  Stream Digests for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to compute a digest of the data read from or written to
+ *      a stream as it passes through, and to report it.
+ *
+ *  Portability Issues:
+ *      Requires POSIX threads and fopencookie().
+ */
+
+#ifndef AESCRYPT_DIGEST_H
+#define AESCRYPT_DIGEST_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "sha256.h"
+#include "sha512.h"
+
+#define DIGEST_MAX_SIZE             64
+#define DIGEST_BUFFER_SIZE          262144  /* Octets hashed at a time */
+#define DIGEST_BUFFER_COUNT         4       /* Buffers queued for hashing */
+
+typedef union {
+    sha256_context sha256;
+    sha512_context sha512;
+} digest_context;
+
+typedef struct {
+    const char *name;               // Name given on the command line
+    const char *tag;                // Name written with the digest
+    size_t size;                    // Length of the digest in octets
+    void (*starts)(digest_context *ctx);
+    void (*update)(digest_context *ctx,
+                   const unsigned char *data,
+                   size_t length);
+    void (*finish)(digest_context *ctx, unsigned char *digest);
+} digest_algorithm;
+
+// Function prototypes
+const digest_algorithm *digest_find(const char *name);
+FILE *digest_open(FILE *fp,
+                  const char *mode,
+                  const digest_algorithm *algorithm,
+                  unsigned char *digest);
+int digest_print(FILE *fp,
+                 const digest_algorithm *algorithm,
+                 const unsigned char *digest,
+                 const char *name);
+
+#endif // AESCRYPT_DIGEST_H
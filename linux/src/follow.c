@@ -0,0 +1,640 @@
+/*
+ *  follow.c
+ *
+ *  Follow Mode for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to encrypt a growing file into a series of volumes,
+ *      finalizing each volume once it reaches a size or age threshold.
+ *
+ *      The input is followed by name in the way "tail -F" follows it: data
+ *      is encrypted as it is appended, and if the file is truncated it is
+ *      read again from the start, while if it is replaced (for example,
+ *      by log rotation) the old file is read to its end before the new
+ *      file is opened.  Rather than polling, the follower sleeps until
+ *      inotify reports a change in the directory holding the file.  When
+ *      the input is a pipe, it is read until the writer closes it.
+ *
+ *      Each volume is an ordinary AES Crypt file named like the volumes of
+ *      split_file(), so the volumes may be decrypted individually or
+ *      joined with join_volumes().  The follower is presented to
+ *      encrypt_stream() as a stdio stream that reports end of file when
+ *      the current volume is to be finalized, so each octet is read only
+ *      once and memory use does not depend on the size of a volume.  A
+ *      volume is only created once there is data to put in it.
+ *
+ *      SIGINT, SIGTERM, or SIGHUP finalizes the current volume and stops.
+ *
+ *  Portability Issues:
+ *      Requires Linux (inotify and signalfd) and fopencookie().
+ */
+
+#define _GNU_SOURCE    // fopencookie
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+
+#include "aescrypt.h"
+#include "stream.h"
+#include "split.h"
+#include "follow.h"
+
+typedef struct {
+    const char *filename;           // Followed file, or NULL for stdin
+    int fd;                         // Descriptor being read, or -1
+    dev_t dev;                      // Identity of the file being read
+    ino_t ino;
+    off_t offset;                   // Octets read from the file
+    int watch_fd;                   // inotify descriptor, or -1 for pipes
+    int signal_fd;                  // Readable when asked to stop
+    int stop;                       // Stop once the volume is finalized
+    int ended;                      // The pipe was closed
+    off_t volume_size;              // Volume size threshold, or 0
+    off_t volume_length;            // Octets given to the current volume
+    unsigned interval;              // Volume age threshold, or 0
+    int deadline_set;               // The current volume has data
+    struct timespec deadline;       // When the current volume ends
+    char pending[16384];            // Data read before the volume began
+    size_t pending_length;
+    size_t pending_offset;
+} follower;
+
+/*
+ *  follow_open
+ *
+ *  Description:
+ *      Open the followed file by name.
+ *
+ *  Parameters:
+ *      f [in/out]
+ *          The follower.
+ *
+ *  Returns:
+ *      0 if the file was opened, 1 if it does not exist (yet), or -1 if
+ *      there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static int follow_open(follower *f)
+{
+    struct stat st;
+
+    if ((f->fd = open(f->filename, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        if (errno == ENOENT) return 1;
+        fprintf(stderr, "Error opening input file %s : ", f->filename);
+        perror("");
+        return -1;
+    }
+
+    if (fstat(f->fd, &st))
+    {
+        perror("Error determining the input file");
+        close(f->fd);
+        f->fd = -1;
+        return -1;
+    }
+
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->offset = 0;
+
+    return 0;
+}
+
+/*
+ *  follow_check
+ *
+ *  Description:
+ *      Once the file being read is at its end, determine whether the file
+ *      was truncated, replaced, or removed.
+ *
+ *  Parameters:
+ *      f [in/out]
+ *          The follower.
+ *
+ *  Returns:
+ *      1 if there may be more to read now, 0 if the follower must wait,
+ *      or -1 if there was an error.
+ *
+ *  Comments:
+ *      A replaced file is only abandoned once it has been read to its end
+ *      and another file has its name.
+ */
+static int follow_check(follower *f)
+{
+    struct stat st;
+    int rc;
+
+    if (stat(f->filename, &st))
+    {
+        if (errno != ENOENT)
+        {
+            fprintf(stderr, "Error checking input file %s : ", f->filename);
+            perror("");
+            return -1;
+        }
+
+        // The file was removed or renamed; keep reading it until another
+        // file takes its name, since rotation may still append to it
+        return 0;
+    }
+
+    if ((f->fd >= 0) && (st.st_dev == f->dev) && (st.st_ino == f->ino))
+    {
+        if (st.st_size >= f->offset) return 0;
+
+        fprintf(stderr, "%s: file truncated\n", f->filename);
+        if (lseek(f->fd, 0, SEEK_SET) < 0)
+        {
+            perror("Error seeking in input file");
+            return -1;
+        }
+        f->offset = 0;
+        return 1;
+    }
+
+    // A different file now has the name, so follow it instead
+    if (f->fd >= 0)
+    {
+        fprintf(stderr,
+                "%s: file replaced; following new file\n",
+                f->filename);
+        close(f->fd);
+        f->fd = -1;
+    }
+
+    rc = follow_open(f);
+
+    return (rc < 0) ? -1 : !rc;
+}
+
+/*
+ *  follow_expired
+ *
+ *  Description:
+ *      Determine whether the current volume has reached its age threshold.
+ *
+ *  Parameters:
+ *      f [in]
+ *          The follower.
+ *
+ *      timeout [out]
+ *          If not NULL, the milliseconds until the threshold, or -1 if
+ *          there is none.
+ *
+ *  Returns:
+ *      1 if the volume is to be finalized, otherwise 0.
+ *
+ *  Comments:
+ *      None.
+ */
+static int follow_expired(const follower *f, int *timeout)
+{
+    struct timespec now;
+    long long remaining;
+
+    if (timeout != NULL) *timeout = -1;
+    if (!f->deadline_set) return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    remaining = (long long) (f->deadline.tv_sec - now.tv_sec) * 1000 +
+                (f->deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+    if (remaining <= 0) return 1;
+
+    if (timeout != NULL)
+    {
+        *timeout = (remaining > 86400000) ? 86400000 : (int) remaining;
+    }
+
+    return 0;
+}
+
+/*
+ *  follow_stopping
+ *
+ *  Description:
+ *      Determine whether a signal has asked the follower to stop.
+ *
+ *  Parameters:
+ *      f [in/out]
+ *          The follower.
+ *
+ *  Returns:
+ *      1 if the follower is to stop, otherwise 0.
+ *
+ *  Comments:
+ *      The stop signals are blocked and read from the signalfd, so a
+ *      signal that arrives while data is flowing is not lost.
+ */
+static int follow_stopping(follower *f)
+{
+    struct signalfd_siginfo info;
+
+    while (!f->stop &&
+           (read(f->signal_fd, &info, sizeof(info)) == sizeof(info)))
+    {
+        f->stop = 1;
+    }
+
+    return f->stop;
+}
+
+/*
+ *  follow_wait
+ *
+ *  Description:
+ *      Sleep until the input may have changed, a signal arrives, or the
+ *      current volume reaches its age threshold.
+ *
+ *  Parameters:
+ *      f [in/out]
+ *          The follower.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Wakeups may be spurious; the caller checks again after each.
+ */
+static int follow_wait(follower *f)
+{
+    struct pollfd fds[2];
+    char events[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    int timeout;
+
+    if (follow_expired(f, &timeout)) return 0;
+
+    fds[0].fd = (f->watch_fd >= 0) ? f->watch_fd : f->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = f->signal_fd;
+    fds[1].events = POLLIN;
+
+    if (poll(fds, 2, timeout) < 0)
+    {
+        if (errno == EINTR) return 0;
+        perror("Error waiting for input");
+        return -1;
+    }
+
+    // Discard the inotify events; the file is examined directly
+    if ((f->watch_fd >= 0) && (fds[0].revents & POLLIN))
+    {
+        while (read(f->watch_fd, events, sizeof(events)) > 0);
+    }
+
+    return 0;
+}
+
+/*
+ *  follow_read
+ *
+ *  Description:
+ *      Read the next data for the current volume, waiting for it if
+ *      necessary.
+ *
+ *  Parameters:
+ *      f [in/out]
+ *          The follower.
+ *
+ *      buffer [out]
+ *          Where the data is placed.
+ *
+ *      size [in]
+ *          The size of the buffer.
+ *
+ *  Returns:
+ *      The number of octets read, 0 if the volume is to be finalized, or
+ *      -1 if there was an error.
+ *
+ *  Comments:
+ *      The age threshold of a volume starts with its first octet.
+ */
+static ssize_t follow_read(follower *f, char *buffer, size_t size)
+{
+    struct pollfd fds;
+    ssize_t length;
+    int rc;
+
+    // Data read before the volume began belongs to it
+    if (f->pending_offset < f->pending_length)
+    {
+        length = f->pending_length - f->pending_offset;
+        if ((size_t) length > size) length = size;
+        memcpy(buffer, f->pending + f->pending_offset, length);
+        f->pending_offset += length;
+        return length;
+    }
+
+    for (;;)
+    {
+        if (follow_stopping(f) || f->ended ||
+            (f->volume_size && (f->volume_length >= f->volume_size)) ||
+            follow_expired(f, NULL))
+        {
+            return 0;
+        }
+
+        if (f->volume_size &&
+            (f->volume_size - f->volume_length < (off_t) size))
+        {
+            size = (size_t) (f->volume_size - f->volume_length);
+        }
+
+        // Only read a pipe once it is known that the read will not block
+        length = 0;
+        if (f->fd >= 0)
+        {
+            fds.fd = f->fd;
+            fds.events = POLLIN;
+            if ((f->watch_fd >= 0) || (poll(&fds, 1, 0) > 0))
+            {
+                length = read(f->fd, buffer, size);
+                if (length == 0 && (f->watch_fd < 0))
+                {
+                    f->ended = 1;
+                    return 0;
+                }
+            }
+        }
+
+        if (length > 0)
+        {
+            if (!f->deadline_set && f->interval)
+            {
+                clock_gettime(CLOCK_MONOTONIC, &f->deadline);
+                f->deadline.tv_sec += f->interval;
+                f->deadline_set = 1;
+            }
+            f->offset += length;
+            f->volume_length += length;
+            return length;
+        }
+
+        if ((length < 0) && (errno != EINTR) && (errno != EAGAIN))
+        {
+            perror("Error reading input");
+            return -1;
+        }
+
+        // At the end of a file, see if it was truncated or replaced
+        if ((length == 0) && (f->watch_fd >= 0))
+        {
+            if ((rc = follow_check(f)) < 0) return -1;
+            if (rc) continue;
+        }
+
+        if (follow_wait(f)) return -1;
+    }
+}
+
+/*
+ *  follow_cookie_read
+ *
+ *  Description:
+ *      The read function of the stdio stream given to encrypt_stream().
+ *
+ *  Parameters:
+ *      cookie [in]
+ *          The follower.
+ *
+ *      buffer [out]
+ *          Where the data is placed.
+ *
+ *      size [in]
+ *          The size of the buffer.
+ *
+ *  Returns:
+ *      The number of octets read, 0 at the end of the volume, or -1 if
+ *      there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static ssize_t follow_cookie_read(void *cookie, char *buffer, size_t size)
+{
+    return follow_read((follower *) cookie, buffer, size);
+}
+
+/*
+ *  follow_file
+ *
+ *  Description:
+ *      Encrypt a growing file into a series of volumes until asked to
+ *      stop or, for a pipe, until the pipe is closed.
+ *
+ *  Parameters:
+ *      infile [in]
+ *          The file to follow, or "-" for standard input.
+ *
+ *      base [in]
+ *          The name to which each volume number is appended.
+ *
+ *      volume_size [in]
+ *          The most plaintext octets in each volume, or 0 for no limit.
+ *
+ *      interval [in]
+ *          The seconds after its first octet when a volume is finalized,
+ *          or 0 for no limit.
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Existing volumes are never overwritten: numbering continues after
+ *      the last volume with the same base name.  The file is read from
+ *      its start.
+ */
+int follow_file(const char *infile,
+                const char *base,
+                off_t volume_size,
+                unsigned interval,
+                const unsigned char *passwd,
+                int passlen)
+{
+    follower f;
+    cookie_io_functions_t functions = {follow_cookie_read, NULL, NULL, NULL};
+    char volume[AES_CRYPT_MAX_PATH];
+    char directory[AES_CRYPT_MAX_PATH];
+    sigset_t stop_signals;
+    sigset_t saved_mask;
+    struct stat st;
+    const char *slash;
+    FILE *infp;
+    FILE *outfp;
+    ssize_t length;
+    unsigned index = 0;
+    int rc = 0;
+
+    memset(&f, 0, sizeof(f));
+    f.filename = strcmp(infile, "-") ? infile : NULL;
+    f.fd = (f.filename == NULL) ? STDIN_FILENO : -1;
+    f.watch_fd = -1;
+    f.volume_size = volume_size;
+    f.interval = interval;
+
+    // Stop signals are received through a descriptor so that they can be
+    // handled between volumes
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGHUP);
+    sigprocmask(SIG_BLOCK, &stop_signals, &saved_mask);
+    if ((f.signal_fd = signalfd(-1,
+                                &stop_signals,
+                                SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+    {
+        perror("Error creating signal descriptor");
+        sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+        return -1;
+    }
+
+    // Watch the directory so that replacement of the file is seen
+    if (f.filename != NULL)
+    {
+        if ((slash = strrchr(f.filename, '/')) == NULL)
+        {
+            strcpy(directory, ".");
+        }
+        else if (slash == f.filename)
+        {
+            strcpy(directory, "/");
+        }
+        else if ((size_t) (slash - f.filename) >= sizeof(directory))
+        {
+            fprintf(stderr, "Error: Input file pathname too long\n");
+            rc = -1;
+        }
+        else
+        {
+            memcpy(directory, f.filename, slash - f.filename);
+            directory[slash - f.filename] = '\0';
+        }
+
+        if (!rc &&
+            (((f.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) ||
+             (inotify_add_watch(f.watch_fd,
+                                directory,
+                                IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE |
+                                IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE |
+                                IN_ATTRIB) < 0)))
+        {
+            fprintf(stderr, "Error watching directory %s : ", directory);
+            perror("");
+            rc = -1;
+        }
+
+        if (!rc && (follow_open(&f) < 0)) rc = -1;
+    }
+
+    // Continue numbering after any volumes from an earlier run
+    while (!rc)
+    {
+        if (snprintf(volume,
+                     AES_CRYPT_MAX_PATH,
+                     SPLIT_VOLUME_FORMAT,
+                     base,
+                     index) >= AES_CRYPT_MAX_PATH)
+        {
+            fprintf(stderr, "Error: Volume pathname too long\n");
+            rc = -1;
+        }
+        else if (stat(volume, &st))
+        {
+            break;
+        }
+        index++;
+    }
+
+    while (!rc)
+    {
+        // Wait for the first data of the next volume
+        f.volume_length = 0;
+        f.deadline_set = 0;
+        f.pending_length = 0;
+        f.pending_offset = 0;
+        if ((length = follow_read(&f, f.pending, sizeof(f.pending))) <= 0)
+        {
+            if (length < 0) rc = -1;
+            break;
+        }
+        f.pending_length = length;
+
+        if (snprintf(volume,
+                     AES_CRYPT_MAX_PATH,
+                     SPLIT_VOLUME_FORMAT,
+                     base,
+                     index) >= AES_CRYPT_MAX_PATH)
+        {
+            fprintf(stderr, "Error: Volume pathname too long\n");
+            rc = -1;
+            break;
+        }
+
+        if ((outfp = fopen(volume, "w")) == NULL)
+        {
+            fprintf(stderr, "Error opening output file %s : ", volume);
+            perror("");
+            rc = -1;
+            break;
+        }
+
+        if ((infp = fopencookie(&f, "r", functions)) == NULL)
+        {
+            perror("Error creating input stream");
+            fclose(outfp);
+            unlink(volume);
+            rc = -1;
+            break;
+        }
+
+        rc = encrypt_stream(infp,
+                            outfp,
+                            (unsigned char *) passwd,
+                            passlen,
+                            NULL);
+        fclose(infp);
+
+        // A finalized volume must reach the disk
+        if (fflush(outfp) || fsync(fileno(outfp)))
+        {
+            if (!rc) fprintf(stderr, "Error: Could not flush %s\n", volume);
+            rc = -1;
+        }
+        if (fclose(outfp) && !rc)
+        {
+            fprintf(stderr, "Error: Could not properly close %s\n", volume);
+            rc = -1;
+        }
+
+        if (rc) unlink(volume);
+
+        index++;
+    }
+
+    if ((f.fd >= 0) && (f.filename != NULL)) close(f.fd);
+    if (f.watch_fd >= 0) close(f.watch_fd);
+    close(f.signal_fd);
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+
+    return rc;
+}
@@ -0,0 +1,32 @@
+/*
+ *  follow.h
+ *
+ *  Follow Mode for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to encrypt a growing file into a series of volumes,
+ *      finalizing each volume once it reaches a size or age threshold.
+ *
+ *  Portability Issues:
+ *      Requires Linux (inotify and signalfd) and fopencookie().
+ */
+
+#ifndef AESCRYPT_FOLLOW_H
+#define AESCRYPT_FOLLOW_H
+
+#include <sys/types.h>
+
+// Seconds after its first octet before a volume is finalized
+#define FOLLOW_DEFAULT_INTERVAL     60
+
+// Function prototypes
+int follow_file(const char *infile,
+                const char *base,
+                off_t volume_size,
+                unsigned interval,
+                const unsigned char *passwd,
+                int passlen);
+
+#endif // AESCRYPT_FOLLOW_H
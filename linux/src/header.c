@@ -0,0 +1,391 @@
+/*
+ *  header.c
+ *
+ *  Stream Header Functions for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to parse the AES Crypt stream header and the extensions
+ *      that follow it in version 2 and later streams, along with the key
+ *      derivation iteration count of version 3 streams.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>  // malloc
+#include <string.h>
+#include <unistd.h>  // pread
+#include <sys/stat.h>  // fstat
+
+#include "header.h"
+#include "chunked.h"
+#include "session.h"
+
+/*
+ *  read_error
+ *
+ *  Description:
+ *      Report a short read from the input stream.
+ *
+ *  Parameters:
+ *      fp [in]
+ *          The stream that was being read.
+ *
+ *      what [in]
+ *          A description of what was being read.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void read_error(FILE *fp, const char *what)
+{
+    if (feof(fp))
+    {
+        fprintf(stderr, "Error: Input file is too short.\n");
+    }
+    else
+    {
+        fprintf(stderr, "Error reading the %s: ", what);
+        perror("");
+    }
+}
+
+/*
+ *  read_header
+ *
+ *  Description:
+ *      Read the AES Crypt stream header and any extensions, leaving the
+ *      stream positioned at the initialization vector.
+ *
+ *  Parameters:
+ *      fp [in]
+ *          The input stream, positioned at the start of the AES Crypt data.
+ *
+ *      header [out]
+ *          The parsed header.  The caller must call free_header() when
+ *          finished with it, even if this function fails.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Offsets recorded in the header are relative to the position of
+ *      the stream when this function was called.
+ */
+int read_header(FILE *fp, aescrypt_header *header)
+{
+    unsigned char buffer[4];
+    aescrypt_extension *extensions;
+    unsigned length;
+    off_t offset = 0;
+
+    memset(header, 0, sizeof(aescrypt_header));
+
+    // Read the file header
+    if (fread(&header->hdr, 1, sizeof(aescrypt_hdr), fp) !=
+        sizeof(aescrypt_hdr))
+    {
+        read_error(fp, "file header");
+        return -1;
+    }
+    offset += sizeof(aescrypt_hdr);
+
+    if (!(header->hdr.aes[0] == 'A' && header->hdr.aes[1] == 'E' &&
+          header->hdr.aes[2] == 'S'))
+    {
+        fprintf(stderr,
+                "Error: Bad file header (not aescrypt file or is corrupted? "
+                "[%x, %x, %x])\n",
+                header->hdr.aes[0],
+                header->hdr.aes[1],
+                header->hdr.aes[2]);
+        return -1;
+    }
+
+    // Validate the version number and take any version-specific actions
+    if (header->hdr.version == 0)
+    {
+        // Let's just consider the least significant nibble to determine
+        // the size of the last block
+        header->hdr.last_block_size = (header->hdr.last_block_size & 0x0F);
+    }
+    else if ((header->hdr.version > 0x03) &&
+             (header->hdr.version != AES_CRYPT_CHUNKED_VERSION))
+    {
+        fprintf(stderr, "Error: Unsupported AES file version: %d\n",
+                header->hdr.version);
+        return -1;
+    }
+
+    // Read extensions present in v2 and later files
+    while (header->hdr.version >= 0x02)
+    {
+        if (fread(buffer, 1, 2, fp) != 2)
+        {
+            read_error(fp, "file extensions");
+            return -1;
+        }
+
+        // Determine the extension length, zero means no more extensions
+        length = (((unsigned)buffer[0]) << 8) | (unsigned)buffer[1];
+        if (!length)
+        {
+            offset += 2;
+            break;
+        }
+
+        extensions = realloc(header->extensions,
+                             (header->extension_count + 1) *
+                                sizeof(aescrypt_extension));
+        if (extensions == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            return -1;
+        }
+        header->extensions = extensions;
+        extensions += header->extension_count;
+
+        if ((extensions->data = malloc(length)) == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            return -1;
+        }
+        extensions->offset = offset;
+        extensions->length = length;
+        header->extension_count++;
+
+        if (fread(extensions->data, 1, length, fp) != length)
+        {
+            read_error(fp, "file extensions");
+            return -1;
+        }
+        offset += 2 + length;
+    }
+
+    // Version 3 gives the PBKDF2 iteration count before the IV
+    if (header->hdr.version == 0x03)
+    {
+        if (fread(buffer, 1, 4, fp) != 4)
+        {
+            read_error(fp, "key derivation iterations");
+            return -1;
+        }
+        offset += 4;
+
+        header->kdf_iterations = ((unsigned long) buffer[0] << 24) |
+                                 ((unsigned long) buffer[1] << 16) |
+                                 ((unsigned long) buffer[2] << 8) |
+                                 (unsigned long) buffer[3];
+        if ((header->kdf_iterations < 1) ||
+            (header->kdf_iterations > AES_CRYPT_V3_MAX_ITERATIONS))
+        {
+            fprintf(stderr,
+                    "Error: Invalid key derivation iteration count: %lu\n",
+                    header->kdf_iterations);
+            return -1;
+        }
+    }
+
+    header->iv_offset = offset;
+
+    return 0;
+}
+
+/*
+ *  read_sizes
+ *
+ *  Description:
+ *      Determine the location and size of the ciphertext and the size of
+ *      the plaintext without decrypting anything.
+ *
+ *  Parameters:
+ *      fp [in]
+ *          The AES Crypt file, which must be a regular file.
+ *
+ *      header [in]
+ *          The header read from the file by read_header().
+ *
+ *      sizes [out]
+ *          The sizes.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      The plaintext size follows from the file size and the file size
+ *      modulo stored before the final HMAC (or in the header for version
+ *      0 files).  For chunked streams, the body is the sequence of chunks
+ *      including their tags, and the plaintext size follows from the file
+ *      size and the chunk size.  Version 3 streams are padded and have no
+ *      modulo, so their plaintext size is only known once the last block
+ *      is decrypted and is given as -1.  The position of fp is not
+ *      changed.
+ */
+int read_sizes(FILE *fp, const aescrypt_header *header, aescrypt_sizes *sizes)
+{
+    struct stat st;
+    unsigned char modulo;
+    unsigned char buffer[4];
+    off_t record_length;
+
+    if (fstat(fileno(fp), &st))
+    {
+        perror("Error determining the input file size");
+        return -1;
+    }
+
+    // Chunked streams have the chunk size before the chunks, and the last
+    // chunk always holds less than the chunk size
+    sizes->chunk_size = 0;
+    if (header->hdr.version == AES_CRYPT_CHUNKED_VERSION)
+    {
+        sizes->body_offset = header->iv_offset + 16 + 48 + 32 + 4;
+        sizes->body_length = st.st_size - sizes->body_offset;
+        sizes->last_block_size = 0;
+        if ((sizes->body_length < CHUNKED_TAG_LEN) ||
+            (pread(fileno(fp), buffer, 4, sizes->body_offset - 4) != 4))
+        {
+            fprintf(stderr, "Error: Input file is too short.\n");
+            return -1;
+        }
+        if (chunked_parse_chunk_size(buffer, &sizes->chunk_size)) return -1;
+
+        record_length = (off_t) sizes->chunk_size + CHUNKED_TAG_LEN;
+        if ((sizes->body_length % record_length) < CHUNKED_TAG_LEN)
+        {
+            fprintf(stderr, "Error: Input file is corrupt.\n");
+            return -1;
+        }
+        sizes->plaintext_size =
+            (sizes->body_length / record_length) * sizes->chunk_size +
+            (sizes->body_length % record_length) - CHUNKED_TAG_LEN;
+
+        return 0;
+    }
+
+    // The IV and, for version 1 and later, the session IV, key, and HMAC
+    sizes->body_offset = header->iv_offset + 16;
+    if (header->hdr.version >= 0x01) sizes->body_offset += 48 + 32;
+
+    // Version 3 ends with the HMAC after at least one padded block
+    if (header->hdr.version == 0x03)
+    {
+        sizes->body_length = st.st_size - sizes->body_offset - 32;
+        sizes->last_block_size = 0;
+        sizes->plaintext_size = -1;
+        if ((sizes->body_length < 16) || (sizes->body_length % 16))
+        {
+            fprintf(stderr, "Error: Input file is corrupt.\n");
+            return -1;
+        }
+
+        return 0;
+    }
+
+    // The ciphertext is followed by the modulo (version 1 and later)
+    // and the HMAC
+    sizes->body_length = st.st_size - sizes->body_offset - 32;
+    sizes->last_block_size = header->hdr.last_block_size;
+    if (header->hdr.version >= 0x01)
+    {
+        sizes->body_length--;
+        if ((sizes->body_length < 0) ||
+            (pread(fileno(fp), &modulo, 1, st.st_size - 33) != 1))
+        {
+            fprintf(stderr, "Error: Input file is too short.\n");
+            return -1;
+        }
+        sizes->last_block_size = modulo & 0x0F;
+    }
+
+    if ((sizes->body_length < 0) || (sizes->body_length % 16) ||
+        ((sizes->body_length == 0) && sizes->last_block_size))
+    {
+        fprintf(stderr, "Error: Input file is corrupt.\n");
+        return -1;
+    }
+
+    sizes->plaintext_size = sizes->body_length;
+    if ((sizes->body_length > 0) && sizes->last_block_size)
+    {
+        sizes->plaintext_size -= 16 - sizes->last_block_size;
+    }
+
+    return 0;
+}
+
+/*
+ *  free_header
+ *
+ *  Description:
+ *      Release memory allocated by read_header().
+ *
+ *  Parameters:
+ *      header [in]
+ *          The header to release.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void free_header(aescrypt_header *header)
+{
+    unsigned i;
+
+    for (i = 0; i < header->extension_count; i++)
+    {
+        free(header->extensions[i].data);
+    }
+    free(header->extensions);
+
+    header->extensions = NULL;
+    header->extension_count = 0;
+}
+
+/*
+ *  find_extension
+ *
+ *  Description:
+ *      Locate the extension having the given identifier.
+ *
+ *  Parameters:
+ *      header [in]
+ *          The parsed header.
+ *
+ *      identifier [in]
+ *          The extension identifier to find (case sensitive).
+ *
+ *  Returns:
+ *      A pointer to the extension or NULL if it is not present.
+ *
+ *  Comments:
+ *      The contents of the extension begin after the identifier and
+ *      its terminating 0x00 octet.
+ */
+const aescrypt_extension *find_extension(const aescrypt_header *header,
+                                         const char *identifier)
+{
+    size_t id_length = strlen(identifier) + 1;
+    unsigned i;
+
+    for (i = 0; i < header->extension_count; i++)
+    {
+        if ((header->extensions[i].length >= id_length) &&
+            !memcmp(header->extensions[i].data, identifier, id_length))
+        {
+            return &header->extensions[i];
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,53 @@
+/*
+ *  header.h
+ *
+ *  Stream Header Functions for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to parse the AES Crypt stream header and the extensions
+ *      that follow it in version 2 and later streams.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#ifndef AESCRYPT_HEADER_H
+#define AESCRYPT_HEADER_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "aescrypt.h"
+
+typedef struct {
+    off_t offset;               // Offset of the two-octet length field
+    unsigned length;            // Length of the identifier and contents
+    unsigned char *data;        // Identifier, 0x00, and contents
+} aescrypt_extension;
+
+typedef struct {
+    aescrypt_hdr hdr;
+    unsigned extension_count;
+    aescrypt_extension *extensions;
+    off_t iv_offset;            // Offset of the IV following the extensions
+    unsigned long kdf_iterations;   // PBKDF2 iterations (version 3), else 0
+} aescrypt_header;
+
+typedef struct {
+    off_t body_offset;          // Offset of the first ciphertext block
+    off_t body_length;          // Length of the ciphertext in octets
+    off_t plaintext_size;       // Length of the plaintext, -1 if unknown
+    unsigned last_block_size;   // File size modulo 16
+    unsigned chunk_size;        // Chunk size of a chunked stream, else 0
+} aescrypt_sizes;
+
+// Function prototypes
+int read_header(FILE *fp, aescrypt_header *header);
+int read_sizes(FILE *fp, const aescrypt_header *header, aescrypt_sizes *sizes);
+void free_header(aescrypt_header *header);
+const aescrypt_extension *find_extension(const aescrypt_header *header,
+                                         const char *identifier);
+
+#endif // AESCRYPT_HEADER_H
@@ -0,0 +1,128 @@
+/*
+ *  hmac.c
+ *
+ *  HMAC-SHA256 Functions for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Module implementing HMAC-SHA256 as per RFC 2104 on top of the
+ *      SHA-256 implementation used by AES Crypt.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+
+#include "hmac.h"
+#include "util.h"
+
+/*
+ *  hmac_sha256_starts
+ *
+ *  Description:
+ *      Initialize the HMAC context with the given key.
+ *
+ *  Parameters:
+ *      ctx [out]
+ *          The HMAC context to initialize.
+ *
+ *      key [in]
+ *          The HMAC key.
+ *
+ *      key_length [in]
+ *          The length of the key in octets, which must not exceed 64.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      AES Crypt only ever uses 32-octet keys, so keys longer than the
+ *      SHA-256 block size are not hashed first.
+ */
+void hmac_sha256_starts(hmac_sha256_context *ctx,
+                        const unsigned char *key,
+                        unsigned key_length)
+{
+    unsigned char ipad[64];
+    unsigned i;
+
+    // Set the ipad and opad arrays with values as
+    // per RFC 2104 (HMAC).  HMAC is defined as
+    //   H(K XOR opad, H(K XOR ipad, text))
+    memset(ipad, 0x36, 64);
+    memset(ctx->opad, 0x5C, 64);
+
+    for (i = 0; (i < key_length) && (i < 64); i++)
+    {
+        ipad[i] ^= key[i];
+        ctx->opad[i] ^= key[i];
+    }
+
+    sha256_starts(&ctx->sha_ctx);
+    sha256_update(&ctx->sha_ctx, ipad, 64);
+
+    secure_erase(ipad, sizeof(ipad));
+}
+
+/*
+ *  hmac_sha256_update
+ *
+ *  Description:
+ *      Add data to the HMAC computation.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The HMAC context.
+ *
+ *      input [in]
+ *          The data to authenticate.
+ *
+ *      length [in]
+ *          The length of the data in octets.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void hmac_sha256_update(hmac_sha256_context *ctx,
+                        const unsigned char *input,
+                        unsigned long length)
+{
+    sha256_update(&ctx->sha_ctx, (unsigned char *) input, length);
+}
+
+/*
+ *  hmac_sha256_finish
+ *
+ *  Description:
+ *      Complete the HMAC computation and produce the digest.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The HMAC context, which is wiped on return.
+ *
+ *      digest [out]
+ *          The resulting 32-octet HMAC.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void hmac_sha256_finish(hmac_sha256_context *ctx, unsigned char digest[32])
+{
+    sha256_finish(&ctx->sha_ctx, digest);
+    sha256_starts(&ctx->sha_ctx);
+    sha256_update(&ctx->sha_ctx, ctx->opad, 64);
+    sha256_update(&ctx->sha_ctx, digest, 32);
+    sha256_finish(&ctx->sha_ctx, digest);
+
+    secure_erase(ctx, sizeof(hmac_sha256_context));
+}
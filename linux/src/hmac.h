@@ -0,0 +1,35 @@
+/*
+ *  hmac.h
+ *
+ *  HMAC-SHA256 Functions for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Module implementing HMAC-SHA256 as per RFC 2104 on top of the
+ *      SHA-256 implementation used by AES Crypt.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#ifndef AESCRYPT_HMAC_H
+#define AESCRYPT_HMAC_H
+
+#include "sha256.h"
+
+typedef struct {
+    sha256_context sha_ctx;
+    unsigned char opad[64];
+} hmac_sha256_context;
+
+// Function prototypes
+void hmac_sha256_starts(hmac_sha256_context *ctx,
+                        const unsigned char *key,
+                        unsigned key_length);
+void hmac_sha256_update(hmac_sha256_context *ctx,
+                        const unsigned char *input,
+                        unsigned long length);
+void hmac_sha256_finish(hmac_sha256_context *ctx, unsigned char digest[32]);
+
+#endif // AESCRYPT_HMAC_H
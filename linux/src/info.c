@@ -0,0 +1,506 @@
+/*
+ *  info.c
+ *
+ *  File Inspection for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to describe AES Crypt files from their headers and sizes
+ *      alone, without a password.
+ *
+ *      Each file is described by one line of JSON on stdout giving the
+ *      format version, the file size, the plaintext size, and the
+ *      extensions in the header, such as:
+ *
+ *          {"path": "a.txt.aes", "version": 2, "size": 1134,
+ *           "plaintext_size": 1000, "extensions": [{"id": "CREATED_BY",
+ *           "value": "aescrypt 4.0.0"}]}
+ *
+ *      though all on one line.  Chunked streams add "chunk_size".  For
+ *      compressed streams, "compression" names the codec and the size of
+ *      the compressed plaintext is given as "compressed_size", since the
+ *      size of the original cannot be known without decompressing it.
+ *      Version 3 streams add "kdf_iterations".  Their plaintext is padded
+ *      with PKCS#7, with 1 to 16 octets, and the padding cannot be seen
+ *      without the password, so the plaintext size is not known; the most
+ *      it can be, one less than the ciphertext, is given instead as
+ *      "plaintext_size_max" (or "compressed_size_max").  Extension
+ *      contents that are not text are given in hexadecimal as "hex" rather
+ *      than "value".  A file that cannot be described has a line with
+ *      "error" giving the reason.
+ *
+ *      Only the header is read, with a single buffered read, along with
+ *      the file size modulo near the end of the file.  Directories are
+ *      searched for files ending in .aes, and files are described in
+ *      batches in parallel, with the lines of each batch written in order.
+ *
+ *  Portability Issues:
+ *      Requires pread(), open_memstream(), and POSIX directory functions.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>     // AT_SYMLINK_NOFOLLOW
+#include <sys/stat.h>
+
+#include "aescrypt.h"
+#include "header.h"
+#include "compress.h"
+#include "workers.h"
+#include "util.h"
+#include "info.h"
+
+typedef struct {
+    char *paths[INFO_BATCH_SIZE];   // Files to describe
+    char *lines[INFO_BATCH_SIZE];   // Their descriptions
+    unsigned count;
+    unsigned jobs;
+    int rc;                         // -1 if any file could not be described
+} info_batch;
+
+/*
+ *  print_extension
+ *
+ *  Description:
+ *      Write an extension as a JSON object.
+ *
+ *  Parameters:
+ *      fp [in]
+ *          The stream to write to.
+ *
+ *      extension [in]
+ *          The extension.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      Contents containing control characters are written in hexadecimal.
+ */
+static void print_extension(FILE *fp, const aescrypt_extension *extension)
+{
+    const unsigned char *data = extension->data;
+    size_t id_length = strnlen((const char *) data, extension->length);
+    size_t i;
+    int text = 1;
+
+    fprintf(fp, "{\"id\": ");
+    json_print_string(fp, data, id_length);
+
+    if (id_length >= extension->length)
+    {
+        fprintf(fp, "}");
+        return;
+    }
+    data += id_length + 1;
+
+    for (i = 0; i < extension->length - id_length - 1; i++)
+    {
+        if ((data[i] < 0x20) || (data[i] == 0x7F)) text = 0;
+    }
+
+    if (text)
+    {
+        fprintf(fp, ", \"value\": ");
+        json_print_string(fp, data, extension->length - id_length - 1);
+    }
+    else
+    {
+        fprintf(fp, ", \"hex\": \"");
+        for (i = 0; i < extension->length - id_length - 1; i++)
+        {
+            fprintf(fp, "%02x", data[i]);
+        }
+        fprintf(fp, "\"");
+    }
+    fprintf(fp, "}");
+}
+
+/*
+ *  describe_file
+ *
+ *  Description:
+ *      Describe an AES Crypt file as a line of JSON.
+ *
+ *  Parameters:
+ *      path [in]
+ *          The file.
+ *
+ *      fp [in]
+ *          The stream to write the line to.
+ *
+ *  Returns:
+ *      0 if successful, otherwise -1 after describing the error.
+ *
+ *  Comments:
+ *      Problems with the file are also reported to stderr.
+ */
+static int describe_file(const char *path, FILE *fp)
+{
+    aescrypt_header header;
+    aescrypt_sizes sizes;
+    const aescrypt_extension *compression;
+    const char *error = NULL;
+    struct stat st;
+    FILE *infp;
+    size_t id_length = strlen(COMPRESS_EXTENSION_ID) + 1;
+    unsigned i, n;
+
+    fprintf(fp, "{\"path\": ");
+    json_print_string(fp, path, strlen(path));
+
+    if ((infp = fopen(path, "r")) == NULL)
+    {
+        fprintf(stderr, "Error opening input file %s : ", path);
+        perror("");
+        fprintf(fp, ", \"error\": ");
+        json_print_string(fp, strerror(errno), strlen(strerror(errno)));
+        fprintf(fp, "}\n");
+        return -1;
+    }
+
+    if (read_header(infp, &header))
+    {
+        error = "not an AES Crypt file";
+    }
+    else if (fstat(fileno(infp), &st) || read_sizes(infp, &header, &sizes))
+    {
+        error = "corrupt AES Crypt file";
+    }
+
+    if (error != NULL)
+    {
+        fprintf(stderr, "Error: Unable to describe %s\n", path);
+        fprintf(fp, ", \"error\": \"%s\"}\n", error);
+        free_header(&header);
+        fclose(infp);
+        return -1;
+    }
+
+    compression = find_extension(&header, COMPRESS_EXTENSION_ID);
+
+    fprintf(fp,
+            ", \"version\": %u, \"size\": %lld",
+            header.hdr.version,
+            (long long) st.st_size);
+    if (sizes.plaintext_size >= 0)
+    {
+        fprintf(fp,
+                ", \"%s\": %lld",
+                (compression != NULL) ? "compressed_size" : "plaintext_size",
+                (long long) sizes.plaintext_size);
+    }
+    else if (header.hdr.version == 0x03)
+    {
+        fprintf(fp,
+                ", \"%s_max\": %lld",
+                (compression != NULL) ? "compressed_size" : "plaintext_size",
+                (long long) sizes.body_length - 1);
+    }
+    if (header.kdf_iterations)
+    {
+        fprintf(fp, ", \"kdf_iterations\": %lu", header.kdf_iterations);
+    }
+    if (sizes.chunk_size)
+    {
+        fprintf(fp, ", \"chunk_size\": %u", sizes.chunk_size);
+    }
+    if ((compression != NULL) && (compression->length >= id_length))
+    {
+        fprintf(fp, ", \"compression\": ");
+        json_print_string(fp,
+                          compression->data + id_length,
+                          compression->length - id_length);
+    }
+
+    // The container for extensions added later has an empty identifier
+    fprintf(fp, ", \"extensions\": [");
+    for (i = 0, n = 0; i < header.extension_count; i++)
+    {
+        if (!header.extensions[i].data[0]) continue;
+        if (n++) fprintf(fp, ", ");
+        print_extension(fp, &header.extensions[i]);
+    }
+    fprintf(fp, "]}\n");
+
+    free_header(&header);
+    fclose(infp);
+
+    return 0;
+}
+
+/*
+ *  describe_worker
+ *
+ *  Description:
+ *      Worker pool function to describe one file of a batch.
+ *
+ *  Parameters:
+ *      context [in]
+ *          The info_batch.
+ *
+ *      item [in]
+ *          Index of the file within the batch.
+ *
+ *  Returns:
+ *      0 if successful, otherwise -1.
+ *
+ *  Comments:
+ *      The description is kept in memory until the batch is written.
+ */
+static int describe_worker(void *context, unsigned item)
+{
+    info_batch *batch = (info_batch *) context;
+    size_t size;
+    FILE *fp;
+    int rc;
+
+    if ((fp = open_memstream(&batch->lines[item], &size)) == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        batch->lines[item] = NULL;
+        return -1;
+    }
+
+    rc = describe_file(batch->paths[item], fp);
+
+    if (fclose(fp))
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        return -1;
+    }
+
+    return rc;
+}
+
+/*
+ *  flush_batch
+ *
+ *  Description:
+ *      Describe the files of a batch and write the descriptions in order.
+ *
+ *  Parameters:
+ *      batch [in/out]
+ *          The batch, which is emptied.
+ *
+ *  Returns:
+ *      Nothing; failures are noted in the batch.
+ *
+ *  Comments:
+ *      None.
+ */
+static void flush_batch(info_batch *batch)
+{
+    unsigned i;
+
+    if (run_workers(batch->jobs, batch->count, describe_worker, batch))
+    {
+        batch->rc = -1;
+    }
+
+    for (i = 0; i < batch->count; i++)
+    {
+        if (batch->lines[i] != NULL) fputs(batch->lines[i], stdout);
+        free(batch->lines[i]);
+        free(batch->paths[i]);
+    }
+    batch->count = 0;
+}
+
+/*
+ *  add_file
+ *
+ *  Description:
+ *      Add a file to the batch, describing the batch once it is full.
+ *
+ *  Parameters:
+ *      batch [in/out]
+ *          The batch.
+ *
+ *      path [in]
+ *          The file.
+ *
+ *  Returns:
+ *      Nothing; failures are noted in the batch.
+ *
+ *  Comments:
+ *      None.
+ */
+static void add_file(info_batch *batch, const char *path)
+{
+    if ((batch->paths[batch->count] = strdup(path)) == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        batch->rc = -1;
+        return;
+    }
+    batch->lines[batch->count] = NULL;
+
+    if (++batch->count == INFO_BATCH_SIZE) flush_batch(batch);
+}
+
+/*
+ *  walk_directory
+ *
+ *  Description:
+ *      Add each file ending in .aes within a directory and its
+ *      subdirectories to the batch.
+ *
+ *  Parameters:
+ *      batch [in/out]
+ *          The batch.
+ *
+ *      path [in]
+ *          The directory.
+ *
+ *  Returns:
+ *      Nothing; failures are noted in the batch.
+ *
+ *  Comments:
+ *      Symbolic links are not followed.
+ */
+static void walk_directory(info_batch *batch, const char *path)
+{
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    char *child;
+    size_t length, path_length = strlen(path);
+
+    if ((dir = opendir(path)) == NULL)
+    {
+        fprintf(stderr, "Error opening directory %s : ", path);
+        perror("");
+        batch->rc = -1;
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+        {
+            continue;
+        }
+
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW))
+        {
+            fprintf(stderr, "Error reading %s/%s : ", path, entry->d_name);
+            perror("");
+            batch->rc = -1;
+            continue;
+        }
+
+        length = strlen(entry->d_name);
+        if (!S_ISDIR(st.st_mode) &&
+            (!S_ISREG(st.st_mode) || (length <= AES_CRYPT_EXTENSION_LEN) ||
+             strcmp(entry->d_name + length - AES_CRYPT_EXTENSION_LEN,
+                    AES_CRYPT_EXTENSION)))
+        {
+            continue;
+        }
+
+        if ((child = malloc(path_length + length + 2)) == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            batch->rc = -1;
+            break;
+        }
+        sprintf(child,
+                "%s%s%s",
+                path,
+                (path_length && (path[path_length - 1] == '/')) ? "" : "/",
+                entry->d_name);
+
+        if (S_ISDIR(st.st_mode))
+        {
+            walk_directory(batch, child);
+        }
+        else
+        {
+            add_file(batch, child);
+        }
+        free(child);
+    }
+
+    closedir(dir);
+}
+
+/*
+ *  info_files
+ *
+ *  Description:
+ *      Describe AES Crypt files, and those found in directories, as lines
+ *      of JSON on stdout.
+ *
+ *  Parameters:
+ *      paths [in]
+ *          The files and directories.
+ *
+ *      count [in]
+ *          The number of paths.
+ *
+ *      jobs [in]
+ *          The number of files to describe concurrently (0 for default).
+ *
+ *  Returns:
+ *      0 if every file was described, otherwise -1.
+ *
+ *  Comments:
+ *      No password is needed, as nothing is decrypted or authenticated.
+ *      Standard input cannot be described, as its size is not known.
+ */
+int info_files(char *const paths[], unsigned count, unsigned jobs)
+{
+    info_batch *batch;
+    struct stat st;
+    unsigned i;
+    int rc;
+
+    if ((batch = calloc(1, sizeof(info_batch))) == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        return -1;
+    }
+    batch->jobs = jobs;
+
+    for (i = 0; i < count; i++)
+    {
+        if (!strcmp(paths[i], "-"))
+        {
+            fprintf(stderr, "Error: --info requires input files\n");
+            batch->rc = -1;
+        }
+        else if (stat(paths[i], &st))
+        {
+            fprintf(stderr, "Error opening input file %s : ", paths[i]);
+            perror("");
+            batch->rc = -1;
+        }
+        else if (S_ISDIR(st.st_mode))
+        {
+            walk_directory(batch, paths[i]);
+        }
+        else
+        {
+            add_file(batch, paths[i]);
+        }
+    }
+    if (batch->count) flush_batch(batch);
+
+    if (fflush(stdout))
+    {
+        perror("Error writing the file descriptions");
+        batch->rc = -1;
+    }
+
+    rc = batch->rc;
+    free(batch);
+
+    return rc;
+}
@@ -0,0 +1,24 @@
+/*
+ *  info.h
+ *
+ *  File Inspection for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to describe AES Crypt files from their headers and sizes
+ *      alone, without a password.
+ *
+ *  Portability Issues:
+ *      Requires pread(), open_memstream(), and POSIX directory functions.
+ */
+
+#ifndef AESCRYPT_INFO_H
+#define AESCRYPT_INFO_H
+
+#define INFO_BATCH_SIZE             1024    /* Files described together */
+
+// Function prototypes
+int info_files(char *const paths[], unsigned count, unsigned jobs);
+
+#endif // AESCRYPT_INFO_H
@@ -0,0 +1,344 @@
+/*
+ *  journal.c
+ *
+ *  Update Journal for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to record the octets of an AES Crypt file that an append
+ *      or a password change is about to rewrite so that an interrupted
+ *      update can be rolled back.
+ *
+ *      An append only ever changes the file from a given offset onward,
+ *      and what it replaces is short: at most the final ciphertext block,
+ *      the file size modulo, and the HMAC.  The journal holds that offset,
+ *      the original file size, and the original octets from the offset to
+ *      the end of the file:
+ *
+ *          "AES-JOURNAL" || 0x00 0x00 0x00 || 0x00 || type (1) ||
+ *          offset (8) || size (8) || tail (size - offset)
+ *
+ *      A password change rewrites a fixed region within the file instead,
+ *      and its journal (type 2) holds that region in place of the tail,
+ *      with size being the offset of the end of the region.  Restoring it
+ *      rewrites the region without truncating the file.
+ *
+ *      The journal holds nothing that is not already in the file.  It is
+ *      written to a temporary file that is renamed into place so that a
+ *      journal is never partial.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>    // mkstemp
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>    // fsync, ftruncate, pread, pwrite
+#include <sys/stat.h>
+
+#include "aescrypt.h"
+#include "journal.h"
+
+#define JOURNAL_MAGIC               "AES-JOURNAL\0\0\0\0"
+#define JOURNAL_MAGIC_LEN           15
+#define JOURNAL_HEADER_LEN          32
+
+// Journal types: the tail of the file or a region within it
+#define JOURNAL_TAIL                1
+#define JOURNAL_REGION              2
+
+#define JOURNAL_MAX_DATA            (JOURNAL_MAX_TAIL > JOURNAL_MAX_REGION ? \
+                                     JOURNAL_MAX_TAIL : JOURNAL_MAX_REGION)
+
+/*
+ *  write_journal
+ *
+ *  Description:
+ *      Write a journal holding the given octets of the file.
+ *
+ *  Parameters:
+ *      filename [in]
+ *          The journal file to create.
+ *
+ *      fp [in]
+ *          The file whose octets are recorded.  Its position is not
+ *          changed.
+ *
+ *      type [in]
+ *          JOURNAL_TAIL or JOURNAL_REGION.
+ *
+ *      offset [in]
+ *          The offset of the octets to record.
+ *
+ *      end [in]
+ *          The offset following the octets to record.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      The journal is on disk when this function returns.
+ */
+static int write_journal(const char *filename,
+                         FILE *fp,
+                         unsigned char type,
+                         off_t offset,
+                         off_t end)
+{
+    unsigned char buffer[JOURNAL_HEADER_LEN + JOURNAL_MAX_DATA];
+    char tmpfile[AES_CRYPT_MAX_PATH];
+    size_t length;
+    FILE *jfp;
+    int fd;
+    int i;
+    int rc = 0;
+
+    length = (size_t) (end - offset);
+
+    memcpy(buffer, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN);
+    buffer[JOURNAL_MAGIC_LEN] = type;
+    for (i = 0; i < 8; i++)
+    {
+        buffer[16 + i] = (unsigned char) ((offset >> (56 - i * 8)) & 0xFF);
+        buffer[24 + i] = (unsigned char) ((end >> (56 - i * 8)) & 0xFF);
+    }
+
+    if (pread(fileno(fp),
+              buffer + JOURNAL_HEADER_LEN,
+              length,
+              offset) != (ssize_t) length)
+    {
+        fprintf(stderr, "Error: Could not read the output file\n");
+        return -1;
+    }
+    length += JOURNAL_HEADER_LEN;
+
+    if (snprintf(tmpfile,
+                 AES_CRYPT_MAX_PATH,
+                 "%s.XXXXXX",
+                 filename) >= AES_CRYPT_MAX_PATH)
+    {
+        fprintf(stderr, "Journal file pathname too long\n");
+        return -1;
+    }
+
+    if ((fd = mkstemp(tmpfile)) < 0)
+    {
+        fprintf(stderr, "Error creating journal file %s : ", tmpfile);
+        perror("");
+        return -1;
+    }
+
+    if ((jfp = fdopen(fd, "w")) == NULL)
+    {
+        perror("Error opening journal file");
+        close(fd);
+        unlink(tmpfile);
+        return -1;
+    }
+
+    if ((fwrite(buffer, 1, length, jfp) != length) ||
+        fflush(jfp) ||
+        fsync(fileno(jfp)))
+    {
+        fprintf(stderr, "Error: Could not write journal file\n");
+        rc = -1;
+    }
+    if (fclose(jfp)) rc = -1;
+
+    if (!rc && rename(tmpfile, filename))
+    {
+        fprintf(stderr, "Error renaming %s to %s : ", tmpfile, filename);
+        perror("");
+        rc = -1;
+    }
+
+    if (rc) unlink(tmpfile);
+
+    return rc;
+}
+
+/*
+ *  save_journal
+ *
+ *  Description:
+ *      Record the octets of the file from the given offset to the end so
+ *      that the file can be restored with restore_journal().
+ *
+ *  Parameters:
+ *      filename [in]
+ *          The journal file to create.
+ *
+ *      fp [in]
+ *          The file whose tail is recorded.  Its position is not changed.
+ *
+ *      offset [in]
+ *          The offset from which the file will be changed.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      The journal is on disk when this function returns.
+ */
+int save_journal(const char *filename, FILE *fp, off_t offset)
+{
+    struct stat st;
+
+    if (fflush(fp) || fstat(fileno(fp), &st))
+    {
+        perror("Error determining the output file size");
+        return -1;
+    }
+
+    if ((offset > st.st_size) || (st.st_size - offset > JOURNAL_MAX_TAIL))
+    {
+        fprintf(stderr, "Error: Invalid journal range\n");
+        return -1;
+    }
+
+    return write_journal(filename, fp, JOURNAL_TAIL, offset, st.st_size);
+}
+
+/*
+ *  save_region_journal
+ *
+ *  Description:
+ *      Record the octets of the given region of the file so that the
+ *      region can be restored with restore_journal().
+ *
+ *  Parameters:
+ *      filename [in]
+ *          The journal file to create.
+ *
+ *      fp [in]
+ *          The file whose region is recorded.  Its position is not
+ *          changed.
+ *
+ *      offset [in]
+ *          The offset of the region.
+ *
+ *      length [in]
+ *          The length of the region.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      The journal is on disk when this function returns.
+ */
+int save_region_journal(const char *filename,
+                        FILE *fp,
+                        off_t offset,
+                        size_t length)
+{
+    if ((offset < 0) || (length > JOURNAL_MAX_REGION))
+    {
+        fprintf(stderr, "Error: Invalid journal range\n");
+        return -1;
+    }
+
+    if (fflush(fp))
+    {
+        perror("Error flushing the output file");
+        return -1;
+    }
+
+    return write_journal(filename,
+                         fp,
+                         JOURNAL_REGION,
+                         offset,
+                         offset + (off_t) length);
+}
+
+/*
+ *  restore_journal
+ *
+ *  Description:
+ *      Restore the file to the state recorded by save_journal() or
+ *      save_region_journal() and remove the journal.
+ *
+ *  Parameters:
+ *      filename [in]
+ *          The journal file.
+ *
+ *      fp [in]
+ *          The file to restore.  Its position is undefined afterward.
+ *
+ *  Returns:
+ *      0 if the file was restored, 1 if there is no journal, or -1 if
+ *      there was an error.
+ *
+ *  Comments:
+ *      Restoring is idempotent, so an interrupted restore may be repeated.
+ */
+int restore_journal(const char *filename, FILE *fp)
+{
+    unsigned char buffer[JOURNAL_HEADER_LEN + JOURNAL_MAX_DATA + 1];
+    unsigned char type = 0;
+    off_t offset = 0;
+    off_t size = 0;
+    size_t length;
+    FILE *jfp;
+    int i;
+
+    if ((jfp = fopen(filename, "r")) == NULL)
+    {
+        if (errno == ENOENT) return 1;
+        fprintf(stderr, "Error opening journal file %s : ", filename);
+        perror("");
+        return -1;
+    }
+
+    length = fread(buffer, 1, sizeof(buffer), jfp);
+    fclose(jfp);
+
+    if ((length >= JOURNAL_HEADER_LEN) &&
+        !memcmp(buffer, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN))
+    {
+        type = buffer[JOURNAL_MAGIC_LEN];
+        for (i = 0; i < 8; i++)
+        {
+            offset = (offset << 8) | buffer[16 + i];
+            size = (size << 8) | buffer[24 + i];
+        }
+    }
+
+    if ((length < JOURNAL_HEADER_LEN) ||
+        ((type != JOURNAL_TAIL) && (type != JOURNAL_REGION)) ||
+        (offset < 0) ||
+        (size < offset) ||
+        (size - offset != (off_t) (length - JOURNAL_HEADER_LEN)))
+    {
+        fprintf(stderr, "Error: %s is not a valid journal file\n", filename);
+        return -1;
+    }
+    length -= JOURNAL_HEADER_LEN;
+
+    // Only the tail of a file is truncated; a region is just rewritten
+    if (fflush(fp) ||
+        ((type == JOURNAL_TAIL) && ftruncate(fileno(fp), offset)) ||
+        (pwrite(fileno(fp),
+                buffer + JOURNAL_HEADER_LEN,
+                length,
+                offset) != (ssize_t) length) ||
+        fsync(fileno(fp)))
+    {
+        perror("Error restoring file from journal");
+        return -1;
+    }
+
+    if (unlink(filename))
+    {
+        fprintf(stderr, "Error removing journal file %s : ", filename);
+        perror("");
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ *  journal.h
+ *
+ *  Update Journal for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to record the octets of an AES Crypt file that an append
+ *      or a password change is about to rewrite so that an interrupted
+ *      update can be rolled back.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#ifndef AESCRYPT_JOURNAL_H
+#define AESCRYPT_JOURNAL_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+// Format used to name the journal from the name of the file updated
+#define JOURNAL_FILE_FORMAT         "%s.journal"
+
+// The most octets replaced by an append: last block, modulo, and HMAC
+#define JOURNAL_MAX_TAIL            (16 + 1 + 32)
+
+// The most octets replaced by a password change: IV, session IV and key, HMAC
+#define JOURNAL_MAX_REGION          (16 + 48 + 32)
+
+// Function prototypes
+int save_journal(const char *filename, FILE *fp, off_t offset);
+int save_region_journal(const char *filename,
+                        FILE *fp,
+                        off_t offset,
+                        size_t length);
+int restore_journal(const char *filename, FILE *fp);
+
+#endif // AESCRYPT_JOURNAL_H
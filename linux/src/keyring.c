@@ -0,0 +1,514 @@
+/*
+ *  keyring.c
+ *
+ *  Key Ring for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to hold several passwords and key files and to choose
+ *      the one that decrypts a given file.
+ *
+ *      Rather than decrypting a file with each password in turn, the key
+ *      for every password is derived from the file's IV at once, using
+ *      derive_keys() to hash several passwords in parallel, and the
+ *      password whose key verifies the HMAC over the wrapped session IV
+ *      and key is chosen.  The key derived is remembered so decryption
+ *      does not derive it again.  The password chosen for the files of
+ *      each directory is tried first, and alone, for the next file in
+ *      that directory, as files encrypted together usually share one.
+ *
+ *      A key ring file names key files, one per line, relative to the
+ *      directory of the key ring file unless given as absolute paths.
+ *      Empty lines and lines starting with "#" are ignored.
+ *
+ *  Portability Issues:
+ *      Requires pread().
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>  // pread
+
+#include "aescrypt.h"
+#include "header.h"
+#include "keyfile.h"
+#include "password.h"
+#include "session.h"
+#include "keyring.h"
+#include "util.h"
+
+// Size of the region read: IV, wrapped session IV and key, HMAC
+#define KEYRING_REGION_LEN (16 + AES_CRYPT_SESSION_LEN + 32)
+
+typedef struct {
+    char directory[AES_CRYPT_MAX_PATH];
+    unsigned index;                 // Password chosen for its files
+} keyring_cache_entry;
+
+static unsigned char keys[KEYRING_MAX_KEYS][MAX_PASSWD_BUF];
+static int lengths[KEYRING_MAX_KEYS];
+static unsigned key_count;
+static keyring_cache_entry cache[KEYRING_CACHE_DIRS];
+static unsigned cache_count;
+static unsigned cache_next;         // Entry replaced once the cache is full
+
+/*
+ *  keyring_add
+ *
+ *  Description:
+ *      Add a password to the key ring.
+ *
+ *  Parameters:
+ *      passwd [in]
+ *          The UTF-16LE encoded password.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *  Returns:
+ *      0 if successful, otherwise -1.
+ *
+ *  Comments:
+ *      The passwords are erased when the program exits.
+ */
+int keyring_add(const unsigned char *passwd, int passlen)
+{
+    if (key_count == KEYRING_MAX_KEYS)
+    {
+        fprintf(stderr,
+                "Error: at most %u passwords and key files may be given\n",
+                KEYRING_MAX_KEYS);
+        return -1;
+    }
+
+    if (!key_count) atexit(keyring_clear);
+
+    memcpy(keys[key_count], passwd, passlen);
+    lengths[key_count++] = passlen;
+
+    return 0;
+}
+
+/*
+ *  keyring_add_password
+ *
+ *  Description:
+ *      Add a password given in the encoding of the current locale to the
+ *      key ring.
+ *
+ *  Parameters:
+ *      password [in]
+ *          The password.
+ *
+ *  Returns:
+ *      0 if successful, otherwise -1.
+ *
+ *  Comments:
+ *      None.
+ */
+int keyring_add_password(const char *password)
+{
+    unsigned char passwd[MAX_PASSWD_BUF];
+    int passlen;
+    int rc;
+
+    passlen = passwd_to_utf16((unsigned char *) password,
+                              strlen(password),
+                              MAX_PASSWD_LEN,
+                              passwd);
+    rc = (passlen < 0) ? -1 : keyring_add(passwd, passlen);
+
+    // For security reasons, erase the password
+    secure_erase(passwd, sizeof(passwd));
+
+    return rc;
+}
+
+/*
+ *  keyring_add_keyfile
+ *
+ *  Description:
+ *      Add the password in a key file to the key ring.
+ *
+ *  Parameters:
+ *      keyfile [in]
+ *          The pathname of the key file.
+ *
+ *  Returns:
+ *      0 if successful, otherwise -1.
+ *
+ *  Comments:
+ *      None.
+ */
+int keyring_add_keyfile(char *keyfile)
+{
+    unsigned char passwd[MAX_PASSWD_BUF];
+    int passlen;
+    int rc;
+
+    if ((passlen = ReadKeyFile(keyfile, passwd)) < 0) return -1;
+
+    rc = keyring_add(passwd, passlen);
+
+    // For security reasons, erase the password
+    secure_erase(passwd, sizeof(passwd));
+
+    return rc;
+}
+
+/*
+ *  keyring_load
+ *
+ *  Description:
+ *      Add the passwords in the key files named by a key ring file.
+ *
+ *  Parameters:
+ *      filename [in]
+ *          The pathname of the key ring file.
+ *
+ *  Returns:
+ *      0 if successful, otherwise -1.
+ *
+ *  Comments:
+ *      Relative key file names are relative to the key ring file.
+ */
+int keyring_load(const char *filename)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    char path[AES_CRYPT_MAX_PATH];
+    const char *slash = strrchr(filename, '/');
+    int directory_length = (slash != NULL) ? (slash - filename) + 1 : 0;
+    int rc = 0;
+
+    if ((fp = fopen(filename, "r")) == NULL)
+    {
+        fprintf(stderr, "Error opening key ring %s : ", filename);
+        perror("");
+        return -1;
+    }
+
+    while (!rc && ((length = getline(&line, &size, fp)) >= 0))
+    {
+        while ((length > 0) &&
+               ((line[length - 1] == '\n') || (line[length - 1] == '\r')))
+        {
+            line[--length] = '\0';
+        }
+        if (!length || (line[0] == '#')) continue;
+
+        if (snprintf(path,
+                     sizeof(path),
+                     "%.*s%s",
+                     (line[0] == '/') ? 0 : directory_length,
+                     filename,
+                     line) >= (int) sizeof(path))
+        {
+            fprintf(stderr, "Error: key file pathname too long\n");
+            rc = -1;
+        }
+        else if (keyring_add_keyfile(path))
+        {
+            fprintf(stderr, "Error: unable to read %s in %s\n",
+                    path, filename);
+            rc = -1;
+        }
+    }
+
+    if (!rc && ferror(fp))
+    {
+        fprintf(stderr, "Error reading key ring %s\n", filename);
+        rc = -1;
+    }
+
+    free(line);
+    fclose(fp);
+
+    return rc;
+}
+
+/*
+ *  keyring_count
+ *
+ *  Description:
+ *      Return the number of passwords in the key ring.
+ *
+ *  Parameters:
+ *      None.
+ *
+ *  Returns:
+ *      The number of passwords.
+ *
+ *  Comments:
+ *      None.
+ */
+unsigned keyring_count(void)
+{
+    return key_count;
+}
+
+/*
+ *  keyring_get
+ *
+ *  Description:
+ *      Copy a password from the key ring.
+ *
+ *  Parameters:
+ *      index [in]
+ *          The password, in the order added.
+ *
+ *      passwd [out]
+ *          A buffer of at least MAX_PASSWD_BUF octets for the password.
+ *
+ *  Returns:
+ *      The length of the password in octets.
+ *
+ *  Comments:
+ *      None.
+ */
+int keyring_get(unsigned index, unsigned char *passwd)
+{
+    memcpy(passwd, keys[index], lengths[index]);
+
+    return lengths[index];
+}
+
+/*
+ *  find_cached
+ *
+ *  Description:
+ *      Find the cache entry for the directory of a file.
+ *
+ *  Parameters:
+ *      filename [in]
+ *          The pathname of the file.
+ *
+ *      directory [out]
+ *          The directory of the file.
+ *
+ *  Returns:
+ *      The cache entry, or NULL if there is none.
+ *
+ *  Comments:
+ *      None.
+ */
+static keyring_cache_entry *find_cached(const char *filename,
+                                        char directory[AES_CRYPT_MAX_PATH])
+{
+    const char *slash = strrchr(filename, '/');
+    unsigned i;
+
+    snprintf(directory,
+             AES_CRYPT_MAX_PATH,
+             "%.*s",
+             (slash != NULL) ? (int) (slash - filename) : 0,
+             filename);
+
+    for (i = 0; i < cache_count; i++)
+    {
+        if (!strcmp(cache[i].directory, directory)) return &cache[i];
+    }
+
+    return NULL;
+}
+
+/*
+ *  keyring_select
+ *
+ *  Description:
+ *      Choose the password in the key ring that decrypts a file.
+ *
+ *  Parameters:
+ *      filename [in]
+ *          The pathname of the AES Crypt file.
+ *
+ *      passwd [out]
+ *          A buffer of at least MAX_PASSWD_BUF octets for the password.
+ *
+ *  Returns:
+ *      The length of the password in octets, or -1 if no password
+ *      decrypts the file or there was an error.
+ *
+ *  Comments:
+ *      Passwords are hashed in batches of similar length so the lanes of
+ *      derive_keys() do equal work (version 3 lanes always do).  Version 0
+ *      files have no session key to verify, so a key ring cannot be used
+ *      with them.
+ */
+int keyring_select(const char *filename, unsigned char *passwd)
+{
+    FILE *fp;
+    aescrypt_header header;
+    unsigned char region[KEYRING_REGION_LEN];
+    unsigned char derived[KDF_LANES][32];
+    unsigned char iv_key[AES_CRYPT_SESSION_LEN];
+    const unsigned char *batch[KDF_LANES];
+    int batch_lengths[KDF_LANES];
+    unsigned order[KEYRING_MAX_KEYS];
+    unsigned indices[KDF_LANES];
+    char directory[AES_CRYPT_MAX_PATH];
+    keyring_cache_entry *entry;
+    unsigned i, j, next, count, found = key_count;
+    unsigned long iterations;
+    unsigned char version;
+    int rc = -1;
+
+    if ((fp = fopen(filename, "r")) == NULL)
+    {
+        fprintf(stderr, "Error opening input file %s : ", filename);
+        perror("");
+        return -1;
+    }
+
+    if (read_header(fp, &header))
+    {
+        free_header(&header);
+        fclose(fp);
+        return -1;
+    }
+
+    if (header.hdr.version < 0x01)
+    {
+        fprintf(stderr,
+                "Error: %s is a version 0 file, which requires a single "
+                "password\n",
+                filename);
+        free_header(&header);
+        fclose(fp);
+        return -1;
+    }
+
+    if (pread(fileno(fp), region, sizeof(region), header.iv_offset) !=
+        (ssize_t) sizeof(region))
+    {
+        fprintf(stderr, "Error: Input file is too short.\n");
+        free_header(&header);
+        fclose(fp);
+        return -1;
+    }
+    version = header.hdr.version;
+    iterations = header.kdf_iterations;
+    free_header(&header);
+    fclose(fp);
+
+    // Try the password chosen for the last file in the same directory
+    if ((entry = find_cached(filename, directory)) != NULL)
+    {
+        derive_key(region, keys[entry->index], lengths[entry->index],
+                   iterations, derived[0]);
+        if (!unwrap_session_key(derived[0],
+                                region,
+                                version,
+                                region + 16,
+                                region + 16 + AES_CRYPT_SESSION_LEN,
+                                iv_key))
+        {
+            found = entry->index;
+        }
+    }
+
+    // Otherwise try every other password, shortest first
+    for (i = 0; i < key_count; i++)
+    {
+        for (j = i; (j > 0) && (lengths[order[j - 1]] > lengths[i]); j--)
+        {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+    next = 0;
+    while ((found == key_count) && (next < key_count))
+    {
+        for (count = 0; (count < KDF_LANES) && (next < key_count); next++)
+        {
+            // The password already tried for the directory is skipped
+            if ((entry != NULL) && (order[next] == entry->index)) continue;
+            indices[count] = order[next];
+            batch[count] = keys[order[next]];
+            batch_lengths[count++] = lengths[order[next]];
+        }
+        if (!count) break;
+
+        derive_keys(region,
+                    batch,
+                    batch_lengths,
+                    count,
+                    iterations,
+                    derived);
+
+        for (j = 0; j < count; j++)
+        {
+            if (!unwrap_session_key(derived[j],
+                                    region,
+                                    version,
+                                    region + 16,
+                                    region + 16 + AES_CRYPT_SESSION_LEN,
+                                    iv_key))
+            {
+                found = indices[j];
+                memcpy(derived[0], derived[j], 32);
+                break;
+            }
+        }
+    }
+
+    if (found < key_count)
+    {
+        // Decryption need not derive the key again
+        remember_key(region,
+                     keys[found],
+                     lengths[found],
+                     iterations,
+                     derived[0]);
+        rc = keyring_get(found, passwd);
+
+        if (entry == NULL)
+        {
+            entry = &cache[cache_next];
+            cache_next = (cache_next + 1) % KEYRING_CACHE_DIRS;
+            if (cache_count < KEYRING_CACHE_DIRS) cache_count++;
+            strcpy(entry->directory, directory);
+        }
+        entry->index = found;
+    }
+    else
+    {
+        fprintf(stderr,
+                "Error: no password or key file given decrypts %s\n",
+                filename);
+    }
+
+    // For security reasons, erase the keys
+    secure_erase(derived, sizeof(derived));
+    secure_erase(iv_key, sizeof(iv_key));
+
+    return rc;
+}
+
+/*
+ *  keyring_clear
+ *
+ *  Description:
+ *      Erase the passwords in the key ring.
+ *
+ *  Parameters:
+ *      None.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      Called when the program exits.
+ */
+void keyring_clear(void)
+{
+    secure_erase(keys, sizeof(keys));
+    secure_erase(lengths, sizeof(lengths));
+    key_count = 0;
+}
@@ -0,0 +1,32 @@
+/*
+ *  keyring.h
+ *
+ *  Key Ring for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to hold several passwords and key files and to choose
+ *      the one that decrypts a given file.
+ *
+ *  Portability Issues:
+ *      Requires pread().
+ */
+
+#ifndef AESCRYPT_KEYRING_H
+#define AESCRYPT_KEYRING_H
+
+#define KEYRING_MAX_KEYS            64      /* Passwords held */
+#define KEYRING_CACHE_DIRS          16      /* Directories remembered */
+
+// Function prototypes
+int keyring_add(const unsigned char *passwd, int passlen);
+int keyring_add_password(const char *password);
+int keyring_add_keyfile(char *keyfile);
+int keyring_load(const char *filename);
+unsigned keyring_count(void);
+int keyring_get(unsigned index, unsigned char *passwd);
+int keyring_select(const char *filename, unsigned char *passwd);
+void keyring_clear(void);
+
+#endif // AESCRYPT_KEYRING_H
@@ -0,0 +1,499 @@
+/*
+ *  merkle.c
+ *
+ *  Merkle Tree Chunk Authentication for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to compute a keyed hash tree over fixed-size chunks of
+ *      the ciphertext so that chunks may be authenticated independently
+ *      and in parallel.
+ *
+ *      All hashes are HMAC-SHA256 using a key derived from the session
+ *      key as HMAC(session key, "MERKLE-SHA256"), so the tree cannot be
+ *      forged without the password.  With || denoting concatenation and
+ *      integers in network byte order:
+ *
+ *          leaf = HMAC(K, 0x00 || 64-bit chunk index || chunk ciphertext)
+ *          node = HMAC(K, 0x01 || left child || right child)
+ *          root = HMAC(K, 0x02 || 64-bit chunk count || top node)
+ *
+ *      Nodes are paired left to right at each level, with an unpaired
+ *      last node promoted to the next level unchanged.  For an empty
+ *      stream, the top node is 32 zero octets.
+ *
+ *      The root is stored in a "MERKLE-SHA256" extension holding the
+ *      32-bit chunk size followed by the root.  The leaf hashes may be
+ *      kept in a sidecar file so that any range can be authenticated by
+ *      hashing just the chunks covering it.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+
+#include "merkle.h"
+#include "util.h"
+
+/*
+ *  put_uint64
+ *
+ *  Description:
+ *      Store a 64-bit value in network byte order.
+ *
+ *  Parameters:
+ *      value [in]
+ *          The value to store.
+ *
+ *      buffer [out]
+ *          The 8-octet output buffer.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void put_uint64(unsigned long long value, unsigned char buffer[8])
+{
+    int i;
+
+    for (i = 7; i >= 0; i--)
+    {
+        buffer[i] = (unsigned char) (value & 0xff);
+        value >>= 8;
+    }
+}
+
+/*
+ *  merkle_node
+ *
+ *  Description:
+ *      Compute an interior node of the tree from its two children.
+ *
+ *  Parameters:
+ *      key [in]
+ *          The tree key.
+ *
+ *      left, right [in]
+ *          The child hashes.
+ *
+ *      node [out]
+ *          The node hash, which may overlap either child.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void merkle_node(const unsigned char key[32],
+                        const unsigned char left[32],
+                        const unsigned char right[32],
+                        unsigned char node[32])
+{
+    hmac_sha256_context hmac_ctx;
+    unsigned char prefix = 0x01;
+
+    hmac_sha256_starts(&hmac_ctx, key, 32);
+    hmac_sha256_update(&hmac_ctx, &prefix, 1);
+    hmac_sha256_update(&hmac_ctx, left, 32);
+    hmac_sha256_update(&hmac_ctx, right, 32);
+    hmac_sha256_finish(&hmac_ctx, node);
+}
+
+/*
+ *  merkle_key
+ *
+ *  Description:
+ *      Derive the tree key from the session key.
+ *
+ *  Parameters:
+ *      session_key [in]
+ *          The 32-octet key used to encrypt the stream contents.
+ *
+ *      key [out]
+ *          The tree key.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void merkle_key(const unsigned char session_key[32], unsigned char key[32])
+{
+    hmac_sha256_context hmac_ctx;
+
+    hmac_sha256_starts(&hmac_ctx, session_key, 32);
+    hmac_sha256_update(&hmac_ctx,
+                       (const unsigned char *) MERKLE_EXTENSION_ID,
+                       strlen(MERKLE_EXTENSION_ID));
+    hmac_sha256_finish(&hmac_ctx, key);
+}
+
+/*
+ *  merkle_starts
+ *
+ *  Description:
+ *      Initialize the context to compute the tree over a ciphertext stream.
+ *
+ *  Parameters:
+ *      ctx [out]
+ *          The context to initialize.
+ *
+ *      session_key [in]
+ *          The 32-octet key used to encrypt the stream contents.
+ *
+ *      chunk_size [in]
+ *          The size of each chunk in octets.
+ *
+ *      sidecar [in]
+ *          A stream to receive each leaf hash, or NULL.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void merkle_starts(merkle_context *ctx,
+                   const unsigned char session_key[32],
+                   unsigned chunk_size,
+                   FILE *sidecar)
+{
+    memset(ctx, 0, sizeof(merkle_context));
+
+    merkle_key(session_key, ctx->key);
+    ctx->chunk_size = chunk_size;
+    ctx->sidecar = sidecar;
+}
+
+/*
+ *  merkle_leaf
+ *
+ *  Description:
+ *      Compute the leaf hash of a single chunk.
+ *
+ *  Parameters:
+ *      key [in]
+ *          The tree key.
+ *
+ *      index [in]
+ *          The index of the chunk within the stream.
+ *
+ *      data [in]
+ *          The chunk ciphertext.
+ *
+ *      length [in]
+ *          The length of the chunk, which is shorter than the chunk size
+ *          only for the final chunk.
+ *
+ *      leaf [out]
+ *          The leaf hash.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void merkle_leaf(const unsigned char key[32],
+                 unsigned long long index,
+                 const unsigned char *data,
+                 unsigned long length,
+                 unsigned char leaf[32])
+{
+    hmac_sha256_context hmac_ctx;
+    unsigned char prefix[9];
+
+    prefix[0] = 0x00;
+    put_uint64(index, prefix + 1);
+
+    hmac_sha256_starts(&hmac_ctx, key, 32);
+    hmac_sha256_update(&hmac_ctx, prefix, sizeof(prefix));
+    hmac_sha256_update(&hmac_ctx, data, length);
+    hmac_sha256_finish(&hmac_ctx, leaf);
+}
+
+/*
+ *  merkle_push_leaf
+ *
+ *  Description:
+ *      Add the next leaf hash to the tree.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The tree context.
+ *
+ *      leaf [in]
+ *          The leaf hash.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The pending subtrees behave like a binary counter: a subtree of
+ *      height h is pending exactly when bit h of the leaf count is set.
+ */
+void merkle_push_leaf(merkle_context *ctx, const unsigned char leaf[32])
+{
+    unsigned char node[32];
+    unsigned level = 0;
+
+    memcpy(node, leaf, 32);
+
+    while ((ctx->count >> level) & 1)
+    {
+        merkle_node(ctx->key, ctx->stack[level], node, node);
+        level++;
+    }
+
+    memcpy(ctx->stack[level], node, 32);
+    ctx->count++;
+}
+
+/*
+ *  complete_leaf
+ *
+ *  Description:
+ *      Finish the leaf hash of the current chunk and add it to the tree.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The tree context.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error writing the sidecar.
+ *
+ *  Comments:
+ *      None.
+ */
+static int complete_leaf(merkle_context *ctx)
+{
+    unsigned char leaf[32];
+
+    hmac_sha256_finish(&ctx->leaf_ctx, leaf);
+    merkle_push_leaf(ctx, leaf);
+    ctx->fill = 0;
+
+    if ((ctx->sidecar != NULL) && (fwrite(leaf, 1, 32, ctx->sidecar) != 32))
+    {
+        fprintf(stderr, "Error: Could not write Merkle tree sidecar\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  merkle_update
+ *
+ *  Description:
+ *      Add ciphertext to the tree computation.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The tree context.
+ *
+ *      data [in]
+ *          The ciphertext.
+ *
+ *      length [in]
+ *          The length of the ciphertext in octets.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+int merkle_update(merkle_context *ctx,
+                  const unsigned char *data,
+                  unsigned long length)
+{
+    unsigned char prefix[9];
+    unsigned long n;
+
+    while (length > 0)
+    {
+        if (ctx->fill == 0)
+        {
+            prefix[0] = 0x00;
+            put_uint64(ctx->count, prefix + 1);
+            hmac_sha256_starts(&ctx->leaf_ctx, ctx->key, 32);
+            hmac_sha256_update(&ctx->leaf_ctx, prefix, sizeof(prefix));
+        }
+
+        n = ctx->chunk_size - ctx->fill;
+        if (n > length) n = length;
+
+        hmac_sha256_update(&ctx->leaf_ctx, data, n);
+        ctx->fill += n;
+        data += n;
+        length -= n;
+
+        if ((ctx->fill == ctx->chunk_size) && complete_leaf(ctx)) return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  merkle_finish
+ *
+ *  Description:
+ *      Complete the tree and produce the root.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The tree context, which is wiped on return.
+ *
+ *      root [out]
+ *          The root of the tree.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+int merkle_finish(merkle_context *ctx, unsigned char root[32])
+{
+    hmac_sha256_context hmac_ctx;
+    unsigned char top[32];
+    unsigned char prefix[9];
+    int have_top = 0;
+    unsigned level;
+    int rc = 0;
+
+    if (ctx->fill > 0) rc = complete_leaf(ctx);
+
+    // Fold the pending subtrees from the smallest to the largest
+    memset(top, 0, 32);
+    for (level = 0; level < 64; level++)
+    {
+        if (!((ctx->count >> level) & 1)) continue;
+
+        if (have_top)
+        {
+            merkle_node(ctx->key, ctx->stack[level], top, top);
+        }
+        else
+        {
+            memcpy(top, ctx->stack[level], 32);
+            have_top = 1;
+        }
+    }
+
+    prefix[0] = 0x02;
+    put_uint64(ctx->count, prefix + 1);
+
+    hmac_sha256_starts(&hmac_ctx, ctx->key, 32);
+    hmac_sha256_update(&hmac_ctx, prefix, sizeof(prefix));
+    hmac_sha256_update(&hmac_ctx, top, 32);
+    hmac_sha256_finish(&hmac_ctx, root);
+
+    secure_erase(ctx, sizeof(merkle_context));
+
+    return rc;
+}
+
+/*
+ *  merkle_build_container
+ *
+ *  Description:
+ *      Build the replacement for the 128-octet "container" extension
+ *      written by encrypt_stream(), holding the Merkle extension followed
+ *      by a smaller "container".
+ *
+ *  Parameters:
+ *      container [out]
+ *          The replacement octets, including the two-octet length fields.
+ *
+ *      chunk_size [in]
+ *          The size of each chunk in octets.
+ *
+ *      root [in]
+ *          The root of the tree.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void merkle_build_container(unsigned char container[MERKLE_CONTAINER_LEN],
+                            unsigned chunk_size,
+                            const unsigned char root[32])
+{
+    unsigned char *p = container;
+    unsigned remaining = MERKLE_CONTAINER_LEN - 2 - MERKLE_EXTENSION_LEN - 2;
+
+    memset(container, 0, MERKLE_CONTAINER_LEN);
+
+    *p++ = 0;
+    *p++ = MERKLE_EXTENSION_LEN;
+    memcpy(p, MERKLE_EXTENSION_ID, strlen(MERKLE_EXTENSION_ID) + 1);
+    p += strlen(MERKLE_EXTENSION_ID) + 1;
+    *p++ = (unsigned char) (chunk_size >> 24);
+    *p++ = (unsigned char) (chunk_size >> 16);
+    *p++ = (unsigned char) (chunk_size >> 8);
+    *p++ = (unsigned char) chunk_size;
+    memcpy(p, root, 32);
+    p += 32;
+
+    // What remains of the "container" is left for other extensions
+    *p++ = (unsigned char) (remaining >> 8);
+    *p++ = (unsigned char) remaining;
+}
+
+/*
+ *  merkle_parse_extension
+ *
+ *  Description:
+ *      Extract the chunk size and root from a Merkle extension.
+ *
+ *  Parameters:
+ *      extension [in]
+ *          The extension as returned by find_extension().
+ *
+ *      chunk_size [out]
+ *          The size of each chunk in octets.
+ *
+ *      root [out]
+ *          The root of the tree.
+ *
+ *  Returns:
+ *      0 if successful, -1 if the extension is malformed.
+ *
+ *  Comments:
+ *      None.
+ */
+int merkle_parse_extension(const aescrypt_extension *extension,
+                           unsigned *chunk_size,
+                           unsigned char root[32])
+{
+    const unsigned char *p;
+
+    if (extension->length != MERKLE_EXTENSION_LEN) return -1;
+
+    p = extension->data + strlen(MERKLE_EXTENSION_ID) + 1;
+    *chunk_size = ((unsigned) p[0] << 24) | ((unsigned) p[1] << 16) |
+                  ((unsigned) p[2] << 8) | (unsigned) p[3];
+    memcpy(root, p + 4, 32);
+
+    if ((*chunk_size < MERKLE_MIN_CHUNK_SIZE) ||
+        (*chunk_size > MERKLE_MAX_CHUNK_SIZE) ||
+        (*chunk_size % 16))
+    {
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ *  merkle.h
+ *
+ *  Merkle Tree Chunk Authentication for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to compute a keyed hash tree over fixed-size chunks of
+ *      the ciphertext so that chunks may be authenticated independently
+ *      and in parallel.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#ifndef AESCRYPT_MERKLE_H
+#define AESCRYPT_MERKLE_H
+
+#include <stdio.h>
+
+#include "hmac.h"
+#include "header.h"
+
+#define MERKLE_EXTENSION_ID         "MERKLE-SHA256"
+#define MERKLE_EXTENSION_LEN        (14 + 4 + 32)
+#define MERKLE_SIDECAR_EXTENSION    ".merkle"
+#define MERKLE_DEFAULT_CHUNK_SIZE   1048576
+#define MERKLE_MIN_CHUNK_SIZE       4096
+#define MERKLE_MAX_CHUNK_SIZE       67108864
+#define MERKLE_CONTAINER_LEN        130     /* Size of the "container" */
+
+typedef struct {
+    unsigned char key[32];          // Tree key derived from the session key
+    unsigned chunk_size;            // Size of each chunk in octets
+    unsigned long long count;       // Number of completed chunks
+    unsigned fill;                  // Octets in the current chunk
+    hmac_sha256_context leaf_ctx;   // HMAC over the current chunk
+    unsigned char stack[64][32];    // Pending subtree roots by height
+    FILE *sidecar;                  // Receives each leaf hash, if not NULL
+} merkle_context;
+
+// Function prototypes
+void merkle_key(const unsigned char session_key[32], unsigned char key[32]);
+void merkle_starts(merkle_context *ctx,
+                   const unsigned char session_key[32],
+                   unsigned chunk_size,
+                   FILE *sidecar);
+int merkle_update(merkle_context *ctx,
+                  const unsigned char *data,
+                  unsigned long length);
+int merkle_finish(merkle_context *ctx, unsigned char root[32]);
+void merkle_leaf(const unsigned char key[32],
+                 unsigned long long index,
+                 const unsigned char *data,
+                 unsigned long length,
+                 unsigned char leaf[32]);
+void merkle_push_leaf(merkle_context *ctx, const unsigned char leaf[32]);
+void merkle_build_container(unsigned char container[MERKLE_CONTAINER_LEN],
+                            unsigned chunk_size,
+                            const unsigned char root[32]);
+int merkle_parse_extension(const aescrypt_extension *extension,
+                           unsigned *chunk_size,
+                           unsigned char root[32]);
+
+#endif // AESCRYPT_MERKLE_H
@@ -0,0 +1,985 @@
+/*
+ *  microbench.c
+ *
+ *  Cryptographic Kernel Microbenchmark for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Measures the cryptographic kernels used by aescrypt in isolation:
+ *      single AES block encryption and decryption, AES-256-CBC as done by
+ *      the version 2 engine (with and without the running HMAC), the CTR
+ *      and tag kernels of chunked streams, SHA-256 compression, the HMAC
+ *      finalization, and the password key derivation of versions 2 and 3.
+ *      The same CBC and HMAC work is also measured through each crypto
+ *      provider built in (see provider.h), such as OpenSSL or the Linux
+ *      kernel crypto API, for comparison with the in-process kernels.
+ *
+ *      Kernels over a buffer are swept across buffer sizes from 16 octets
+ *      to 16 MiB, so that the effect of the data falling out of each level
+ *      of cache is visible.  Each measurement runs for a minimum time and
+ *      reports the time per operation, the throughput, and the cycles per
+ *      octet.  Where the kernel permits it (see perf_event_paranoid), the
+ *      hardware counters for cycles, instructions, L1 data cache read
+ *      misses, and branch misses are read as well; otherwise cycles are
+ *      counted using the time stamp counter, where there is one.
+ *
+ *      usage: microbench [-t <seconds>] [-m <max size>] [<kernel> ...]
+ *
+ *  Portability Issues:
+ *      Hardware counters require Linux.  Without them, cycles are counted
+ *      only on x86.
+ */
+
+#define _GNU_SOURCE    // syscall
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "aescrypt.h"
+#include "hmac.h"
+#include "session.h"
+#include "chunked.h"
+#include "provider.h"
+
+#define MIN_SIZE                    16
+#define MAX_SIZE                    16777216
+#define DEFAULT_MIN_TIME            0.25    /* Seconds per measurement */
+#define BATCH_OCTETS                65536   /* Octets between clock reads */
+
+// Hardware counters, in the order they are read
+enum {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_L1D_MISSES,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_COUNT
+};
+
+typedef struct {
+    int fd[COUNTER_COUNT];          // Descriptors, or -1 if unavailable
+    uint64_t value[COUNTER_COUNT];  // Counts over the last measurement
+} counters;
+
+typedef struct {
+    aes_context aes_ctx;
+    hmac_sha256_context hmac_ctx;
+    chunked_keys keys;
+    unsigned char IV[16];
+    unsigned char passwd[32];
+    unsigned char *buffer;
+    crypto_context crypto;          // Started for the provider kernels
+    int crypto_started;
+} bench_state;
+
+typedef void (*kernel_function)(bench_state *state, size_t size);
+
+typedef struct {
+    const char *name;
+    kernel_function function;
+    int sweep;                      // Swept over buffer sizes, else one op
+    size_t size;                    // Octets per op when not swept
+} kernel;
+
+/*
+ *  aes_encrypt_kernel, aes_decrypt_kernel
+ *
+ *  Description:
+ *      Encrypt or decrypt a single block.
+ *
+ *  Parameters:
+ *      state [in/out]
+ *          The benchmark state.
+ *
+ *      size [in]
+ *          Unused.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void aes_encrypt_kernel(bench_state *state, size_t size)
+{
+    (void) size;
+    aes_encrypt(&state->aes_ctx, state->buffer, state->buffer);
+}
+
+static void aes_decrypt_kernel(bench_state *state, size_t size)
+{
+    (void) size;
+    aes_decrypt(&state->aes_ctx, state->buffer, state->buffer);
+}
+
+/*
+ *  cbc_encrypt_kernel
+ *
+ *  Description:
+ *      Encrypt a buffer in CBC mode as encrypt_blocks() in stream.c does,
+ *      optionally computing the HMAC over the ciphertext as well.
+ *
+ *  Parameters:
+ *      state [in/out]
+ *          The benchmark state.
+ *
+ *      size [in]
+ *          The size of the buffer.
+ *
+ *      hmac [in]
+ *          Non-zero to update the HMAC.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void cbc_encrypt_kernel(bench_state *state, size_t size, int hmac)
+{
+    unsigned char *block;
+    unsigned i;
+
+    for (block = state->buffer; size >= 16; block += 16, size -= 16)
+    {
+        for (i = 0; i < 16; i++) block[i] ^= state->IV[i];
+        aes_encrypt(&state->aes_ctx, block, block);
+        if (hmac) hmac_sha256_update(&state->hmac_ctx, block, 16);
+        memcpy(state->IV, block, 16);
+    }
+}
+
+static void cbc_encrypt_only(bench_state *state, size_t size)
+{
+    cbc_encrypt_kernel(state, size, 0);
+}
+
+static void cbc_encrypt_hmac(bench_state *state, size_t size)
+{
+    cbc_encrypt_kernel(state, size, 1);
+}
+
+/*
+ *  cbc_decrypt_kernel
+ *
+ *  Description:
+ *      Decrypt a buffer in CBC mode as decrypt_body() in stream.c does,
+ *      computing the HMAC over the ciphertext.
+ *
+ *  Parameters:
+ *      state [in/out]
+ *          The benchmark state.
+ *
+ *      size [in]
+ *          The size of the buffer.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void cbc_decrypt_kernel(bench_state *state, size_t size)
+{
+    unsigned char ciphertext[16];
+    unsigned char *block;
+    unsigned i;
+
+    for (block = state->buffer; size >= 16; block += 16, size -= 16)
+    {
+        memcpy(ciphertext, block, 16);
+        hmac_sha256_update(&state->hmac_ctx, block, 16);
+        aes_decrypt(&state->aes_ctx, block, block);
+        for (i = 0; i < 16; i++) block[i] ^= state->IV[i];
+        memcpy(state->IV, ciphertext, 16);
+    }
+}
+
+/*
+ *  ctr_kernel, tag_kernel
+ *
+ *  Description:
+ *      Encrypt a buffer as a chunk of a chunked stream, or compute the
+ *      tag over it.
+ *
+ *  Parameters:
+ *      state [in/out]
+ *          The benchmark state.
+ *
+ *      size [in]
+ *          The size of the buffer.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void ctr_kernel(bench_state *state, size_t size)
+{
+    chunked_crypt(&state->keys, 0, state->buffer, size);
+}
+
+static void tag_kernel(bench_state *state, size_t size)
+{
+    unsigned char tag[CHUNKED_TAG_LEN];
+
+    chunked_tag(&state->keys, 0, 0, state->buffer, size, tag);
+}
+
+/*
+ *  sha256_kernel
+ *
+ *  Description:
+ *      Hash a buffer with SHA-256.
+ *
+ *  Parameters:
+ *      state [in/out]
+ *          The benchmark state.
+ *
+ *      size [in]
+ *          The size of the buffer.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The buffer sizes are multiples of the block size, so this measures
+ *      the compression function.
+ */
+static void sha256_kernel(bench_state *state, size_t size)
+{
+    sha256_update(&state->hmac_ctx.sha_ctx, state->buffer, (uint32) size);
+}
+
+/*
+ *  hmac_finish_kernel
+ *
+ *  Description:
+ *      Finish an HMAC-SHA256 computation.
+ *
+ *  Parameters:
+ *      state [in/out]
+ *          The benchmark state.
+ *
+ *      size [in]
+ *          Unused.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      A started context is copied first, as finishing consumes it.
+ */
+static void hmac_finish_kernel(bench_state *state, size_t size)
+{
+    hmac_sha256_context hmac_ctx = state->hmac_ctx;
+
+    (void) size;
+    hmac_sha256_finish(&hmac_ctx, state->buffer);
+}
+
+/*
+ *  kdf_kernel
+ *
+ *  Description:
+ *      Derive the key from the password and IV.
+ *
+ *  Parameters:
+ *      state [in/out]
+ *          The benchmark state.
+ *
+ *      size [in]
+ *          Unused.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void kdf_kernel(bench_state *state, size_t size)
+{
+    (void) size;
+    derive_key(state->IV,
+               state->passwd,
+               sizeof(state->passwd),
+               0,
+               state->buffer);
+}
+
+/*
+ *  kdf_lanes_kernel
+ *
+ *  Description:
+ *      Derive the keys for KDF_LANES passwords at once, as a key ring does.
+ *
+ *  Parameters:
+ *      state [in/out]
+ *          The benchmark state.
+ *
+ *      size [in]
+ *          Unused.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The same password is used in every lane.
+ */
+static void kdf_lanes_kernel(bench_state *state, size_t size)
+{
+    const unsigned char *passwds[KDF_LANES];
+    int passlens[KDF_LANES];
+    unsigned char keys[KDF_LANES][32];
+    unsigned i;
+
+    (void) size;
+    for (i = 0; i < KDF_LANES; i++)
+    {
+        passwds[i] = state->passwd;
+        passlens[i] = sizeof(state->passwd);
+    }
+    derive_keys(state->IV, passwds, passlens, KDF_LANES, 0, keys);
+    memcpy(state->buffer, keys[0], 32);
+}
+
+/*
+ *  pbkdf2_kernel
+ *
+ *  Description:
+ *      Derive the key of a version 3 stream from the password and IV with
+ *      the default iteration count.
+ *
+ *  Parameters:
+ *      state [in/out]
+ *          The benchmark state.
+ *
+ *      size [in]
+ *          Unused.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void pbkdf2_kernel(bench_state *state, size_t size)
+{
+    (void) size;
+    derive_key(state->IV,
+               state->passwd,
+               sizeof(state->passwd),
+               AES_CRYPT_V3_ITERATIONS,
+               state->buffer);
+}
+
+/*
+ *  pbkdf2_lanes_kernel
+ *
+ *  Description:
+ *      Derive the keys of a version 3 stream for KDF_LANES passwords at
+ *      once, as a key ring does.
+ *
+ *  Parameters:
+ *      state [in/out]
+ *          The benchmark state.
+ *
+ *      size [in]
+ *          Unused.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The same password is used in every lane.
+ */
+static void pbkdf2_lanes_kernel(bench_state *state, size_t size)
+{
+    const unsigned char *passwds[KDF_LANES];
+    int passlens[KDF_LANES];
+    unsigned char keys[KDF_LANES][32];
+    unsigned i;
+
+    (void) size;
+    for (i = 0; i < KDF_LANES; i++)
+    {
+        passwds[i] = state->passwd;
+        passlens[i] = sizeof(state->passwd);
+    }
+    derive_keys(state->IV,
+                passwds,
+                passlens,
+                KDF_LANES,
+                AES_CRYPT_V3_ITERATIONS,
+                keys);
+    memcpy(state->buffer, keys[0], 32);
+}
+
+/*
+ *  provider_kernel
+ *
+ *  Description:
+ *      Encrypt a buffer in CBC mode and compute the HMAC over the
+ *      ciphertext using the given crypto provider, as encrypt_blocks() in
+ *      stream.c does.
+ *
+ *  Parameters:
+ *      state [in/out]
+ *          The benchmark state.
+ *
+ *      size [in]
+ *          The size of the buffer.
+ *
+ *      name [in]
+ *          The name of the provider.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The provider is started on first use and kept until another
+ *      provider is measured, so that the setup is not measured.
+ */
+static void provider_kernel(bench_state *state, size_t size, const char *name)
+{
+    const crypto_provider *provider = provider_find(name);
+
+    if (state->crypto_started && (state->crypto.provider != provider))
+    {
+        crypto_end(&state->crypto);
+        state->crypto_started = 0;
+    }
+    if (!state->crypto_started)
+    {
+        if (crypto_start(&state->crypto,
+                         provider,
+                         state->passwd,
+                         state->IV,
+                         1))
+        {
+            exit(1);
+        }
+        state->crypto_started = 1;
+    }
+
+    size &= ~(size_t) 15;
+    if (crypto_cipher(&state->crypto, state->buffer, state->buffer, size) ||
+        crypto_mac(&state->crypto, state->buffer, size))
+    {
+        exit(1);
+    }
+}
+
+static void provider_builtin_kernel(bench_state *state, size_t size)
+{
+    provider_kernel(state, size, "builtin");
+}
+
+#ifdef HAVE_OPENSSL
+static void provider_openssl_kernel(bench_state *state, size_t size)
+{
+    provider_kernel(state, size, "openssl");
+}
+#endif
+
+#ifdef HAVE_AF_ALG
+static void provider_af_alg_kernel(bench_state *state, size_t size)
+{
+    provider_kernel(state, size, "af_alg");
+}
+#endif
+
+static const kernel kernels[] =
+{
+    {"aes-encrypt-block",   aes_encrypt_kernel,     0, 16},
+    {"aes-decrypt-block",   aes_decrypt_kernel,     0, 16},
+    {"cbc-encrypt",         cbc_encrypt_only,       1, 0},
+    {"cbc-encrypt-hmac",    cbc_encrypt_hmac,       1, 0},
+    {"cbc-decrypt-hmac",    cbc_decrypt_kernel,     1, 0},
+    {"ctr-chunk",           ctr_kernel,             1, 0},
+    {"chunk-tag",           tag_kernel,             1, 0},
+    {"sha256",              sha256_kernel,          1, 0},
+    {"hmac-finish",         hmac_finish_kernel,     0, 0},
+    {"kdf",                 kdf_kernel,             0, 0},
+    {"kdf-lanes",           kdf_lanes_kernel,       0, 0},
+    {"pbkdf2-sha512",       pbkdf2_kernel,          0, 0},
+    {"pbkdf2-sha512-lanes", pbkdf2_lanes_kernel,    0, 0},
+    {"provider-builtin",    provider_builtin_kernel, 1, 0},
+#ifdef HAVE_OPENSSL
+    {"provider-openssl",    provider_openssl_kernel, 1, 0},
+#endif
+#ifdef HAVE_AF_ALG
+    {"provider-af_alg",     provider_af_alg_kernel, 1, 0},
+#endif
+};
+
+/*
+ *  open_counters
+ *
+ *  Description:
+ *      Open the hardware counters for this thread.
+ *
+ *  Parameters:
+ *      c [out]
+ *          The counters.
+ *
+ *  Returns:
+ *      The number of counters that could be opened.
+ *
+ *  Comments:
+ *      Only user space is counted, so that the counters may be opened
+ *      with the default perf_event_paranoid setting.
+ */
+static int open_counters(counters *c)
+{
+    int opened = 0;
+    unsigned i;
+#ifdef __linux__
+    struct perf_event_attr attr;
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+    } events[COUNTER_COUNT] =
+    {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                             (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+    };
+#endif
+
+    for (i = 0; i < COUNTER_COUNT; i++)
+    {
+        c->fd[i] = -1;
+#ifdef __linux__
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        c->fd[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (c->fd[i] >= 0) opened++;
+#endif
+    }
+
+    return opened;
+}
+
+/*
+ *  start_counters, stop_counters
+ *
+ *  Description:
+ *      Reset and start the hardware counters, or stop them and read their
+ *      values.
+ *
+ *  Parameters:
+ *      c [in/out]
+ *          The counters.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      Counters that are not available read as zero.
+ */
+static void start_counters(counters *c)
+{
+    unsigned i;
+
+    for (i = 0; i < COUNTER_COUNT; i++)
+    {
+        c->value[i] = 0;
+#ifdef __linux__
+        if (c->fd[i] < 0) continue;
+        ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+}
+
+static void stop_counters(counters *c)
+{
+    unsigned i;
+
+    for (i = 0; i < COUNTER_COUNT; i++)
+    {
+#ifdef __linux__
+        if (c->fd[i] < 0) continue;
+        ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(c->fd[i], &c->value[i], sizeof(uint64_t)) !=
+            sizeof(uint64_t))
+        {
+            c->value[i] = 0;
+        }
+#endif
+    }
+}
+
+/*
+ *  read_tsc
+ *
+ *  Description:
+ *      Read the time stamp counter.
+ *
+ *  Parameters:
+ *      None.
+ *
+ *  Returns:
+ *      The counter, or 0 if there is none.
+ *
+ *  Comments:
+ *      The time stamp counter runs at a constant rate that may differ
+ *      from the core clock.
+ */
+static uint64_t read_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+ *  now
+ *
+ *  Description:
+ *      Read the monotonic clock.
+ *
+ *  Parameters:
+ *      None.
+ *
+ *  Returns:
+ *      The time in seconds.
+ *
+ *  Comments:
+ *      None.
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ *  measure
+ *
+ *  Description:
+ *      Run a kernel repeatedly for at least the minimum time and report
+ *      the result.
+ *
+ *  Parameters:
+ *      k [in]
+ *          The kernel.
+ *
+ *      state [in/out]
+ *          The benchmark state.
+ *
+ *      size [in]
+ *          The octets processed by each operation, or 0 if not
+ *          meaningful.
+ *
+ *      min_time [in]
+ *          The minimum time to run, in seconds.
+ *
+ *      c [in/out]
+ *          The hardware counters.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The kernel is run once before measuring so that the code and data
+ *      are in the caches, as they are in steady state.
+ */
+static void measure(const kernel *k,
+                    bench_state *state,
+                    size_t size,
+                    double min_time,
+                    counters *c)
+{
+    unsigned long long ops = 0;
+    unsigned long batch;
+    unsigned long i;
+    double start, elapsed;
+    uint64_t tsc;
+    double cycles;
+    double octets;
+
+    batch = (size > 0) && (size < BATCH_OCTETS) ? BATCH_OCTETS / size : 1;
+
+    k->function(state, size);
+
+    start_counters(c);
+    tsc = read_tsc();
+    start = now();
+    do
+    {
+        for (i = 0; i < batch; i++) k->function(state, size);
+        ops += batch;
+        elapsed = now() - start;
+    } while (elapsed < min_time);
+    tsc = read_tsc() - tsc;
+    stop_counters(c);
+
+    cycles = (c->fd[COUNTER_CYCLES] >= 0) ?
+                (double) c->value[COUNTER_CYCLES] : (double) tsc;
+    octets = (double) size * ops;
+
+    printf("%-18s %9lu %12.1f", k->name, (unsigned long) size,
+           elapsed * 1e9 / ops);
+    if (size > 0)
+    {
+        printf(" %10.1f", octets / elapsed / 1048576);
+    }
+    else
+    {
+        printf(" %10s", "-");
+    }
+    if ((cycles > 0) && (size > 0))
+    {
+        printf(" %8.2f", cycles / octets);
+    }
+    else if (cycles > 0)
+    {
+        printf(" %8s", "-");
+    }
+    else
+    {
+        printf(" %8s", "n/a");
+    }
+    if (cycles > 0)
+    {
+        printf(" %12.0f", cycles / ops);
+    }
+    else
+    {
+        printf(" %12s", "n/a");
+    }
+    if ((c->fd[COUNTER_INSTRUCTIONS] >= 0) && (c->fd[COUNTER_CYCLES] >= 0) &&
+        (c->value[COUNTER_CYCLES] > 0))
+    {
+        printf(" %5.2f",
+               (double) c->value[COUNTER_INSTRUCTIONS] /
+               c->value[COUNTER_CYCLES]);
+    }
+    else
+    {
+        printf(" %5s", "n/a");
+    }
+    for (i = COUNTER_L1D_MISSES; i <= COUNTER_BRANCH_MISSES; i++)
+    {
+        if (c->fd[i] >= 0)
+        {
+            printf(" %10.3f", (double) c->value[i] / ops);
+        }
+        else
+        {
+            printf(" %10s", "n/a");
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+/*
+ *  usage
+ *
+ *  Description:
+ *      Displays the program usage to the user.
+ *
+ *  Parameters:
+ *      progname [in]
+ *          The name of the program.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void usage(const char *progname)
+{
+    unsigned i;
+
+    fprintf(stderr,
+            "usage: %s [-t <seconds>] [-m <max size>] [<kernel> ...]\n"
+            "  -t  minimum time for each measurement (default %.2f)\n"
+            "  -m  largest buffer size in the sweep (default %d)\n"
+            "kernels:",
+            progname,
+            DEFAULT_MIN_TIME,
+            MAX_SIZE);
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+    {
+        fprintf(stderr, " %s", kernels[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+/*
+ *  main
+ *
+ *  Description:
+ *      Run the selected kernels, or all of them.
+ *
+ *  Parameters:
+ *      argc [in]
+ *          A count of the arguments passed to the program.
+ *
+ *      argv [in]
+ *          A vector of argument strings passed to the program.
+ *
+ *  Returns:
+ *      0 if successful, non-zero if there was a failure.
+ *
+ *  Comments:
+ *      None.
+ */
+int main(int argc, char *argv[])
+{
+    double min_time = DEFAULT_MIN_TIME;
+    unsigned long max_size = MAX_SIZE;
+    bench_state state;
+    unsigned char iv_key[48];
+    counters c;
+    size_t size;
+    char *endptr;
+    unsigned i;
+    int j, selected;
+    int opened;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ht:m:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                min_time = strtod(optarg, &endptr);
+                if ((*endptr != '\0') || (min_time <= 0))
+                {
+                    fprintf(stderr, "Error: invalid time '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'm':
+                max_size = strtoul(optarg, &endptr, 10);
+                if ((*endptr != '\0') || (max_size < MIN_SIZE) ||
+                    (max_size > MAX_SIZE))
+                {
+                    fprintf(stderr,
+                            "Error: the size must be from %d to %d\n",
+                            MIN_SIZE,
+                            MAX_SIZE);
+                    return 1;
+                }
+                break;
+
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    for (j = optind; j < argc; j++)
+    {
+        for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+        {
+            if (!strcmp(argv[j], kernels[i].name)) break;
+        }
+        if (i == sizeof(kernels) / sizeof(kernels[0]))
+        {
+            fprintf(stderr, "Error: unknown kernel '%s'\n", argv[j]);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // The data and keys are arbitrary
+    memset(&state, 0, sizeof(state));
+    if ((state.buffer = malloc(MAX_SIZE)) == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        return 1;
+    }
+    for (i = 0; i < MAX_SIZE; i++) state.buffer[i] = (unsigned char) i;
+    for (i = 0; i < sizeof(iv_key); i++) iv_key[i] = (unsigned char) (i * 7);
+    memcpy(state.IV, iv_key, 16);
+    memcpy(state.passwd, iv_key + 16, sizeof(state.passwd));
+    aes_set_key(&state.aes_ctx, iv_key + 16, 256);
+    hmac_sha256_starts(&state.hmac_ctx, iv_key + 16, 32);
+    chunked_keys_init(&state.keys, iv_key, CHUNKED_DEFAULT_CHUNK_SIZE);
+
+    opened = open_counters(&c);
+    if (opened < COUNTER_COUNT)
+    {
+        printf("# %d of %d hardware counters available%s\n",
+               opened,
+               COUNTER_COUNT,
+               (c.fd[COUNTER_CYCLES] < 0) && read_tsc() ?
+                   "; cycles are time stamp counter ticks" : "");
+    }
+    printf("%-18s %9s %12s %10s %8s %12s %5s %10s %10s\n",
+           "kernel", "octets", "ns/op", "MiB/s", "cyc/B", "cyc/op", "IPC",
+           "L1Dmiss/op", "brmiss/op");
+
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+    {
+        selected = (optind == argc);
+        for (j = optind; j < argc; j++)
+        {
+            if (!strcmp(argv[j], kernels[i].name)) selected = 1;
+        }
+        if (!selected) continue;
+
+        // Skip providers that this system does not support
+        if (!strncmp(kernels[i].name, "provider-", 9) &&
+            !provider_available(provider_find(kernels[i].name + 9)))
+        {
+            printf("%-18s unavailable\n", kernels[i].name);
+            continue;
+        }
+
+        if (!kernels[i].sweep)
+        {
+            measure(&kernels[i], &state, kernels[i].size, min_time, &c);
+            continue;
+        }
+
+        for (size = MIN_SIZE; size <= max_size; size *= 4)
+        {
+            measure(&kernels[i], &state, size, min_time, &c);
+        }
+    }
+
+    for (i = 0; i < COUNTER_COUNT; i++)
+    {
+        if (c.fd[i] >= 0) close(c.fd[i]);
+    }
+    if (state.crypto_started) crypto_end(&state.crypto);
+    free(state.buffer);
+
+    return 0;
+}
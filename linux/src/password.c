@@ -20,6 +20,7 @@
 #include <fcntl.h>
 #include <unistd.h>   // getopt
 #include <stdlib.h>   // malloc
+#include <stdint.h>   // uint64_t
 #include <locale.h>   // setlocale
 #include <iconv.h>    // iconv
 #include <langinfo.h> // nl_langinfo
@@ -264,6 +265,176 @@ int read_password(unsigned char* buffer, encryptmode_t mode)
     return chars_read;
 }
 
+/*
+ *  locale_is_utf8
+ *
+ *  Description:
+ *      Determine whether passwords are given in UTF-8.
+ *
+ *  Parameters:
+ *      None.
+ *
+ *  Returns:
+ *      1 if the locale uses UTF-8 or ASCII, otherwise 0.
+ *
+ *  Comments:
+ *      The locale is set from the environment on the first call only.
+ *      ASCII is a subset of UTF-8, so passwords given in the C locale, or
+ *      when the locale cannot be loaded (as in a static build), are also
+ *      treated as UTF-8.
+ */
+static int locale_is_utf8(void)
+{
+    static int utf8 = -1;
+    const char *codeset;
+
+    if (utf8 < 0)
+    {
+        // Set the locale based on the current environment
+        setlocale(LC_CTYPE, "");
+
+        codeset = nl_langinfo(CODESET);
+        utf8 = !strcmp(codeset, "UTF-8") || !strcmp(codeset, "utf8") ||
+               !strcmp(codeset, "ANSI_X3.4-1968") ||
+               !strcmp(codeset, "US-ASCII");
+    }
+
+    return utf8;
+}
+
+/*
+ *  utf8_to_utf16
+ *
+ *  Description:
+ *      Convert a UTF-8 string to UTF-16LE.
+ *
+ *  Parameters:
+ *      in [in]
+ *          The UTF-8 string.
+ *
+ *      length [in]
+ *          The length of the string in octets.
+ *
+ *      max_length [in]
+ *          The size of the output buffer in octets.
+ *
+ *      out [out]
+ *          The string converted to UTF-16LE.
+ *
+ *  Returns:
+ *      The length in octets of the converted string, or -1 if the string
+ *      is not valid UTF-8 or is too long.
+ *
+ *  Comments:
+ *      Sixteen octets of ASCII are widened at a time, tested using word
+ *      operations, which the compiler turns into vector instructions.
+ *      Overlong forms, surrogates, and code points above U+10FFFF are
+ *      rejected, as iconv() would reject them.
+ */
+static int utf8_to_utf16(const unsigned char *in,
+                         int length,
+                         int max_length,
+                         unsigned char *out)
+{
+    const unsigned char *end = in + length;
+    unsigned char *out_start = out;
+    unsigned char *out_end = out + max_length;
+    uint64_t words[2];
+    uint32_t code;
+    unsigned i, count;
+
+    while (in < end)
+    {
+        // Widen a run of ASCII characters
+        if ((end - in >= 16) && (out_end - out >= 32))
+        {
+            memcpy(words, in, sizeof(words));
+            if (!((words[0] | words[1]) & 0x8080808080808080ULL))
+            {
+                for (i = 0; i < 16; i++)
+                {
+                    out[2 * i] = in[i];
+                    out[2 * i + 1] = 0;
+                }
+                in += 16;
+                out += 32;
+                continue;
+            }
+        }
+
+        // Decode one character
+        if (in[0] < 0x80)
+        {
+            code = in[0];
+            count = 0;
+        }
+        else if ((in[0] >= 0xC2) && (in[0] <= 0xDF))
+        {
+            code = in[0] & 0x1F;
+            count = 1;
+        }
+        else if ((in[0] >= 0xE0) && (in[0] <= 0xEF))
+        {
+            code = in[0] & 0x0F;
+            count = 2;
+        }
+        else if ((in[0] >= 0xF0) && (in[0] <= 0xF4))
+        {
+            code = in[0] & 0x07;
+            count = 3;
+        }
+        else
+        {
+            fprintf(stderr, "Error: password is not valid UTF-8\n");
+            return -1;
+        }
+
+        if ((unsigned) (end - in) <= count)
+        {
+            fprintf(stderr, "Error: password is not valid UTF-8\n");
+            return -1;
+        }
+        for (i = 1; i <= count; i++)
+        {
+            if ((in[i] & 0xC0) != 0x80)
+            {
+                fprintf(stderr, "Error: password is not valid UTF-8\n");
+                return -1;
+            }
+            code = (code << 6) | (in[i] & 0x3F);
+        }
+
+        if (((count == 2) && (code < 0x800)) ||
+            ((count == 3) && ((code < 0x10000) || (code > 0x10FFFF))) ||
+            ((code >= 0xD800) && (code <= 0xDFFF)))
+        {
+            fprintf(stderr, "Error: password is not valid UTF-8\n");
+            return -1;
+        }
+        in += count + 1;
+
+        // Encode it, using a surrogate pair beyond the BMP
+        if (out_end - out < ((code >= 0x10000) ? 4 : 2))
+        {
+            fprintf(stderr, "Error: password too long\n");
+            return -1;
+        }
+        if (code >= 0x10000)
+        {
+            code -= 0x10000;
+            out[0] = (unsigned char) ((code >> 10) & 0xFF);
+            out[1] = (unsigned char) (0xD8 | (code >> 18));
+            code = 0xDC00 | (code & 0x3FF);
+            out += 2;
+        }
+        out[0] = (unsigned char) (code & 0xFF);
+        out[1] = (unsigned char) (code >> 8);
+        out += 2;
+    }
+
+    return (int) (out - out_start);
+}
+
 /*
  *  passwd_to_utf16
  *
@@ -287,7 +458,9 @@ int read_password(unsigned char* buffer, encryptmode_t mode)
  *      The length in octets of the converted password.
  *
  *  Comments:
- *      None.
+ *      Passwords in UTF-8 are converted here; iconv() is used only for
+ *      other encodings, as loading its converters slows startup and is
+ *      not possible in a static build.
  */
 int passwd_to_utf16(unsigned char *in_passwd,
                     int length,
@@ -305,14 +478,16 @@ int passwd_to_utf16(unsigned char *in_passwd,
     // UTF-16 string.
     max_length *= 2;
 
+    if (locale_is_utf8())
+    {
+        return utf8_to_utf16(in_passwd, length, max_length, out_passwd);
+    }
+
     ic_inbuf = in_passwd;
     ic_inbytesleft = length;
     ic_outbytesleft = max_length;
     ic_outbuf = out_passwd;
 
-    // Set the locale based on the current environment
-    setlocale(LC_CTYPE,"");
-
     if ((condesc = iconv_open("UTF-16LE", nl_langinfo(CODESET))) ==
         (iconv_t)(-1))
     {
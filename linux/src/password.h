@@ -18,7 +18,7 @@
 #define MAX_PASSWD_LEN  1024
 #define MAX_PASSWD_BUF  2050 /* MAX_PASSWD_LEN * 2 + 2 -- UTF-16 */
 
-typedef enum {UNINIT, DEC, ENC} encryptmode_t;
+typedef enum {UNINIT, DEC, ENC, REKEY, REENCRYPT, INFO} encryptmode_t;
 
 // Error codes for read_password function.
 #define AESCRYPT_READPWD_NONE         0
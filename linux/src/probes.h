@@ -0,0 +1,121 @@
+/*
+ *  probes.h
+ *
+ *  Static Tracepoints for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Macros that place USDT probes, the static tracepoints understood by
+ *      bpftrace, perf, and SystemTap, in the program.  For example:
+ *
+ *          bpftrace -e 'usdt:/usr/bin/aescrypt:aescrypt:kdf_end
+ *                       { @kdf = hist(nsecs - @start[tid]); }
+ *                       usdt:/usr/bin/aescrypt:aescrypt:kdf_start
+ *                       { @start[tid] = nsecs; }'
+ *
+ *      Each probe is a single no-op instruction whose address and
+ *      argument locations are recorded in the .note.stapsdt section, so a
+ *      probe that is not being traced costs next to nothing and nothing is
+ *      needed at run time.  The probes are:
+ *
+ *          file_open(name)                 An input file was opened
+ *          file_close(name, rc)            Its output was closed
+ *          kdf_start(iterations)           Key derivation is starting
+ *          kdf_end(iterations)             Key derivation is complete
+ *          session_unwrap(ok)              The session key was unwrapped
+ *          chunk_encrypt(index, bytes, offset)
+ *          chunk_decrypt(index, bytes, offset)
+ *                                          A chunk was processed; in other
+ *                                          streams, a piece of up to
+ *                                          STREAM_BUFFER_SIZE octets
+ *          hmac_verify(ok)                 An HMAC or tag was checked
+ *          queue_depth(items)              Work items not yet taken from
+ *                                          the worker pool
+ *
+ *      Every argument is passed as a signed 64-bit integer; names are
+ *      addresses of strings.
+ *
+ *  Portability Issues:
+ *      The macros of <sys/sdt.h> are used if it is present at build time
+ *      (HAVE_SDT).  Otherwise equivalent notes are written directly when
+ *      building for ELF on x86-64 or AArch64 with GCC or Clang, and the
+ *      probes are omitted elsewhere.
+ */
+
+#ifndef AESCRYPT_PROBES_H
+#define AESCRYPT_PROBES_H
+
+#define AESCRYPT_PROBE_ARG(x)       ((long long) (x))
+
+#if defined(HAVE_SDT)
+
+#include <sys/sdt.h>
+
+#define AESCRYPT_PROBE1(name, a1) \
+    STAP_PROBE1(aescrypt, name, AESCRYPT_PROBE_ARG(a1))
+#define AESCRYPT_PROBE2(name, a1, a2) \
+    STAP_PROBE2(aescrypt, name, AESCRYPT_PROBE_ARG(a1), \
+                AESCRYPT_PROBE_ARG(a2))
+#define AESCRYPT_PROBE3(name, a1, a2, a3) \
+    STAP_PROBE3(aescrypt, name, AESCRYPT_PROBE_ARG(a1), \
+                AESCRYPT_PROBE_ARG(a2), AESCRYPT_PROBE_ARG(a3))
+
+#elif defined(__GNUC__) && defined(__ELF__) && \
+      (defined(__x86_64__) || defined(__aarch64__))
+
+// The note format is that of <sys/sdt.h>: the probe address, the address
+// of _.stapsdt.base (to detect relocation by prelink), a semaphore address
+// (unused), then the provider, probe name, and argument locations.
+#define AESCRYPT_PROBE_NOTE(name, args)                                     \
+    "990:   nop\n"                                                          \
+    "       .pushsection .note.stapsdt,\"?\",\"note\"\n"                    \
+    "       .balign 4\n"                                                    \
+    "       .4byte 992f-991f, 994f-993f, 3\n"                               \
+    "991:   .asciz \"stapsdt\"\n"                                           \
+    "992:   .balign 4\n"                                                    \
+    "993:   .8byte 990b\n"                                                  \
+    "       .8byte _.stapsdt.base\n"                                        \
+    "       .8byte 0\n"                                                     \
+    "       .asciz \"aescrypt\"\n"                                          \
+    "       .asciz \"" #name "\"\n"                                         \
+    "       .asciz \"" args "\"\n"                                          \
+    "994:   .balign 4\n"                                                    \
+    "       .popsection\n"                                                  \
+    ".ifndef _.stapsdt.base\n"                                              \
+    "       .pushsection .stapsdt.base,\"aG\",\"progbits\","                \
+            ".stapsdt.base,comdat\n"                                        \
+    "       .weak _.stapsdt.base\n"                                         \
+    "       .hidden _.stapsdt.base\n"                                       \
+    "_.stapsdt.base: .space 1\n"                                            \
+    "       .size _.stapsdt.base, 1\n"                                      \
+    "       .popsection\n"                                                  \
+    ".endif\n"
+
+#define AESCRYPT_PROBE1(name, v1)                                           \
+    __asm__ __volatile__ (AESCRYPT_PROBE_NOTE(name, "-8@%[a1]")             \
+                          :                                                 \
+                          : [a1] "nor" (AESCRYPT_PROBE_ARG(v1)))
+#define AESCRYPT_PROBE2(name, v1, v2)                                       \
+    __asm__ __volatile__ (AESCRYPT_PROBE_NOTE(name,                         \
+                                              "-8@%[a1] -8@%[a2]")          \
+                          :                                                 \
+                          : [a1] "nor" (AESCRYPT_PROBE_ARG(v1)),            \
+                            [a2] "nor" (AESCRYPT_PROBE_ARG(v2)))
+#define AESCRYPT_PROBE3(name, v1, v2, v3)                                   \
+    __asm__ __volatile__ (AESCRYPT_PROBE_NOTE(name,                         \
+                                              "-8@%[a1] -8@%[a2] -8@%[a3]") \
+                          :                                                 \
+                          : [a1] "nor" (AESCRYPT_PROBE_ARG(v1)),            \
+                            [a2] "nor" (AESCRYPT_PROBE_ARG(v2)),            \
+                            [a3] "nor" (AESCRYPT_PROBE_ARG(v3)))
+
+#else
+
+#define AESCRYPT_PROBE1(name, a1)               ((void) 0)
+#define AESCRYPT_PROBE2(name, a1, a2)           ((void) 0)
+#define AESCRYPT_PROBE3(name, a1, a2, a3)       ((void) 0)
+
+#endif
+
+#endif // AESCRYPT_PROBES_H
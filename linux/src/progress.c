@@ -0,0 +1,211 @@
+/*
+ *  progress.c
+ *
+ *  Progress Reports for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to report the progress of a long-running operation when
+ *      signaled, or periodically, in the manner of dd.
+ *
+ *      A thread waits for SIGUSR1 (or SIGINFO, which is sent by Ctrl-T on
+ *      BSD and macOS terminals), or for the reporting interval to pass, and
+ *      writes a line to stderr with the octets read and written and the
+ *      average and current rates.  The figures are the running totals
+ *      kept by the statistics functions, which are updated without locks
+ *      as the work proceeds.  When statistics are being gathered, as they
+ *      are for periodic reports, the line also gives the time spent
+ *      reading, in the cryptographic functions, and writing.
+ *
+ *      The signals are blocked in every other thread, so no signal handler
+ *      runs in the middle of the work and stdio may be used freely, and
+ *      every other signal is blocked in the reporting thread, so that it
+ *      never takes a signal meant for the work.  The thread is started for
+ *      every operation, as dd does, so that a signal sent to ask for
+ *      progress never ends the process; periodic reports, and the timing
+ *      they need, are only enabled when asked for.
+ *
+ *  Portability Issues:
+ *      Requires POSIX threads and sigtimedwait().
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "stats.h"
+#include "progress.h"
+
+static sigset_t progress_signals;
+static unsigned progress_interval;
+static double start_time;           // When reporting started
+static double last_time;            // When the last report was written
+static unsigned long long last_octets;
+
+/*
+ *  print_progress
+ *
+ *  Description:
+ *      Write a progress report to stderr.
+ *
+ *  Parameters:
+ *      None.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The current rate is of the input read since the last report.
+ */
+static void print_progress(void)
+{
+    double seconds[STATS_PHASES];
+    unsigned long long octets[STATS_PHASES];
+    double now = stats_now();
+    double average = 0, current = 0;
+
+    stats_totals(seconds, octets);
+
+    if (now > start_time)
+    {
+        average = octets[STATS_READ] / (now - start_time) / 1048576;
+    }
+    if (now > last_time)
+    {
+        current = (octets[STATS_READ] - last_octets) / (now - last_time) /
+                  1048576;
+    }
+
+    fprintf(stderr,
+            "progress: %llu octets read, %llu octets written, %.1f s, "
+            "%.1f MiB/s (%.1f MiB/s current)",
+            octets[STATS_READ],
+            octets[STATS_WRITE],
+            now - start_time,
+            average,
+            current);
+    if (stats_enabled)
+    {
+        fprintf(stderr,
+                "; read %.1f s, crypto %.1f s, write %.1f s",
+                seconds[STATS_READ],
+                seconds[STATS_KDF] + seconds[STATS_AES] +
+                    seconds[STATS_HMAC],
+                seconds[STATS_WRITE]);
+    }
+    fprintf(stderr, "\n");
+
+    last_time = now;
+    last_octets = octets[STATS_READ];
+}
+
+/*
+ *  progress_thread
+ *
+ *  Description:
+ *      Thread body that writes a progress report whenever signaled or
+ *      the reporting interval passes.
+ *
+ *  Parameters:
+ *      arg [in]
+ *          Unused.
+ *
+ *  Returns:
+ *      Never returns; the thread ends with the process.
+ *
+ *  Comments:
+ *      None.
+ */
+static void *progress_thread(void *arg)
+{
+    struct timespec timeout;
+    int rc;
+
+    (void) arg;
+
+    timeout.tv_sec = progress_interval;
+    timeout.tv_nsec = 0;
+
+    while (1)
+    {
+        if (progress_interval)
+        {
+            rc = sigtimedwait(&progress_signals, NULL, &timeout);
+        }
+        else
+        {
+            rc = sigwaitinfo(&progress_signals, NULL);
+        }
+        if ((rc < 0) && (errno == EINTR)) continue;
+
+        print_progress();
+    }
+
+    return NULL;
+}
+
+/*
+ *  progress_start
+ *
+ *  Description:
+ *      Start reporting progress when signaled, or periodically.
+ *
+ *  Parameters:
+ *      interval [in]
+ *          Seconds between reports, or 0 to report only when signaled.
+ *
+ *  Returns:
+ *      0 if successful, otherwise -1.
+ *
+ *  Comments:
+ *      This must be called before any other thread is created, so that
+ *      every thread inherits the blocked signals.  Statistics are gathered
+ *      only for periodic reports.
+ */
+int progress_start(unsigned interval)
+{
+    sigset_t all, previous;
+    pthread_t thread;
+    int rc;
+
+    if (interval) stats_init(STATS_REPORT_NONE);
+
+    sigemptyset(&progress_signals);
+    sigaddset(&progress_signals, SIGUSR1);
+#ifdef SIGINFO
+    sigaddset(&progress_signals, SIGINFO);
+#endif
+    if (pthread_sigmask(SIG_BLOCK, &progress_signals, NULL))
+    {
+        fprintf(stderr, "Error: Unable to block progress signals\n");
+        return -1;
+    }
+
+    progress_interval = interval;
+    start_time = last_time = stats_now();
+
+    // The thread inherits a mask blocking every signal, so that signals
+    // such as SIGTERM, blocked later by the main thread, are not taken by
+    // the reporting thread
+    sigfillset(&all);
+    if (pthread_sigmask(SIG_SETMASK, &all, &previous))
+    {
+        fprintf(stderr, "Error: Unable to block signals\n");
+        return -1;
+    }
+    rc = pthread_create(&thread, NULL, progress_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (rc || pthread_detach(thread))
+    {
+        fprintf(stderr, "Error: Unable to create progress thread\n");
+        return -1;
+    }
+
+    return 0;
+}
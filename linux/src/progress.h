@@ -0,0 +1,24 @@
+/*
+ *  progress.h
+ *
+ *  Progress Reports for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to report the progress of a long-running operation when
+ *      signaled, or periodically.
+ *
+ *  Portability Issues:
+ *      Requires POSIX threads and sigtimedwait().
+ */
+
+#ifndef AESCRYPT_PROGRESS_H
+#define AESCRYPT_PROGRESS_H
+
+#define PROGRESS_DEFAULT_INTERVAL   1       /* Seconds between reports */
+
+// Function prototypes
+int progress_start(unsigned interval);
+
+#endif // AESCRYPT_PROGRESS_H
@@ -0,0 +1,1368 @@
+/*
+ *  provider.c
+ *
+ *  Cryptographic Providers for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions that perform the bulk AES-256-CBC encryption and
+ *      HMAC-SHA256 authentication of a stream using one of several
+ *      implementations, selected when the program starts:
+ *
+ *          builtin     The AES and HMAC code of AES Crypt (the default)
+ *          openssl     The EVP interfaces of OpenSSL's libcrypto
+ *          af_alg      The Linux kernel crypto API, through AF_ALG sockets
+ *
+ *      A provider is given the session key and IV once, then any number
+ *      of whole blocks to encrypt or decrypt, carrying the CBC chain from
+ *      one call to the next, and any amount of ciphertext to authenticate.
+ *      Every provider produces exactly the same output, so a stream
+ *      written with one can be read with any other.
+ *
+ *      Only the bulk of version 0 to 3 streams goes through a provider.
+ *      Key derivation, session key wrapping, chunked streams, and random
+ *      access reads always use the built-in code.
+ *
+ *      The kernel may use hardware the program cannot reach directly.  Data
+ *      is given to it by splicing the pages holding it into the socket, so
+ *      it is not copied into the kernel, falling back to sending it when
+ *      splicing is refused.  A provider that may be missing at run time,
+ *      as AF_ALG may be, is probed when it is selected and the built-in
+ *      provider is used in its place if it is unavailable.
+ *
+ *  Portability Issues:
+ *      The OpenSSL provider requires libcrypto 3.0 or later at build time
+ *      (HAVE_OPENSSL).  The AF_ALG provider requires Linux, with
+ *      <linux/if_alg.h> at build time (HAVE_AF_ALG).
+ */
+
+#define _GNU_SOURCE    // splice, vmsplice, pipe2, accept4
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#ifdef HAVE_AF_ALG
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/if_alg.h>
+#endif
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
+
+#include "util.h"
+#include "provider.h"
+
+/*
+ *  builtin_start
+ *
+ *  Description:
+ *      Prepare the built-in AES and HMAC code for a stream.
+ *
+ *  Parameters:
+ *      ctx [out]
+ *          The context to prepare.
+ *
+ *      key [in]
+ *          The key for both the cipher and the HMAC.
+ *
+ *      IV [in]
+ *          The CBC initialization vector.
+ *
+ *      encrypt [in]
+ *          Non-zero to encrypt, zero to decrypt.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      The key schedule is the same in either direction.
+ */
+static int builtin_start(crypto_context *ctx,
+                         const unsigned char key[32],
+                         const unsigned char IV[16],
+                         int encrypt)
+{
+    (void) encrypt;             // Kept in the context by crypto_start()
+
+    aes_set_key(&ctx->aes_ctx, (unsigned char *) key, 256);
+    hmac_sha256_starts(&ctx->hmac_ctx, key, 32);
+    memcpy(ctx->IV, IV, 16);
+
+    return 0;
+}
+
+/*
+ *  builtin_cipher
+ *
+ *  Description:
+ *      Encrypt or decrypt whole blocks in CBC mode.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The context, whose CBC chaining value is updated.
+ *
+ *      input [in]
+ *          The blocks to encrypt or decrypt.
+ *
+ *      output [out]
+ *          The result, which may be the same as the input.
+ *
+ *      length [in]
+ *          The length of the input, a multiple of 16 octets.
+ *
+ *  Returns:
+ *      0.
+ *
+ *  Comments:
+ *      None.
+ */
+static int builtin_cipher(crypto_context *ctx,
+                          const unsigned char *input,
+                          unsigned char *output,
+                          size_t length)
+{
+    unsigned char chain[16];
+    size_t i;
+    unsigned j;
+
+    for (i = 0; i < length; i += 16)
+    {
+        if (ctx->encrypt)
+        {
+            for (j = 0; j < 16; j++) ctx->IV[j] ^= input[i + j];
+            aes_encrypt(&ctx->aes_ctx, ctx->IV, ctx->IV);
+            memcpy(output + i, ctx->IV, 16);
+        }
+        else
+        {
+            memcpy(chain, input + i, 16);
+            aes_decrypt(&ctx->aes_ctx, chain, output + i);
+            for (j = 0; j < 16; j++) output[i + j] ^= ctx->IV[j];
+            memcpy(ctx->IV, chain, 16);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ *  builtin_mac, builtin_mac_finish
+ *
+ *  Description:
+ *      Add data to the HMAC, or complete it.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The context.
+ *
+ *      data [in], length [in]
+ *          The data to authenticate.
+ *
+ *      digest [out]
+ *          The HMAC.
+ *
+ *  Returns:
+ *      0.
+ *
+ *  Comments:
+ *      None.
+ */
+static int builtin_mac(crypto_context *ctx,
+                       const unsigned char *data,
+                       size_t length)
+{
+    hmac_sha256_update(&ctx->hmac_ctx, data, length);
+
+    return 0;
+}
+
+static int builtin_mac_finish(crypto_context *ctx, unsigned char digest[32])
+{
+    hmac_sha256_finish(&ctx->hmac_ctx, digest);
+
+    return 0;
+}
+
+/*
+ *  builtin_end
+ *
+ *  Description:
+ *      Release the state of the built-in code.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The context.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The context is erased by crypto_end().
+ */
+static void builtin_end(crypto_context *ctx)
+{
+    (void) ctx;
+}
+
+#ifdef HAVE_OPENSSL
+
+/*
+ *  openssl_start
+ *
+ *  Description:
+ *      Prepare an OpenSSL cipher and MAC context for a stream.
+ *
+ *  Parameters:
+ *      ctx [out]
+ *          The context to prepare.
+ *
+ *      key [in]
+ *          The key for both the cipher and the HMAC.
+ *
+ *      IV [in]
+ *          The CBC initialization vector.
+ *
+ *      encrypt [in]
+ *          Non-zero to encrypt, zero to decrypt.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Padding is disabled, as the streams handle their own last block.
+ */
+static int openssl_start(crypto_context *ctx,
+                         const unsigned char key[32],
+                         const unsigned char IV[16],
+                         int encrypt)
+{
+    EVP_CIPHER_CTX *cipher;
+    EVP_MAC *mac;
+    EVP_MAC_CTX *mac_ctx = NULL;
+    OSSL_PARAM params[2];
+
+    params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                 (char *) "SHA256",
+                                                 0);
+    params[1] = OSSL_PARAM_construct_end();
+
+    cipher = EVP_CIPHER_CTX_new();
+    if ((mac = EVP_MAC_fetch(NULL, "HMAC", NULL)) != NULL)
+    {
+        mac_ctx = EVP_MAC_CTX_new(mac);
+        EVP_MAC_free(mac);
+    }
+
+    if ((cipher == NULL) || (mac_ctx == NULL) ||
+        !EVP_CipherInit_ex(cipher, EVP_aes_256_cbc(), NULL, key, IV,
+                           encrypt ? 1 : 0) ||
+        !EVP_CIPHER_CTX_set_padding(cipher, 0) ||
+        !EVP_MAC_init(mac_ctx, key, 32, params))
+    {
+        fprintf(stderr, "Error: Could not initialize OpenSSL\n");
+        EVP_CIPHER_CTX_free(cipher);
+        EVP_MAC_CTX_free(mac_ctx);
+        return -1;
+    }
+
+    ctx->cipher = cipher;
+    ctx->mac = mac_ctx;
+
+    return 0;
+}
+
+/*
+ *  openssl_cipher
+ *
+ *  Description:
+ *      Encrypt or decrypt whole blocks in CBC mode.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The context, whose CBC chaining value is updated.
+ *
+ *      input [in]
+ *          The blocks to encrypt or decrypt.
+ *
+ *      output [out]
+ *          The result, which may be the same as the input.
+ *
+ *      length [in]
+ *          The length of the input, a multiple of 16 octets.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Without padding, OpenSSL returns every block it is given.
+ */
+static int openssl_cipher(crypto_context *ctx,
+                          const unsigned char *input,
+                          unsigned char *output,
+                          size_t length)
+{
+    int n;
+    int outlen;
+
+    while (length > 0)
+    {
+        n = (length > 0x40000000) ? 0x40000000 : (int) length;
+        if (!EVP_CipherUpdate(ctx->cipher, output, &outlen, input, n) ||
+            (outlen != n))
+        {
+            fprintf(stderr, "Error: OpenSSL could not process the data\n");
+            return -1;
+        }
+        input += n;
+        output += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+/*
+ *  openssl_mac, openssl_mac_finish
+ *
+ *  Description:
+ *      Add data to the HMAC, or complete it.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The context.
+ *
+ *      data [in], length [in]
+ *          The data to authenticate.
+ *
+ *      digest [out]
+ *          The HMAC.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static int openssl_mac(crypto_context *ctx,
+                       const unsigned char *data,
+                       size_t length)
+{
+    if (!EVP_MAC_update(ctx->mac, data, length))
+    {
+        fprintf(stderr, "Error: OpenSSL could not compute the HMAC\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int openssl_mac_finish(crypto_context *ctx, unsigned char digest[32])
+{
+    size_t length;
+
+    if (!EVP_MAC_final(ctx->mac, digest, &length, 32) || (length != 32))
+    {
+        fprintf(stderr, "Error: OpenSSL could not compute the HMAC\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  openssl_end
+ *
+ *  Description:
+ *      Release the OpenSSL cipher and MAC contexts.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The context.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      OpenSSL erases the keys as the contexts are freed.
+ */
+static void openssl_end(crypto_context *ctx)
+{
+    EVP_CIPHER_CTX_free(ctx->cipher);
+    EVP_MAC_CTX_free(ctx->mac);
+}
+
+#endif // HAVE_OPENSSL
+
+#ifdef HAVE_AF_ALG
+
+#ifndef SOL_ALG
+#define SOL_ALG                     279
+#endif
+
+#define AF_ALG_MAX_PAGES            16      /* Pages taken in one request */
+#define AF_ALG_BUFFER_SIZE          65536
+
+typedef struct {
+    int cipher_fd;                  // Operation socket for cbc(aes)
+    int mac_fd;                     // Operation socket for hmac(sha256)
+    int pipe_fd[2];                 // Pipe for splicing, or -1 if not used
+    size_t page_size;
+    unsigned char buffer[AF_ALG_BUFFER_SIZE];   // Results of in-place work
+} af_alg_state;
+
+/*
+ *  af_alg_open
+ *
+ *  Description:
+ *      Open a kernel crypto API operation socket for an algorithm.
+ *
+ *  Parameters:
+ *      type [in]
+ *          The type of the algorithm, such as "skcipher".
+ *
+ *      name [in]
+ *          The name of the algorithm, such as "cbc(aes)".
+ *
+ *      key [in]
+ *          The 32-octet key.
+ *
+ *  Returns:
+ *      The operation socket, or -1 if there was an error.
+ *
+ *  Comments:
+ *      The operation socket holds a reference to the algorithm, so the
+ *      socket that named it is closed here.
+ */
+static int af_alg_open(const char *type,
+                       const char *name,
+                       const unsigned char key[32])
+{
+    struct sockaddr_alg sa;
+    int tfm_fd;
+    int op_fd = -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.salg_family = AF_ALG;
+    strncpy((char *) sa.salg_type, type, sizeof(sa.salg_type) - 1);
+    strncpy((char *) sa.salg_name, name, sizeof(sa.salg_name) - 1);
+
+    if ((tfm_fd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+    {
+        return -1;
+    }
+
+    if (!bind(tfm_fd, (struct sockaddr *) &sa, sizeof(sa)) &&
+        !setsockopt(tfm_fd, SOL_ALG, ALG_SET_KEY, key, 32))
+    {
+        op_fd = accept4(tfm_fd, NULL, NULL, SOCK_CLOEXEC);
+    }
+    close(tfm_fd);
+
+    return op_fd;
+}
+
+/*
+ *  af_alg_probe
+ *
+ *  Description:
+ *      Determine whether the kernel offers the algorithms through AF_ALG.
+ *
+ *  Parameters:
+ *      None.
+ *
+ *  Returns:
+ *      0 if the provider can be used, otherwise it cannot.
+ *
+ *  Comments:
+ *      AF_ALG may be missing from the kernel, not loaded, or blocked by a
+ *      sandbox.
+ */
+static int af_alg_probe(void)
+{
+    static const unsigned char key[32];
+    int cipher_fd, mac_fd = -1;
+
+    if ((cipher_fd = af_alg_open("skcipher", "cbc(aes)", key)) >= 0)
+    {
+        mac_fd = af_alg_open("hash", "hmac(sha256)", key);
+        close(cipher_fd);
+    }
+    if (mac_fd < 0) return -1;
+    close(mac_fd);
+
+    return 0;
+}
+
+/*
+ *  af_alg_start
+ *
+ *  Description:
+ *      Open kernel crypto API sockets for a stream.
+ *
+ *  Parameters:
+ *      ctx [out]
+ *          The context to prepare.
+ *
+ *      key [in]
+ *          The key for both the cipher and the HMAC.
+ *
+ *      IV [in]
+ *          The CBC initialization vector.
+ *
+ *      encrypt [in]
+ *          Non-zero to encrypt, zero to decrypt.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      The CBC chaining value is kept in the context and given with each
+ *      request.  Splicing is used if a pipe can be created, until the
+ *      kernel first refuses it.
+ */
+static int af_alg_start(crypto_context *ctx,
+                        const unsigned char key[32],
+                        const unsigned char IV[16],
+                        int encrypt)
+{
+    af_alg_state *state;
+
+    (void) encrypt;             // Kept in the context by crypto_start()
+
+    if ((state = malloc(sizeof(af_alg_state))) == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        return -1;
+    }
+    state->cipher_fd = -1;
+    state->mac_fd = -1;
+    state->page_size = (size_t) sysconf(_SC_PAGESIZE);
+    if (pipe2(state->pipe_fd, O_CLOEXEC)) state->pipe_fd[0] = -1;
+    ctx->cipher = state;
+    memcpy(ctx->IV, IV, 16);
+
+    if (((state->cipher_fd = af_alg_open("skcipher", "cbc(aes)", key)) < 0) ||
+        ((state->mac_fd = af_alg_open("hash", "hmac(sha256)", key)) < 0))
+    {
+        perror("Error opening the kernel crypto API");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  af_alg_splice
+ *
+ *  Description:
+ *      Pass data to a kernel crypto API socket through the pipe, so that
+ *      the kernel refers to the pages holding it rather than copying them.
+ *
+ *  Parameters:
+ *      state [in/out]
+ *          The provider state.
+ *
+ *      fd [in]
+ *          The operation socket.
+ *
+ *      data [in]
+ *          The data, spanning at most AF_ALG_MAX_PAGES pages.
+ *
+ *      length [in]
+ *          The length of the data in octets.
+ *
+ *  Returns:
+ *      The number of octets passed, which is less than the length if
+ *      they could not all be spliced.
+ *
+ *  Comments:
+ *      The data is flagged as having more to follow, so the caller sends
+ *      whatever was not passed, and ends the request.  Once splicing
+ *      fails, it is not tried again.
+ */
+static size_t af_alg_splice(af_alg_state *state,
+                            int fd,
+                            const unsigned char *data,
+                            size_t length)
+{
+    struct iovec iov;
+    ssize_t queued, moved, r;
+    size_t done = 0;
+    size_t left;
+
+    if (state->pipe_fd[0] < 0) return 0;
+
+    iov.iov_base = (void *) data;
+    iov.iov_len = length;
+    queued = vmsplice(state->pipe_fd[1], &iov, 1, 0);
+
+    while ((queued > 0) && (done < (size_t) queued))
+    {
+        moved = splice(state->pipe_fd[0],
+                       NULL,
+                       fd,
+                       NULL,
+                       (size_t) queued - done,
+                       SPLICE_F_MORE);
+        if (moved <= 0) break;
+        done += (size_t) moved;
+    }
+
+    if ((queued > 0) && (done == (size_t) queued)) return done;
+
+    // Empty the pipe of what did not reach the socket and stop splicing
+    left = (queued > 0) ? (size_t) queued - done : 0;
+    for (; left > 0; left -= (size_t) r)
+    {
+        r = (left < sizeof(state->buffer)) ? (ssize_t) left :
+                                             (ssize_t) sizeof(state->buffer);
+        if ((r = read(state->pipe_fd[0], state->buffer, (size_t) r)) <= 0)
+        {
+            break;
+        }
+    }
+    close(state->pipe_fd[0]);
+    close(state->pipe_fd[1]);
+    state->pipe_fd[0] = -1;
+
+    return done;
+}
+
+/*
+ *  af_alg_cipher
+ *
+ *  Description:
+ *      Encrypt or decrypt whole blocks in CBC mode.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The context, whose CBC chaining value is updated.
+ *
+ *      input [in]
+ *          The blocks to encrypt or decrypt.
+ *
+ *      output [out]
+ *          The result, which may be the same as the input.
+ *
+ *      length [in]
+ *          The length of the input, a multiple of 16 octets.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Each request gives the operation and IV in control messages, then
+ *      the data, spliced where possible, then an empty message ending the
+ *      request.  A request is limited to the pages the kernel accepts at
+ *      once.  When working in place, the result is received into a
+ *      separate buffer, as the spliced input pages are read while the
+ *      result is written.
+ */
+static int af_alg_cipher(crypto_context *ctx,
+                         const unsigned char *input,
+                         unsigned char *output,
+                         size_t length)
+{
+    af_alg_state *state = ctx->cipher;
+    union {
+        char buffer[CMSG_SPACE(sizeof(uint32_t)) +
+                    CMSG_SPACE(sizeof(struct af_alg_iv) + 16)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    uint32_t op = ctx->encrypt ? ALG_OP_ENCRYPT : ALG_OP_DECRYPT;
+    struct af_alg_iv *alg_iv;
+    unsigned char *result;
+    size_t n, passed, received;
+    ssize_t r;
+    int rc;
+
+    while (length > 0)
+    {
+        n = AF_ALG_MAX_PAGES * state->page_size -
+            (uintptr_t) input % state->page_size;
+        if (n > sizeof(state->buffer)) n = sizeof(state->buffer);
+        n = (n < length) ? n & ~(size_t) 15 : length;
+        result = (output == input) ? state->buffer : output;
+
+        memset(&control, 0, sizeof(control));
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_ALG;
+        cmsg->cmsg_type = ALG_SET_OP;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+        memcpy(CMSG_DATA(cmsg), &op, sizeof(op));
+
+        cmsg = CMSG_NXTHDR(&msg, cmsg);
+        cmsg->cmsg_level = SOL_ALG;
+        cmsg->cmsg_type = ALG_SET_IV;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct af_alg_iv) + 16);
+        alg_iv = (struct af_alg_iv *) CMSG_DATA(cmsg);
+        alg_iv->ivlen = 16;
+        memcpy(alg_iv->iv, ctx->IV, 16);
+
+        rc = -1;
+        if (sendmsg(state->cipher_fd, &msg, MSG_MORE) == 0)
+        {
+            passed = af_alg_splice(state, state->cipher_fd, input, n);
+            if (send(state->cipher_fd, input + passed, n - passed, 0) ==
+                (ssize_t) (n - passed))
+            {
+                rc = 0;
+            }
+        }
+
+        for (received = 0; !rc && (received < n); received += (size_t) r)
+        {
+            if ((r = read(state->cipher_fd,
+                          result + received,
+                          n - received)) <= 0)
+            {
+                rc = -1;
+            }
+        }
+        if (rc)
+        {
+            perror("Error using the kernel crypto API");
+            return -1;
+        }
+
+        // Continue the CBC chain from the last ciphertext block
+        memcpy(ctx->IV, (ctx->encrypt ? result : input) + n - 16, 16);
+        if (result != output) memcpy(output, result, n);
+
+        input += n;
+        output += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+/*
+ *  af_alg_mac, af_alg_mac_finish
+ *
+ *  Description:
+ *      Add data to the HMAC, or complete it.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The context.
+ *
+ *      data [in], length [in]
+ *          The data to authenticate.
+ *
+ *      digest [out]
+ *          The HMAC.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Data is passed flagged as having more to follow, and reading the
+ *      result completes the HMAC, even if no data was passed.
+ */
+static int af_alg_mac(crypto_context *ctx,
+                      const unsigned char *data,
+                      size_t length)
+{
+    af_alg_state *state = ctx->cipher;
+    size_t n, passed;
+
+    while (length > 0)
+    {
+        n = AF_ALG_MAX_PAGES * state->page_size -
+            (uintptr_t) data % state->page_size;
+        if (n > length) n = length;
+
+        passed = af_alg_splice(state, state->mac_fd, data, n);
+        if ((passed < n) &&
+            (send(state->mac_fd, data + passed, n - passed, MSG_MORE) !=
+                (ssize_t) (n - passed)))
+        {
+            perror("Error using the kernel crypto API");
+            return -1;
+        }
+
+        data += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+static int af_alg_mac_finish(crypto_context *ctx, unsigned char digest[32])
+{
+    af_alg_state *state = ctx->cipher;
+
+    if (read(state->mac_fd, digest, 32) != 32)
+    {
+        perror("Error using the kernel crypto API");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  af_alg_end
+ *
+ *  Description:
+ *      Close the kernel crypto API sockets.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The context.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The kernel erases the keys as the sockets are closed.
+ */
+static void af_alg_end(crypto_context *ctx)
+{
+    af_alg_state *state = ctx->cipher;
+
+    if (state == NULL) return;
+
+    if (state->cipher_fd >= 0) close(state->cipher_fd);
+    if (state->mac_fd >= 0) close(state->mac_fd);
+    if (state->pipe_fd[0] >= 0)
+    {
+        close(state->pipe_fd[0]);
+        close(state->pipe_fd[1]);
+    }
+    secure_erase(state, sizeof(af_alg_state));
+    free(state);
+}
+
+#endif // HAVE_AF_ALG
+
+static const crypto_provider providers[] =
+{
+    {PROVIDER_BUILTIN, NULL, builtin_start, builtin_cipher,
+     builtin_mac, builtin_mac_finish, builtin_end},
+#ifdef HAVE_OPENSSL
+    {"openssl", NULL, openssl_start, openssl_cipher,
+     openssl_mac, openssl_mac_finish, openssl_end},
+#endif
+#ifdef HAVE_AF_ALG
+    {"af_alg", af_alg_probe, af_alg_start, af_alg_cipher,
+     af_alg_mac, af_alg_mac_finish, af_alg_end},
+#endif
+};
+
+static const crypto_provider *selected = &providers[0];
+
+// Set once a failure to start a provider has been reported
+static atomic_flag fallback_reported = ATOMIC_FLAG_INIT;
+
+/*
+ *  provider_find
+ *
+ *  Description:
+ *      Find a provider by name.
+ *
+ *  Parameters:
+ *      name [in]
+ *          The name of the provider, such as "openssl".
+ *
+ *  Returns:
+ *      The provider, or NULL if it is not built in.
+ *
+ *  Comments:
+ *      None.
+ */
+const crypto_provider *provider_find(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(providers) / sizeof(providers[0]); i++)
+    {
+        if (!strcmp(name, providers[i].name)) return &providers[i];
+    }
+
+    return NULL;
+}
+
+/*
+ *  provider_available
+ *
+ *  Description:
+ *      Determine whether a provider can be used.
+ *
+ *  Parameters:
+ *      provider [in]
+ *          The provider.
+ *
+ *  Returns:
+ *      Non-zero if the provider can be used.
+ *
+ *  Comments:
+ *      Providers without a probe are always available once built in.
+ */
+int provider_available(const crypto_provider *provider)
+{
+    return (provider->probe == NULL) || !provider->probe();
+}
+
+/*
+ *  provider_select
+ *
+ *  Description:
+ *      Choose the provider used by crypto_start() when none is given.
+ *
+ *  Parameters:
+ *      name [in]
+ *          The name of the provider.
+ *
+ *  Returns:
+ *      0 if successful, otherwise the provider is not built in.
+ *
+ *  Comments:
+ *      This is to be called before any stream is processed.  If the
+ *      provider is built in but cannot be used, the built-in provider is
+ *      selected with a warning.
+ */
+int provider_select(const char *name)
+{
+    const crypto_provider *provider = provider_find(name);
+
+    if (provider == NULL)
+    {
+        fprintf(stderr, "Error: Unknown provider %s (available:", name);
+        provider_list(stderr);
+        fprintf(stderr, ")\n");
+        return -1;
+    }
+
+    if (!provider_available(provider))
+    {
+        fprintf(stderr,
+                "Warning: The %s provider is not available; using %s\n",
+                name,
+                PROVIDER_BUILTIN);
+        provider = &providers[0];
+    }
+
+    selected = provider;
+
+    return 0;
+}
+
+/*
+ *  provider_selected
+ *
+ *  Description:
+ *      Return the provider chosen by provider_select().
+ *
+ *  Parameters:
+ *      None.
+ *
+ *  Returns:
+ *      The provider.
+ *
+ *  Comments:
+ *      None.
+ */
+const crypto_provider *provider_selected(void)
+{
+    return selected;
+}
+
+/*
+ *  provider_list
+ *
+ *  Description:
+ *      Write the names of the providers that are built in.
+ *
+ *  Parameters:
+ *      fp [in]
+ *          The stream to write to.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      Each name is preceded by a space.
+ */
+void provider_list(FILE *fp)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(providers) / sizeof(providers[0]); i++)
+    {
+        fprintf(fp, " %s", providers[i].name);
+    }
+}
+
+/*
+ *  crypto_start
+ *
+ *  Description:
+ *      Prepare a provider to encrypt or decrypt a stream.
+ *
+ *  Parameters:
+ *      ctx [out]
+ *          The context to prepare.
+ *
+ *      provider [in]
+ *          The provider to use, or NULL for the selected one.
+ *
+ *      key [in]
+ *          The session key, for both the cipher and the HMAC.
+ *
+ *      IV [in]
+ *          The CBC initialization vector.
+ *
+ *      encrypt [in]
+ *          Non-zero to encrypt, zero to decrypt.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Once started, the context must be released with crypto_end().  If
+ *      a provider that may be unavailable at run time cannot be started,
+ *      the built-in provider is used in its place.  That is reported only
+ *      the first time, as every stream of a run would fall back alike.
+ */
+int crypto_start(crypto_context *ctx,
+                 const crypto_provider *provider,
+                 const unsigned char key[32],
+                 const unsigned char IV[16],
+                 int encrypt)
+{
+    if (provider == NULL) provider = selected;
+
+    memset(ctx, 0, sizeof(crypto_context));
+    ctx->provider = provider;
+    ctx->encrypt = encrypt;
+
+    if (provider->start(ctx, key, IV, encrypt) == 0) return 0;
+    if (provider->probe == NULL) return -1;
+
+    if (!atomic_flag_test_and_set(&fallback_reported))
+    {
+        fprintf(stderr, "Warning: Using the %s provider\n", PROVIDER_BUILTIN);
+    }
+    crypto_end(ctx);
+    ctx->provider = &providers[0];
+    ctx->encrypt = encrypt;
+
+    return ctx->provider->start(ctx, key, IV, encrypt);
+}
+
+/*
+ *  crypto_cipher
+ *
+ *  Description:
+ *      Encrypt or decrypt whole blocks in CBC mode.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The context.
+ *
+ *      input [in]
+ *          The blocks to encrypt or decrypt.
+ *
+ *      output [out]
+ *          The result, which may be the same as the input.
+ *
+ *      length [in]
+ *          The length of the input, a multiple of 16 octets.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      The CBC chain continues from the last block of the previous call.
+ */
+int crypto_cipher(crypto_context *ctx,
+                  const unsigned char *input,
+                  unsigned char *output,
+                  size_t length)
+{
+    return ctx->provider->cipher(ctx, input, output, length);
+}
+
+/*
+ *  crypto_mac
+ *
+ *  Description:
+ *      Add data to the HMAC.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The context.
+ *
+ *      data [in]
+ *          The data to authenticate.
+ *
+ *      length [in]
+ *          The length of the data in octets.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+int crypto_mac(crypto_context *ctx,
+               const unsigned char *data,
+               size_t length)
+{
+    return ctx->provider->mac(ctx, data, length);
+}
+
+/*
+ *  crypto_mac_finish
+ *
+ *  Description:
+ *      Complete the HMAC.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The context.
+ *
+ *      digest [out]
+ *          The HMAC.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      No more data may be authenticated afterward.
+ */
+int crypto_mac_finish(crypto_context *ctx, unsigned char digest[32])
+{
+    return ctx->provider->mac_finish(ctx, digest);
+}
+
+/*
+ *  crypto_end
+ *
+ *  Description:
+ *      Release and erase the context.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The context, which may not have been started.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void crypto_end(crypto_context *ctx)
+{
+    if (ctx->provider != NULL) ctx->provider->end(ctx);
+    secure_erase(ctx, sizeof(crypto_context));
+}
+
+#ifdef TEST
+
+/*
+ * AES-256-CBC test vector
+ * source: NIST SP 800-38A, F.2.5 and F.2.6
+ */
+
+static const unsigned char test_key[32] =
+{
+    0x60, 0x3D, 0xEB, 0x10, 0x15, 0xCA, 0x71, 0xBE,
+    0x2B, 0x73, 0xAE, 0xF0, 0x85, 0x7D, 0x77, 0x81,
+    0x1F, 0x35, 0x2C, 0x07, 0x3B, 0x61, 0x08, 0xD7,
+    0x2D, 0x98, 0x10, 0xA3, 0x09, 0x14, 0xDF, 0xF4
+};
+
+static const unsigned char test_iv[16] =
+{
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F
+};
+
+static const unsigned char test_plain[64] =
+{
+    0x6B, 0xC1, 0xBE, 0xE2, 0x2E, 0x40, 0x9F, 0x96,
+    0xE9, 0x3D, 0x7E, 0x11, 0x73, 0x93, 0x17, 0x2A,
+    0xAE, 0x2D, 0x8A, 0x57, 0x1E, 0x03, 0xAC, 0x9C,
+    0x9E, 0xB7, 0x6F, 0xAC, 0x45, 0xAF, 0x8E, 0x51,
+    0x30, 0xC8, 0x1C, 0x46, 0xA3, 0x5C, 0xE4, 0x11,
+    0xE5, 0xFB, 0xC1, 0x19, 0x1A, 0x0A, 0x52, 0xEF,
+    0xF6, 0x9F, 0x24, 0x45, 0xDF, 0x4F, 0x9B, 0x17,
+    0xAD, 0x2B, 0x41, 0x7B, 0xE6, 0x6C, 0x37, 0x10
+};
+
+static const unsigned char test_cipher[64] =
+{
+    0xF5, 0x8C, 0x4C, 0x04, 0xD6, 0xE5, 0xF1, 0xBA,
+    0x77, 0x9E, 0xAB, 0xFB, 0x5F, 0x7B, 0xFB, 0xD6,
+    0x9C, 0xFC, 0x4E, 0x96, 0x7E, 0xDB, 0x80, 0x8D,
+    0x67, 0x9F, 0x77, 0x7B, 0xC6, 0x70, 0x2C, 0x7D,
+    0x39, 0xF2, 0x33, 0x69, 0xA9, 0xD9, 0xBA, 0xCF,
+    0xA5, 0x30, 0xE2, 0x63, 0x04, 0x23, 0x14, 0x61,
+    0xB2, 0xEB, 0x05, 0xE2, 0xC3, 0x9B, 0xE9, 0xFC,
+    0xDA, 0x6C, 0x19, 0x07, 0x8C, 0x6A, 0x9D, 0x1B
+};
+
+// HMAC-SHA256 of test_cipher keyed with test_key
+static const unsigned char test_hmac[32] =
+{
+    0x6E, 0x17, 0x68, 0x03, 0xDF, 0xC6, 0xAD, 0x2F,
+    0x7D, 0x4F, 0x51, 0xE4, 0x24, 0xB7, 0xEA, 0xFF,
+    0x7F, 0x0D, 0xFC, 0x1B, 0x3A, 0x8C, 0xE2, 0xE2,
+    0xA2, 0xE5, 0x35, 0xED, 0x08, 0x41, 0x4C, 0x16
+};
+
+#define TEST_LENGTH                 65536
+
+/*
+ *  run_provider
+ *
+ *  Description:
+ *      Encrypt and authenticate, or decrypt and authenticate, a buffer
+ *      in pieces of varying length.
+ *
+ *  Parameters:
+ *      provider [in]
+ *          The provider to test.
+ *
+ *      encrypt [in]
+ *          Non-zero to encrypt, zero to decrypt.
+ *
+ *      input [in], output [out], length [in]
+ *          The data, whose length is a multiple of 16 octets.
+ *
+ *      digest [out]
+ *          The HMAC of the ciphertext.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static int run_provider(const crypto_provider *provider,
+                        int encrypt,
+                        const unsigned char *input,
+                        unsigned char *output,
+                        size_t length,
+                        unsigned char digest[32])
+{
+    crypto_context ctx;
+    size_t offset, n;
+    size_t piece = 16;
+    int rc;
+
+    rc = crypto_start(&ctx, provider, test_key, test_iv, encrypt);
+    for (offset = 0; !rc && (offset < length); offset += n)
+    {
+        n = (piece < length - offset) ? piece : length - offset;
+        piece = (piece * 3) % 4096 + 16;
+        piece -= piece % 16;
+
+        rc = crypto_cipher(&ctx, input + offset, output + offset, n);
+        if (!rc)
+        {
+            rc = crypto_mac(&ctx, encrypt ? output + offset : input + offset,
+                            n);
+        }
+    }
+    if (!rc) rc = crypto_mac_finish(&ctx, digest);
+    crypto_end(&ctx);
+
+    return rc;
+}
+
+int main(void)
+{
+    static unsigned char plain[TEST_LENGTH];
+    static unsigned char expected[TEST_LENGTH];
+    static unsigned char buffer[TEST_LENGTH];
+    unsigned char expected_hmac[32];
+    unsigned char digest[32];
+    const crypto_provider *provider;
+    size_t i;
+    int failed = 0;
+
+    for (i = 0; i < TEST_LENGTH; i++) plain[i] = (unsigned char) (i * 7 + 1);
+
+    // The built-in provider gives the output every other must match
+    provider = provider_find(PROVIDER_BUILTIN);
+    if (run_provider(provider, 1, plain, expected, TEST_LENGTH,
+                     expected_hmac))
+    {
+        return 1;
+    }
+
+    printf("\n Crypto provider conformance (AES-256-CBC, HMAC-SHA256)\n\n");
+
+    for (i = 0; i < sizeof(providers) / sizeof(providers[0]); i++)
+    {
+        provider = &providers[i];
+        printf(" Provider %-8s: ", provider->name);
+
+        if (!provider_available(provider))
+        {
+            printf("not available\n");
+            continue;
+        }
+
+        // Known answer
+        if (run_provider(provider, 1, test_plain, buffer, 64, digest) ||
+            memcmp(buffer, test_cipher, 64) || memcmp(digest, test_hmac, 32))
+        {
+            printf("known answer failed\n");
+            failed = 1;
+            continue;
+        }
+        if (run_provider(provider, 0, test_cipher, buffer, 64, digest) ||
+            memcmp(buffer, test_plain, 64) || memcmp(digest, test_hmac, 32))
+        {
+            printf("known answer decryption failed\n");
+            failed = 1;
+            continue;
+        }
+
+        // The same output as the built-in provider, in other pieces
+        if (run_provider(provider, 1, plain, buffer, TEST_LENGTH, digest) ||
+            memcmp(buffer, expected, TEST_LENGTH) ||
+            memcmp(digest, expected_hmac, 32))
+        {
+            printf("encryption differs\n");
+            failed = 1;
+            continue;
+        }
+        if (run_provider(provider, 0, expected, buffer, TEST_LENGTH,
+                         digest) ||
+            memcmp(buffer, plain, TEST_LENGTH) ||
+            memcmp(digest, expected_hmac, 32))
+        {
+            printf("decryption differs\n");
+            failed = 1;
+            continue;
+        }
+
+        printf("passed\n");
+    }
+
+    printf("\n");
+
+    return failed;
+}
+
+#endif // TEST
@@ -0,0 +1,82 @@
+/*
+ *  provider.h
+ *
+ *  Cryptographic Providers for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions that perform the bulk AES-256-CBC encryption and
+ *      HMAC-SHA256 authentication of a stream using one of several
+ *      implementations, selected when the program starts.
+ *
+ *  Portability Issues:
+ *      The OpenSSL provider requires libcrypto 3.0 or later at build time
+ *      (HAVE_OPENSSL).  The AF_ALG provider requires Linux, with
+ *      <linux/if_alg.h> at build time (HAVE_AF_ALG).
+ */
+
+#ifndef AESCRYPT_PROVIDER_H
+#define AESCRYPT_PROVIDER_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "aes.h"
+#include "hmac.h"
+
+#define PROVIDER_BUILTIN            "builtin"
+
+struct crypto_provider;
+
+// The state of the cipher and HMAC for one stream
+typedef struct {
+    const struct crypto_provider *provider;
+    int encrypt;                    // Non-zero when encrypting
+    aes_context aes_ctx;            // Built-in provider state
+    hmac_sha256_context hmac_ctx;
+    unsigned char IV[16];           // The CBC chaining value
+    void *cipher;                   // Other providers' state
+    void *mac;
+} crypto_context;
+
+typedef struct crypto_provider {
+    const char *name;               // Name given on the command line
+    int (*probe)(void);             // Zero if usable, or NULL if always
+    int (*start)(crypto_context *ctx,
+                 const unsigned char key[32],
+                 const unsigned char IV[16],
+                 int encrypt);
+    int (*cipher)(crypto_context *ctx,
+                  const unsigned char *input,
+                  unsigned char *output,
+                  size_t length);
+    int (*mac)(crypto_context *ctx,
+               const unsigned char *data,
+               size_t length);
+    int (*mac_finish)(crypto_context *ctx, unsigned char digest[32]);
+    void (*end)(crypto_context *ctx);
+} crypto_provider;
+
+// Function prototypes
+const crypto_provider *provider_find(const char *name);
+int provider_available(const crypto_provider *provider);
+int provider_select(const char *name);
+const crypto_provider *provider_selected(void);
+void provider_list(FILE *fp);
+int crypto_start(crypto_context *ctx,
+                 const crypto_provider *provider,
+                 const unsigned char key[32],
+                 const unsigned char IV[16],
+                 int encrypt);
+int crypto_cipher(crypto_context *ctx,
+                  const unsigned char *input,
+                  unsigned char *output,
+                  size_t length);
+int crypto_mac(crypto_context *ctx,
+               const unsigned char *data,
+               size_t length);
+int crypto_mac_finish(crypto_context *ctx, unsigned char digest[32]);
+void crypto_end(crypto_context *ctx);
+
+#endif // AESCRYPT_PROVIDER_H
@@ -0,0 +1,1139 @@
+/*
+ *  reader.c
+ *
+ *  Random-Access Reader for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to decrypt arbitrary byte ranges of an AES Crypt file
+ *      without processing the file from the start.
+ *
+ *      In CBC mode, plaintext block i depends only on ciphertext blocks
+ *      i-1 and i, so once the session key is unwrapped any range can be
+ *      decrypted by reading just the blocks that cover it plus the one
+ *      before.  The HMAC, however, covers the entire ciphertext, so data
+ *      returned by aescrypt_reader_pread() is NOT authenticated.  Call
+ *      aescrypt_reader_verify() to authenticate the whole file when that
+ *      matters.  Files carrying a Merkle tree may be verified in parallel
+ *      and, given the sidecar holding the leaf hashes, individual ranges
+ *      may be authenticated with aescrypt_reader_verify_range().
+ *
+ *      Chunked streams are different: each chunk carries its own tag, so
+ *      every read is authenticated and verification is always parallel.
+ *
+ *  Portability Issues:
+ *      Requires pread().
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>    // malloc
+#include <string.h>
+#include <unistd.h>    // pread
+
+#include "aescrypt.h"
+#include "hmac.h"
+#include "header.h"
+#include "session.h"
+#include "merkle.h"
+#include "workers.h"
+#include "compress.h"
+#include "probes.h"
+#include "reader.h"
+#include "util.h"
+
+// Amount of ciphertext read from the file at once
+#define READER_BUFFER_SIZE 65536
+
+typedef struct {
+    aescrypt_reader *reader;
+    unsigned char *leaves;
+} leaf_context;
+
+/*
+ *  read_chunk
+ *
+ *  Description:
+ *      Read, authenticate, and decrypt one chunk of a chunked stream.
+ *
+ *  Parameters:
+ *      reader [in]
+ *          The open reader.
+ *
+ *      index [in]
+ *          The chunk number.
+ *
+ *      buffer [out]
+ *          A buffer of at least the chunk size plus CHUNKED_TAG_LEN that
+ *          receives the plaintext.
+ *
+ *      decrypt [in]
+ *          If zero, the chunk is only authenticated.
+ *
+ *  Returns:
+ *      The length of the chunk's plaintext, or -1 if there was an error
+ *      or the chunk is not authentic.
+ *
+ *  Comments:
+ *      None.
+ */
+static ssize_t read_chunk(aescrypt_reader *reader,
+                          unsigned long long index,
+                          unsigned char *buffer,
+                          int decrypt)
+{
+    unsigned char tag[CHUNKED_TAG_LEN];
+    unsigned long long last = reader->plaintext_size / reader->chunk_size;
+    off_t start = (off_t) index * reader->chunk_size;
+    size_t n = reader->chunk_size;
+    int authentic;
+
+    // Every chunk but the last is full
+    if (index == last) n = reader->plaintext_size - start;
+
+    if (pread(fileno(reader->fp),
+              buffer,
+              n + CHUNKED_TAG_LEN,
+              reader->body_offset +
+                  (off_t) index * (reader->chunk_size + CHUNKED_TAG_LEN)) !=
+        (ssize_t) (n + CHUNKED_TAG_LEN))
+    {
+        perror("Error reading input file");
+        return -1;
+    }
+
+    chunked_tag(&reader->chunk_keys, index, (index == last), buffer, n, tag);
+    authentic = !memcmp(tag, buffer + n, CHUNKED_TAG_LEN);
+    AESCRYPT_PROBE1(hmac_verify, authentic);
+    if (!authentic)
+    {
+        fprintf(stderr,
+                "Error: Message has been altered and should not be "
+                "trusted\n");
+        return -1;
+    }
+
+    if (decrypt) chunked_crypt(&reader->chunk_keys, index, buffer, n);
+
+    return (ssize_t) n;
+}
+
+/*
+ *  chunked_pread
+ *
+ *  Description:
+ *      Decrypt the given range of plaintext from a chunked stream.
+ *
+ *  Parameters:
+ *      reader [in]
+ *          The open reader.
+ *
+ *      buffer [out]
+ *          The buffer to receive the plaintext.
+ *
+ *      length [in]
+ *          The number of octets to read, already limited to the end of the
+ *          plaintext.
+ *
+ *      offset [in]
+ *          The offset within the plaintext at which to start reading.
+ *
+ *  Returns:
+ *      The number of octets read, or -1 if there was an error.
+ *
+ *  Comments:
+ *      Every chunk covering the range is authenticated.
+ */
+static ssize_t chunked_pread(aescrypt_reader *reader,
+                             unsigned char *buffer,
+                             size_t length,
+                             off_t offset)
+{
+    unsigned char *chunk;
+    unsigned long long index = offset / reader->chunk_size;
+    size_t skip = offset % reader->chunk_size;
+    size_t done = 0, n;
+    ssize_t chunk_length = 0;
+
+    if ((chunk = malloc(reader->chunk_size + CHUNKED_TAG_LEN)) == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        return -1;
+    }
+
+    while (done < length)
+    {
+        if ((chunk_length = read_chunk(reader, index++, chunk, 1)) < 0) break;
+
+        n = chunk_length - skip;
+        if (n > length - done) n = length - done;
+        memcpy(buffer + done, chunk + skip, n);
+        done += n;
+        skip = 0;
+    }
+
+    secure_erase(chunk, reader->chunk_size + CHUNKED_TAG_LEN);
+    free(chunk);
+
+    return (chunk_length < 0) ? -1 : (ssize_t) length;
+}
+
+/*
+ *  chunk_verify_worker
+ *
+ *  Description:
+ *      Worker pool function to authenticate one chunk of a chunked stream.
+ *
+ *  Parameters:
+ *      context [in]
+ *          The aescrypt_reader.
+ *
+ *      item [in]
+ *          The chunk number.
+ *
+ *  Returns:
+ *      0 if the chunk is authentic, otherwise -1.
+ *
+ *  Comments:
+ *      None.
+ */
+static int chunk_verify_worker(void *context, unsigned item)
+{
+    aescrypt_reader *reader = (aescrypt_reader *) context;
+    unsigned char *buffer;
+    ssize_t rc;
+
+    if ((buffer = malloc(reader->chunk_size + CHUNKED_TAG_LEN)) == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        return -1;
+    }
+
+    rc = read_chunk(reader, item, buffer, 0);
+
+    free(buffer);
+
+    return (rc < 0) ? -1 : 0;
+}
+
+/*
+ *  read_padding
+ *
+ *  Description:
+ *      Determine the plaintext size of a version 3 stream by decrypting
+ *      its last block.
+ *
+ *  Parameters:
+ *      reader [in/out]
+ *          The reader, whose plaintext size is set.
+ *
+ *  Returns:
+ *      0 if successful, otherwise the padding is invalid.
+ *
+ *  Comments:
+ *      None.
+ */
+static int read_padding(aescrypt_reader *reader)
+{
+    unsigned char blocks[32];
+    unsigned char *chain = blocks;
+    unsigned padding;
+    off_t offset = reader->body_offset + reader->body_length - 32;
+    size_t length = 32;
+    unsigned i;
+
+    // The block before the last is its chaining value, unless it is first
+    if (reader->body_length == 16)
+    {
+        memcpy(blocks, reader->iv, 16);
+        offset += 16;
+        length = 16;
+    }
+
+    if (pread(fileno(reader->fp), blocks + 32 - length, length, offset) !=
+        (ssize_t) length)
+    {
+        perror("Error reading input file");
+        return -1;
+    }
+
+    aes_decrypt(&reader->aes_ctx, blocks + 16, blocks + 16);
+    for (i = 0; i < 16; i++) blocks[16 + i] ^= chain[i];
+
+    padding = blocks[31];
+    if (padding > 16) padding = 0;
+    for (i = 32 - padding; padding && (i < 32); i++)
+    {
+        if (blocks[i] != padding) padding = 0;
+    }
+    secure_erase(blocks, sizeof(blocks));
+    if (!padding)
+    {
+        fprintf(stderr,
+                "Error: Message has been altered or password is "
+                "incorrect\n");
+        return -1;
+    }
+
+    reader->plaintext_size = reader->body_length - padding;
+
+    return 0;
+}
+
+/*
+ *  aescrypt_reader_open
+ *
+ *  Description:
+ *      Open an AES Crypt file for random-access reading.
+ *
+ *  Parameters:
+ *      reader [out]
+ *          The reader to initialize.
+ *
+ *      filename [in]
+ *          The AES Crypt file to open.
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      The body offset is computed from the parsed header and extensions,
+ *      and the plaintext size from the file size and the modulo octet
+ *      that precedes the final HMAC or, for version 3 streams, the padding
+ *      at the end of the last block.  The padding is not authenticated
+ *      until the file is verified.
+ */
+int aescrypt_reader_open(aescrypt_reader *reader,
+                         const char *filename,
+                         const unsigned char *passwd,
+                         int passlen)
+{
+    aescrypt_header header;
+    aescrypt_sizes sizes;
+    const aescrypt_extension *extension;
+    unsigned char buffer[16 + 48 + 32];
+    unsigned char iv_key[48];
+    unsigned char key[32];
+    size_t length;
+    int fd;
+
+    memset(reader, 0, sizeof(aescrypt_reader));
+
+    if ((reader->fp = fopen(filename, "r")) == NULL)
+    {
+        fprintf(stderr, "Error opening input file %s : ", filename);
+        perror("");
+        return -1;
+    }
+    fd = fileno(reader->fp);
+
+    if (read_header(reader->fp, &header))
+    {
+        free_header(&header);
+        aescrypt_reader_close(reader);
+        return -1;
+    }
+    reader->hdr = header.hdr;
+
+    // Note the Merkle tree, if present (chunked streams need none)
+    if ((reader->hdr.version != AES_CRYPT_CHUNKED_VERSION) &&
+        (extension = find_extension(&header, MERKLE_EXTENSION_ID)) != NULL)
+    {
+        if (merkle_parse_extension(extension,
+                                   &reader->merkle_chunk_size,
+                                   reader->merkle_root))
+        {
+            fprintf(stderr, "Warning: ignoring malformed Merkle tree\n");
+            reader->merkle_chunk_size = 0;
+        }
+    }
+
+    // Offsets into compressed contents are not offsets into the file
+    reader->compressed = (find_extension(&header,
+                                         COMPRESS_EXTENSION_ID) != NULL);
+
+    if (read_sizes(reader->fp, &header, &sizes))
+    {
+        free_header(&header);
+        aescrypt_reader_close(reader);
+        return -1;
+    }
+    free_header(&header);
+    reader->body_offset = sizes.body_offset;
+    reader->body_length = sizes.body_length;
+    reader->plaintext_size = sizes.plaintext_size;
+    reader->hdr.last_block_size = sizes.last_block_size;
+    reader->chunk_size = sizes.chunk_size;
+
+    // Read the IV and, for version 1 and later, the session IV and key
+    length = (reader->hdr.version >= 0x01) ? 16 + 48 + 32 : 16;
+    if (pread(fd, buffer, length, header.iv_offset) != (ssize_t) length)
+    {
+        fprintf(stderr, "Error: Input file is too short.\n");
+        aescrypt_reader_close(reader);
+        return -1;
+    }
+
+    derive_key(buffer, passwd, passlen, header.kdf_iterations, key);
+
+    if (reader->hdr.version >= 0x01)
+    {
+        if (unwrap_session_key(key,
+                               buffer,
+                               reader->hdr.version,
+                               buffer + 16,
+                               buffer + 64,
+                               iv_key))
+        {
+            fprintf(stderr,
+                    "Error: Message has been altered or password is "
+                    "incorrect\n");
+            secure_erase(key, sizeof(key));
+            aescrypt_reader_close(reader);
+            return -1;
+        }
+        memcpy(reader->iv, iv_key, 16);
+        memcpy(reader->hmac_key, iv_key + 16, 32);
+        if (reader->chunk_size)
+        {
+            chunked_keys_init(&reader->chunk_keys,
+                              iv_key,
+                              reader->chunk_size);
+        }
+        secure_erase(iv_key, sizeof(iv_key));
+    }
+    else
+    {
+        memcpy(reader->iv, buffer, 16);
+        memcpy(reader->hmac_key, key, 32);
+    }
+    secure_erase(key, sizeof(key));
+
+    aes_set_key(&reader->aes_ctx, reader->hmac_key, 256);
+
+    // The padding of a version 3 stream gives its plaintext size
+    if ((reader->hdr.version == 0x03) && read_padding(reader))
+    {
+        aescrypt_reader_close(reader);
+        return -1;
+    }
+
+    if (reader->merkle_chunk_size)
+    {
+        merkle_key(reader->hmac_key, reader->merkle_key);
+    }
+
+    return 0;
+}
+
+/*
+ *  aescrypt_reader_pread
+ *
+ *  Description:
+ *      Decrypt the given range of plaintext.
+ *
+ *  Parameters:
+ *      reader [in]
+ *          The open reader.
+ *
+ *      buffer [out]
+ *          The buffer to receive the plaintext.
+ *
+ *      length [in]
+ *          The number of octets to read.
+ *
+ *      offset [in]
+ *          The offset within the plaintext at which to start reading.
+ *
+ *  Returns:
+ *      The number of octets read, which is less than requested only at
+ *      the end of the plaintext, or -1 if there was an error.
+ *
+ *  Comments:
+ *      The returned plaintext is not authenticated, except for chunked
+ *      streams.  The reader is not modified, so multiple threads may read
+ *      from it concurrently.
+ */
+ssize_t aescrypt_reader_pread(aescrypt_reader *reader,
+                              void *buffer,
+                              size_t length,
+                              off_t offset)
+{
+    unsigned char cipher[READER_BUFFER_SIZE];
+    unsigned char chain[16], block[16];
+    unsigned char *out = (unsigned char *) buffer;
+    int fd = fileno(reader->fp);
+    off_t block_index;
+    size_t done = 0, blocks, n, i, j;
+    unsigned skip;
+
+    if (reader->compressed)
+    {
+        fprintf(stderr,
+                "Error: Compressed files can only be decrypted in full\n");
+        return -1;
+    }
+
+    if ((offset < 0) || (offset >= reader->plaintext_size)) return 0;
+    if ((off_t) length > reader->plaintext_size - offset)
+    {
+        length = reader->plaintext_size - offset;
+    }
+
+    if (reader->chunk_size)
+    {
+        return chunked_pread(reader, out, length, offset);
+    }
+
+    block_index = offset / 16;
+    skip = offset % 16;
+
+    // The first block is chained to the previous ciphertext block
+    if (block_index == 0)
+    {
+        memcpy(chain, reader->iv, 16);
+    }
+    else if (pread(fd,
+                   chain,
+                   16,
+                   reader->body_offset + (block_index - 1) * 16) != 16)
+    {
+        perror("Error reading input file");
+        return -1;
+    }
+
+    while (done < length)
+    {
+        blocks = (skip + length - done + 15) / 16;
+        if (blocks > sizeof(cipher) / 16) blocks = sizeof(cipher) / 16;
+
+        if (pread(fd,
+                  cipher,
+                  blocks * 16,
+                  reader->body_offset + block_index * 16) !=
+            (ssize_t) (blocks * 16))
+        {
+            perror("Error reading input file");
+            return -1;
+        }
+
+        for (i = 0; i < blocks; i++)
+        {
+            aes_decrypt(&reader->aes_ctx, cipher + i * 16, block);
+
+            // XOR plain text block with previous encrypted
+            // output (i.e., use CBC)
+            for (j = 0; j < 16; j++) block[j] ^= chain[j];
+            memcpy(chain, cipher + i * 16, 16);
+
+            n = 16 - skip;
+            if (n > length - done) n = length - done;
+            memcpy(out + done, block + skip, n);
+            done += n;
+            skip = 0;
+        }
+
+        block_index += blocks;
+    }
+
+    secure_erase(block, sizeof(block));
+
+    return (ssize_t) length;
+}
+
+/*
+ *  verify_hmac
+ *
+ *  Description:
+ *      Authenticate the entire file by verifying its final HMAC.
+ *
+ *  Parameters:
+ *      reader [in]
+ *          The open reader.
+ *
+ *  Returns:
+ *      0 if the file is authentic, otherwise -1.
+ *
+ *  Comments:
+ *      This reads the entire ciphertext, but performs no decryption.
+ */
+static int verify_hmac(aescrypt_reader *reader)
+{
+    hmac_sha256_context hmac_ctx;
+    unsigned char buffer[READER_BUFFER_SIZE];
+    sha256_t digest, expected;
+    int fd = fileno(reader->fp);
+    off_t position = 0;
+    size_t n;
+    int authentic;
+
+    hmac_sha256_starts(&hmac_ctx, reader->hmac_key, 32);
+
+    while (position < reader->body_length)
+    {
+        n = sizeof(buffer);
+        if ((off_t) n > reader->body_length - position)
+        {
+            n = reader->body_length - position;
+        }
+
+        if (pread(fd, buffer, n, reader->body_offset + position) !=
+            (ssize_t) n)
+        {
+            perror("Error reading input file");
+            return -1;
+        }
+
+        hmac_sha256_update(&hmac_ctx, buffer, n);
+        position += n;
+    }
+
+    hmac_sha256_finish(&hmac_ctx, digest);
+
+    if (pread(fd,
+              expected,
+              32,
+              reader->body_offset + reader->body_length +
+                  (((reader->hdr.version >= 0x01) &&
+                    (reader->hdr.version < 0x03)) ? 1 : 0)) != 32)
+    {
+        perror("Error reading input file digest");
+        return -1;
+    }
+
+    authentic = !memcmp(digest, expected, 32);
+    AESCRYPT_PROBE1(hmac_verify, authentic);
+    if (!authentic)
+    {
+        fprintf(stderr,
+                "Error: Message has been altered and should not be "
+                "trusted\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  chunk_leaf
+ *
+ *  Description:
+ *      Read the given Merkle chunk and compute its leaf hash.
+ *
+ *  Parameters:
+ *      reader [in]
+ *          The open reader.
+ *
+ *      index [in]
+ *          The index of the chunk.
+ *
+ *      buffer [in]
+ *          A buffer of at least the chunk size.
+ *
+ *      leaf [out]
+ *          The leaf hash.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static int chunk_leaf(aescrypt_reader *reader,
+                      unsigned long long index,
+                      unsigned char *buffer,
+                      unsigned char leaf[32])
+{
+    off_t start = (off_t) index * reader->merkle_chunk_size;
+    size_t n = reader->merkle_chunk_size;
+
+    if ((off_t) n > reader->body_length - start)
+    {
+        n = reader->body_length - start;
+    }
+
+    if (pread(fileno(reader->fp), buffer, n, reader->body_offset + start) !=
+        (ssize_t) n)
+    {
+        perror("Error reading input file");
+        return -1;
+    }
+
+    merkle_leaf(reader->merkle_key, index, buffer, n, leaf);
+
+    return 0;
+}
+
+/*
+ *  leaf_worker
+ *
+ *  Description:
+ *      Worker pool function to compute the leaf hash of one chunk.
+ *
+ *  Parameters:
+ *      context [in]
+ *          The leaf_context.
+ *
+ *      item [in]
+ *          Index of the chunk.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static int leaf_worker(void *context, unsigned item)
+{
+    leaf_context *ctx = (leaf_context *) context;
+    unsigned char *buffer;
+    int rc;
+
+    if ((buffer = malloc(ctx->reader->merkle_chunk_size)) == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        return -1;
+    }
+
+    rc = chunk_leaf(ctx->reader, item, buffer, ctx->leaves + item * 32);
+
+    free(buffer);
+
+    return rc;
+}
+
+/*
+ *  merkle_root_matches
+ *
+ *  Description:
+ *      Compute the Merkle tree root from the leaf hashes and compare it
+ *      with the root stored in the file header.
+ *
+ *  Parameters:
+ *      reader [in]
+ *          The open reader.
+ *
+ *      leaves [in]
+ *          The leaf hashes of every chunk.
+ *
+ *      count [in]
+ *          The number of chunks.
+ *
+ *  Returns:
+ *      Non-zero if the root matches.
+ *
+ *  Comments:
+ *      None.
+ */
+static int merkle_root_matches(aescrypt_reader *reader,
+                               const unsigned char *leaves,
+                               unsigned long long count)
+{
+    merkle_context merkle_ctx;
+    unsigned char root[32];
+    unsigned long long i;
+
+    memset(&merkle_ctx, 0, sizeof(merkle_ctx));
+    memcpy(merkle_ctx.key, reader->merkle_key, 32);
+    merkle_ctx.chunk_size = reader->merkle_chunk_size;
+
+    for (i = 0; i < count; i++) merkle_push_leaf(&merkle_ctx, leaves + i * 32);
+
+    merkle_finish(&merkle_ctx, root);
+
+    return !memcmp(root, reader->merkle_root, 32);
+}
+
+/*
+ *  chunk_count
+ *
+ *  Description:
+ *      Determine the number of Merkle chunks in the file.
+ *
+ *  Parameters:
+ *      reader [in]
+ *          The open reader.
+ *
+ *  Returns:
+ *      The number of chunks.
+ *
+ *  Comments:
+ *      None.
+ */
+static unsigned long long chunk_count(aescrypt_reader *reader)
+{
+    return (reader->body_length + reader->merkle_chunk_size - 1) /
+           reader->merkle_chunk_size;
+}
+
+/*
+ *  aescrypt_reader_verify
+ *
+ *  Description:
+ *      Authenticate the entire file.
+ *
+ *  Parameters:
+ *      reader [in]
+ *          The open reader.
+ *
+ *      jobs [in]
+ *          The number of threads to use (0 for default) if the file
+ *          carries a Merkle tree.
+ *
+ *  Returns:
+ *      0 if the file is authentic, otherwise -1.
+ *
+ *  Comments:
+ *      If the file is a chunked stream, the chunk tags are checked in
+ *      parallel.  If the file carries a Merkle tree, the chunks are hashed
+ *      in parallel and the tree root is checked.  Otherwise, the final
+ *      HMAC is verified.  No decryption is performed in any case.
+ */
+int aescrypt_reader_verify(aescrypt_reader *reader, unsigned jobs)
+{
+    leaf_context ctx;
+    unsigned long long count;
+    int rc = 0;
+
+    if (reader->chunk_size)
+    {
+        count = reader->plaintext_size / reader->chunk_size + 1;
+        if (count > 0xFFFFFFFF)
+        {
+            fprintf(stderr, "Error: Input file has too many chunks\n");
+            return -1;
+        }
+        return run_workers(jobs,
+                           (unsigned) count,
+                           chunk_verify_worker,
+                           reader) ? -1 : 0;
+    }
+
+    if (!reader->merkle_chunk_size) return verify_hmac(reader);
+
+    count = chunk_count(reader);
+    if (count > 0xFFFFFFFF) return verify_hmac(reader);
+
+    ctx.reader = reader;
+    if ((ctx.leaves = malloc(count ? count * 32 : 1)) == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        return -1;
+    }
+
+    if (run_workers(jobs, (unsigned) count, leaf_worker, &ctx) ||
+        !merkle_root_matches(reader, ctx.leaves, count))
+    {
+        fprintf(stderr,
+                "Error: Message has been altered and should not be "
+                "trusted\n");
+        rc = -1;
+    }
+
+    free(ctx.leaves);
+
+    return rc;
+}
+
+/*
+ *  aescrypt_reader_verify_range
+ *
+ *  Description:
+ *      Authenticate just the chunks covering the given plaintext range
+ *      using the Merkle tree leaf hashes stored in a sidecar file.
+ *
+ *  Parameters:
+ *      reader [in]
+ *          The open reader.
+ *
+ *      sidecar [in]
+ *          The name of the file holding the leaf hashes.
+ *
+ *      offset [in]
+ *          The offset of the plaintext range.
+ *
+ *      length [in]
+ *          The length of the plaintext range.
+ *
+ *  Returns:
+ *      0 if the range is authentic, -1 if it is not or there was an
+ *      error, or 1 if the file has no Merkle tree or the sidecar is not
+ *      available.
+ *
+ *  Comments:
+ *      The sidecar itself need not be trusted, since the leaves it holds
+ *      are checked against the root in the file header.  Chunked streams
+ *      need no sidecar, since each read is authenticated.
+ */
+int aescrypt_reader_verify_range(aescrypt_reader *reader,
+                                 const char *sidecar,
+                                 off_t offset,
+                                 off_t length)
+{
+    unsigned char leaf[32];
+    unsigned char *leaves = NULL;
+    unsigned char *buffer = NULL;
+    unsigned long long count, first, last, i;
+    FILE *fp;
+    int rc = -1;
+
+    if (reader->chunk_size) return 0;
+    if (!reader->merkle_chunk_size) return 1;
+    if ((fp = fopen(sidecar, "r")) == NULL) return 1;
+
+    count = chunk_count(reader);
+    if ((leaves = malloc(count ? count * 32 : 1)) == NULL ||
+        (buffer = malloc(reader->merkle_chunk_size)) == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        goto done;
+    }
+
+    if (fread(leaves, 32, count, fp) != count)
+    {
+        fprintf(stderr, "Error: Merkle tree sidecar %s is too short\n",
+                sidecar);
+        goto done;
+    }
+
+    if (!merkle_root_matches(reader, leaves, count))
+    {
+        fprintf(stderr,
+                "Error: Merkle tree sidecar %s does not match the file\n",
+                sidecar);
+        goto done;
+    }
+
+    if ((length <= 0) || (count == 0))
+    {
+        rc = 0;
+        goto done;
+    }
+
+    // Hash each chunk covering the range; since plaintext offsets map to
+    // the same ciphertext offsets, include the chunk holding the
+    // preceding ciphertext block used for CBC chaining
+    first = ((offset >= 16) ? offset - 16 : 0) / reader->merkle_chunk_size;
+    last = (offset + length - 1) / reader->merkle_chunk_size;
+    if (last >= count) last = count - 1;
+
+    for (i = first; i <= last; i++)
+    {
+        if (chunk_leaf(reader, i, buffer, leaf)) goto done;
+
+        if (memcmp(leaf, leaves + i * 32, 32))
+        {
+            fprintf(stderr,
+                    "Error: Message has been altered and should not be "
+                    "trusted\n");
+            goto done;
+        }
+    }
+
+    rc = 0;
+
+done:
+    free(buffer);
+    free(leaves);
+    fclose(fp);
+
+    return rc;
+}
+
+/*
+ *  aescrypt_reader_close
+ *
+ *  Description:
+ *      Close the reader and erase key material.
+ *
+ *  Parameters:
+ *      reader [in]
+ *          The reader to close.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void aescrypt_reader_close(aescrypt_reader *reader)
+{
+    if (reader->fp != NULL) fclose(reader->fp);
+
+    secure_erase(reader, sizeof(aescrypt_reader));
+}
+
+/*
+ *  decrypt_range
+ *
+ *  Description:
+ *      Decrypt a range of the given file into the output stream.
+ *
+ *  Parameters:
+ *      filename [in]
+ *          The AES Crypt file to read.
+ *
+ *      outfp [in]
+ *          The output stream into which decrypted data is written.
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *      offset [in]
+ *          The offset within the plaintext at which to start.
+ *
+ *      length [in]
+ *          The number of octets to decrypt, or -1 for the balance of the
+ *          file.
+ *
+ *      verify [in]
+ *          If non-zero, authenticate the range before writing any output.
+ *
+ *      jobs [in]
+ *          The number of threads to use when verifying (0 for default).
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Unless verify is requested, the output is not authenticated.  When
+ *      verifying, just the range is authenticated if the file has a Merkle
+ *      tree and its sidecar exists; otherwise the entire file is verified.
+ */
+int decrypt_range(const char *filename,
+                  FILE *outfp,
+                  const unsigned char *passwd,
+                  int passlen,
+                  off_t offset,
+                  off_t length,
+                  int verify,
+                  unsigned jobs)
+{
+    aescrypt_reader reader;
+    unsigned char buffer[READER_BUFFER_SIZE];
+    char sidecar[AES_CRYPT_MAX_PATH];
+    ssize_t n;
+    size_t request;
+    int rc = 0;
+
+    if (aescrypt_reader_open(&reader, filename, passwd, passlen))
+    {
+        return -1;
+    }
+
+    if ((length < 0) || (length > reader.plaintext_size))
+    {
+        length = reader.plaintext_size;
+    }
+
+    if (verify)
+    {
+        if (snprintf(sidecar,
+                     AES_CRYPT_MAX_PATH,
+                     "%s%s",
+                     filename,
+                     MERKLE_SIDECAR_EXTENSION) >= AES_CRYPT_MAX_PATH)
+        {
+            sidecar[0] = '\0';
+        }
+
+        rc = aescrypt_reader_verify_range(&reader, sidecar, offset, length);
+        if (rc > 0) rc = aescrypt_reader_verify(&reader, jobs);
+
+        if (rc)
+        {
+            aescrypt_reader_close(&reader);
+            return -1;
+        }
+    }
+
+    while (length > 0)
+    {
+        request = sizeof(buffer);
+        if ((off_t) request > length) request = length;
+
+        if ((n = aescrypt_reader_pread(&reader, buffer, request, offset)) < 0)
+        {
+            rc = -1;
+            break;
+        }
+        if (n == 0) break;
+
+        if (fwrite(buffer, 1, n, outfp) != (size_t) n)
+        {
+            perror("Error writing decrypted block:");
+            rc = -1;
+            break;
+        }
+
+        offset += n;
+        length -= n;
+    }
+
+    secure_erase(buffer, sizeof(buffer));
+    aescrypt_reader_close(&reader);
+
+    if (!rc && fflush(outfp))
+    {
+        fprintf(stderr, "Error: Could not flush output file buffer\n");
+        rc = -1;
+    }
+
+    return rc;
+}
+
+/*
+ *  verify_file
+ *
+ *  Description:
+ *      Authenticate the given file without producing any output.
+ *
+ *  Parameters:
+ *      filename [in]
+ *          The AES Crypt file to verify.
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *      jobs [in]
+ *          The number of threads to use (0 for default).
+ *
+ *  Returns:
+ *      0 if the file is authentic, otherwise -1.
+ *
+ *  Comments:
+ *      None.
+ */
+int verify_file(const char *filename,
+                const unsigned char *passwd,
+                int passlen,
+                unsigned jobs)
+{
+    aescrypt_reader reader;
+    int rc;
+
+    if (aescrypt_reader_open(&reader, filename, passwd, passlen))
+    {
+        return -1;
+    }
+
+    rc = aescrypt_reader_verify(&reader, jobs);
+
+    aescrypt_reader_close(&reader);
+
+    return rc;
+}
@@ -0,0 +1,70 @@
+/*
+ *  reader.h
+ *
+ *  Random-Access Reader for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to decrypt arbitrary byte ranges of an AES Crypt file
+ *      without processing the file from the start.
+ *
+ *  Portability Issues:
+ *      Requires pread().
+ */
+
+#ifndef AESCRYPT_READER_H
+#define AESCRYPT_READER_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "aescrypt.h"
+#include "chunked.h"
+
+typedef struct {
+    FILE *fp;                       // The open AES Crypt file
+    aescrypt_hdr hdr;               // The file header
+    aes_context aes_ctx;            // Key schedule for the file contents
+    unsigned char iv[16];           // IV for the first ciphertext block
+    unsigned char hmac_key[32];     // Key for the contents and their HMAC
+    off_t body_offset;              // Offset of the first ciphertext block
+    off_t body_length;              // Length of the ciphertext in octets
+    off_t plaintext_size;           // Length of the plaintext in octets
+    unsigned merkle_chunk_size;     // Merkle tree chunk size, 0 if none
+    unsigned char merkle_root[32];  // Merkle tree root from the header
+    unsigned char merkle_key[32];   // Merkle tree key
+    unsigned chunk_size;            // Chunk size of a chunked stream, else 0
+    chunked_keys chunk_keys;        // Keys for a chunked stream
+    int compressed;                 // The plaintext is compressed
+} aescrypt_reader;
+
+// Function prototypes
+int aescrypt_reader_open(aescrypt_reader *reader,
+                         const char *filename,
+                         const unsigned char *passwd,
+                         int passlen);
+ssize_t aescrypt_reader_pread(aescrypt_reader *reader,
+                              void *buffer,
+                              size_t length,
+                              off_t offset);
+int aescrypt_reader_verify(aescrypt_reader *reader, unsigned jobs);
+int aescrypt_reader_verify_range(aescrypt_reader *reader,
+                                 const char *sidecar,
+                                 off_t offset,
+                                 off_t length);
+void aescrypt_reader_close(aescrypt_reader *reader);
+int decrypt_range(const char *filename,
+                  FILE *outfp,
+                  const unsigned char *passwd,
+                  int passlen,
+                  off_t offset,
+                  off_t length,
+                  int verify,
+                  unsigned jobs);
+int verify_file(const char *filename,
+                const unsigned char *passwd,
+                int passlen,
+                unsigned jobs);
+
+#endif // AESCRYPT_READER_H
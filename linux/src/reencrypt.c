@@ -0,0 +1,592 @@
+/*
+ *  reencrypt.c
+ *
+ *  Single-Pass Re-encryption for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to decrypt an AES Crypt file and encrypt the result with
+ *      a new password and session key without the plaintext being written
+ *      to disk.
+ *
+ *      Decryption runs in its own thread and feeds the plaintext through
+ *      a pipe to encryption running in the calling thread, so the two
+ *      proceed concurrently on separate processors.  The new file is
+ *      written to a temporary file that is renamed into place only once
+ *      the HMAC of the original file has been verified.
+ *
+ *      The new file keeps the format of the original: a version 3 file
+ *      keeps its key derivation iteration count and a chunked stream its
+ *      chunk size.  The contents of a compressed file are decrypted but
+ *      not decompressed and are encrypted again as they are, so that the
+ *      compression is kept exactly.  A file with a Merkle tree is refused,
+ *      as the tree and its sidecar would have to be rebuilt.
+ *
+ *  Portability Issues:
+ *      Requires POSIX threads.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>    // mkstemp
+#include <string.h>
+#include <signal.h>    // pthread_sigmask, sigtimedwait
+#include <time.h>      // timespec
+#include <unistd.h>    // pipe
+#include <pthread.h>
+#include <sys/stat.h>  // fchmod
+
+#include "aescrypt.h"
+#include "header.h"
+#include "compress.h"
+#include "merkle.h"
+#include "stream.h"
+#include "workers.h"
+#include "reencrypt.h"
+
+typedef struct {
+    FILE *infp;
+    FILE *outfp;
+    const unsigned char *passwd;
+    int passlen;
+    int compressed;
+    int rc;
+} decrypt_job;
+
+typedef struct {
+    char **filenames;
+    const char *outfile;
+    const unsigned char *old_passwd;
+    int old_passlen;
+    const unsigned char *new_passwd;
+    int new_passlen;
+    unsigned long iterations;
+} reencrypt_context;
+
+/*
+ *  decrypt_thread
+ *
+ *  Description:
+ *      Thread body that decrypts the input file into the pipe.
+ *
+ *  Parameters:
+ *      arg [in]
+ *          The decrypt_job.
+ *
+ *  Returns:
+ *      NULL.
+ *
+ *  Comments:
+ *      The write end of the pipe is closed on return so that the reader
+ *      sees end of file.  Compressed contents are left compressed when
+ *      the job says so.
+ *
+ *      SIGPIPE is blocked in this thread so that writing to the pipe
+ *      after encryption stopped early fails rather than terminating the
+ *      process.  The signal raised is directed at this thread and is
+ *      accepted before it returns.
+ */
+static void *decrypt_thread(void *arg)
+{
+    decrypt_job *job = (decrypt_job *) arg;
+    struct timespec no_wait = {0, 0};
+    sigset_t pipe_signal;
+
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, NULL);
+
+    if (job->compressed)
+    {
+        job->rc = decrypt_compressed(job->infp,
+                                     job->outfp,
+                                     (unsigned char *) job->passwd,
+                                     job->passlen);
+    }
+    else
+    {
+        job->rc = decrypt_stream(job->infp,
+                                 job->outfp,
+                                 (unsigned char *) job->passwd,
+                                 job->passlen);
+    }
+
+    if (fclose(job->outfp) && !job->rc) job->rc = -1;
+
+    while (sigtimedwait(&pipe_signal, NULL, &no_wait) == SIGPIPE);
+
+    return NULL;
+}
+
+/*
+ *  reencrypt_stream
+ *
+ *  Description:
+ *      Decrypt the input stream and encrypt the plaintext into the output
+ *      stream, with decryption and encryption running concurrently.
+ *
+ *  Parameters:
+ *      infp [in]
+ *          The AES Crypt stream to decrypt.
+ *
+ *      outfp [in]
+ *          The output stream for the new AES Crypt stream.
+ *
+ *      old_passwd, old_passlen [in]
+ *          The UTF-16LE encoded password protecting the input stream.
+ *
+ *      new_passwd, new_passlen [in]
+ *          The UTF-16LE encoded password to protect the output stream.
+ *
+ *      options [in]
+ *          The format of the output stream.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.  A non-zero result
+ *      indicates the output must be discarded.
+ *
+ *  Comments:
+ *      None.
+ */
+static int reencrypt_stream(FILE *infp,
+                            FILE *outfp,
+                            const unsigned char *old_passwd,
+                            int old_passlen,
+                            const unsigned char *new_passwd,
+                            int new_passlen,
+                            const stream_options *options)
+{
+    decrypt_job job;
+    pthread_t thread;
+    int pipefd[2];
+    FILE *pipefp;
+    int rc;
+
+    if (pipe(pipefd))
+    {
+        perror("Error creating pipe");
+        return -1;
+    }
+
+    if ((pipefp = fdopen(pipefd[0], "r")) == NULL)
+    {
+        perror("Error creating pipe");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+
+    if ((job.outfp = fdopen(pipefd[1], "w")) == NULL)
+    {
+        perror("Error creating pipe");
+        fclose(pipefp);
+        close(pipefd[1]);
+        return -1;
+    }
+
+    job.infp = infp;
+    job.passwd = old_passwd;
+    job.passlen = old_passlen;
+    job.compressed = (options->compressed_codec != NULL);
+    job.rc = -1;
+
+    if (pthread_create(&thread, NULL, decrypt_thread, &job))
+    {
+        fprintf(stderr, "Error: Unable to create decryption thread\n");
+        fclose(job.outfp);
+        fclose(pipefp);
+        return -1;
+    }
+
+    rc = encrypt_stream(pipefp,
+                        outfp,
+                        (unsigned char *) new_passwd,
+                        new_passlen,
+                        options);
+
+    // Closing the read end unblocks the decryption thread if encryption
+    // stopped early
+    fclose(pipefp);
+    pthread_join(thread, NULL);
+
+    return (rc || job.rc) ? -1 : 0;
+}
+
+/*
+ *  source_options
+ *
+ *  Description:
+ *      Determine the format of the new stream from the header of the
+ *      original.
+ *
+ *  Parameters:
+ *      infp [in]
+ *          The AES Crypt stream to re-encrypt.  Its position is restored.
+ *
+ *      iterations [in]
+ *          The key derivation iteration count of a version 3 stream to
+ *          write, or 0 to keep the format of the original.
+ *
+ *      options [out]
+ *          The options for encrypt_stream().
+ *
+ *      codec [out]
+ *          Receives the codec of compressed contents, to which the options
+ *          refer.
+ *
+ *  Returns:
+ *      0 if successful, otherwise the header could not be read or the
+ *      stream cannot be re-encrypted.
+ *
+ *  Comments:
+ *      The header of a stream that is not a regular file cannot be read
+ *      ahead, so a version 2 stream is written unless iterations are
+ *      given.  The compression level is not recorded in a file, so
+ *      compressed contents are to be passed through as they are.
+ */
+static int source_options(FILE *infp,
+                          unsigned long iterations,
+                          stream_options *options,
+                          char codec[256])
+{
+    aescrypt_header header;
+    aescrypt_sizes sizes;
+    const aescrypt_extension *extension;
+    size_t id_length = strlen(COMPRESS_EXTENSION_ID) + 1;
+    struct stat st;
+    off_t start;
+    int rc = 0;
+
+    memset(options, 0, sizeof(stream_options));
+    options->kdf_iterations = iterations;
+
+    if (fstat(fileno(infp), &st) || !S_ISREG(st.st_mode) ||
+        ((start = ftello(infp)) < 0))
+    {
+        if (!iterations)
+        {
+            fprintf(stderr,
+                    "Warning: The format of input that is not a regular "
+                    "file is not kept\n");
+        }
+        return 0;
+    }
+
+    if (read_header(infp, &header))
+    {
+        rc = -1;
+    }
+    else if (!iterations &&
+             (header.hdr.version == AES_CRYPT_CHUNKED_VERSION))
+    {
+        if (read_sizes(infp, &header, &sizes))
+        {
+            rc = -1;
+        }
+        else
+        {
+            options->chunk_size = sizes.chunk_size;
+        }
+    }
+    else if (!iterations)
+    {
+        options->kdf_iterations = header.kdf_iterations;
+    }
+
+    if (!rc && (find_extension(&header, MERKLE_EXTENSION_ID) != NULL))
+    {
+        fprintf(stderr,
+                "Error: A file with a Merkle tree must be decrypted and "
+                "encrypted again with --merkle\n");
+        rc = -1;
+    }
+
+    if (!rc &&
+        ((extension = find_extension(&header,
+                                     COMPRESS_EXTENSION_ID)) != NULL) &&
+        (extension->length >= id_length))
+    {
+        snprintf(codec,
+                 256,
+                 "%.*s",
+                 (int) (extension->length - id_length),
+                 (const char *) extension->data + id_length);
+        options->compressed_codec = codec;
+    }
+    free_header(&header);
+
+    if (fseeko(infp, start, SEEK_SET))
+    {
+        perror("Error rewinding input file");
+        rc = -1;
+    }
+
+    return rc;
+}
+
+/*
+ *  reencrypt_file
+ *
+ *  Description:
+ *      Re-encrypt the given file with a new password and session key.
+ *
+ *  Parameters:
+ *      infile [in]
+ *          The AES Crypt file to re-encrypt, or "-" for standard input.
+ *
+ *      outfile [in]
+ *          The file to write, "-" for standard output, or NULL to replace
+ *          the input file.
+ *
+ *      old_passwd, old_passlen [in]
+ *          The UTF-16LE encoded password protecting the input file.
+ *
+ *      new_passwd, new_passlen [in]
+ *          The UTF-16LE encoded password to protect the output file.
+ *
+ *      iterations [in]
+ *          The key derivation iteration count of a version 3 file to
+ *          write, or 0 to keep the format of the input file.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Output written to standard output cannot be withheld until the
+ *      input has been verified; a non-zero exit status indicates that
+ *      the output must be discarded.  An output file that is the input
+ *      file is refused, as it is replaced only by passing NULL.
+ */
+int reencrypt_file(const char *infile,
+                   const char *outfile,
+                   const unsigned char *old_passwd,
+                   int old_passlen,
+                   const unsigned char *new_passwd,
+                   int new_passlen,
+                   unsigned long iterations)
+{
+    char tmpfile[AES_CRYPT_MAX_PATH];
+    char codec[256];
+    stream_options options;
+    struct stat st;
+    struct stat out_st;
+    FILE *infp;
+    FILE *outfp;
+    int fd;
+    int rc;
+    int replace = (outfile == NULL);
+
+    if (replace) outfile = infile;
+
+    if (!strcmp(infile, "-"))
+    {
+        infp = stdin;
+    }
+    else if ((infp = fopen(infile, "r")) == NULL)
+    {
+        fprintf(stderr, "Error opening input file %s : ", infile);
+        perror("");
+        return -1;
+    }
+
+    // Naming the input file as the output is most likely a mistake
+    if (!replace && (infp != stdin) && strcmp(outfile, "-") &&
+        !fstat(fileno(infp), &st) && !stat(outfile, &out_st) &&
+        (st.st_dev == out_st.st_dev) && (st.st_ino == out_st.st_ino))
+    {
+        fprintf(stderr,
+                "Error: The output file %s is the input file; omit -o to "
+                "replace it\n",
+                outfile);
+        fclose(infp);
+        return -1;
+    }
+
+    // Keep the format of the original file
+    if (source_options(infp, iterations, &options, codec))
+    {
+        fprintf(stderr, "Error: %s was not re-encrypted\n", infile);
+        if (infp != stdin) fclose(infp);
+        return -1;
+    }
+
+    if (!strcmp(outfile, "-"))
+    {
+        rc = reencrypt_stream(infp,
+                              stdout,
+                              old_passwd,
+                              old_passlen,
+                              new_passwd,
+                              new_passlen,
+                              &options);
+        if (infp != stdin) fclose(infp);
+        return rc;
+    }
+
+    // Write to a temporary file in the same directory as the output
+    if (snprintf(tmpfile,
+                 AES_CRYPT_MAX_PATH,
+                 "%s.XXXXXX",
+                 outfile) >= AES_CRYPT_MAX_PATH)
+    {
+        fprintf(stderr, "Output file pathname too long\n");
+        if (infp != stdin) fclose(infp);
+        return -1;
+    }
+
+    if ((fd = mkstemp(tmpfile)) < 0)
+    {
+        fprintf(stderr, "Error creating temporary file %s : ", tmpfile);
+        perror("");
+        if (infp != stdin) fclose(infp);
+        return -1;
+    }
+
+    // Retain the permissions of the original file
+    if ((infp != stdin) && !fstat(fileno(infp), &st))
+    {
+        fchmod(fd, st.st_mode & 07777);
+    }
+
+    if ((outfp = fdopen(fd, "w")) == NULL)
+    {
+        perror("Error opening temporary file");
+        close(fd);
+        unlink(tmpfile);
+        if (infp != stdin) fclose(infp);
+        return -1;
+    }
+
+    rc = reencrypt_stream(infp,
+                          outfp,
+                          old_passwd,
+                          old_passlen,
+                          new_passwd,
+                          new_passlen,
+                          &options);
+
+    if (infp != stdin) fclose(infp);
+
+    // Ensure the new file is on disk before it replaces anything
+    if (!rc && (fflush(outfp) || fsync(fileno(outfp))))
+    {
+        fprintf(stderr, "Error: Could not flush output file\n");
+        rc = -1;
+    }
+    if (fclose(outfp) && !rc)
+    {
+        fprintf(stderr, "Error: Could not properly close output file\n");
+        rc = -1;
+    }
+
+    if (!rc && rename(tmpfile, outfile))
+    {
+        fprintf(stderr, "Error renaming %s to %s : ", tmpfile, outfile);
+        perror("");
+        rc = -1;
+    }
+
+    if (rc)
+    {
+        fprintf(stderr, "Error: %s was not re-encrypted\n", infile);
+        unlink(tmpfile);
+    }
+
+    return rc;
+}
+
+/*
+ *  reencrypt_worker
+ *
+ *  Description:
+ *      Worker pool function to re-encrypt one file.
+ *
+ *  Parameters:
+ *      context [in]
+ *          The reencrypt_context.
+ *
+ *      item [in]
+ *          Index of the file to process.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static int reencrypt_worker(void *context, unsigned item)
+{
+    reencrypt_context *ctx = (reencrypt_context *) context;
+
+    return reencrypt_file(ctx->filenames[item],
+                          ctx->outfile,
+                          ctx->old_passwd,
+                          ctx->old_passlen,
+                          ctx->new_passwd,
+                          ctx->new_passlen,
+                          ctx->iterations);
+}
+
+/*
+ *  reencrypt_files
+ *
+ *  Description:
+ *      Re-encrypt each of the given files, processing files in parallel.
+ *
+ *  Parameters:
+ *      filenames [in]
+ *          The AES Crypt files to re-encrypt.
+ *
+ *      count [in]
+ *          The number of files.
+ *
+ *      jobs [in]
+ *          The number of files to process concurrently (0 for default).
+ *
+ *      outfile [in]
+ *          The output file when re-encrypting a single file, or NULL to
+ *          replace each input file.
+ *
+ *      old_passwd, old_passlen [in]
+ *          The UTF-16LE encoded password protecting the input files.
+ *
+ *      new_passwd, new_passlen [in]
+ *          The UTF-16LE encoded password to protect the output files.
+ *
+ *      iterations [in]
+ *          The key derivation iteration count of version 3 files to
+ *          write, or 0 to keep the format of each input file.
+ *
+ *  Returns:
+ *      0 if all files were successfully re-encrypted, otherwise -1.
+ *
+ *  Comments:
+ *      Each file uses two threads, so the default job count is half the
+ *      number of processors.
+ */
+int reencrypt_files(char *filenames[],
+                    unsigned count,
+                    unsigned jobs,
+                    const char *outfile,
+                    const unsigned char *old_passwd,
+                    int old_passlen,
+                    const unsigned char *new_passwd,
+                    int new_passlen,
+                    unsigned long iterations)
+{
+    reencrypt_context ctx;
+
+    if (jobs == 0) jobs = (default_worker_count() + 1) / 2;
+
+    ctx.filenames = filenames;
+    ctx.outfile = outfile;
+    ctx.old_passwd = old_passwd;
+    ctx.old_passlen = old_passlen;
+    ctx.new_passwd = new_passwd;
+    ctx.new_passlen = new_passlen;
+    ctx.iterations = iterations;
+
+    return run_workers(jobs, count, reencrypt_worker, &ctx) ? -1 : 0;
+}
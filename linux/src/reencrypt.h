@@ -0,0 +1,38 @@
+/*
+ *  reencrypt.h
+ *
+ *  Single-Pass Re-encryption for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to decrypt an AES Crypt file and encrypt the result with
+ *      a new password and session key without the plaintext being written
+ *      to disk.
+ *
+ *  Portability Issues:
+ *      Requires POSIX threads.
+ */
+
+#ifndef AESCRYPT_REENCRYPT_H
+#define AESCRYPT_REENCRYPT_H
+
+// Function prototypes
+int reencrypt_file(const char *infile,
+                   const char *outfile,
+                   const unsigned char *old_passwd,
+                   int old_passlen,
+                   const unsigned char *new_passwd,
+                   int new_passlen,
+                   unsigned long iterations);
+int reencrypt_files(char *filenames[],
+                    unsigned count,
+                    unsigned jobs,
+                    const char *outfile,
+                    const unsigned char *old_passwd,
+                    int old_passlen,
+                    const unsigned char *new_passwd,
+                    int new_passlen,
+                    unsigned long iterations);
+
+#endif // AESCRYPT_REENCRYPT_H
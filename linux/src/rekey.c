@@ -0,0 +1,330 @@
+/*
+ *  rekey.c
+ *
+ *  Password Rotation for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to change the password protecting an AES Crypt file
+ *      without re-encrypting the file contents.
+ *
+ *      In version 1 and later files, the bulk of the file is encrypted
+ *      with a random session IV and key.  Only those 48 octets and their
+ *      HMAC are protected with the password-derived key, so changing the
+ *      password requires rewriting just the IV, the wrapped session
+ *      IV and key, and the HMAC that follow the header.
+ *
+ *      Those octets are rewritten in place.  As a write interrupted by a
+ *      crash could leave a file that no password opens, the old octets are
+ *      first saved in a journal, as an append does, so that the next
+ *      password change of the file can roll the interrupted one back.
+ *
+ *  Portability Issues:
+ *      Requires pread() and pwrite().
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>     // open
+#include <unistd.h>    // fsync, pread, pwrite
+
+#include "aescrypt.h"
+#include "header.h"
+#include "journal.h"
+#include "session.h"
+#include "workers.h"
+#include "rekey.h"
+#include "util.h"
+
+// Size of the region rewritten: IV, wrapped session IV and key, HMAC
+#define REKEY_REGION_LEN (16 + AES_CRYPT_SESSION_LEN + 32)
+
+typedef struct {
+    char **filenames;
+    const unsigned char *old_passwd;
+    int old_passlen;
+    const unsigned char *new_passwd;
+    int new_passlen;
+} rekey_context;
+
+/*
+ *  rekey_file
+ *
+ *  Description:
+ *      Change the password protecting the given file.
+ *
+ *  Parameters:
+ *      filename [in]
+ *          The AES Crypt file to modify.
+ *
+ *      old_passwd [in]
+ *          The UTF-16LE encoded password currently protecting the file.
+ *
+ *      old_passlen [in]
+ *          The length of the old password in octets.
+ *
+ *      new_passwd [in]
+ *          The UTF-16LE encoded password to protect the file with.
+ *
+ *      new_passlen [in]
+ *          The length of the new password in octets.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      The file is not modified unless the old password verifies.  A new
+ *      random IV is used so that the same password does not produce the
+ *      same derived key.  The old region is saved in a journal before it
+ *      is overwritten; if a change is interrupted, the next change of the
+ *      file finds the journal and either rolls the file back or, if the
+ *      interrupted change had completed, discards the journal.  A version
+ *      3 file keeps its key derivation iteration count.
+ */
+int rekey_file(const char *filename,
+               const unsigned char *old_passwd,
+               int old_passlen,
+               const unsigned char *new_passwd,
+               int new_passlen)
+{
+    aescrypt_header header;
+    char journal[AES_CRYPT_MAX_PATH];
+    unsigned char region[REKEY_REGION_LEN];
+    unsigned char iv_key[AES_CRYPT_SESSION_LEN];
+    unsigned char key[32];
+    FILE *fp = NULL;
+    FILE *randfp = NULL;
+    int restored;
+    int fd;
+    int rc = -1;
+
+    memset(&header, 0, sizeof(header));
+
+    if (snprintf(journal,
+                 AES_CRYPT_MAX_PATH,
+                 JOURNAL_FILE_FORMAT,
+                 filename) >= AES_CRYPT_MAX_PATH)
+    {
+        fprintf(stderr, "Journal file pathname too long\n");
+        return -1;
+    }
+
+    if ((fd = open(filename, O_RDWR)) < 0)
+    {
+        fprintf(stderr, "Error opening file %s : ", filename);
+        perror("");
+        return -1;
+    }
+
+    if ((fp = fdopen(fd, "r+")) == NULL)
+    {
+        fprintf(stderr, "Error opening file %s : ", filename);
+        perror("");
+        close(fd);
+        return -1;
+    }
+
+    if (read_header(fp, &header))
+    {
+        fprintf(stderr, "Error: Unable to read header of %s\n", filename);
+        goto done;
+    }
+
+    if (header.hdr.version < 0x01)
+    {
+        fprintf(stderr,
+                "Error: %s is a version 0 file and must be re-encrypted\n",
+                filename);
+        goto done;
+    }
+
+    // Recover the session IV and key using the old password; if that
+    // fails and an earlier change left a journal, roll that change back
+    // and try again.  If it succeeds, any journal belongs to a change that
+    // completed.
+    for (restored = 0; ; restored = 1)
+    {
+        if (pread(fd, region, REKEY_REGION_LEN, header.iv_offset) !=
+            REKEY_REGION_LEN)
+        {
+            fprintf(stderr, "Error: %s is too short\n", filename);
+            goto done;
+        }
+
+        derive_key(region,
+                   old_passwd,
+                   old_passlen,
+                   header.kdf_iterations,
+                   key);
+        if (!unwrap_session_key(key,
+                                region,
+                                header.hdr.version,
+                                region + 16,
+                                region + 64,
+                                iv_key))
+        {
+            break;
+        }
+
+        if (restored || restore_journal(journal, fp))
+        {
+            fprintf(stderr,
+                    "Error: %s has been altered or password is incorrect\n",
+                    filename);
+            goto done;
+        }
+        fprintf(stderr,
+                "Restored %s after an interrupted password change\n",
+                filename);
+    }
+
+    if ((unlink(journal) != 0) && (errno != ENOENT))
+    {
+        fprintf(stderr, "Error removing journal file %s : ", journal);
+        perror("");
+        goto done;
+    }
+
+    // Protect the session IV and key with the new password
+    if ((randfp = fopen("/dev/urandom", "r")) == NULL)
+    {
+        perror("Error open /dev/urandom:");
+        goto done;
+    }
+    if (generate_iv(randfp, region))
+    {
+        goto done;
+    }
+    derive_key(region, new_passwd, new_passlen, header.kdf_iterations, key);
+    wrap_session_key(key,
+                     region,
+                     header.hdr.version,
+                     iv_key,
+                     region + 16,
+                     region + 64);
+
+    if (save_region_journal(journal, fp, header.iv_offset, REKEY_REGION_LEN))
+    {
+        fprintf(stderr,
+                "Error: The password of %s was not changed\n",
+                filename);
+        goto done;
+    }
+
+    // The change is complete once the file is on disk
+    if ((pwrite(fd, region, REKEY_REGION_LEN, header.iv_offset) !=
+            REKEY_REGION_LEN) ||
+        fsync(fd))
+    {
+        fprintf(stderr, "Error writing file %s : ", filename);
+        perror("");
+        if (!restore_journal(journal, fp))
+        {
+            fprintf(stderr,
+                    "Restored %s to its state before the change\n",
+                    filename);
+        }
+        goto done;
+    }
+
+    unlink(journal);
+
+    rc = 0;
+
+done:
+    secure_erase(iv_key, sizeof(iv_key));
+    secure_erase(key, sizeof(key));
+    free_header(&header);
+    if (randfp != NULL) fclose(randfp);
+    fclose(fp);
+
+    return rc;
+}
+
+/*
+ *  rekey_worker
+ *
+ *  Description:
+ *      Worker pool function to change the password of one file.
+ *
+ *  Parameters:
+ *      context [in]
+ *          The rekey_context.
+ *
+ *      item [in]
+ *          Index of the file to process.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static int rekey_worker(void *context, unsigned item)
+{
+    rekey_context *ctx = (rekey_context *) context;
+
+    return rekey_file(ctx->filenames[item],
+                      ctx->old_passwd,
+                      ctx->old_passlen,
+                      ctx->new_passwd,
+                      ctx->new_passlen);
+}
+
+/*
+ *  rekey_files
+ *
+ *  Description:
+ *      Change the password of each of the given files, processing files
+ *      in parallel.
+ *
+ *  Parameters:
+ *      filenames [in]
+ *          The AES Crypt files to modify.
+ *
+ *      count [in]
+ *          The number of files.
+ *
+ *      jobs [in]
+ *          The number of files to process concurrently (0 for default).
+ *
+ *      old_passwd [in]
+ *          The UTF-16LE encoded password currently protecting the files.
+ *
+ *      old_passlen [in]
+ *          The length of the old password in octets.
+ *
+ *      new_passwd [in]
+ *          The UTF-16LE encoded password to protect the files with.
+ *
+ *      new_passlen [in]
+ *          The length of the new password in octets.
+ *
+ *  Returns:
+ *      0 if all files were successfully modified, otherwise -1.
+ *
+ *  Comments:
+ *      A failure on one file does not stop processing of the others.
+ */
+int rekey_files(char *filenames[],
+                unsigned count,
+                unsigned jobs,
+                const unsigned char *old_passwd,
+                int old_passlen,
+                const unsigned char *new_passwd,
+                int new_passlen)
+{
+    rekey_context ctx;
+
+    ctx.filenames = filenames;
+    ctx.old_passwd = old_passwd;
+    ctx.old_passlen = old_passlen;
+    ctx.new_passwd = new_passwd;
+    ctx.new_passlen = new_passlen;
+
+    return run_workers(jobs, count, rekey_worker, &ctx) ? -1 : 0;
+}
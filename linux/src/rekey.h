@@ -0,0 +1,33 @@
+/*
+ *  rekey.h
+ *
+ *  Password Rotation for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to change the password protecting an AES Crypt file
+ *      without re-encrypting the file contents.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#ifndef AESCRYPT_REKEY_H
+#define AESCRYPT_REKEY_H
+
+// Function prototypes
+int rekey_file(const char *filename,
+               const unsigned char *old_passwd,
+               int old_passlen,
+               const unsigned char *new_passwd,
+               int new_passlen);
+int rekey_files(char *filenames[],
+                unsigned count,
+                unsigned jobs,
+                const unsigned char *old_passwd,
+                int old_passlen,
+                const unsigned char *new_passwd,
+                int new_passlen);
+
+#endif // AESCRYPT_REKEY_H
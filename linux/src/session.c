@@ -0,0 +1,1193 @@
+/*
+ *  session.c
+ *
+ *  Session Key Utilities for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to generate, wrap, and unwrap the random IV and key used
+ *      to encrypt the bulk of an AES Crypt stream, along with the
+ *      password-based key derivation used to protect them: 8192 rounds of
+ *      SHA-256 for versions 0 to 2 and PBKDF2-HMAC-SHA512 for version 3.
+ *
+ *  Portability Issues:
+ *      The lane functions are compiled for several instruction sets where
+ *      GCC or Clang support target_clones on x86-64 ELF systems.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>  // getpid
+#include <time.h>    // time
+
+#include "aescrypt.h"
+#include "hmac.h"
+#include "password.h"
+#include "probes.h"
+#include "session.h"
+#include "sha512.h"
+#include "stats.h"
+#include "util.h"
+
+// Blocks in the longest message hashed by the key derivation: the key,
+// the password, and the padding
+#define KDF_MAX_BLOCKS  ((32 + MAX_PASSWD_LEN * 2 + 9 + 63) / 64)
+
+// Longest password in UTF-8: three octets for each UTF-16 code unit
+#define KDF_MAX_UTF8    (MAX_PASSWD_BUF / 2 * 3)
+
+// Iterations reported by the kdf_start and kdf_end probes
+#define KDF_ROUNDS(n)   ((n) ? (n) : AES_CRYPT_KDF_ITERATIONS)
+
+// The lane functions are also compiled for AVX2 and AVX-512, the variant
+// used being chosen when the program is loaded
+#if defined(__x86_64__) && defined(__ELF__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define KDF_TARGETS     __attribute__((target_clones("avx512f", "avx2", \
+                                                     "default")))
+#endif
+#endif
+#ifndef KDF_TARGETS
+#define KDF_TARGETS
+#endif
+
+// Round constants of SHA-256 (FIPS 180-4, section 4.2.2)
+static const uint32_t kdf_constants[64] =
+{
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5,
+    0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+    0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC,
+    0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7,
+    0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+    0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3,
+    0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5,
+    0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+    0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+// Message of each lane of derive_keys(), as big-endian words
+typedef struct {
+    uint32_t words[KDF_MAX_BLOCKS * 16][KDF_LANES];
+    unsigned blocks[KDF_LANES];     // Blocks in each lane's message
+} kdf_messages;
+
+// A derived key noted by remember_key() for the next derive_key()
+typedef struct {
+    int valid;
+    unsigned char IV[16];
+    unsigned char passwd[MAX_PASSWD_BUF];
+    int passlen;
+    unsigned long iterations;
+    unsigned char key[32];
+} kdf_memo;
+
+static _Thread_local kdf_memo memo;
+
+#define KDF_ROTR(x,n)   (((x) >> (n)) | ((x) << (32 - (n))))
+#define KDF_ROTR64(x,n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+/*
+ *  generate_iv
+ *
+ *  Description:
+ *      Generate an initialization vector comprised of the current time,
+ *      process ID, and random data, all hashed together with SHA-256.
+ *
+ *  Parameters:
+ *      randfp [in]
+ *          An open stream for /dev/urandom.
+ *
+ *      IV [out]
+ *          The generated 16-octet initialization vector.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+int generate_iv(FILE *randfp, unsigned char IV[16])
+{
+    sha256_context sha_ctx;
+    sha256_t digest;
+    unsigned char buffer[32];
+    time_t current_time;
+    pid_t process_id;
+    unsigned i;
+    double start = 0;
+
+    if (stats_enabled) start = stats_now();
+
+    sha256_starts(&sha_ctx);
+
+    current_time = time(NULL);
+    sha256_update(&sha_ctx,
+                  (unsigned char *)&current_time,
+                  sizeof(current_time));
+
+    process_id = getpid();
+    sha256_update(&sha_ctx, (unsigned char *)&process_id, sizeof(process_id));
+
+    for (i=0; i<256; i++)
+    {
+        if (fread(buffer, 1, 32, randfp) != 32)
+        {
+            fprintf(stderr, "Error: Couldn't read from /dev/random\n");
+            return -1;
+        }
+        sha256_update(&sha_ctx, buffer, 32);
+    }
+
+    sha256_finish(&sha_ctx, digest);
+
+    memcpy(IV, digest, 16);
+
+    secure_erase(buffer, sizeof(buffer));
+    secure_erase(digest, sizeof(digest));
+
+    if (stats_enabled) stats_add(STATS_RANDOM, stats_now() - start, 0);
+
+    return 0;
+}
+
+/*
+ *  generate_iv_key
+ *
+ *  Description:
+ *      Create the 16-octet IV and 32-octet encryption key used for
+ *      encrypting the plaintext stream.
+ *
+ *  Parameters:
+ *      randfp [in]
+ *          An open stream for /dev/urandom.
+ *
+ *      iv_key [out]
+ *          The generated IV followed by the generated key.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      We do not trust the random source blindly, so we improve on that
+ *      by also hashing the random digits and using only a portion of the
+ *      hash.  This IV and key generation could be replaced with any good
+ *      random source of data.
+ */
+int generate_iv_key(FILE *randfp, unsigned char iv_key[48])
+{
+    sha256_context sha_ctx;
+    sha256_t digest;
+    unsigned char buffer[32];
+    size_t bytes_read;
+    unsigned i, j;
+    double start = 0;
+
+    if (stats_enabled) start = stats_now();
+
+    memset(iv_key, 0, 48);
+    for (i=0; i<48; i+=16)
+    {
+        memset(buffer, 0, 32);
+        sha256_starts(&sha_ctx);
+        for (j = 0; j < 256; j++)
+        {
+            if ((bytes_read = fread(buffer, 1, 32, randfp)) != 32)
+            {
+                fprintf(stderr, "Error: Couldn't read from /dev/urandom : %u\n",
+                        (unsigned) bytes_read);
+                return -1;
+            }
+            sha256_update(&sha_ctx, buffer, 32);
+        }
+        sha256_finish(&sha_ctx, digest);
+        memcpy(iv_key+i, digest, 16);
+    }
+
+    secure_erase(buffer, sizeof(buffer));
+    secure_erase(digest, sizeof(digest));
+
+    if (stats_enabled) stats_add(STATS_RANDOM, stats_now() - start, 0);
+
+    return 0;
+}
+
+/*
+ *  utf16_to_utf8
+ *
+ *  Description:
+ *      Convert a UTF-16LE password to UTF-8 for version 3 key derivation.
+ *
+ *  Parameters:
+ *      passwd [in]
+ *          The UTF-16LE encoded password.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *      utf8 [out]
+ *          The UTF-8 encoded password, of at most KDF_MAX_UTF8 octets.
+ *
+ *  Returns:
+ *      The length of the UTF-8 password in octets.
+ *
+ *  Comments:
+ *      A surrogate without its pair, which can only come from a key file,
+ *      is replaced by U+FFFD as other UTF-16 converters do.
+ */
+static size_t utf16_to_utf8(const unsigned char *passwd,
+                            int passlen,
+                            unsigned char utf8[KDF_MAX_UTF8])
+{
+    size_t length = 0;
+    unsigned long c, d;
+    int i;
+
+    for (i = 0; i + 1 < passlen; i += 2)
+    {
+        c = passwd[i] | ((unsigned long) passwd[i + 1] << 8);
+
+        if ((c >= 0xD800) && (c < 0xDC00) && (i + 3 < passlen))
+        {
+            d = passwd[i + 2] | ((unsigned long) passwd[i + 3] << 8);
+            if ((d >= 0xDC00) && (d < 0xE000))
+            {
+                c = 0x10000 + ((c - 0xD800) << 10) + (d - 0xDC00);
+                i += 2;
+            }
+        }
+        if ((c >= 0xD800) && (c < 0xE000)) c = 0xFFFD;
+
+        if (c < 0x80)
+        {
+            utf8[length++] = (unsigned char) c;
+        }
+        else if (c < 0x800)
+        {
+            utf8[length++] = (unsigned char) (0xC0 | (c >> 6));
+            utf8[length++] = (unsigned char) (0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000)
+        {
+            utf8[length++] = (unsigned char) (0xE0 | (c >> 12));
+            utf8[length++] = (unsigned char) (0x80 | ((c >> 6) & 0x3F));
+            utf8[length++] = (unsigned char) (0x80 | (c & 0x3F));
+        }
+        else
+        {
+            utf8[length++] = (unsigned char) (0xF0 | (c >> 18));
+            utf8[length++] = (unsigned char) (0x80 | ((c >> 12) & 0x3F));
+            utf8[length++] = (unsigned char) (0x80 | ((c >> 6) & 0x3F));
+            utf8[length++] = (unsigned char) (0x80 | (c & 0x3F));
+        }
+    }
+
+    return length;
+}
+
+/*
+ *  pbkdf2_pads
+ *
+ *  Description:
+ *      Compute the SHA-512 states of HMAC keyed by a password after its
+ *      inner and outer padded keys, and the first PBKDF2 block.
+ *
+ *  Parameters:
+ *      IV [in]
+ *          The initialization vector stored in the stream header (the
+ *          salt).
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *      inner [out]
+ *          The state after the inner padded key.
+ *
+ *      outer [out]
+ *          The state after the outer padded key.
+ *
+ *      u [out]
+ *          The first PBKDF2 block, U1, as big-endian words.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      Every later block is then two compressions from these states.
+ */
+static void pbkdf2_pads(const unsigned char IV[16],
+                        const unsigned char *passwd,
+                        int passlen,
+                        uint64_t inner[8],
+                        uint64_t outer[8],
+                        uint64_t u[8])
+{
+    static const unsigned char index[4] = {0, 0, 0, 1};
+    hmac_sha512_context hmac_ctx;
+    unsigned char utf8[KDF_MAX_UTF8];
+    unsigned char digest[64];
+    size_t length;
+    unsigned i, j;
+
+    length = utf16_to_utf8(passwd, passlen, utf8);
+
+    hmac_sha512_starts(&hmac_ctx, utf8, length);
+    memcpy(inner, hmac_ctx.inner.state, 8 * sizeof(uint64_t));
+    memcpy(outer, hmac_ctx.outer.state, 8 * sizeof(uint64_t));
+
+    hmac_sha512_update(&hmac_ctx, IV, 16);
+    hmac_sha512_update(&hmac_ctx, index, sizeof(index));
+    hmac_sha512_finish(&hmac_ctx, digest);
+
+    for (i = 0; i < 8; i++)
+    {
+        u[i] = 0;
+        for (j = 0; j < 8; j++) u[i] = (u[i] << 8) | digest[8 * i + j];
+    }
+
+    secure_erase(&hmac_ctx, sizeof(hmac_ctx));
+    secure_erase(utf8, sizeof(utf8));
+    secure_erase(digest, sizeof(digest));
+}
+
+/*
+ *  pbkdf2_block
+ *
+ *  Description:
+ *      Form the padded message block hashing a 64-octet digest after a
+ *      128-octet padded key.
+ *
+ *  Parameters:
+ *      block [out]
+ *          The sixteen words of the block; the first eight are left for
+ *          the digest.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void pbkdf2_block(uint64_t block[16])
+{
+    unsigned i;
+
+    block[8] = 0x8000000000000000ULL;
+    for (i = 9; i < 15; i++) block[i] = 0;
+    block[15] = (128 + 64) * 8;
+}
+
+/*
+ *  pbkdf2_sha512
+ *
+ *  Description:
+ *      Derive a 32-octet key from a password with PBKDF2-HMAC-SHA512.
+ *
+ *  Parameters:
+ *      IV [in]
+ *          The initialization vector stored in the stream header (the
+ *          salt).
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password, hashed as UTF-8.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *      iterations [in]
+ *          The iteration count, at least 1.
+ *
+ *      key [out]
+ *          The derived key.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The key is the first half of the single 64-octet PBKDF2 block.
+ */
+static void pbkdf2_sha512(const unsigned char IV[16],
+                          const unsigned char *passwd,
+                          int passlen,
+                          unsigned long iterations,
+                          unsigned char key[32])
+{
+    uint64_t inner[8], outer[8], u[8], t[8], state[8];
+    uint64_t block[16];
+    unsigned long n;
+    unsigned i;
+
+    pbkdf2_pads(IV, passwd, passlen, inner, outer, u);
+    memcpy(t, u, sizeof(t));
+    pbkdf2_block(block);
+
+    for (n = 1; n < iterations; n++)
+    {
+        memcpy(block, u, sizeof(u));
+        memcpy(state, inner, sizeof(state));
+        sha512_process_words(state, block);
+
+        memcpy(block, state, sizeof(state));
+        memcpy(u, outer, sizeof(u));
+        sha512_process_words(u, block);
+
+        for (i = 0; i < 8; i++) t[i] ^= u[i];
+    }
+
+    for (i = 0; i < 32; i++)
+    {
+        key[i] = (unsigned char) (t[i / 8] >> (56 - 8 * (i % 8)));
+    }
+
+    secure_erase(inner, sizeof(inner));
+    secure_erase(outer, sizeof(outer));
+    secure_erase(u, sizeof(u));
+    secure_erase(t, sizeof(t));
+    secure_erase(state, sizeof(state));
+    secure_erase(block, sizeof(block));
+}
+
+/*
+ *  derive_key
+ *
+ *  Description:
+ *      Derive the key used to protect the session IV and key from the
+ *      password.
+ *
+ *  Parameters:
+ *      IV [in]
+ *          The initialization vector stored in the stream header.
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *      iterations [in]
+ *          The PBKDF2 iteration count of a version 3 stream, or 0 for
+ *          earlier versions.
+ *
+ *      key [out]
+ *          The derived 32-octet key.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      Versions 0 to 2 hash the IV and password 8192 times with SHA-256,
+ *      while version 3 uses PBKDF2-HMAC-SHA512 with the IV as the salt.
+ *      A key noted by remember_key() for the same IV and password is used
+ *      once rather than being derived again.
+ */
+void derive_key(const unsigned char IV[16],
+                const unsigned char *passwd,
+                int passlen,
+                unsigned long iterations,
+                unsigned char key[32])
+{
+    sha256_context sha_ctx;
+    unsigned i;
+    double start = 0;
+
+    // Use the key already derived while choosing the password, if any
+    if (memo.valid && (memo.passlen == passlen) &&
+        (memo.iterations == iterations) &&
+        !memcmp(memo.IV, IV, 16) && !memcmp(memo.passwd, passwd, passlen))
+    {
+        memcpy(key, memo.key, 32);
+        secure_erase(&memo, sizeof(memo));
+        return;
+    }
+
+    if (stats_enabled) start = stats_now();
+    AESCRYPT_PROBE1(kdf_start, KDF_ROUNDS(iterations));
+
+    if (iterations)
+    {
+        pbkdf2_sha512(IV, passwd, passlen, iterations, key);
+    }
+    else
+    {
+        memset(key, 0, 32);
+        memcpy(key, IV, 16);
+        for (i = 0; i < AES_CRYPT_KDF_ITERATIONS; i++)
+        {
+            sha256_starts(&sha_ctx);
+            sha256_update(&sha_ctx, key, 32);
+            sha256_update(&sha_ctx, (unsigned char *) passwd, passlen);
+            sha256_finish(&sha_ctx, key);
+        }
+
+        secure_erase(&sha_ctx, sizeof(sha_ctx));
+    }
+
+    AESCRYPT_PROBE1(kdf_end, KDF_ROUNDS(iterations));
+    if (stats_enabled) stats_add(STATS_KDF, stats_now() - start, 0);
+}
+
+/*
+ *  kdf_compress
+ *
+ *  Description:
+ *      Apply the SHA-256 compression function to one block of each lane.
+ *
+ *  Parameters:
+ *      state [in/out]
+ *          The hash state of each lane.
+ *
+ *      block [in]
+ *          The first sixteen words of the message schedule of each lane.
+ *
+ *      active [in]
+ *          All ones for each lane whose state is to be updated, else zero.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      Lanes are kept in the innermost array index, so each step is a loop
+ *      over the lanes that the compiler turns into vector instructions.
+ */
+KDF_TARGETS
+static void kdf_compress(uint32_t state[8][KDF_LANES],
+                         const uint32_t block[16][KDF_LANES],
+                         const uint32_t active[KDF_LANES])
+{
+    uint32_t w[64][KDF_LANES];
+    uint32_t v[8][KDF_LANES];
+    uint32_t t1, t2, x, y;
+    unsigned i, l;
+
+    memcpy(w, block, sizeof(uint32_t) * 16 * KDF_LANES);
+    memcpy(v, state, sizeof(v));
+
+    for (i = 0; i < 64; i++)
+    {
+        if (i >= 16)
+        {
+            for (l = 0; l < KDF_LANES; l++)
+            {
+                x = w[i - 2][l];
+                y = w[i - 15][l];
+                w[i][l] = (KDF_ROTR(x, 17) ^ KDF_ROTR(x, 19) ^ (x >> 10)) +
+                          w[i - 7][l] +
+                          (KDF_ROTR(y, 7) ^ KDF_ROTR(y, 18) ^ (y >> 3)) +
+                          w[i - 16][l];
+            }
+        }
+
+        for (l = 0; l < KDF_LANES; l++)
+        {
+            x = v[4][l];
+            y = v[0][l];
+            t1 = v[7][l] +
+                 (KDF_ROTR(x, 6) ^ KDF_ROTR(x, 11) ^ KDF_ROTR(x, 25)) +
+                 (v[6][l] ^ (x & (v[5][l] ^ v[6][l]))) +
+                 kdf_constants[i] + w[i][l];
+            t2 = (KDF_ROTR(y, 2) ^ KDF_ROTR(y, 13) ^ KDF_ROTR(y, 22)) +
+                 ((y & v[1][l]) | (v[2][l] & (y | v[1][l])));
+            v[7][l] = v[6][l];
+            v[6][l] = v[5][l];
+            v[5][l] = x;
+            v[4][l] = v[3][l] + t1;
+            v[3][l] = v[2][l];
+            v[2][l] = v[1][l];
+            v[1][l] = y;
+            v[0][l] = t1 + t2;
+        }
+    }
+
+    for (i = 0; i < 8; i++)
+    {
+        for (l = 0; l < KDF_LANES; l++) state[i][l] += v[i][l] & active[l];
+    }
+
+    secure_erase(w, sizeof(w));
+    secure_erase(v, sizeof(v));
+}
+
+/*
+ *  kdf512_compress
+ *
+ *  Description:
+ *      Apply the SHA-512 compression function to one block of each lane.
+ *
+ *  Parameters:
+ *      state [in/out]
+ *          The hash state of each lane.
+ *
+ *      block [in]
+ *          The sixteen words of the block of each lane.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      As kdf_compress, with every lane active.
+ */
+KDF_TARGETS
+static void kdf512_compress(uint64_t state[8][KDF_LANES],
+                            const uint64_t block[16][KDF_LANES])
+{
+    uint64_t w[80][KDF_LANES];
+    uint64_t v[8][KDF_LANES];
+    uint64_t t1, t2, x, y;
+    unsigned i, l;
+
+    memcpy(w, block, sizeof(uint64_t) * 16 * KDF_LANES);
+    memcpy(v, state, sizeof(v));
+
+    for (i = 0; i < 80; i++)
+    {
+        if (i >= 16)
+        {
+            for (l = 0; l < KDF_LANES; l++)
+            {
+                x = w[i - 2][l];
+                y = w[i - 15][l];
+                w[i][l] = (KDF_ROTR64(x, 19) ^ KDF_ROTR64(x, 61) ^
+                           (x >> 6)) +
+                          w[i - 7][l] +
+                          (KDF_ROTR64(y, 1) ^ KDF_ROTR64(y, 8) ^
+                           (y >> 7)) +
+                          w[i - 16][l];
+            }
+        }
+
+        for (l = 0; l < KDF_LANES; l++)
+        {
+            x = v[4][l];
+            y = v[0][l];
+            t1 = v[7][l] +
+                 (KDF_ROTR64(x, 14) ^ KDF_ROTR64(x, 18) ^
+                  KDF_ROTR64(x, 41)) +
+                 (v[6][l] ^ (x & (v[5][l] ^ v[6][l]))) +
+                 sha512_constants[i] + w[i][l];
+            t2 = (KDF_ROTR64(y, 28) ^ KDF_ROTR64(y, 34) ^
+                  KDF_ROTR64(y, 39)) +
+                 ((y & v[1][l]) | (v[2][l] & (y | v[1][l])));
+            v[7][l] = v[6][l];
+            v[6][l] = v[5][l];
+            v[5][l] = x;
+            v[4][l] = v[3][l] + t1;
+            v[3][l] = v[2][l];
+            v[2][l] = v[1][l];
+            v[1][l] = y;
+            v[0][l] = t1 + t2;
+        }
+    }
+
+    for (i = 0; i < 8; i++)
+    {
+        for (l = 0; l < KDF_LANES; l++) state[i][l] += v[i][l];
+    }
+
+    secure_erase(w, sizeof(w));
+    secure_erase(v, sizeof(v));
+}
+
+/*
+ *  sha256_lanes
+ *
+ *  Description:
+ *      Derive the keys of versions 0 to 2 for several passwords in
+ *      parallel lanes.
+ *
+ *  Parameters:
+ *      IV [in]
+ *          The initialization vector stored in the stream header.
+ *
+ *      passwds [in]
+ *          The UTF-16LE encoded passwords.
+ *
+ *      passlens [in]
+ *          The length of each password in octets.
+ *
+ *      count [in]
+ *          The number of passwords, at most KDF_LANES.
+ *
+ *      keys [out]
+ *          The derived 32-octet key for each password.
+ *
+ *  Returns:
+ *      0 if successful, -1 if memory could not be allocated.
+ *
+ *  Comments:
+ *      None.
+ */
+static int sha256_lanes(const unsigned char IV[16],
+                        const unsigned char *const passwds[],
+                        const int passlens[],
+                        unsigned count,
+                        unsigned char keys[][32])
+{
+    kdf_messages *messages;
+    uint32_t state[8][KDF_LANES];
+    uint32_t active[KDF_LANES];
+    unsigned char *octets;
+    unsigned blocks = 0;
+    unsigned i, j, l, b;
+
+    if ((messages = calloc(1, sizeof(kdf_messages))) == NULL) return -1;
+    if ((octets = calloc(KDF_MAX_BLOCKS, 64)) == NULL)
+    {
+        free(messages);
+        return -1;
+    }
+
+    // Form the padded message of each lane, the key being replaced by
+    // the previous digest in each iteration
+    for (l = 0; l < count; l++)
+    {
+        size_t length = 32 + passlens[l];
+        unsigned long long bits = (unsigned long long) length * 8;
+
+        memset(octets, 0, KDF_MAX_BLOCKS * 64);
+        memcpy(octets, IV, 16);
+        memcpy(octets + 32, passwds[l], passlens[l]);
+        octets[length] = 0x80;
+        messages->blocks[l] = (length + 9 + 63) / 64;
+        for (i = 0; i < 8; i++)
+        {
+            octets[messages->blocks[l] * 64 - 1 - i] =
+                (unsigned char) (bits >> (8 * i));
+        }
+        for (i = 0; i < messages->blocks[l] * 16; i++)
+        {
+            messages->words[i][l] = ((uint32_t) octets[4 * i] << 24) |
+                                    ((uint32_t) octets[4 * i + 1] << 16) |
+                                    ((uint32_t) octets[4 * i + 2] << 8) |
+                                    (uint32_t) octets[4 * i + 3];
+        }
+        if (messages->blocks[l] > blocks) blocks = messages->blocks[l];
+    }
+
+    for (j = 0; j < AES_CRYPT_KDF_ITERATIONS; j++)
+    {
+        for (l = 0; l < KDF_LANES; l++)
+        {
+            state[0][l] = 0x6A09E667;
+            state[1][l] = 0xBB67AE85;
+            state[2][l] = 0x3C6EF372;
+            state[3][l] = 0xA54FF53A;
+            state[4][l] = 0x510E527F;
+            state[5][l] = 0x9B05688C;
+            state[6][l] = 0x1F83D9AB;
+            state[7][l] = 0x5BE0CD19;
+        }
+
+        for (b = 0; b < blocks; b++)
+        {
+            for (l = 0; l < KDF_LANES; l++)
+            {
+                active[l] = (b < messages->blocks[l]) ? 0xFFFFFFFF : 0;
+            }
+            kdf_compress(state,
+                         (const uint32_t (*)[KDF_LANES])
+                             messages->words[b * 16],
+                         active);
+        }
+
+        memcpy(messages->words, state, sizeof(state));
+    }
+
+    for (l = 0; l < count; l++)
+    {
+        for (i = 0; i < 8; i++)
+        {
+            keys[l][4 * i] = (unsigned char) (state[i][l] >> 24);
+            keys[l][4 * i + 1] = (unsigned char) (state[i][l] >> 16);
+            keys[l][4 * i + 2] = (unsigned char) (state[i][l] >> 8);
+            keys[l][4 * i + 3] = (unsigned char) state[i][l];
+        }
+    }
+
+    secure_erase(messages, sizeof(kdf_messages));
+    secure_erase(octets, KDF_MAX_BLOCKS * 64);
+    secure_erase(state, sizeof(state));
+    free(messages);
+    free(octets);
+
+    return 0;
+}
+
+/*
+ *  pbkdf2_lanes
+ *
+ *  Description:
+ *      Derive the keys of version 3 for several passwords in parallel
+ *      lanes.
+ *
+ *  Parameters:
+ *      IV [in]
+ *          The initialization vector stored in the stream header.
+ *
+ *      passwds [in]
+ *          The UTF-16LE encoded passwords.
+ *
+ *      passlens [in]
+ *          The length of each password in octets.
+ *
+ *      count [in]
+ *          The number of passwords, at most KDF_LANES.
+ *
+ *      iterations [in]
+ *          The PBKDF2 iteration count.
+ *
+ *      keys [out]
+ *          The derived 32-octet key for each password.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      After the padded keys every iteration hashes one block of the same
+ *      shape in each lane, so the lanes never diverge whatever the lengths
+ *      of the passwords.
+ */
+static void pbkdf2_lanes(const unsigned char IV[16],
+                         const unsigned char *const passwds[],
+                         const int passlens[],
+                         unsigned count,
+                         unsigned long iterations,
+                         unsigned char keys[][32])
+{
+    uint64_t inner[8][KDF_LANES], outer[8][KDF_LANES];
+    uint64_t u[8][KDF_LANES], t[8][KDF_LANES];
+    uint64_t state[8][KDF_LANES];
+    uint64_t block[16][KDF_LANES];
+    uint64_t pads[3][8], pad[16];
+    unsigned long n;
+    unsigned i, l;
+
+    memset(inner, 0, sizeof(inner));
+    memset(outer, 0, sizeof(outer));
+    memset(u, 0, sizeof(u));
+    for (l = 0; l < count; l++)
+    {
+        pbkdf2_pads(IV, passwds[l], passlens[l], pads[0], pads[1], pads[2]);
+        for (i = 0; i < 8; i++)
+        {
+            inner[i][l] = pads[0][i];
+            outer[i][l] = pads[1][i];
+            u[i][l] = pads[2][i];
+        }
+    }
+    memcpy(t, u, sizeof(t));
+
+    pbkdf2_block(pad);
+    for (i = 8; i < 16; i++)
+    {
+        for (l = 0; l < KDF_LANES; l++) block[i][l] = pad[i];
+    }
+
+    for (n = 1; n < iterations; n++)
+    {
+        memcpy(block, u, sizeof(u));
+        memcpy(state, inner, sizeof(state));
+        kdf512_compress(state, (const uint64_t (*)[KDF_LANES]) block);
+
+        memcpy(block, state, sizeof(state));
+        memcpy(u, outer, sizeof(u));
+        kdf512_compress(u, (const uint64_t (*)[KDF_LANES]) block);
+
+        for (i = 0; i < 8; i++)
+        {
+            for (l = 0; l < KDF_LANES; l++) t[i][l] ^= u[i][l];
+        }
+    }
+
+    for (l = 0; l < count; l++)
+    {
+        for (i = 0; i < 32; i++)
+        {
+            keys[l][i] = (unsigned char) (t[i / 8][l] >> (56 - 8 * (i % 8)));
+        }
+    }
+
+    secure_erase(inner, sizeof(inner));
+    secure_erase(outer, sizeof(outer));
+    secure_erase(u, sizeof(u));
+    secure_erase(t, sizeof(t));
+    secure_erase(state, sizeof(state));
+    secure_erase(block, sizeof(block));
+    secure_erase(pads, sizeof(pads));
+}
+
+/*
+ *  derive_keys
+ *
+ *  Description:
+ *      Derive the keys for several passwords and the same IV at once, as
+ *      derive_key does for one.
+ *
+ *  Parameters:
+ *      IV [in]
+ *          The initialization vector stored in the stream header.
+ *
+ *      passwds [in]
+ *          The UTF-16LE encoded passwords.
+ *
+ *      passlens [in]
+ *          The length of each password in octets.
+ *
+ *      count [in]
+ *          The number of passwords, at most KDF_LANES.
+ *
+ *      iterations [in]
+ *          The PBKDF2 iteration count of a version 3 stream, or 0 for
+ *          earlier versions.
+ *
+ *      keys [out]
+ *          The derived 32-octet key for each password.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The passwords are hashed in parallel lanes, taking little more
+ *      time than two passwords hashed by derive_key when their lengths are
+ *      similar.
+ */
+void derive_keys(const unsigned char IV[16],
+                 const unsigned char *const passwds[],
+                 const int passlens[],
+                 unsigned count,
+                 unsigned long iterations,
+                 unsigned char keys[][32])
+{
+    unsigned l;
+    int rc = 0;
+    double start = 0;
+
+    // A single password is derived faster alone, as is every password if
+    // memory cannot be allocated for the lanes
+    if (count > 1)
+    {
+        if (stats_enabled) start = stats_now();
+        AESCRYPT_PROBE1(kdf_start, KDF_ROUNDS(iterations));
+
+        if (iterations)
+        {
+            pbkdf2_lanes(IV, passwds, passlens, count, iterations, keys);
+        }
+        else
+        {
+            rc = sha256_lanes(IV, passwds, passlens, count, keys);
+        }
+
+        AESCRYPT_PROBE1(kdf_end, KDF_ROUNDS(iterations));
+        if (!rc)
+        {
+            if (stats_enabled) stats_add(STATS_KDF, stats_now() - start, 0);
+            return;
+        }
+    }
+
+    for (l = 0; l < count; l++)
+    {
+        derive_key(IV, passwds[l], passlens[l], iterations, keys[l]);
+    }
+}
+
+/*
+ *  remember_key
+ *
+ *  Description:
+ *      Note a derived key so the next call to derive_key for the same IV
+ *      and password in this thread need not derive it again.
+ *
+ *  Parameters:
+ *      IV [in]
+ *          The initialization vector stored in the stream header.
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *      iterations [in]
+ *          The iteration count given to derive_key.
+ *
+ *      key [in]
+ *          The key derived from them.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      Only one key is noted, and it is erased once used.
+ */
+void remember_key(const unsigned char IV[16],
+                  const unsigned char *passwd,
+                  int passlen,
+                  unsigned long iterations,
+                  const unsigned char key[32])
+{
+    memo.valid = 1;
+    memcpy(memo.IV, IV, 16);
+    memcpy(memo.passwd, passwd, passlen);
+    memo.passlen = passlen;
+    memo.iterations = iterations;
+    memcpy(memo.key, key, 32);
+}
+
+/*
+ *  wrap_session_key
+ *
+ *  Description:
+ *      Encrypt the session IV and key with the password-derived key using
+ *      AES-256 in CBC mode and compute the HMAC over the result.
+ *
+ *  Parameters:
+ *      key [in]
+ *          The password-derived key (see derive_key).
+ *
+ *      IV [in]
+ *          The initialization vector stored in the stream header.
+ *
+ *      version [in]
+ *          The stream format version.
+ *
+ *      iv_key [in]
+ *          The session IV and key to protect.
+ *
+ *      wrapped [out]
+ *          The encrypted session IV and key.
+ *
+ *      hmac [out]
+ *          The HMAC over the encrypted session IV and key.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      Version 3 appends the version octet to the data authenticated.
+ */
+void wrap_session_key(const unsigned char key[32],
+                      const unsigned char IV[16],
+                      unsigned char version,
+                      const unsigned char iv_key[48],
+                      unsigned char wrapped[48],
+                      unsigned char hmac[32])
+{
+    aes_context aes_ctx;
+    hmac_sha256_context hmac_ctx;
+    const unsigned char *chain = IV;
+    unsigned i, j;
+
+    aes_set_key(&aes_ctx, (unsigned char *) key, 256);
+    hmac_sha256_starts(&hmac_ctx, key, 32);
+
+    for (i = 0; i < 48; i += 16)
+    {
+        // XOR plain text block with previous encrypted
+        // output (i.e., use CBC)
+        for (j = 0; j < 16; j++) wrapped[i + j] = iv_key[i + j] ^ chain[j];
+
+        aes_encrypt(&aes_ctx, wrapped + i, wrapped + i);
+
+        chain = wrapped + i;
+    }
+
+    hmac_sha256_update(&hmac_ctx, wrapped, 48);
+    if (version == 0x03) hmac_sha256_update(&hmac_ctx, &version, 1);
+    hmac_sha256_finish(&hmac_ctx, hmac);
+
+    secure_erase(&aes_ctx, sizeof(aes_ctx));
+}
+
+/*
+ *  unwrap_session_key
+ *
+ *  Description:
+ *      Verify the HMAC over the encrypted session IV and key and, if it
+ *      is correct, decrypt them.
+ *
+ *  Parameters:
+ *      key [in]
+ *          The password-derived key (see derive_key).
+ *
+ *      IV [in]
+ *          The initialization vector stored in the stream header.
+ *
+ *      version [in]
+ *          The stream format version.
+ *
+ *      wrapped [in]
+ *          The encrypted session IV and key.
+ *
+ *      hmac [in]
+ *          The HMAC read from the stream.
+ *
+ *      iv_key [out]
+ *          The decrypted session IV and key.
+ *
+ *  Returns:
+ *      0 if successful, -1 if the HMAC does not verify (i.e., the password
+ *      is incorrect or the stream has been altered).
+ *
+ *  Comments:
+ *      Version 3 appends the version octet to the data authenticated.
+ */
+int unwrap_session_key(const unsigned char key[32],
+                       const unsigned char IV[16],
+                       unsigned char version,
+                       const unsigned char wrapped[48],
+                       const unsigned char hmac[32],
+                       unsigned char iv_key[48])
+{
+    aes_context aes_ctx;
+    hmac_sha256_context hmac_ctx;
+    sha256_t digest;
+    unsigned char buffer[16];
+    const unsigned char *chain = IV;
+    unsigned i, j;
+
+    hmac_sha256_starts(&hmac_ctx, key, 32);
+    hmac_sha256_update(&hmac_ctx, wrapped, 48);
+    if (version == 0x03) hmac_sha256_update(&hmac_ctx, &version, 1);
+    hmac_sha256_finish(&hmac_ctx, digest);
+
+    if (memcmp(digest, hmac, 32))
+    {
+        AESCRYPT_PROBE1(session_unwrap, 0);
+        return -1;
+    }
+
+    aes_set_key(&aes_ctx, (unsigned char *) key, 256);
+
+    for (i = 0; i < 48; i += 16)
+    {
+        aes_decrypt(&aes_ctx, (unsigned char *) wrapped + i, buffer);
+
+        // XOR plain text block with previous encrypted
+        // output (i.e., use CBC)
+        for (j = 0; j < 16; j++) iv_key[i + j] = buffer[j] ^ chain[j];
+
+        chain = wrapped + i;
+    }
+
+    secure_erase(&aes_ctx, sizeof(aes_ctx));
+    secure_erase(buffer, sizeof(buffer));
+
+    AESCRYPT_PROBE1(session_unwrap, 1);
+
+    return 0;
+}
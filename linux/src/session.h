@@ -0,0 +1,60 @@
+/*
+ *  session.h
+ *
+ *  Session Key Utilities for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to generate, wrap, and unwrap the random IV and key used
+ *      to encrypt the bulk of an AES Crypt stream, along with the
+ *      password-based key derivation used to protect them.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#ifndef AESCRYPT_SESSION_H
+#define AESCRYPT_SESSION_H
+
+#include <stdio.h>
+
+#define AES_CRYPT_KDF_ITERATIONS 8192
+#define AES_CRYPT_SESSION_LEN    48  /* 16-octet IV plus 32-octet key */
+#define KDF_LANES                8   /* Passwords derive_keys() hashes */
+#define AES_CRYPT_V3_ITERATIONS  300000     /* Default PBKDF2 iterations */
+#define AES_CRYPT_V3_MAX_ITERATIONS 5000000 /* Most PBKDF2 iterations */
+
+// Function prototypes
+int generate_iv(FILE *randfp, unsigned char IV[16]);
+int generate_iv_key(FILE *randfp, unsigned char iv_key[48]);
+void derive_key(const unsigned char IV[16],
+                const unsigned char *passwd,
+                int passlen,
+                unsigned long iterations,
+                unsigned char key[32]);
+void derive_keys(const unsigned char IV[16],
+                 const unsigned char *const passwds[],
+                 const int passlens[],
+                 unsigned count,
+                 unsigned long iterations,
+                 unsigned char keys[][32]);
+void remember_key(const unsigned char IV[16],
+                  const unsigned char *passwd,
+                  int passlen,
+                  unsigned long iterations,
+                  const unsigned char key[32]);
+void wrap_session_key(const unsigned char key[32],
+                      const unsigned char IV[16],
+                      unsigned char version,
+                      const unsigned char iv_key[48],
+                      unsigned char wrapped[48],
+                      unsigned char hmac[32]);
+int unwrap_session_key(const unsigned char key[32],
+                       const unsigned char IV[16],
+                       unsigned char version,
+                       const unsigned char wrapped[48],
+                       const unsigned char hmac[32],
+                       unsigned char iv_key[48]);
+
+#endif // AESCRYPT_SESSION_H
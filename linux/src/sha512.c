@@ -0,0 +1,416 @@
+/*
+ *  sha512.c
+ *
+ *  SHA-512 for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      The SHA-512 hash function (FIPS 180-4) and HMAC-SHA512 (RFC 2104),
+ *      used by the key derivation of version 3 streams.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#include <string.h>
+
+#include "sha512.h"
+#include "util.h"
+
+#define SHA512_ROTR(x,n)    (((x) >> (n)) | ((x) << (64 - (n))))
+
+const uint64_t sha512_initial_state[8] =
+{
+    0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL,
+    0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+    0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL,
+    0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+};
+
+const uint64_t sha512_constants[80] =
+{
+    0x428A2F98D728AE22ULL, 0x7137449123EF65CDULL, 0xB5C0FBCFEC4D3B2FULL,
+    0xE9B5DBA58189DBBCULL, 0x3956C25BF348B538ULL, 0x59F111F1B605D019ULL,
+    0x923F82A4AF194F9BULL, 0xAB1C5ED5DA6D8118ULL, 0xD807AA98A3030242ULL,
+    0x12835B0145706FBEULL, 0x243185BE4EE4B28CULL, 0x550C7DC3D5FFB4E2ULL,
+    0x72BE5D74F27B896FULL, 0x80DEB1FE3B1696B1ULL, 0x9BDC06A725C71235ULL,
+    0xC19BF174CF692694ULL, 0xE49B69C19EF14AD2ULL, 0xEFBE4786384F25E3ULL,
+    0x0FC19DC68B8CD5B5ULL, 0x240CA1CC77AC9C65ULL, 0x2DE92C6F592B0275ULL,
+    0x4A7484AA6EA6E483ULL, 0x5CB0A9DCBD41FBD4ULL, 0x76F988DA831153B5ULL,
+    0x983E5152EE66DFABULL, 0xA831C66D2DB43210ULL, 0xB00327C898FB213FULL,
+    0xBF597FC7BEEF0EE4ULL, 0xC6E00BF33DA88FC2ULL, 0xD5A79147930AA725ULL,
+    0x06CA6351E003826FULL, 0x142929670A0E6E70ULL, 0x27B70A8546D22FFCULL,
+    0x2E1B21385C26C926ULL, 0x4D2C6DFC5AC42AEDULL, 0x53380D139D95B3DFULL,
+    0x650A73548BAF63DEULL, 0x766A0ABB3C77B2A8ULL, 0x81C2C92E47EDAEE6ULL,
+    0x92722C851482353BULL, 0xA2BFE8A14CF10364ULL, 0xA81A664BBC423001ULL,
+    0xC24B8B70D0F89791ULL, 0xC76C51A30654BE30ULL, 0xD192E819D6EF5218ULL,
+    0xD69906245565A910ULL, 0xF40E35855771202AULL, 0x106AA07032BBD1B8ULL,
+    0x19A4C116B8D2D0C8ULL, 0x1E376C085141AB53ULL, 0x2748774CDF8EEB99ULL,
+    0x34B0BCB5E19B48A8ULL, 0x391C0CB3C5C95A63ULL, 0x4ED8AA4AE3418ACBULL,
+    0x5B9CCA4F7763E373ULL, 0x682E6FF3D6B2B8A3ULL, 0x748F82EE5DEFB2FCULL,
+    0x78A5636F43172F60ULL, 0x84C87814A1F0AB72ULL, 0x8CC702081A6439ECULL,
+    0x90BEFFFA23631E28ULL, 0xA4506CEBDE82BDE9ULL, 0xBEF9A3F7B2C67915ULL,
+    0xC67178F2E372532BULL, 0xCA273ECEEA26619CULL, 0xD186B8C721C0C207ULL,
+    0xEADA7DD6CDE0EB1EULL, 0xF57D4F7FEE6ED178ULL, 0x06F067AA72176FBAULL,
+    0x0A637DC5A2C898A6ULL, 0x113F9804BEF90DAEULL, 0x1B710B35131C471BULL,
+    0x28DB77F523047D84ULL, 0x32CAAB7B40C72493ULL, 0x3C9EBE0A15C9BEBCULL,
+    0x431D67C49C100D4CULL, 0x4CC5D4BECB3E42B6ULL, 0x597F299CFC657E2AULL,
+    0x5FCB6FAB3AD6FAECULL, 0x6C44198C4A475817ULL
+};
+
+/*
+ *  sha512_starts
+ *
+ *  Description:
+ *      Begin computing a SHA-512 digest.
+ *
+ *  Parameters:
+ *      ctx [out]
+ *          The SHA-512 context.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void sha512_starts(sha512_context *ctx)
+{
+    memcpy(ctx->state, sha512_initial_state, sizeof(ctx->state));
+    ctx->total = 0;
+}
+
+/*
+ *  sha512_process_words
+ *
+ *  Description:
+ *      Apply the SHA-512 compression function to one block given as
+ *      words.
+ *
+ *  Parameters:
+ *      state [in/out]
+ *          The hash state.
+ *
+ *      block [in]
+ *          The block as sixteen big-endian words.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The working variables are rotated by renaming them through the
+ *      rounds, eight at a time, rather than by moving their values.
+ */
+void sha512_process_words(uint64_t state[8], const uint64_t block[16])
+{
+    uint64_t w[80];
+    uint64_t a, b, c, d, e, f, g, h, t1;
+    unsigned i;
+
+    memcpy(w, block, 16 * sizeof(uint64_t));
+    for (i = 16; i < 80; i++)
+    {
+        w[i] = (SHA512_ROTR(w[i - 2], 19) ^ SHA512_ROTR(w[i - 2], 61) ^
+                (w[i - 2] >> 6)) +
+               w[i - 7] +
+               (SHA512_ROTR(w[i - 15], 1) ^ SHA512_ROTR(w[i - 15], 8) ^
+                (w[i - 15] >> 7)) +
+               w[i - 16];
+    }
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    f = state[5];
+    g = state[6];
+    h = state[7];
+
+#define SHA512_ROUND(a,b,c,d,e,f,g,h,i)                                     \
+    t1 = h + (SHA512_ROTR(e, 14) ^ SHA512_ROTR(e, 18) ^                     \
+              SHA512_ROTR(e, 41)) +                                         \
+         (g ^ (e & (f ^ g))) + sha512_constants[i] + w[i];                  \
+    d += t1;                                                                \
+    h = t1 + (SHA512_ROTR(a, 28) ^ SHA512_ROTR(a, 34) ^                     \
+              SHA512_ROTR(a, 39)) +                                         \
+        ((a & b) | (c & (a | b)));
+
+    for (i = 0; i < 80; i += 8)
+    {
+        SHA512_ROUND(a, b, c, d, e, f, g, h, i);
+        SHA512_ROUND(h, a, b, c, d, e, f, g, i + 1);
+        SHA512_ROUND(g, h, a, b, c, d, e, f, i + 2);
+        SHA512_ROUND(f, g, h, a, b, c, d, e, i + 3);
+        SHA512_ROUND(e, f, g, h, a, b, c, d, i + 4);
+        SHA512_ROUND(d, e, f, g, h, a, b, c, i + 5);
+        SHA512_ROUND(c, d, e, f, g, h, a, b, i + 6);
+        SHA512_ROUND(b, c, d, e, f, g, h, a, i + 7);
+    }
+
+#undef SHA512_ROUND
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+
+    secure_erase(w, sizeof(w));
+}
+
+/*
+ *  sha512_process
+ *
+ *  Description:
+ *      Apply the SHA-512 compression function to one block.
+ *
+ *  Parameters:
+ *      state [in/out]
+ *          The hash state.
+ *
+ *      block [in]
+ *          The 128-octet block.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void sha512_process(uint64_t state[8], const unsigned char block[128])
+{
+    uint64_t w[16];
+    unsigned i;
+
+    for (i = 0; i < 16; i++)
+    {
+        w[i] = ((uint64_t) block[8 * i] << 56) |
+               ((uint64_t) block[8 * i + 1] << 48) |
+               ((uint64_t) block[8 * i + 2] << 40) |
+               ((uint64_t) block[8 * i + 3] << 32) |
+               ((uint64_t) block[8 * i + 4] << 24) |
+               ((uint64_t) block[8 * i + 5] << 16) |
+               ((uint64_t) block[8 * i + 6] << 8) |
+               (uint64_t) block[8 * i + 7];
+    }
+
+    sha512_process_words(state, w);
+
+    secure_erase(w, sizeof(w));
+}
+
+/*
+ *  sha512_update
+ *
+ *  Description:
+ *      Add data to a SHA-512 digest.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The SHA-512 context.
+ *
+ *      data [in]
+ *          The data to hash.
+ *
+ *      length [in]
+ *          The length of the data in octets.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void sha512_update(sha512_context *ctx,
+                   const unsigned char *data,
+                   size_t length)
+{
+    size_t used = ctx->total % 128;
+    size_t n;
+
+    ctx->total += length;
+
+    if (used)
+    {
+        n = (length < 128 - used) ? length : 128 - used;
+        memcpy(ctx->buffer + used, data, n);
+        data += n;
+        length -= n;
+        if (used + n < 128) return;
+        sha512_process(ctx->state, ctx->buffer);
+    }
+
+    while (length >= 128)
+    {
+        sha512_process(ctx->state, data);
+        data += 128;
+        length -= 128;
+    }
+
+    memcpy(ctx->buffer, data, length);
+}
+
+/*
+ *  sha512_finish
+ *
+ *  Description:
+ *      Complete a SHA-512 digest.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The SHA-512 context.
+ *
+ *      digest [out]
+ *          The 64-octet digest.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      Messages are limited to 2^64 - 1 octets.
+ */
+void sha512_finish(sha512_context *ctx, unsigned char digest[64])
+{
+    size_t used = ctx->total % 128;
+    uint64_t bits = ctx->total << 3;
+    unsigned i;
+
+    ctx->buffer[used++] = 0x80;
+    if (used > 112)
+    {
+        memset(ctx->buffer + used, 0, 128 - used);
+        sha512_process(ctx->state, ctx->buffer);
+        used = 0;
+    }
+    memset(ctx->buffer + used, 0, 120 - used);
+    for (i = 0; i < 8; i++)
+    {
+        ctx->buffer[120 + i] = (unsigned char) (bits >> (56 - 8 * i));
+    }
+    ctx->buffer[112] = (unsigned char) (ctx->total >> 61);
+    sha512_process(ctx->state, ctx->buffer);
+
+    for (i = 0; i < 64; i++)
+    {
+        digest[i] = (unsigned char) (ctx->state[i / 8] >> (56 - 8 * (i % 8)));
+    }
+
+    secure_erase(ctx, sizeof(sha512_context));
+}
+
+/*
+ *  hmac_sha512_starts
+ *
+ *  Description:
+ *      Begin computing an HMAC-SHA512.
+ *
+ *  Parameters:
+ *      ctx [out]
+ *          The HMAC context.
+ *
+ *      key [in]
+ *          The key.
+ *
+ *      length [in]
+ *          The length of the key in octets.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      Keys longer than the block size are hashed first.
+ */
+void hmac_sha512_starts(hmac_sha512_context *ctx,
+                        const unsigned char *key,
+                        size_t length)
+{
+    unsigned char pad[128];
+    unsigned char digest[64];
+    unsigned i;
+
+    if (length > 128)
+    {
+        sha512_starts(&ctx->inner);
+        sha512_update(&ctx->inner, key, length);
+        sha512_finish(&ctx->inner, digest);
+        key = digest;
+        length = 64;
+    }
+
+    memset(pad, 0x36, sizeof(pad));
+    for (i = 0; i < length; i++) pad[i] ^= key[i];
+    sha512_starts(&ctx->inner);
+    sha512_update(&ctx->inner, pad, sizeof(pad));
+
+    memset(pad, 0x5C, sizeof(pad));
+    for (i = 0; i < length; i++) pad[i] ^= key[i];
+    sha512_starts(&ctx->outer);
+    sha512_update(&ctx->outer, pad, sizeof(pad));
+
+    secure_erase(pad, sizeof(pad));
+    secure_erase(digest, sizeof(digest));
+}
+
+/*
+ *  hmac_sha512_update
+ *
+ *  Description:
+ *      Add data to an HMAC-SHA512.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The HMAC context.
+ *
+ *      data [in]
+ *          The data to authenticate.
+ *
+ *      length [in]
+ *          The length of the data in octets.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void hmac_sha512_update(hmac_sha512_context *ctx,
+                        const unsigned char *data,
+                        size_t length)
+{
+    sha512_update(&ctx->inner, data, length);
+}
+
+/*
+ *  hmac_sha512_finish
+ *
+ *  Description:
+ *      Complete an HMAC-SHA512.
+ *
+ *  Parameters:
+ *      ctx [in/out]
+ *          The HMAC context.
+ *
+ *      digest [out]
+ *          The 64-octet HMAC.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void hmac_sha512_finish(hmac_sha512_context *ctx, unsigned char digest[64])
+{
+    unsigned char inner[64];
+
+    sha512_finish(&ctx->inner, inner);
+    sha512_update(&ctx->outer, inner, sizeof(inner));
+    sha512_finish(&ctx->outer, digest);
+
+    secure_erase(inner, sizeof(inner));
+}
@@ -0,0 +1,55 @@
+/*
+ *  sha512.h
+ *
+ *  SHA-512 for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      The SHA-512 hash function (FIPS 180-4) and HMAC-SHA512 (RFC 2104),
+ *      used by the key derivation of version 3 streams.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#ifndef AESCRYPT_SHA512_H
+#define AESCRYPT_SHA512_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint64_t state[8];
+    uint64_t total;                 // Octets hashed
+    unsigned char buffer[128];      // Octets not yet hashed
+} sha512_context;
+
+typedef struct {
+    sha512_context inner;
+    sha512_context outer;
+} hmac_sha512_context;
+
+// Initial hash value of SHA-512
+extern const uint64_t sha512_initial_state[8];
+
+// Round constants of SHA-512
+extern const uint64_t sha512_constants[80];
+
+// Function prototypes
+void sha512_starts(sha512_context *ctx);
+void sha512_process_words(uint64_t state[8], const uint64_t block[16]);
+void sha512_process(uint64_t state[8], const unsigned char block[128]);
+void sha512_update(sha512_context *ctx,
+                   const unsigned char *data,
+                   size_t length);
+void sha512_finish(sha512_context *ctx, unsigned char digest[64]);
+void hmac_sha512_starts(hmac_sha512_context *ctx,
+                        const unsigned char *key,
+                        size_t length);
+void hmac_sha512_update(hmac_sha512_context *ctx,
+                        const unsigned char *data,
+                        size_t length);
+void hmac_sha512_finish(hmac_sha512_context *ctx, unsigned char digest[64]);
+
+#endif // AESCRYPT_SHA512_H
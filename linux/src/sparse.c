@@ -0,0 +1,558 @@
+/*
+ *  sparse.c
+ *
+ *  Sparse File Handling for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to read sparse files without reading their holes and
+ *      to write decrypted data as a sparse file.
+ *
+ *      When encrypting a regular file that has holes, the input is read
+ *      through a stdio stream that finds the holes with SEEK_DATA and
+ *      SEEK_HOLE and produces zeros for them rather than reading them
+ *      from the file system.
+ *
+ *      When decrypting into a regular file, the output is written
+ *      through a stdio stream that writes at explicit offsets and skips
+ *      over blocks of SPARSE_BLOCK_SIZE octets that are entirely zero,
+ *      leaving holes in the file.  Blocks that overlay data already in
+ *      the file are punched out instead, or written if that is not
+ *      supported.  The size of the file is set when the stream is
+ *      closed, since a trailing hole is never written.
+ *
+ *  Portability Issues:
+ *      Requires fopencookie().  Holes are found using SEEK_DATA and
+ *      SEEK_HOLE and punched using fallocate() where available.
+ */
+
+#define _GNU_SOURCE    // fopencookie, SEEK_DATA, fallocate
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sparse.h"
+
+typedef struct {
+    FILE *infp;
+    int fd;
+    off_t offset;                   // Offset of the next octet to read
+    off_t segment_end;              // End of the current data or hole
+    int hole;                       // The current segment is a hole
+} sparse_reader;
+
+typedef struct {
+    FILE *outfp;
+    int fd;
+    off_t offset;                   // Offset of the next octet to write
+    off_t original_size;            // Size of the file when opened
+} sparse_writer;
+
+/*
+ *  is_zero
+ *
+ *  Description:
+ *      Determine whether a buffer holds only zeros.
+ *
+ *  Parameters:
+ *      data [in]
+ *          The data to examine.
+ *
+ *      length [in]
+ *          The length of the data.
+ *
+ *  Returns:
+ *      1 if every octet is zero, otherwise 0.
+ *
+ *  Comments:
+ *      Sixty-four octets are combined at a time using word operations,
+ *      which the compiler turns into vector instructions.
+ */
+static int is_zero(const unsigned char *data, size_t length)
+{
+    uint64_t words[8];
+    uint64_t any;
+    unsigned i;
+
+    while (length >= sizeof(words))
+    {
+        memcpy(words, data, sizeof(words));
+        any = 0;
+        for (i = 0; i < 8; i++) any |= words[i];
+        if (any) return 0;
+        data += sizeof(words);
+        length -= sizeof(words);
+    }
+
+    while (length--)
+    {
+        if (*data++) return 0;
+    }
+
+    return 1;
+}
+
+/*
+ *  next_segment
+ *
+ *  Description:
+ *      Find the extent of the data or hole at the current read offset.
+ *
+ *  Parameters:
+ *      r [in/out]
+ *          The sparse_reader.
+ *
+ *  Returns:
+ *      0 if successful, otherwise -1.
+ *
+ *  Comments:
+ *      If the file system cannot report holes, the balance of the file
+ *      is treated as data.
+ */
+static int next_segment(sparse_reader *r)
+{
+    struct stat st;
+    off_t data;
+
+    if ((data = lseek(r->fd, r->offset, SEEK_DATA)) < 0)
+    {
+        if (errno != ENXIO)
+        {
+            r->hole = 0;
+            r->segment_end = INT64_MAX;
+            return 0;
+        }
+
+        // There is no more data, though a hole may extend to the end
+        if (fstat(r->fd, &st)) return -1;
+        r->hole = 1;
+        r->segment_end = (st.st_size > r->offset) ? st.st_size : r->offset;
+        return 0;
+    }
+
+    if (data > r->offset)
+    {
+        r->hole = 1;
+        r->segment_end = data;
+        return 0;
+    }
+
+    r->hole = 0;
+    if ((r->segment_end = lseek(r->fd, r->offset, SEEK_HOLE)) <= r->offset)
+    {
+        r->segment_end = INT64_MAX;
+    }
+
+    return 0;
+}
+
+/*
+ *  sparse_read
+ *
+ *  Description:
+ *      The read function of the stdio stream returned by
+ *      sparse_reader_open().
+ *
+ *  Parameters:
+ *      cookie [in]
+ *          The sparse_reader.
+ *
+ *      buffer [out]
+ *          The buffer to fill.
+ *
+ *      size [in]
+ *          The size of the buffer.
+ *
+ *  Returns:
+ *      The number of octets read, 0 at the end of the file, or -1 if
+ *      there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static ssize_t sparse_read(void *cookie, char *buffer, size_t size)
+{
+    sparse_reader *r = (sparse_reader *) cookie;
+    ssize_t n;
+
+    if ((r->offset >= r->segment_end) && next_segment(r))
+    {
+        perror("Error reading input file");
+        return -1;
+    }
+
+    if ((off_t) size > r->segment_end - r->offset)
+    {
+        size = r->segment_end - r->offset;
+    }
+
+    if (r->hole)
+    {
+        memset(buffer, 0, size);
+        n = size;
+    }
+    else
+    {
+        while (((n = pread(r->fd, buffer, size, r->offset)) < 0) &&
+               (errno == EINTR));
+        if (n < 0)
+        {
+            perror("Error reading input file");
+            return -1;
+        }
+    }
+
+    r->offset += n;
+
+    return n;
+}
+
+/*
+ *  sparse_reader_close
+ *
+ *  Description:
+ *      The close function of the stdio stream returned by
+ *      sparse_reader_open().
+ *
+ *  Parameters:
+ *      cookie [in]
+ *          The sparse_reader.
+ *
+ *  Returns:
+ *      0 if successful, otherwise -1.
+ *
+ *  Comments:
+ *      The input stream is not closed, but is positioned just past what
+ *      was read.
+ */
+static int sparse_reader_close(void *cookie)
+{
+    sparse_reader *r = (sparse_reader *) cookie;
+    int rc = fseeko(r->infp, r->offset, SEEK_SET) ? -1 : 0;
+
+    free(r);
+
+    return rc;
+}
+
+/*
+ *  sparse_reader_open
+ *
+ *  Description:
+ *      Open a stream that reads the input without reading its holes.
+ *
+ *  Parameters:
+ *      infp [in]
+ *          The input stream.
+ *
+ *  Returns:
+ *      The stream, or NULL if the input is not a regular file with holes
+ *      or the stream could not be created.
+ *
+ *  Comments:
+ *      When NULL is returned, the input should be read directly.
+ */
+FILE *sparse_reader_open(FILE *infp)
+{
+    cookie_io_functions_t functions = {sparse_read,
+                                       NULL,
+                                       NULL,
+                                       sparse_reader_close};
+    sparse_reader *r;
+    struct stat st;
+    off_t offset;
+    off_t position;
+    off_t hole;
+    int fd = fileno(infp);
+    FILE *fp;
+
+    if ((fd < 0) || fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+        ((offset = ftello(infp)) < 0))
+    {
+        return NULL;
+    }
+
+    // Files without holes are read as usual, so restore the descriptor's
+    // offset moved by looking for a hole
+    if (((position = lseek(fd, 0, SEEK_CUR)) < 0) ||
+        ((hole = lseek(fd, offset, SEEK_HOLE)) < 0) ||
+        (lseek(fd, position, SEEK_SET) < 0) ||
+        (hole >= st.st_size))
+    {
+        return NULL;
+    }
+
+    if ((r = calloc(1, sizeof(sparse_reader))) == NULL) return NULL;
+    r->infp = infp;
+    r->fd = fd;
+    r->offset = offset;
+    r->segment_end = offset;
+
+    if ((fp = fopencookie(r, "r", functions)) == NULL)
+    {
+        free(r);
+        return NULL;
+    }
+    setvbuf(fp, NULL, _IOFBF, SPARSE_BUFFER_SIZE);
+
+    return fp;
+}
+
+/*
+ *  write_data
+ *
+ *  Description:
+ *      Write data to the output file at the given offset.
+ *
+ *  Parameters:
+ *      w [in]
+ *          The sparse_writer.
+ *
+ *      data [in]
+ *          The data to write.
+ *
+ *      length [in]
+ *          The length of the data.
+ *
+ *      offset [in]
+ *          The offset in the file at which to write.
+ *
+ *  Returns:
+ *      0 if successful, otherwise -1.
+ *
+ *  Comments:
+ *      None.
+ */
+static int write_data(sparse_writer *w,
+                      const char *data,
+                      size_t length,
+                      off_t offset)
+{
+    ssize_t n;
+
+    while (length)
+    {
+        if ((n = pwrite(w->fd, data, length, offset)) < 0)
+        {
+            if (errno == EINTR) continue;
+            perror("Error writing output file");
+            return -1;
+        }
+        data += n;
+        length -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+/*
+ *  punch_hole
+ *
+ *  Description:
+ *      Ensure a block of the output file reads as zeros without writing
+ *      it.
+ *
+ *  Parameters:
+ *      w [in]
+ *          The sparse_writer.
+ *
+ *      offset [in]
+ *          The offset of the block.
+ *
+ *      length [in]
+ *          The length of the block.
+ *
+ *  Returns:
+ *      0 if the block reads as zeros, or -1 if it must be written.
+ *
+ *  Comments:
+ *      Blocks beyond the original end of the file are already holes.
+ */
+static int punch_hole(sparse_writer *w, off_t offset, off_t length)
+{
+    if (offset >= w->original_size) return 0;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (!fallocate(w->fd,
+                   FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                   offset,
+                   length))
+    {
+        return 0;
+    }
+#else
+    (void) length;
+#endif
+
+    return -1;
+}
+
+/*
+ *  sparse_write
+ *
+ *  Description:
+ *      The write function of the stdio stream returned by
+ *      sparse_writer_open().
+ *
+ *  Parameters:
+ *      cookie [in]
+ *          The sparse_writer.
+ *
+ *      buffer [in]
+ *          The data to write.
+ *
+ *      size [in]
+ *          The length of the data.
+ *
+ *  Returns:
+ *      The number of octets written, or -1 if there was an error.
+ *
+ *  Comments:
+ *      Consecutive blocks that are not skipped are written together.
+ */
+static ssize_t sparse_write(void *cookie, const char *buffer, size_t size)
+{
+    sparse_writer *w = (sparse_writer *) cookie;
+    const char *run = buffer;
+    size_t run_length = 0;
+    off_t run_offset = w->offset;
+    size_t used = 0;
+    size_t n;
+
+    while (used < size)
+    {
+        n = SPARSE_BLOCK_SIZE - (size_t) (w->offset % SPARSE_BLOCK_SIZE);
+        if (n > size - used) n = size - used;
+
+        if ((n == SPARSE_BLOCK_SIZE) &&
+            is_zero((const unsigned char *) buffer + used, n) &&
+            !punch_hole(w, w->offset, n))
+        {
+            if (run_length &&
+                write_data(w, run, run_length, run_offset))
+            {
+                return -1;
+            }
+            run_length = 0;
+        }
+        else
+        {
+            if (!run_length)
+            {
+                run = buffer + used;
+                run_offset = w->offset;
+            }
+            run_length += n;
+        }
+
+        used += n;
+        w->offset += n;
+    }
+
+    if (run_length && write_data(w, run, run_length, run_offset))
+    {
+        return -1;
+    }
+
+    return size;
+}
+
+/*
+ *  sparse_writer_close
+ *
+ *  Description:
+ *      The close function of the stdio stream returned by
+ *      sparse_writer_open().
+ *
+ *  Parameters:
+ *      cookie [in]
+ *          The sparse_writer.
+ *
+ *  Returns:
+ *      0 if successful, otherwise -1.
+ *
+ *  Comments:
+ *      The file is extended over any trailing hole and the output stream
+ *      is positioned just past what was written.  The output stream is
+ *      not closed.
+ */
+static int sparse_writer_close(void *cookie)
+{
+    sparse_writer *w = (sparse_writer *) cookie;
+    struct stat st;
+    int rc = 0;
+
+    if (fstat(w->fd, &st) ||
+        ((st.st_size < w->offset) && ftruncate(w->fd, w->offset)) ||
+        fseeko(w->outfp, w->offset, SEEK_SET))
+    {
+        perror("Error setting the output file size");
+        rc = -1;
+    }
+
+    free(w);
+
+    return rc;
+}
+
+/*
+ *  sparse_writer_open
+ *
+ *  Description:
+ *      Open a stream that writes to the output, leaving holes where the
+ *      data is zeros.
+ *
+ *  Parameters:
+ *      outfp [in]
+ *          The output stream.
+ *
+ *  Returns:
+ *      The stream, or NULL if the output is not a regular file that can
+ *      be written at any offset or the stream could not be created.
+ *
+ *  Comments:
+ *      When NULL is returned, the output should be written directly.
+ */
+FILE *sparse_writer_open(FILE *outfp)
+{
+    cookie_io_functions_t functions = {NULL,
+                                       sparse_write,
+                                       NULL,
+                                       sparse_writer_close};
+    sparse_writer *w;
+    struct stat st;
+    off_t offset;
+    int fd = fileno(outfp);
+    int flags;
+    FILE *fp;
+
+    if ((fd < 0) || fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+        ((flags = fcntl(fd, F_GETFL)) < 0) || (flags & O_APPEND) ||
+        fflush(outfp) || ((offset = ftello(outfp)) < 0))
+    {
+        return NULL;
+    }
+
+    if ((w = calloc(1, sizeof(sparse_writer))) == NULL) return NULL;
+    w->outfp = outfp;
+    w->fd = fd;
+    w->offset = offset;
+    w->original_size = st.st_size;
+
+    if ((fp = fopencookie(w, "w", functions)) == NULL)
+    {
+        free(w);
+        return NULL;
+    }
+    setvbuf(fp, NULL, _IOFBF, SPARSE_BUFFER_SIZE);
+
+    return fp;
+}
@@ -0,0 +1,29 @@
+/*
+ *  sparse.h
+ *
+ *  Sparse File Handling for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to read sparse files without reading their holes and
+ *      to write decrypted data as a sparse file.
+ *
+ *  Portability Issues:
+ *      Requires fopencookie().  Holes are found using SEEK_DATA and
+ *      SEEK_HOLE and punched using fallocate() where available.
+ */
+
+#ifndef AESCRYPT_SPARSE_H
+#define AESCRYPT_SPARSE_H
+
+#include <stdio.h>
+
+#define SPARSE_BLOCK_SIZE           4096    /* Unit of holes in the output */
+#define SPARSE_BUFFER_SIZE          65536   /* Stdio buffer of the streams */
+
+// Function prototypes
+FILE *sparse_reader_open(FILE *infp);
+FILE *sparse_writer_open(FILE *outfp);
+
+#endif // AESCRYPT_SPARSE_H
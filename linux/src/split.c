@@ -0,0 +1,702 @@
+/*
+ *  split.c
+ *
+ *  Split Volumes for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to encrypt a file into a series of independently
+ *      encrypted volumes and to join those volumes back together.
+ *
+ *      Each volume is a complete AES Crypt file with its own session key
+ *      and HMAC holding a fixed-size slice of the plaintext, so volumes
+ *      can be encrypted and decrypted in parallel.  Volumes are named by
+ *      appending a three-digit sequence number to the base name (e.g.,
+ *      "file.aes.000", "file.aes.001", ...).
+ *
+ *      When the input is a regular file, each worker encrypts its slice
+ *      directly from the file.  Otherwise, workers take turns reading the
+ *      next slice into memory and then encrypt it concurrently with the
+ *      other workers.  When joining into a regular file, each worker
+ *      decrypts its volume directly into place; otherwise, the plaintext
+ *      of each volume is held until the preceding volumes are written.
+ *
+ *  Portability Issues:
+ *      Requires POSIX threads.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>    // malloc
+#include <string.h>
+#include <unistd.h>    // unlink
+#include <pthread.h>
+#include <sys/stat.h>  // stat
+
+#include "aescrypt.h"
+#include "stream.h"
+#include "header.h"
+#include "util.h"
+#include "workers.h"
+#include "split.h"
+
+typedef struct {
+    const char *infile;
+    FILE *infp;
+    const char *base;
+    off_t volume_size;
+    const unsigned char *passwd;
+    int passlen;
+    pthread_mutex_t mutex;
+    unsigned next_volume;
+    int done;
+} split_context;
+
+typedef struct {
+    const char *base;
+    FILE *outfp;
+    const char *outfile;
+    off_t *offsets;
+    const unsigned char *passwd;
+    int passlen;
+    pthread_mutex_t mutex;
+    pthread_cond_t turn;
+    unsigned next_write;
+    int failed;
+} join_context;
+
+/*
+ *  volume_name
+ *
+ *  Description:
+ *      Form the name of a volume from the base name and volume number.
+ *
+ *  Parameters:
+ *      name [out]
+ *          Buffer of AES_CRYPT_MAX_PATH octets to receive the name.
+ *
+ *      base [in]
+ *          The base name.
+ *
+ *      volume [in]
+ *          The volume number.
+ *
+ *  Returns:
+ *      0 if successful, otherwise the name was too long.
+ *
+ *  Comments:
+ *      None.
+ */
+static int volume_name(char *name, const char *base, unsigned volume)
+{
+    if (snprintf(name,
+                 AES_CRYPT_MAX_PATH,
+                 SPLIT_VOLUME_FORMAT,
+                 base,
+                 volume) >= AES_CRYPT_MAX_PATH)
+    {
+        fprintf(stderr, "Error: Volume pathname too long for %s\n", base);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  encrypt_volume
+ *
+ *  Description:
+ *      Encrypt up to the given number of octets from the input stream
+ *      into the named volume.
+ *
+ *  Parameters:
+ *      infp [in]
+ *          The input stream, positioned at the start of the slice.
+ *
+ *      length [in]
+ *          The number of octets to encrypt (0 for the rest of infp).
+ *
+ *      ctx [in]
+ *          The split_context.
+ *
+ *      volume [in]
+ *          The volume number.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      A partially written volume is removed.
+ */
+static int encrypt_volume(FILE *infp,
+                          off_t length,
+                          split_context *ctx,
+                          unsigned volume)
+{
+    char name[AES_CRYPT_MAX_PATH];
+    stream_options options;
+    FILE *outfp;
+    int rc;
+
+    if (volume_name(name, ctx->base, volume)) return -1;
+
+    if ((outfp = fopen(name, "w")) == NULL)
+    {
+        fprintf(stderr, "Error opening output file %s : ", name);
+        perror("");
+        return -1;
+    }
+
+    memset(&options, 0, sizeof(options));
+    options.input_limit = length;
+
+    rc = encrypt_stream(infp,
+                        outfp,
+                        (unsigned char *) ctx->passwd,
+                        ctx->passlen,
+                        &options);
+
+    if (fclose(outfp) && !rc)
+    {
+        fprintf(stderr, "Error: Could not properly close output file\n");
+        rc = -1;
+    }
+
+    if (rc) unlink(name);
+
+    return rc;
+}
+
+/*
+ *  split_file_worker
+ *
+ *  Description:
+ *      Worker pool function to encrypt one volume from a regular file.
+ *
+ *  Parameters:
+ *      context [in]
+ *          The split_context.
+ *
+ *      item [in]
+ *          The volume number.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Each worker uses its own file stream so that no locking is
+ *      required to read its slice.
+ */
+static int split_file_worker(void *context, unsigned item)
+{
+    split_context *ctx = (split_context *) context;
+    FILE *infp;
+    int rc;
+
+    if ((infp = fopen(ctx->infile, "r")) == NULL)
+    {
+        fprintf(stderr, "Error opening input file %s : ", ctx->infile);
+        perror("");
+        return -1;
+    }
+
+    if (fseeko(infp, (off_t) item * ctx->volume_size, SEEK_SET))
+    {
+        perror("Error seeking in input file");
+        fclose(infp);
+        return -1;
+    }
+
+    rc = encrypt_volume(infp, ctx->volume_size, ctx, item);
+
+    fclose(infp);
+
+    return rc;
+}
+
+/*
+ *  split_stream_worker
+ *
+ *  Description:
+ *      Worker pool function that repeatedly reads the next slice of a
+ *      non-seekable input and encrypts it into the next volume.
+ *
+ *  Parameters:
+ *      context [in]
+ *          The split_context.
+ *
+ *      item [in]
+ *          Unused; there is one item per worker.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Reading is serialized so that slices are taken in order, while
+ *      encryption proceeds in parallel.  Each worker holds at most one
+ *      slice in memory.
+ */
+static int split_stream_worker(void *context, unsigned item)
+{
+    split_context *ctx = (split_context *) context;
+    unsigned char *buffer;
+    unsigned volume;
+    size_t length;
+    FILE *slicefp;
+    int rc = 0;
+
+    (void) item;
+
+    if ((buffer = malloc(ctx->volume_size)) == NULL)
+    {
+        fprintf(stderr,
+                "Error: Unable to buffer a volume from the input; use a "
+                "smaller volume size\n");
+        pthread_mutex_lock(&ctx->mutex);
+        ctx->done = 1;
+        pthread_mutex_unlock(&ctx->mutex);
+        return -1;
+    }
+
+    while (!rc)
+    {
+        pthread_mutex_lock(&ctx->mutex);
+        if (ctx->done)
+        {
+            pthread_mutex_unlock(&ctx->mutex);
+            break;
+        }
+        length = fread(buffer, 1, ctx->volume_size, ctx->infp);
+        if (length < (size_t) ctx->volume_size) ctx->done = 1;
+        if (ferror(ctx->infp))
+        {
+            fprintf(stderr, "Error: Couldn't read input file\n");
+            pthread_mutex_unlock(&ctx->mutex);
+            rc = -1;
+            break;
+        }
+
+        // Empty input still produces one (empty) volume
+        if ((length == 0) && (ctx->next_volume > 0))
+        {
+            pthread_mutex_unlock(&ctx->mutex);
+            break;
+        }
+        volume = ctx->next_volume++;
+        pthread_mutex_unlock(&ctx->mutex);
+
+        if (length > 0)
+        {
+            slicefp = fmemopen(buffer, length, "r");
+        }
+        else
+        {
+            slicefp = fopen("/dev/null", "r");
+        }
+        if (slicefp == NULL)
+        {
+            perror("Error opening volume buffer");
+            rc = -1;
+            break;
+        }
+
+        rc = encrypt_volume(slicefp, 0, ctx, volume);
+
+        fclose(slicefp);
+    }
+
+    if (rc)
+    {
+        pthread_mutex_lock(&ctx->mutex);
+        ctx->done = 1;
+        pthread_mutex_unlock(&ctx->mutex);
+    }
+
+    free(buffer);
+
+    return rc;
+}
+
+/*
+ *  split_file
+ *
+ *  Description:
+ *      Encrypt the input into a series of independently encrypted
+ *      volumes, encrypting volumes in parallel.
+ *
+ *  Parameters:
+ *      infile [in]
+ *          The file to encrypt, or "-" for standard input.
+ *
+ *      base [in]
+ *          The base name of the volumes.
+ *
+ *      volume_size [in]
+ *          The number of plaintext octets in each volume but the last.
+ *
+ *      jobs [in]
+ *          The number of volumes to encrypt concurrently (0 for default).
+ *
+ *      passwd, passlen [in]
+ *          The UTF-16LE encoded password.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      On failure, all volumes are removed.  On success, any higher
+ *      numbered volumes left over from an earlier split with the same
+ *      base name are removed so they are not mistakenly joined.
+ */
+int split_file(const char *infile,
+               const char *base,
+               off_t volume_size,
+               unsigned jobs,
+               const unsigned char *passwd,
+               int passlen)
+{
+    char name[AES_CRYPT_MAX_PATH];
+    split_context ctx;
+    struct stat st;
+    unsigned volumes;
+    unsigned failures;
+    unsigned i;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.infile = infile;
+    ctx.base = base;
+    ctx.volume_size = volume_size;
+    ctx.passwd = passwd;
+    ctx.passlen = passlen;
+    pthread_mutex_init(&ctx.mutex, NULL);
+
+    if (strcmp(infile, "-") && !stat(infile, &st) && S_ISREG(st.st_mode))
+    {
+        volumes = (st.st_size + volume_size - 1) / volume_size;
+        if (volumes == 0) volumes = 1;
+        failures = run_workers(jobs, volumes, split_file_worker, &ctx);
+    }
+    else
+    {
+        if (!strcmp(infile, "-"))
+        {
+            ctx.infp = stdin;
+        }
+        else if ((ctx.infp = fopen(infile, "r")) == NULL)
+        {
+            fprintf(stderr, "Error opening input file %s : ", infile);
+            perror("");
+            pthread_mutex_destroy(&ctx.mutex);
+            return -1;
+        }
+
+        if (jobs == 0) jobs = default_worker_count();
+        failures = run_workers(jobs, jobs, split_stream_worker, &ctx);
+        volumes = ctx.next_volume;
+
+        if (ctx.infp != stdin) fclose(ctx.infp);
+    }
+
+    pthread_mutex_destroy(&ctx.mutex);
+
+    if (failures)
+    {
+        for (i = 0; i < volumes; i++)
+        {
+            if (!volume_name(name, base, i)) unlink(name);
+        }
+        return -1;
+    }
+
+    // Remove stale volumes that would otherwise follow the last volume
+    for (i = volumes; !volume_name(name, base, i) && !unlink(name); i++)
+    {
+        // Nothing more to do
+    }
+
+    return 0;
+}
+
+/*
+ *  join_in_place_worker
+ *
+ *  Description:
+ *      Worker pool function to decrypt one volume directly into its
+ *      position within the output file.
+ *
+ *  Parameters:
+ *      context [in]
+ *          The join_context.
+ *
+ *      item [in]
+ *          The volume number.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static int join_in_place_worker(void *context, unsigned item)
+{
+    join_context *ctx = (join_context *) context;
+    char name[AES_CRYPT_MAX_PATH];
+    FILE *infp;
+    FILE *outfp;
+    int rc;
+
+    if (volume_name(name, ctx->base, item)) return -1;
+
+    if ((infp = fopen(name, "r")) == NULL)
+    {
+        fprintf(stderr, "Error opening input file %s : ", name);
+        perror("");
+        return -1;
+    }
+
+    if ((outfp = fopen(ctx->outfile, "r+")) == NULL)
+    {
+        fprintf(stderr, "Error opening output file %s : ", ctx->outfile);
+        perror("");
+        fclose(infp);
+        return -1;
+    }
+
+    if (fseeko(outfp, ctx->offsets[item], SEEK_SET))
+    {
+        perror("Error seeking in output file");
+        fclose(outfp);
+        fclose(infp);
+        return -1;
+    }
+
+    rc = decrypt_stream(infp,
+                        outfp,
+                        (unsigned char *) ctx->passwd,
+                        ctx->passlen);
+
+    if (fclose(outfp) && !rc)
+    {
+        fprintf(stderr, "Error: Could not properly close output file\n");
+        rc = -1;
+    }
+    fclose(infp);
+
+    if (rc) fprintf(stderr, "Error: Unable to decrypt volume %s\n", name);
+
+    return rc;
+}
+
+/*
+ *  join_ordered_worker
+ *
+ *  Description:
+ *      Worker pool function to decrypt one volume into memory and write
+ *      it to the output stream once all preceding volumes are written.
+ *
+ *  Parameters:
+ *      context [in]
+ *          The join_context.
+ *
+ *      item [in]
+ *          The volume number.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Since the worker pool hands out volumes in order, every preceding
+ *      volume is held by an active worker, so waiting cannot deadlock.
+ */
+static int join_ordered_worker(void *context, unsigned item)
+{
+    join_context *ctx = (join_context *) context;
+    char name[AES_CRYPT_MAX_PATH];
+    char *plaintext = NULL;
+    size_t length = 0;
+    FILE *infp;
+    FILE *memfp;
+    int rc = -1;
+
+    if (!volume_name(name, ctx->base, item) &&
+        ((infp = fopen(name, "r")) != NULL))
+    {
+        if ((memfp = open_memstream(&plaintext, &length)) != NULL)
+        {
+            rc = decrypt_stream(infp,
+                                memfp,
+                                (unsigned char *) ctx->passwd,
+                                ctx->passlen);
+            if (fclose(memfp)) rc = -1;
+        }
+        else
+        {
+            perror("Error allocating volume buffer");
+        }
+        fclose(infp);
+        if (rc) fprintf(stderr, "Error: Unable to decrypt volume %s\n", name);
+    }
+    else
+    {
+        fprintf(stderr, "Error opening input file %s : ", name);
+        perror("");
+    }
+
+    pthread_mutex_lock(&ctx->mutex);
+    while (!ctx->failed && (ctx->next_write != item))
+    {
+        pthread_cond_wait(&ctx->turn, &ctx->mutex);
+    }
+    if (!rc && !ctx->failed &&
+        (fwrite(plaintext, 1, length, ctx->outfp) != length))
+    {
+        fprintf(stderr, "Error: Could not write to output file\n");
+        rc = -1;
+    }
+    if (rc) ctx->failed = 1;
+    ctx->next_write++;
+    pthread_cond_broadcast(&ctx->turn);
+    pthread_mutex_unlock(&ctx->mutex);
+
+    if (plaintext != NULL)
+    {
+        secure_erase(plaintext, length);
+        free(plaintext);
+    }
+
+    return rc;
+}
+
+/*
+ *  join_volumes
+ *
+ *  Description:
+ *      Decrypt the volumes produced by split_file() in parallel and write
+ *      the plaintext to the output in order.
+ *
+ *  Parameters:
+ *      base [in]
+ *          The base name of the volumes.
+ *
+ *      outfp [in]
+ *          The output stream.
+ *
+ *      outfile [in]
+ *          The name of the output file, or NULL if not known.
+ *
+ *      jobs [in]
+ *          The number of volumes to decrypt concurrently (0 for default).
+ *
+ *      passwd, passlen [in]
+ *          The UTF-16LE encoded password.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Volumes are found by number starting from zero until one does not
+ *      exist.  When the output is a regular file, the plaintext size of
+ *      each volume is determined from its trailer so that volumes can be
+ *      decrypted directly into place.
+ */
+int join_volumes(const char *base,
+                 FILE *outfp,
+                 const char *outfile,
+                 unsigned jobs,
+                 const unsigned char *passwd,
+                 int passlen)
+{
+    char name[AES_CRYPT_MAX_PATH];
+    join_context ctx;
+    aescrypt_header header;
+    aescrypt_sizes sizes;
+    struct stat st;
+    unsigned volumes;
+    unsigned failures;
+    unsigned i;
+    FILE *fp;
+    int in_place;
+
+    // Count the volumes
+    for (volumes = 0;
+         !volume_name(name, base, volumes) && !stat(name, &st);
+         volumes++)
+    {
+        // Nothing more to do
+    }
+    if (volumes == 0)
+    {
+        fprintf(stderr, "Error: No volumes found for %s\n", base);
+        return -1;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.base = base;
+    ctx.outfp = outfp;
+    ctx.outfile = outfile;
+    ctx.passwd = passwd;
+    ctx.passlen = passlen;
+
+    in_place = (outfile != NULL) &&
+               !fstat(fileno(outfp), &st) &&
+               S_ISREG(st.st_mode);
+
+    if (!in_place)
+    {
+        pthread_mutex_init(&ctx.mutex, NULL);
+        pthread_cond_init(&ctx.turn, NULL);
+
+        failures = run_workers(jobs, volumes, join_ordered_worker, &ctx);
+
+        pthread_cond_destroy(&ctx.turn);
+        pthread_mutex_destroy(&ctx.mutex);
+
+        return failures ? -1 : 0;
+    }
+
+    // Determine where each volume's plaintext belongs
+    if ((ctx.offsets = malloc((volumes + 1) * sizeof(off_t))) == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        return -1;
+    }
+    ctx.offsets[0] = 0;
+    for (i = 0; i < volumes; i++)
+    {
+        volume_name(name, base, i);
+        if ((fp = fopen(name, "r")) == NULL)
+        {
+            fprintf(stderr, "Error opening input file %s : ", name);
+            perror("");
+            free(ctx.offsets);
+            return -1;
+        }
+        if (read_header(fp, &header) || read_sizes(fp, &header, &sizes))
+        {
+            fprintf(stderr, "Error: Unable to read volume %s\n", name);
+            free_header(&header);
+            fclose(fp);
+            free(ctx.offsets);
+            return -1;
+        }
+        free_header(&header);
+        fclose(fp);
+        ctx.offsets[i + 1] = ctx.offsets[i] + sizes.plaintext_size;
+    }
+
+    // Size the output so volumes may be written in any order
+    if (fflush(outfp) || ftruncate(fileno(outfp), ctx.offsets[volumes]))
+    {
+        perror("Error sizing output file");
+        free(ctx.offsets);
+        return -1;
+    }
+
+    failures = run_workers(jobs, volumes, join_in_place_worker, &ctx);
+
+    free(ctx.offsets);
+
+    return failures ? -1 : 0;
+}
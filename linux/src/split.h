@@ -0,0 +1,39 @@
+/*
+ *  split.h
+ *
+ *  Split Volumes for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to encrypt a file into a series of independently
+ *      encrypted volumes and to join those volumes back together.
+ *
+ *  Portability Issues:
+ *      Requires POSIX threads.
+ */
+
+#ifndef AESCRYPT_SPLIT_H
+#define AESCRYPT_SPLIT_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+// Format used to name each volume from the base name and volume number
+#define SPLIT_VOLUME_FORMAT         "%s.%03u"
+
+// Function prototypes
+int split_file(const char *infile,
+               const char *base,
+               off_t volume_size,
+               unsigned jobs,
+               const unsigned char *passwd,
+               int passlen);
+int join_volumes(const char *base,
+                 FILE *outfp,
+                 const char *outfile,
+                 unsigned jobs,
+                 const unsigned char *passwd,
+                 int passlen);
+
+#endif // AESCRYPT_SPLIT_H
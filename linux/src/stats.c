@@ -0,0 +1,695 @@
+/*
+ *  stats.c
+ *
+ *  Timing Statistics for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to time the phases of encrypting and decrypting files
+ *      and to report the results per file and in aggregate.
+ *
+ *      Each file's time is divided among key derivation, reading random
+ *      data, reading the input, AES, HMAC, and writing the output, and
+ *      the octets read and written are counted.  The remaining time goes
+ *      to work such as parsing headers.  Reports are written to stderr,
+ *      either as text or as a JSON document, and when several files are
+ *      processed they include the median and 99th percentile time per
+ *      file and a histogram of the times.
+ *
+ *      Timing a version 2 stream block by block would take about as long
+ *      as the work being timed, so one block in STATS_SAMPLE_INTERVAL is
+ *      timed and the measured time of the loop is divided among the
+ *      phases in the proportions seen in those blocks, every
+ *      STATS_FLUSH_SAMPLES timed blocks.  The interval
+ *      is prime so that the timed blocks do not coincide with the refills
+ *      and flushes of stdio buffers, whose sizes are powers of two.
+ *      Chunks are timed individually.
+ *
+ *      The totals are updated without locks as the work proceeds, so they
+ *      may be read at any time, such as to report progress.  The octets
+ *      read and written are always counted, at the cost of one atomic
+ *      addition per piece of input or output.  When statistics are off,
+ *      the cost of timing is a test of stats_enabled at each point that
+ *      would be timed.
+ *
+ *  Portability Issues:
+ *      Requires C11 atomics and clock_gettime().
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "stats.h"
+#include "util.h"
+
+typedef struct {
+    char *name;                     // The file name
+    int failed;                     // The file could not be processed
+    double seconds;                 // Time taken by the file
+    double phase_seconds[STATS_PHASES];
+    unsigned long long octets[STATS_PHASES];
+} stats_record;
+
+static const char *phase_names[STATS_PHASES] =
+{
+    "kdf", "random", "read", "aes", "hmac", "write"
+};
+
+int stats_enabled = 0;
+
+static _Atomic unsigned long long total_ns[STATS_PHASES];
+static _Atomic unsigned long long total_octets[STATS_PHASES];
+static stats_report_format report_format;
+static double current_start;        // When the current file was started
+static double start_seconds[STATS_PHASES];
+static unsigned long long start_octets[STATS_PHASES];
+static double clock_cost;           // Time taken to read the clock
+static stats_record *records;       // Files processed
+static unsigned record_count;
+
+/*
+ *  stats_init
+ *
+ *  Description:
+ *      Start gathering statistics.
+ *
+ *  Parameters:
+ *      format [in]
+ *          The form of the report, if any, of each file and the totals.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The time taken to read the clock is measured so that it can be
+ *      excluded from sampled blocks, where it is comparable to the work.
+ *      Once a report format is chosen, later calls do not remove it.
+ */
+void stats_init(stats_report_format format)
+{
+    double t0, t1;
+    unsigned i;
+
+    if (format != STATS_REPORT_NONE) report_format = format;
+    if (stats_enabled) return;
+    stats_enabled = 1;
+
+    clock_cost = 1;
+    for (i = 0; i < 16; i++)
+    {
+        t0 = stats_now();
+        t1 = stats_now();
+        if (t1 - t0 < clock_cost) clock_cost = t1 - t0;
+    }
+}
+
+/*
+ *  stats_now
+ *
+ *  Description:
+ *      Read the monotonic clock.
+ *
+ *  Parameters:
+ *      None.
+ *
+ *  Returns:
+ *      The time in seconds.
+ *
+ *  Comments:
+ *      None.
+ */
+double stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ *  stats_add
+ *
+ *  Description:
+ *      Add time spent and octets processed in a phase to the totals.
+ *
+ *  Parameters:
+ *      phase [in]
+ *          The phase.
+ *
+ *      seconds [in]
+ *          The time spent.
+ *
+ *      octets [in]
+ *          The octets processed, if counted for the phase.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      May be called from any thread.
+ */
+void stats_add(stats_phase phase, double seconds, unsigned long long octets)
+{
+    atomic_fetch_add_explicit(&total_ns[phase],
+                              (unsigned long long) (seconds * 1e9),
+                              memory_order_relaxed);
+    if (octets)
+    {
+        atomic_fetch_add_explicit(&total_octets[phase],
+                                  octets,
+                                  memory_order_relaxed);
+    }
+}
+
+/*
+ *  stats_count
+ *
+ *  Description:
+ *      Add octets read or written to the totals, whether or not statistics
+ *      are being gathered.
+ *
+ *  Parameters:
+ *      phase [in]
+ *          The phase, STATS_READ or STATS_WRITE.
+ *
+ *      octets [in]
+ *          The octets processed.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      May be called from any thread.
+ */
+void stats_count(stats_phase phase, unsigned long long octets)
+{
+    atomic_fetch_add_explicit(&total_octets[phase],
+                              octets,
+                              memory_order_relaxed);
+}
+
+/*
+ *  stats_totals
+ *
+ *  Description:
+ *      Read the time spent and octets processed in each phase so far.
+ *
+ *  Parameters:
+ *      seconds [out]
+ *          The time spent in each phase.
+ *
+ *      octets [out]
+ *          The octets processed in each phase.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      May be called from any thread while the totals are being updated.
+ */
+void stats_totals(double seconds[STATS_PHASES],
+                  unsigned long long octets[STATS_PHASES])
+{
+    unsigned i;
+
+    for (i = 0; i < STATS_PHASES; i++)
+    {
+        seconds[i] = atomic_load_explicit(&total_ns[i],
+                                          memory_order_relaxed) / 1e9;
+        octets[i] = atomic_load_explicit(&total_octets[i],
+                                         memory_order_relaxed);
+    }
+}
+
+/*
+ *  flush_samples
+ *
+ *  Description:
+ *      Divide the time since the totals were last updated among the phases
+ *      in proportion to the samples taken since then, and add it and the
+ *      octets counted to the totals.
+ *
+ *  Parameters:
+ *      s [in/out]
+ *          The sampler.
+ *
+ *      now [in]
+ *          The current time.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+static void flush_samples(stats_sampler *s, double now)
+{
+    double elapsed = now - s->flushed;
+    double sampled = 0;
+    unsigned i;
+
+    for (i = 0; i < STATS_PHASES; i++) sampled += s->sampled[i];
+
+    for (i = 0; i < STATS_PHASES; i++)
+    {
+        stats_add((stats_phase) i,
+                  (sampled > 0) ? elapsed * s->sampled[i] / sampled : 0,
+                  s->octets[i]);
+        s->sampled[i] = 0;
+        s->octets[i] = 0;
+    }
+
+    s->flushed = now;
+}
+
+/*
+ *  stats_sampler_start
+ *
+ *  Description:
+ *      Start timing a loop over blocks.
+ *
+ *  Parameters:
+ *      s [out]
+ *          The sampler.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The first block is timed.
+ */
+void stats_sampler_start(stats_sampler *s)
+{
+    memset(s, 0, sizeof(stats_sampler));
+    s->flushed = stats_now();
+    stats_sample_block(s);
+}
+
+/*
+ *  stats_sample_block
+ *
+ *  Description:
+ *      Note the start of the next block, deciding whether to time it.
+ *
+ *  Parameters:
+ *      s [in/out]
+ *          The sampler.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The totals are updated before every STATS_FLUSH_SAMPLES timed
+ *      blocks.
+ */
+void stats_sample_block(stats_sampler *s)
+{
+    s->sampling = !(s->blocks++ % STATS_SAMPLE_INTERVAL);
+    if (s->sampling)
+    {
+        s->last = stats_now();
+        if (!(++s->samples % STATS_FLUSH_SAMPLES)) flush_samples(s, s->last);
+    }
+}
+
+/*
+ *  stats_mark
+ *
+ *  Description:
+ *      Note the end of a phase of the current block.
+ *
+ *  Parameters:
+ *      s [in/out]
+ *          The sampler.
+ *
+ *      phase [in]
+ *          The phase that just ended.
+ *
+ *      octets [in]
+ *          The octets read or written in the phase, if counted.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The clock is read only if the block is being timed.
+ */
+void stats_mark(stats_sampler *s,
+                stats_phase phase,
+                unsigned long long octets)
+{
+    double now, elapsed;
+
+    s->octets[phase] += octets;
+
+    if (s->sampling)
+    {
+        now = stats_now();
+        elapsed = now - s->last - clock_cost;
+        if (elapsed > 0) s->sampled[phase] += elapsed;
+        s->last = now;
+    }
+}
+
+/*
+ *  stats_sampler_finish
+ *
+ *  Description:
+ *      Finish timing a loop over blocks and add the rest of the time of
+ *      each phase to the totals.
+ *
+ *  Parameters:
+ *      s [in/out]
+ *          The sampler.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      None.
+ */
+void stats_sampler_finish(stats_sampler *s)
+{
+    flush_samples(s, stats_now());
+}
+
+/*
+ *  stats_begin_file
+ *
+ *  Description:
+ *      Start gathering statistics for a file.
+ *
+ *  Parameters:
+ *      None.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The file's statistics are the change in the totals.
+ */
+void stats_begin_file(void)
+{
+    stats_totals(start_seconds, start_octets);
+    current_start = stats_now();
+}
+
+/*
+ *  print_text
+ *
+ *  Description:
+ *      Write a record as a line of text.
+ *
+ *  Parameters:
+ *      fp [in]
+ *          The stream to write to.
+ *
+ *      label [in]
+ *          The label of the line.
+ *
+ *      record [in]
+ *          The record.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      Throughput is of the input read.
+ */
+static void print_text(FILE *fp, const char *label, const stats_record *record)
+{
+    unsigned i;
+
+    fprintf(fp,
+            "stats: %s: %.6f s, %.1f MiB/s%s\n       ",
+            label,
+            record->seconds,
+            (record->seconds > 0) ?
+                record->octets[STATS_READ] / record->seconds / 1048576 : 0,
+            record->failed ? ", failed" : "");
+
+    for (i = 0; i < STATS_PHASES; i++)
+    {
+        fprintf(fp,
+                " %s %.6f s",
+                phase_names[i],
+                record->phase_seconds[i]);
+        if ((i == STATS_READ) || (i == STATS_WRITE))
+        {
+            fprintf(fp, " (%llu octets)", record->octets[i]);
+        }
+        fprintf(fp, (i < STATS_PHASES - 1) ? "," : "\n");
+    }
+}
+
+/*
+ *  print_json
+ *
+ *  Description:
+ *      Write the members of a record as JSON.
+ *
+ *  Parameters:
+ *      fp [in]
+ *          The stream to write to.
+ *
+ *      record [in]
+ *          The record.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The enclosing object is written by the caller.
+ */
+static void print_json(FILE *fp, const stats_record *record)
+{
+    unsigned i;
+
+    fprintf(fp, "\"seconds\": %.6f, \"phases\": {", record->seconds);
+    for (i = 0; i < STATS_PHASES; i++)
+    {
+        fprintf(fp,
+                "%s\"%s\": {\"seconds\": %.6f",
+                i ? ", " : "",
+                phase_names[i],
+                record->phase_seconds[i]);
+        if ((i == STATS_READ) || (i == STATS_WRITE))
+        {
+            fprintf(fp, ", \"octets\": %llu", record->octets[i]);
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "}");
+}
+
+/*
+ *  stats_end_file
+ *
+ *  Description:
+ *      Finish gathering statistics for a file and record them.
+ *
+ *  Parameters:
+ *      name [in]
+ *          The name of the file.
+ *
+ *      rc [in]
+ *          Non-zero if the file could not be processed.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      With text reports, the file's statistics are written at once.
+ */
+void stats_end_file(const char *name, int rc)
+{
+    stats_record current;
+    stats_record *grown;
+    unsigned i;
+
+    current.seconds = stats_now() - current_start;
+    current.failed = rc ? 1 : 0;
+    stats_totals(current.phase_seconds, current.octets);
+    for (i = 0; i < STATS_PHASES; i++)
+    {
+        current.phase_seconds[i] -= start_seconds[i];
+        current.octets[i] -= start_octets[i];
+    }
+
+    if (report_format == STATS_REPORT_TEXT)
+    {
+        print_text(stderr, name, &current);
+    }
+
+    grown = realloc(records, (record_count + 1) * sizeof(stats_record));
+    if ((grown == NULL) || ((current.name = strdup(name)) == NULL))
+    {
+        if (grown != NULL) records = grown;
+        fprintf(stderr, "Error: Unable to allocate memory for statistics\n");
+        return;
+    }
+    records = grown;
+    records[record_count++] = current;
+}
+
+/*
+ *  compare_seconds
+ *
+ *  Description:
+ *      qsort() comparison of times.
+ *
+ *  Parameters:
+ *      a [in], b [in]
+ *          The times to compare.
+ *
+ *  Returns:
+ *      Less than, equal to, or greater than zero as a is less than, equal
+ *      to, or greater than b.
+ *
+ *  Comments:
+ *      None.
+ */
+static int compare_seconds(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ *  stats_report
+ *
+ *  Description:
+ *      Write the aggregate statistics, and with JSON reports the
+ *      statistics of every file, to stderr.
+ *
+ *  Parameters:
+ *      None.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      The recorded statistics are released.
+ */
+void stats_report(void)
+{
+    stats_record total;
+    unsigned long histogram[STATS_HISTOGRAM_BUCKETS];
+    double *latency;
+    double p50 = 0, p99 = 0;
+    unsigned i, j, bucket;
+
+    if (report_format == STATS_REPORT_NONE) return;
+
+    memset(&total, 0, sizeof(total));
+    memset(histogram, 0, sizeof(histogram));
+    latency = malloc((record_count + 1) * sizeof(double));
+
+    for (i = 0; i < record_count; i++)
+    {
+        total.seconds += records[i].seconds;
+        total.failed += records[i].failed;
+        for (j = 0; j < STATS_PHASES; j++)
+        {
+            total.phase_seconds[j] += records[i].phase_seconds[j];
+            total.octets[j] += records[i].octets[j];
+        }
+
+        for (bucket = 0;
+             (bucket < STATS_HISTOGRAM_BUCKETS - 1) &&
+             (records[i].seconds * 1000 > (double) (1UL << bucket));
+             bucket++);
+        histogram[bucket]++;
+
+        if (latency != NULL) latency[i] = records[i].seconds;
+    }
+
+    // Nearest-rank percentiles
+    if ((latency != NULL) && record_count)
+    {
+        qsort(latency, record_count, sizeof(double), compare_seconds);
+        p50 = latency[(record_count + 1) / 2 - 1];
+        p99 = latency[(99 * record_count + 99) / 100 - 1];
+    }
+    free(latency);
+
+    if (report_format == STATS_REPORT_JSON)
+    {
+        fprintf(stderr, "{\"files\": [");
+        for (i = 0; i < record_count; i++)
+        {
+            fprintf(stderr, "%s\n  {\"name\": ", i ? "," : "");
+            json_print_string(stderr,
+                              records[i].name,
+                              strlen(records[i].name));
+            fprintf(stderr,
+                    ", \"failed\": %s, ",
+                    records[i].failed ? "true" : "false");
+            print_json(stderr, &records[i]);
+            fprintf(stderr, "}");
+        }
+        fprintf(stderr,
+                "],\n \"aggregate\": {\"files\": %u, \"failed\": %d, ",
+                record_count,
+                total.failed);
+        print_json(stderr, &total);
+        fprintf(stderr,
+                ",\n  \"latency\": {\"p50\": %.6f, \"p99\": %.6f, "
+                "\"histogram\": [",
+                p50,
+                p99);
+        for (i = 0, j = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+        {
+            if (!histogram[i]) continue;
+            fprintf(stderr, "%s{\"le_ms\": ", j++ ? ", " : "");
+            if (i < STATS_HISTOGRAM_BUCKETS - 1)
+            {
+                fprintf(stderr, "%lu", 1UL << i);
+            }
+            else
+            {
+                fprintf(stderr, "null");
+            }
+            fprintf(stderr, ", \"count\": %lu}", histogram[i]);
+        }
+        fprintf(stderr, "]}}}\n");
+    }
+    else if (record_count > 1)
+    {
+        fprintf(stderr, "stats: %u files, %d failed\n",
+                record_count, total.failed);
+        print_text(stderr, "total", &total);
+        fprintf(stderr,
+                "stats: time per file: p50 %.6f s, p99 %.6f s\n",
+                p50,
+                p99);
+        for (i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+        {
+            if (!histogram[i]) continue;
+            if (i < STATS_HISTOGRAM_BUCKETS - 1)
+            {
+                fprintf(stderr, "stats:   <= %8lu ms: %lu\n",
+                        1UL << i, histogram[i]);
+            }
+            else
+            {
+                fprintf(stderr, "stats:    > %8lu ms: %lu\n",
+                        1UL << (i - 1), histogram[i]);
+            }
+        }
+    }
+
+    for (i = 0; i < record_count; i++) free(records[i].name);
+    free(records);
+    records = NULL;
+    record_count = 0;
+}
@@ -0,0 +1,72 @@
+/*
+ *  stats.h
+ *
+ *  Timing Statistics for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to time the phases of encrypting and decrypting files
+ *      and to report the results per file and in aggregate.
+ *
+ *  Portability Issues:
+ *      Requires C11 atomics and clock_gettime().
+ */
+
+#ifndef AESCRYPT_STATS_H
+#define AESCRYPT_STATS_H
+
+#include <stdio.h>
+
+#define STATS_SAMPLE_INTERVAL       61      /* Blocks per timed block */
+#define STATS_FLUSH_SAMPLES         16      /* Timed blocks per update */
+#define STATS_HISTOGRAM_BUCKETS     24      /* Powers of two milliseconds */
+
+typedef enum {
+    STATS_KDF,                      // Deriving the key from the password
+    STATS_RANDOM,                   // Reading random IVs and keys
+    STATS_READ,                     // Reading the input
+    STATS_AES,                      // Encrypting or decrypting
+    STATS_HMAC,                     // Authenticating
+    STATS_WRITE,                    // Writing the output
+    STATS_PHASES
+} stats_phase;
+
+typedef enum {
+    STATS_REPORT_NONE,              // Gather statistics without a report
+    STATS_REPORT_TEXT,
+    STATS_REPORT_JSON
+} stats_report_format;
+
+// Timing of a loop over 16-octet blocks, of which only a sample is timed
+typedef struct {
+    double flushed;                 // When the totals were last updated
+    double last;                    // Time of the last mark in the sample
+    double sampled[STATS_PHASES];   // Time of each phase in the sample
+    unsigned long long octets[STATS_PHASES];
+    unsigned long long blocks;
+    unsigned samples;               // Blocks timed
+    int sampling;                   // The current block is being timed
+} stats_sampler;
+
+// Non-zero when statistics are being gathered
+extern int stats_enabled;
+
+// Function prototypes
+void stats_init(stats_report_format format);
+double stats_now(void);
+void stats_add(stats_phase phase, double seconds, unsigned long long octets);
+void stats_count(stats_phase phase, unsigned long long octets);
+void stats_totals(double seconds[STATS_PHASES],
+                  unsigned long long octets[STATS_PHASES]);
+void stats_sampler_start(stats_sampler *s);
+void stats_sample_block(stats_sampler *s);
+void stats_mark(stats_sampler *s,
+                stats_phase phase,
+                unsigned long long octets);
+void stats_sampler_finish(stats_sampler *s);
+void stats_begin_file(void);
+void stats_end_file(const char *name, int rc);
+void stats_report(void);
+
+#endif // AESCRYPT_STATS_H
@@ -0,0 +1,1791 @@
+/*
+ *  stream.c
+ *
+ *  Stream Encryption and Decryption for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to encrypt and decrypt data streams in the AES Crypt
+ *      file format.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>  // fsync
+#include <errno.h>
+
+#include "aescrypt.h"
+#include "hmac.h"
+#include "header.h"
+#include "session.h"
+#include "merkle.h"
+#include "chunked.h"
+#include "checkpoint.h"
+#include "journal.h"
+#include "compress.h"
+#include "sparse.h"
+#include "digest.h"
+#include "stats.h"
+#include "provider.h"
+#include "probes.h"
+#include "stream.h"
+#include "version.h"
+#include "util.h"
+
+// Input read at once when encrypting or decrypting
+#define STREAM_BUFFER_SIZE 65536
+
+/*
+ *  write_trailer
+ *
+ *  Description:
+ *      Write the file size modulo and the final HMAC that follow the
+ *      ciphertext.
+ *
+ *  Parameters:
+ *      outfp [in]
+ *          The output file stream, positioned after the ciphertext.
+ *
+ *      crypto [in/out]
+ *          The cipher and running HMAC over the ciphertext, which is
+ *          finished.
+ *
+ *      version [in]
+ *          The stream format version.
+ *
+ *      last_block_size [in]
+ *          The number of plaintext octets in the last block.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Version 3 streams are padded, so they have no modulo.
+ */
+static int write_trailer(FILE *outfp,
+                         crypto_context *crypto,
+                         unsigned char version,
+                         unsigned last_block_size)
+{
+    unsigned char modulo;
+    sha256_t digest;
+
+    // Write the file size modulo
+    modulo = (unsigned char) (last_block_size & 0x0F);
+    if ((version < 0x03) && (fwrite(&modulo, 1, 1, outfp) != 1))
+    {
+        fprintf(stderr, "Error: Could not write the file size modulo\n");
+        return -1;
+    }
+
+    // Write the HMAC
+    if (crypto_mac_finish(crypto, digest)) return -1;
+
+    if (fwrite(digest, 1, 32, outfp) != 32)
+    {
+        fprintf(stderr, "Error: Could not write the file HMAC\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  encrypt_blocks
+ *
+ *  Description:
+ *      Encrypt the balance of the input stream in CBC mode and write the
+ *      file size modulo (or padding) and final HMAC.
+ *
+ *  Parameters:
+ *      infp [in]
+ *          The input file stream to encrypt.
+ *
+ *      outfp [in]
+ *          The output file stream, positioned after any ciphertext already
+ *          written.
+ *
+ *      crypto [in/out]
+ *          The cipher, CBC chaining value, and running HMAC over the
+ *          ciphertext.
+ *
+ *      merkle_ctx [in/out]
+ *          The Merkle tree being computed, or NULL if none.
+ *
+ *      options [in]
+ *          Optional behavior, or NULL for the defaults.
+ *
+ *      checkpoint_ctx [in]
+ *          Keys protecting checkpoints, or NULL if none are to be saved.
+ *
+ *      input_offset [in]
+ *          The number of input octets already encrypted.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      The input is read and encrypted STREAM_BUFFER_SIZE octets at a
+ *      time; only the last piece may end within a block.  The balance of
+ *      the last block is filled with octets giving its length, which is
+ *      the PKCS#7 padding of version 3 and is ignored in earlier versions.
+ *
+ *      Checkpoints are only saved after full blocks, and need the state of
+ *      the built-in provider.  Reads stop at each checkpoint, so that the
+ *      output written between checkpoints does not exceed the interval
+ *      by more than a block.  Each piece read fires the chunk_encrypt
+ *      probe.
+ *
+ *      When the options give a key derivation iteration count, the stream
+ *      is version 3 and a whole block of padding is added when the input
+ *      ends on a block boundary.
+ */
+static int encrypt_blocks(FILE *infp,
+                          FILE *outfp,
+                          crypto_context *crypto,
+                          merkle_context *merkle_ctx,
+                          const stream_options *options,
+                          const checkpoint_keys *checkpoint_ctx,
+                          off_t input_offset)
+{
+    checkpoint_state state;
+    unsigned char buffer[STREAM_BUFFER_SIZE + 16];
+    size_t request, bytes_read, length;
+    off_t remaining = 0;
+    off_t since_checkpoint = 0;
+    unsigned last_block_size = 0;
+    unsigned padding;
+    unsigned long long piece = 0;
+    unsigned char version = 0x02;
+    int limited = 0;
+    int done = 0;
+    double start = 0, now;
+
+    if (options != NULL)
+    {
+        remaining = options->input_limit;
+        limited = (remaining > 0);
+        if (options->kdf_iterations) version = 0x03;
+    }
+
+    if ((checkpoint_ctx != NULL) &&
+        strcmp(crypto->provider->name, PROVIDER_BUILTIN))
+    {
+        fprintf(stderr,
+                "Error: Checkpoints require the %s provider\n",
+                PROVIDER_BUILTIN);
+        return -1;
+    }
+
+    while (!done)
+    {
+        // Stop at the next checkpoint, and do not read beyond the input
+        // limit, if any
+        request = STREAM_BUFFER_SIZE;
+        if ((checkpoint_ctx != NULL) &&
+            (since_checkpoint + (off_t) request >
+                options->checkpoint_interval))
+        {
+            request = (size_t) (options->checkpoint_interval -
+                                since_checkpoint + 15) & ~(size_t) 15;
+        }
+        if (limited && (remaining < (off_t) request))
+        {
+            request = (size_t) remaining;
+        }
+
+        if (stats_enabled) start = stats_now();
+        bytes_read = request ? fread(buffer, 1, request, infp) : 0;
+        if (stats_enabled)
+        {
+            now = stats_now();
+            stats_add(STATS_READ, now - start, 0);
+            start = now;
+        }
+        stats_count(STATS_READ, bytes_read);
+        done = (bytes_read < request) || !request;
+
+        // Fill out a final partial block, or add a block of padding
+        length = bytes_read;
+        if (bytes_read % 16)
+        {
+            last_block_size = bytes_read % 16;
+            padding = 16 - last_block_size;
+            memset(buffer + bytes_read, padding, padding);
+            length += padding;
+        }
+        else if (done && (version == 0x03) && !last_block_size)
+        {
+            memset(buffer + bytes_read, 16, 16);
+            length += 16;
+        }
+        if (!length) break;
+
+        if (crypto_cipher(crypto, buffer, buffer, length)) return -1;
+        if (stats_enabled)
+        {
+            now = stats_now();
+            stats_add(STATS_AES, now - start, 0);
+            start = now;
+        }
+
+        // Concatenate the "text" as we compute the HMAC
+        if (crypto_mac(crypto, buffer, length)) return -1;
+
+        if ((merkle_ctx != NULL) && merkle_update(merkle_ctx, buffer, length))
+        {
+            return -1;
+        }
+        if (stats_enabled)
+        {
+            now = stats_now();
+            stats_add(STATS_HMAC, now - start, 0);
+            start = now;
+        }
+
+        // Write the encrypted blocks
+        if (fwrite(buffer, 1, length, outfp) != length)
+        {
+            fprintf(stderr, "Error: Could not write to output file\n");
+            return -1;
+        }
+        if (stats_enabled) stats_add(STATS_WRITE, stats_now() - start, 0);
+        stats_count(STATS_WRITE, length);
+
+        AESCRYPT_PROBE3(chunk_encrypt, piece, bytes_read, input_offset);
+        piece++;
+
+        remaining -= bytes_read;
+        input_offset += bytes_read;
+        since_checkpoint += bytes_read;
+
+        // Periodically save the state needed to resume from here
+        if ((checkpoint_ctx != NULL) && (length == bytes_read) &&
+            (since_checkpoint >= options->checkpoint_interval))
+        {
+            // The ciphertext must be on disk before a checkpoint covers it
+            state.input_offset = input_offset;
+            if (fflush(outfp) || fsync(fileno(outfp)) ||
+                ((state.output_offset = ftello(outfp)) < 0))
+            {
+                fprintf(stderr, "Error: Could not flush output file\n");
+                return -1;
+            }
+            memcpy(state.iv, crypto->IV, 16);
+            state.hmac_inner = crypto->hmac_ctx.sha_ctx;
+
+            if (save_checkpoint(options->checkpoint, checkpoint_ctx, &state))
+            {
+                secure_erase(&state, sizeof(state));
+                return -1;
+            }
+            secure_erase(&state, sizeof(state));
+            since_checkpoint = 0;
+        }
+    }
+
+    secure_erase(buffer, sizeof(buffer));
+
+    // Check to see if we had a read error
+    if (ferror(infp))
+    {
+        fprintf(stderr, "Error: Couldn't read input file\n");
+        return -1;
+    }
+
+    if (write_trailer(outfp, crypto, version, last_block_size))
+    {
+        return -1;
+    }
+
+    // The checkpoint is no longer needed once the output is on disk
+    if (checkpoint_ctx != NULL)
+    {
+        if (fflush(outfp) || fsync(fileno(outfp)))
+        {
+            fprintf(stderr, "Error: Could not flush output file\n");
+            return -1;
+        }
+        unlink(options->checkpoint);
+    }
+
+    return 0;
+}
+
+/*
+ *  encrypt_data
+ *
+ *  Description:
+ *      Write the AES Crypt stream for the input data stream.
+ *
+ *  Parameters:
+ *      infp [in]
+ *          The input file stream to encrypt.
+ *
+ *      outfp [in]
+ *          The output file stream into which encrypted data is written.
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password used for encryption.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *      options [in]
+ *          Optional behavior, or NULL for the defaults.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      When a Merkle tree is requested, the output stream must be
+ *      seekable so that the root can be placed in the "container"
+ *      extension once the ciphertext is complete.
+ *
+ *      When an input limit is given, reading stops after that many octets
+ *      even if infp has more data, leaving infp positioned just past them.
+ *
+ *      When a chunk size is given, the output is a chunked stream (see
+ *      chunked.c) rather than a version 2 stream.
+ *
+ *      When a compression level is given, the input is compressed before
+ *      it is encrypted and the codec is named in the "COMPRESSION"
+ *      extension.  An input limit then applies to the compressed input.
+ *      When a compressed codec is given instead, the input is already
+ *      compressed with that codec and is only named in the extension.
+ *
+ *      When a key derivation iteration count is given, the output is a
+ *      version 3 stream, whose key is derived with PBKDF2-HMAC-SHA512.
+ */
+static int encrypt_data(FILE *infp,
+                        FILE *outfp,
+                        unsigned char* passwd,
+                        int passlen,
+                        const stream_options *options)
+{
+    crypto_context crypto;
+    sha256_t digest;
+    unsigned char IV[16];
+    unsigned char iv_key[48];
+    unsigned char wrapped[48];
+    unsigned char key[32];
+    unsigned j;
+    unsigned char buffer[32];
+    FILE *randfp = NULL;
+    unsigned char tag_buffer[256];
+    merkle_context merkle_ctx;
+    checkpoint_keys checkpoint_ctx;
+    unsigned merkle_chunk_size = 0;
+    unsigned chunk_size = 0;
+    const char *checkpoint = NULL;
+    off_t container_offset = 0;
+    int compression_level = 0;
+    const char *codec = NULL;
+    unsigned long iterations = 0;
+    FILE *zfp = NULL;
+    int rc;
+
+    if (options != NULL)
+    {
+        merkle_chunk_size = options->merkle_chunk_size;
+        chunk_size = options->chunk_size;
+        checkpoint = options->checkpoint;
+        compression_level = options->compression_level;
+        codec = options->compressed_codec;
+        iterations = options->kdf_iterations;
+    }
+    if (compression_level) codec = compress_codec();
+
+    // Any earlier checkpoint does not apply to this new output
+    if (checkpoint != NULL) unlink(checkpoint);
+
+    // Open the source for random data.  Note that while the entropy
+    // might be lower with /dev/urandom than /dev/random, it will not
+    // fail to produce something.  Also, we're going to hash the result
+    // anyway.
+    if ((randfp = fopen("/dev/urandom", "r")) == NULL)
+    {
+        perror("Error open /dev/urandom:");
+        return -1;
+    }
+
+    // Create the 16-octet IV and 32-octet encryption key
+    // used for encrypting the plaintext file.
+    if (generate_iv_key(randfp, iv_key))
+    {
+        fclose(randfp);
+        return -1;
+    }
+
+    // Write an AES signature at the head of the file, along
+    // with the AES file format version number.
+    buffer[0] = 'A';
+    buffer[1] = 'E';
+    buffer[2] = 'S';
+    buffer[3] = (unsigned char) 0x02;   // Version 2
+    buffer[4] = '\0';                   // Reserved for version 0
+    if (chunk_size) buffer[3] = AES_CRYPT_CHUNKED_VERSION;
+    if (iterations) buffer[3] = (unsigned char) 0x03;
+    if (fwrite(buffer, 1, 5, outfp) != 5)
+    {
+        fprintf(stderr, "Error: Could not write out header data\n");
+        fclose(randfp);
+        return -1;
+    }
+
+    // Write out the CREATED-BY tag
+    j = 11 +                   // "CREATED-BY\0"
+        strlen(PROG_NAME) +    // Program name
+        1 +                    // Space
+        strlen(PROG_VERSION);  // Program version ID
+
+    // Our extension buffer is only 256 octets long, so
+    // let's not write an extension if it is too big
+    if (j < 256)
+    {
+        buffer[0] = '\0';
+        buffer[1] = (unsigned char) (j & 0xff);
+        if (fwrite(buffer, 1, 2, outfp) != 2)
+        {
+            fprintf(stderr, "Error: Could not write tag to AES file (1)\n");
+            fclose(randfp);
+            return -1;
+        }
+
+        strncpy((char *)tag_buffer, "CREATED_BY", 255);
+        tag_buffer[255] = '\0';
+        if (fwrite(tag_buffer, 1, 11, outfp) != 11)
+        {
+            fprintf(stderr, "Error: Could not write tag to AES file (2)\n");
+            fclose(randfp);
+            return -1;
+        }
+
+        sprintf((char *)tag_buffer, "%s %s", PROG_NAME, PROG_VERSION);
+        j = strlen((char *)tag_buffer);
+        if (fwrite(tag_buffer, 1, j, outfp) != j)
+        {
+            fprintf(stderr, "Error: Could not write tag to AES file (3)\n");
+            fclose(randfp);
+            return -1;
+        }
+    }
+
+    // Name the codec of compressed contents
+    if (codec != NULL)
+    {
+        j = strlen(COMPRESS_EXTENSION_ID) + 1 + strlen(codec);
+        if (j > 255)
+        {
+            fprintf(stderr, "Error: Compression codec name is too long\n");
+            fclose(randfp);
+            return -1;
+        }
+        buffer[0] = '\0';
+        buffer[1] = (unsigned char) j;
+        sprintf((char *) tag_buffer,
+                "%s%c%s",
+                COMPRESS_EXTENSION_ID,
+                '\0',
+                codec);
+        if ((fwrite(buffer, 1, 2, outfp) != 2) ||
+            (fwrite(tag_buffer, 1, j, outfp) != j))
+        {
+            fprintf(stderr, "Error: Could not write tag to AES file (7)\n");
+            fclose(randfp);
+            return -1;
+        }
+    }
+
+    // Note where the "container" extension is written so that it may
+    // be filled in later
+    if (merkle_chunk_size && ((container_offset = ftello(outfp)) < 0))
+    {
+        fprintf(stderr,
+                "Error: A Merkle tree requires a seekable output file\n");
+        fclose(randfp);
+        return -1;
+    }
+
+    // Write out the "container" extension
+    buffer[0] = '\0';
+    buffer[1] = (unsigned char) 128;
+    if (fwrite(buffer, 1, 2, outfp) != 2)
+    {
+        fprintf(stderr, "Error: Could not write tag to AES file (4)\n");
+        fclose(randfp);
+        return -1;
+    }
+    memset(tag_buffer, 0, 128);
+    if (fwrite(tag_buffer, 1, 128, outfp) != 128)
+    {
+        fprintf(stderr, "Error: Could not write tag to AES file (5)\n");
+        fclose(randfp);
+        return -1;
+    }
+
+    // Write out 0x0000 to indicate that no more extensions exist
+    buffer[0] = '\0';
+    buffer[1] = '\0';
+    if (fwrite(buffer, 1, 2, outfp) != 2)
+    {
+        fprintf(stderr, "Error: Could not write tag to AES file (6)\n");
+        fclose(randfp);
+        return -1;
+    }
+
+    // Version 3 gives the key derivation iteration count
+    if (iterations)
+    {
+        buffer[0] = (unsigned char) (iterations >> 24);
+        buffer[1] = (unsigned char) (iterations >> 16);
+        buffer[2] = (unsigned char) (iterations >> 8);
+        buffer[3] = (unsigned char) iterations;
+        if (fwrite(buffer, 1, 4, outfp) != 4)
+        {
+            fprintf(stderr,
+                    "Error: Could not write the key derivation "
+                    "iterations\n");
+            fclose(randfp);
+            return -1;
+        }
+    }
+
+    // We will use an initialization vector comprised of the current time
+    // process ID, and random data, all hashed together with SHA-256.
+    if (generate_iv(randfp, IV))
+    {
+        fclose(randfp);
+        return -1;
+    }
+
+    // We're finished collecting random data
+    fclose(randfp);
+
+    // Write the initialization vector to the file
+    if (fwrite(IV, 1, 16, outfp) != 16)
+    {
+        fprintf(stderr, "Error: Could not write out initialization vector\n");
+        return -1;
+    }
+
+    // Hash the IV and password 8192 times, or with PBKDF2 (version 3)
+    derive_key(IV, passwd, passlen, iterations, key);
+
+    // Encrypt the IV and key used to encrypt the plaintext file
+    // and compute the HMAC over the encrypted text
+    wrap_session_key(key,
+                     IV,
+                     iterations ? 0x03 : 0x02,
+                     iv_key,
+                     wrapped,
+                     digest);
+
+    // Checkpoints are protected using the password-derived key
+    if (checkpoint != NULL) checkpoint_keys_init(&checkpoint_ctx, key);
+    secure_erase(key, 32);
+
+    // Write the encrypted IV and key
+    if (fwrite(wrapped, 1, 48, outfp) != 48)
+    {
+        fprintf(stderr, "Error: Could not write iv_key data\n");
+        return -1;
+    }
+
+    // Write the HMAC
+    if (fwrite(digest, 1, 32, outfp) != 32)
+    {
+        fprintf(stderr, "Error: Could not write iv_key HMAC\n");
+        return -1;
+    }
+
+    // Compress the input ahead of encryption
+    if (compression_level)
+    {
+        if ((zfp = compress_open(infp,
+                                 compression_level,
+                                 options->jobs)) == NULL)
+        {
+            secure_erase(iv_key, 48);
+            return -1;
+        }
+        infp = zfp;
+    }
+
+    // Chunked streams encrypt the balance of the file independently
+    if (chunk_size)
+    {
+        rc = chunked_encrypt(infp,
+                             outfp,
+                             iv_key,
+                             chunk_size,
+                             options->input_limit,
+                             options->jobs);
+        secure_erase(iv_key, 48);
+        if (zfp != NULL) fclose(zfp);
+        if (rc) return -1;
+
+        if (fflush(outfp))
+        {
+            fprintf(stderr, "Error: Could not flush output file buffer\n");
+            return -1;
+        }
+
+        return 0;
+    }
+
+    // Encrypt and authenticate the datafile with the session IV and key
+    // using the selected provider
+    if (crypto_start(&crypto, NULL, iv_key+16, iv_key, 1))
+    {
+        secure_erase(iv_key, 48);
+        if (zfp != NULL) fclose(zfp);
+        return -1;
+    }
+
+    if (merkle_chunk_size)
+    {
+        merkle_starts(&merkle_ctx,
+                      iv_key+16,
+                      merkle_chunk_size,
+                      options->merkle_sidecar);
+    }
+
+    // Wipe the IV and encryption key from memory
+    secure_erase(iv_key, 48);
+
+    rc = encrypt_blocks(infp,
+                        outfp,
+                        &crypto,
+                        merkle_chunk_size ? &merkle_ctx : NULL,
+                        options,
+                        (checkpoint != NULL) ? &checkpoint_ctx : NULL,
+                        0);
+    crypto_end(&crypto);
+    secure_erase(&checkpoint_ctx, sizeof(checkpoint_ctx));
+    if (zfp != NULL) fclose(zfp);
+    if (rc) return -1;
+
+    // Place the Merkle tree root in the "container" extension
+    if (merkle_chunk_size)
+    {
+        if (merkle_finish(&merkle_ctx, digest))
+        {
+            return -1;
+        }
+
+        merkle_build_container(tag_buffer, merkle_chunk_size, digest);
+
+        if (fseeko(outfp, container_offset, SEEK_SET) ||
+            (fwrite(tag_buffer, 1, MERKLE_CONTAINER_LEN, outfp) !=
+                MERKLE_CONTAINER_LEN) ||
+            fseeko(outfp, 0, SEEK_END))
+        {
+            fprintf(stderr, "Error: Could not write the Merkle tree root\n");
+            return -1;
+        }
+    }
+
+    // Flush the output buffer to ensure all data is written to disk
+    if (fflush(outfp))
+    {
+        fprintf(stderr, "Error: Could not flush output file buffer\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  encrypt_stream
+ *
+ *  Description:
+ *      This function is called to encrypt the input data stream.
+ *
+ *  Parameters:
+ *      infp [in]
+ *          The input file stream to encrypt.
+ *
+ *      outfp [in]
+ *          The output file stream into which encrypted data is written.
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password used for encryption.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *      options [in]
+ *          Optional behavior, or NULL for the defaults.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      See encrypt_data() for the effect of the options.  In addition,
+ *      the holes of a sparse input file are not read (see sparse.c).
+ *
+ *      When digests are requested, the plaintext and the complete output
+ *      are hashed as they pass through (see digest.c).  A digest of the
+ *      output cannot be combined with a Merkle tree or checkpoints, as
+ *      those seek in or synchronize the output stream.
+ */
+int encrypt_stream(FILE *infp,
+                   FILE *outfp,
+                   unsigned char* passwd,
+                   int passlen,
+                   const stream_options *options)
+{
+    stream_digests *digests = (options != NULL) ? options->digests : NULL;
+    FILE *sfp = NULL;
+    FILE *pfp = NULL;
+    FILE *cfp = NULL;
+    int rc;
+
+    // Read sparse input without reading its holes, unless only a part
+    // of it is to be read
+    if (((options == NULL) || !options->input_limit) &&
+        ((sfp = sparse_reader_open(infp)) != NULL))
+    {
+        infp = sfp;
+    }
+
+    // Hash the plaintext as it is read
+    if ((digests != NULL) && (digests->plain_algorithm != NULL))
+    {
+        if ((pfp = digest_open(infp,
+                               "r",
+                               digests->plain_algorithm,
+                               digests->plain)) == NULL)
+        {
+            if (sfp != NULL) fclose(sfp);
+            return -1;
+        }
+        infp = pfp;
+    }
+
+    // Hash the output as it is written
+    if ((digests != NULL) && (digests->cipher_algorithm != NULL))
+    {
+        if ((cfp = digest_open(outfp,
+                               "w",
+                               digests->cipher_algorithm,
+                               digests->cipher)) == NULL)
+        {
+            if (pfp != NULL) fclose(pfp);
+            if (sfp != NULL) fclose(sfp);
+            return -1;
+        }
+    }
+
+    rc = encrypt_data(infp,
+                      (cfp != NULL) ? cfp : outfp,
+                      passwd,
+                      passlen,
+                      options);
+
+    if ((cfp != NULL) && fclose(cfp) && !rc)
+    {
+        fprintf(stderr, "Error: Could not write to the output file\n");
+        rc = -1;
+    }
+    if ((pfp != NULL) && fclose(pfp)) rc = -1;
+    if ((sfp != NULL) && fclose(sfp)) rc = -1;
+
+    if ((cfp != NULL) && !rc && fflush(outfp))
+    {
+        fprintf(stderr, "Error: Could not flush output file buffer\n");
+        rc = -1;
+    }
+
+    return rc;
+}
+
+/*
+ *  resume_stream
+ *
+ *  Description:
+ *      Continue an interrupted encryption from its last checkpoint.
+ *
+ *  Parameters:
+ *      infp [in]
+ *          The input file stream being encrypted, which must be seekable.
+ *
+ *      outfp [in]
+ *          The partially written output file, opened for update.
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password used for encryption.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *      options [in]
+ *          Optional behavior, which must name the checkpoint file.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      The session key is unwrapped from the header of the output, the
+ *      output is truncated to the length recorded in the checkpoint, and
+ *      encryption continues from the recorded input offset.
+ */
+int resume_stream(FILE *infp,
+                  FILE *outfp,
+                  unsigned char *passwd,
+                  int passlen,
+                  const stream_options *options)
+{
+    crypto_context crypto;
+    aescrypt_header header;
+    checkpoint_keys checkpoint_ctx;
+    checkpoint_state state;
+    unsigned char buffer[16 + 48 + 32];
+    unsigned char iv_key[48];
+    unsigned char key[32];
+    off_t body_offset;
+    int rc;
+
+    // Read the header, IV, and wrapped session key of the output
+    if (read_header(outfp, &header))
+    {
+        free_header(&header);
+        return -1;
+    }
+
+    if ((header.hdr.version != 0x02) ||
+        (find_extension(&header, MERKLE_EXTENSION_ID) != NULL) ||
+        (find_extension(&header, COMPRESS_EXTENSION_ID) != NULL))
+    {
+        fprintf(stderr, "Error: The output file cannot be resumed\n");
+        free_header(&header);
+        return -1;
+    }
+    free_header(&header);
+
+    if (fread(buffer, 1, sizeof(buffer), outfp) != sizeof(buffer))
+    {
+        fprintf(stderr, "Error: The output file is too short to resume\n");
+        return -1;
+    }
+    body_offset = header.iv_offset + sizeof(buffer);
+
+    derive_key(buffer, passwd, passlen, 0, key);
+
+    if (unwrap_session_key(key,
+                           buffer,
+                           0x02,
+                           buffer + 16,
+                           buffer + 64,
+                           iv_key))
+    {
+        fprintf(stderr,
+                "Error: Message has been altered or password is "
+                "incorrect\n");
+        secure_erase(key, 32);
+        return -1;
+    }
+
+    checkpoint_keys_init(&checkpoint_ctx, key);
+    secure_erase(key, 32);
+
+    rc = load_checkpoint(options->checkpoint, &checkpoint_ctx, &state);
+
+    // Every input octet up to the checkpoint produced one output octet
+    if (!rc && ((state.output_offset - body_offset != state.input_offset) ||
+                (state.input_offset % 16)))
+    {
+        fprintf(stderr, "Error: The checkpoint is inconsistent\n");
+        rc = -1;
+    }
+
+    // Discard any output written after the checkpoint
+    if (!rc && (fflush(outfp) ||
+                ftruncate(fileno(outfp), state.output_offset) ||
+                fseeko(outfp, state.output_offset, SEEK_SET)))
+    {
+        perror("Error truncating output file");
+        rc = -1;
+    }
+
+    if (!rc && fseeko(infp, state.input_offset, SEEK_SET))
+    {
+        perror("Error seeking in input file");
+        rc = -1;
+    }
+
+    // Restore the CBC chain and the running HMAC, which only the
+    // built-in provider exposes
+    if (!rc)
+    {
+        rc = crypto_start(&crypto,
+                          provider_find(PROVIDER_BUILTIN),
+                          iv_key + 16,
+                          state.iv,
+                          1);
+        crypto.hmac_ctx.sha_ctx = state.hmac_inner;
+
+        if (!rc)
+        {
+            rc = encrypt_blocks(infp,
+                                outfp,
+                                &crypto,
+                                NULL,
+                                options,
+                                &checkpoint_ctx,
+                                state.input_offset);
+        }
+        crypto_end(&crypto);
+    }
+
+    secure_erase(iv_key, 48);
+    secure_erase(&state, sizeof(state));
+    secure_erase(&checkpoint_ctx, sizeof(checkpoint_ctx));
+
+    if (!rc && fflush(outfp))
+    {
+        fprintf(stderr, "Error: Could not flush output file buffer\n");
+        rc = -1;
+    }
+
+    return rc;
+}
+
+/*
+ *  decrypt_blocks
+ *
+ *  Description:
+ *      Decrypt the ciphertext of a stream, which ends with the file size
+ *      modulo (versions 1 and 2) or PKCS#7 padding (version 3), and the
+ *      HMAC.
+ *
+ *  Parameters:
+ *      infp [in]
+ *          The input file stream, positioned at the ciphertext.
+ *
+ *      outfp [in]
+ *          The output file stream into which decrypted data is written.
+ *
+ *      aeshdr [in]
+ *          The file header, which gives the version and, for version 0,
+ *          the number of octets in the last block.
+ *
+ *      crypto [in/out]
+ *          The cipher, CBC chaining value, and running HMAC over the
+ *          ciphertext.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      The input is read in large pieces, holding back the last block and
+ *      the trailer, which are only known to be last at the end of the
+ *      input.  The last block is only decrypted, and any padding checked,
+ *      once the HMAC has been verified.  Each piece written fires the
+ *      chunk_decrypt probe.
+ */
+static int decrypt_blocks(FILE *infp,
+                          FILE *outfp,
+                          const aescrypt_hdr *aeshdr,
+                          crypto_context *crypto)
+{
+    unsigned char buffer[STREAM_BUFFER_SIZE + 49];
+    sha256_t digest;
+    size_t trailer = 32;
+    size_t held = 0;
+    size_t bytes_read, length, j;
+    unsigned last_block_size = aeshdr->last_block_size;
+    unsigned padding;
+    unsigned long long piece = 0;
+    off_t offset = 0;
+    int authentic;
+    double start = 0, now;
+
+    // Versions 1 and 2 give the file size modulo before the HMAC
+    if ((aeshdr->version == 0x01) || (aeshdr->version == 0x02)) trailer = 33;
+
+    for (;;)
+    {
+        if (stats_enabled) start = stats_now();
+        bytes_read = fread(buffer + held, 1, sizeof(buffer) - held, infp);
+        if (stats_enabled)
+        {
+            now = stats_now();
+            stats_add(STATS_READ, now - start, 0);
+            start = now;
+        }
+        stats_count(STATS_READ, bytes_read);
+        if (!bytes_read) break;
+        held += bytes_read;
+
+        // Keep back what may be the last block and the trailer
+        if (held <= trailer + 16) continue;
+        length = (held - trailer - 16) & ~(size_t) 15;
+
+        if (crypto_mac(crypto, buffer, length)) return -1;
+        if (stats_enabled)
+        {
+            now = stats_now();
+            stats_add(STATS_HMAC, now - start, 0);
+            start = now;
+        }
+
+        if (crypto_cipher(crypto, buffer, buffer, length)) return -1;
+        if (stats_enabled)
+        {
+            now = stats_now();
+            stats_add(STATS_AES, now - start, 0);
+            start = now;
+        }
+
+        if (fwrite(buffer, 1, length, outfp) != length)
+        {
+            perror("Error writing decrypted block:");
+            return -1;
+        }
+        if (stats_enabled) stats_add(STATS_WRITE, stats_now() - start, 0);
+        stats_count(STATS_WRITE, length);
+
+        AESCRYPT_PROBE3(chunk_decrypt, piece, length, offset);
+        piece++;
+        offset += length;
+
+        held -= length;
+        memmove(buffer, buffer + length, held);
+    }
+
+    if (ferror(infp))
+    {
+        perror("Error reading input file:");
+        return -1;
+    }
+
+    // The ciphertext is a whole number of blocks, which may be none only
+    // if the plaintext is empty (and the stream is not padded)
+    if (held == trailer + 16)
+    {
+        if (crypto_mac(crypto, buffer, 16)) return -1;
+        if (trailer == 33) last_block_size = buffer[16] & 0x0F;
+    }
+    else if ((held != trailer) || (aeshdr->version == 0x03) ||
+             ((trailer == 33) ? (buffer[0] & 0x0F) : last_block_size))
+    {
+        fprintf(stderr, "Error: Input file is corrupt.\n");
+        return -1;
+    }
+
+    if (crypto_mac_finish(crypto, digest)) return -1;
+
+    authentic = !memcmp(digest, buffer + held - 32, 32);
+    AESCRYPT_PROBE1(hmac_verify, authentic);
+    if (!authentic)
+    {
+        if (aeshdr->version == 0x00)
+        {
+            fprintf(stderr,
+                    "Error: Message has been altered or password is "
+                    "incorrect\n");
+        }
+        else
+        {
+            fprintf(stderr,
+                    "Error: Message has been altered and should not be "
+                    "trusted\n");
+        }
+        return -1;
+    }
+
+    if (held == trailer + 16)
+    {
+        if (crypto_cipher(crypto, buffer, buffer, 16)) return -1;
+
+        // Every octet of the padding gives its length
+        if (aeshdr->version == 0x03)
+        {
+            padding = buffer[15];
+            if (padding > 16) padding = 0;
+            for (j = 16 - padding; padding && (j < 16); j++)
+            {
+                if (buffer[j] != padding) padding = 0;
+            }
+            if (!padding)
+            {
+                fprintf(stderr, "Error: Input file has invalid padding.\n");
+                return -1;
+            }
+            last_block_size = 16 - padding;
+        }
+        else if (!last_block_size)
+        {
+            last_block_size = 16;
+        }
+
+        if (stats_enabled) start = stats_now();
+        if (fwrite(buffer, 1, last_block_size, outfp) != last_block_size)
+        {
+            perror("Error writing decrypted block:");
+            return -1;
+        }
+        if (stats_enabled) stats_add(STATS_WRITE, stats_now() - start, 0);
+        stats_count(STATS_WRITE, last_block_size);
+
+        AESCRYPT_PROBE3(chunk_decrypt, piece, last_block_size, offset);
+    }
+
+    secure_erase(buffer, sizeof(buffer));
+
+    // Flush the output buffer to ensure all data is written to disk
+    if (fflush(outfp))
+    {
+        fprintf(stderr, "Error: Could not flush output file buffer\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  decrypt_body
+ *
+ *  Description:
+ *      Decrypt the input data stream following its header.
+ *
+ *  Parameters:
+ *      infp [in]
+ *          The input file stream, positioned after the extensions.
+ *
+ *      outfp [in]
+ *          The output file stream into which decrypted data is written.
+ *
+ *      aeshdr [in]
+ *          The file header.
+ *
+ *      iterations [in]
+ *          The key derivation iterations of a version 3 stream, else 0.
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password used for encryption.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      None.
+ */
+static int decrypt_body(FILE *infp,
+                        FILE *outfp,
+                        aescrypt_hdr aeshdr,
+                        unsigned long iterations,
+                        unsigned char *passwd,
+                        int passlen)
+{
+    crypto_context crypto;
+    unsigned char IV[16];
+    unsigned char iv_key[48];
+    unsigned char key[32];
+    size_t bytes_read;
+    unsigned char buffer[48], buffer2[32];
+    int rc;
+
+    // Read the initialization vector from the file
+    if ((bytes_read = fread(IV, 1, 16, infp)) != 16)
+    {
+        if (feof(infp))
+        {
+            fprintf(stderr, "Error: Input file is too short.\n");
+        }
+        else
+        {
+            perror("Error reading the initialization vector:");
+        }
+        return -1;
+    }
+
+    // Hash the IV and password 8192 times, or with PBKDF2 (version 3)
+    derive_key(IV, passwd, passlen, iterations, key);
+
+    // If this is a version 1 or later file, then read the IV and key
+    // for decrypting the bulk of the file.
+    if (aeshdr.version >= 0x01)
+    {
+        if (((bytes_read = fread(buffer, 1, 48, infp)) != 48) ||
+            ((bytes_read = fread(buffer2, 1, 32, infp)) != 32))
+        {
+            if (feof(infp))
+            {
+                fprintf(stderr, "Error: Input file is too short.\n");
+            }
+            else
+            {
+                perror("Error reading input file IV and key:");
+            }
+            secure_erase(key, 32);
+            return -1;
+        }
+
+        // Verify that the HMAC is correct and decrypt the IV and key
+        if (unwrap_session_key(key,
+                               IV,
+                               aeshdr.version,
+                               buffer,
+                               buffer2,
+                               iv_key))
+        {
+            fprintf(stderr,
+                    "Error: Message has been altered or password is "
+                    "incorrect\n");
+            secure_erase(key, 32);
+            return -1;
+        }
+
+        // Chunked streams decrypt the balance of the file independently
+        if (aeshdr.version == AES_CRYPT_CHUNKED_VERSION)
+        {
+            secure_erase(key, 32);
+            rc = chunked_decrypt(infp, outfp, iv_key, 0);
+            secure_erase(iv_key, 48);
+            return rc;
+        }
+
+        // Decrypt the datafile with the session IV and key
+        rc = crypto_start(&crypto, NULL, iv_key+16, iv_key, 0);
+
+        // Wipe the IV and encryption key from memory
+        secure_erase(iv_key, 48);
+    }
+    else
+    {
+        // Version 0 files encrypt the data directly using the
+        // password-derived key
+        rc = crypto_start(&crypto, NULL, key, IV, 0);
+    }
+
+    secure_erase(key, 32);
+
+    // Decrypt the balance of the file
+    if (!rc) rc = decrypt_blocks(infp, outfp, &aeshdr, &crypto);
+    crypto_end(&crypto);
+
+    return rc;
+}
+
+/*
+ *  decrypt_stream
+ *
+ *  Description:
+ *      This function is called to decrypt the input data stream.
+ *
+ *  Parameters:
+ *      infp [in]
+ *          The input file stream to decrypt.
+ *
+ *      outfp [in]
+ *          The output file stream into which decrypted data is written.
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password used for encryption.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Compressed contents are decompressed as they are decrypted.  A
+ *      regular output file is written as a sparse file.
+ */
+int decrypt_stream(FILE *infp, FILE *outfp, unsigned char* passwd, int passlen)
+{
+    aescrypt_header header;
+    aescrypt_hdr aeshdr;
+    unsigned long iterations;
+    const aescrypt_extension *extension;
+    char codec[256];
+    size_t id_length = strlen(COMPRESS_EXTENSION_ID) + 1;
+    int compressed = 0;
+    FILE *zfp = NULL;
+    FILE *sfp = NULL;
+    int rc;
+
+    // Read the file header and skip over any extensions
+    if (read_header(infp, &header))
+    {
+        free_header(&header);
+        return -1;
+    }
+    aeshdr = header.hdr;
+    iterations = header.kdf_iterations;
+
+    if ((extension = find_extension(&header,
+                                    COMPRESS_EXTENSION_ID)) != NULL)
+    {
+        snprintf(codec,
+                 sizeof(codec),
+                 "%.*s",
+                 (int) (extension->length - id_length),
+                 (const char *) extension->data + id_length);
+        compressed = 1;
+    }
+    free_header(&header);
+
+    // Leave holes in a regular output file where the plaintext is zeros
+    if ((sfp = sparse_writer_open(outfp)) != NULL) outfp = sfp;
+
+    if (compressed && ((zfp = decompress_open(outfp, codec)) == NULL))
+    {
+        if (sfp != NULL) fclose(sfp);
+        return -1;
+    }
+
+    rc = decrypt_body(infp,
+                      (zfp != NULL) ? zfp : outfp,
+                      aeshdr,
+                      iterations,
+                      passwd,
+                      passlen);
+
+    if ((zfp != NULL) && fclose(zfp) && !rc)
+    {
+        fprintf(stderr, "Error: Compressed data is incomplete\n");
+        rc = -1;
+    }
+
+    if ((sfp != NULL) && fclose(sfp)) rc = -1;
+
+    if ((zfp != NULL) && (sfp == NULL) && !rc && fflush(outfp))
+    {
+        fprintf(stderr, "Error: Could not flush output file buffer\n");
+        rc = -1;
+    }
+
+    return rc;
+}
+
+/*
+ *  decrypt_compressed
+ *
+ *  Description:
+ *      Decrypt the input data stream without decompressing its contents.
+ *
+ *  Parameters:
+ *      infp [in]
+ *          The input file stream to decrypt.
+ *
+ *      outfp [in]
+ *          The output file stream into which decrypted data is written.
+ *
+ *      passwd [in]
+ *          The UTF-16LE encoded password used for encryption.
+ *
+ *      passlen [in]
+ *          The length of the password in octets.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error.
+ *
+ *  Comments:
+ *      Compressed contents are written as they were compressed, so that
+ *      they can be encrypted again with the "compressed_codec" option
+ *      without being compressed a second time.  Other contents are
+ *      written as decrypt_stream() writes them, but never sparsely.
+ */
+int decrypt_compressed(FILE *infp,
+                       FILE *outfp,
+                       unsigned char *passwd,
+                       int passlen)
+{
+    aescrypt_header header;
+    aescrypt_hdr aeshdr;
+    unsigned long iterations;
+
+    if (read_header(infp, &header))
+    {
+        free_header(&header);
+        return -1;
+    }
+    aeshdr = header.hdr;
+    iterations = header.kdf_iterations;
+    free_header(&header);
+
+    return decrypt_body(infp, outfp, aeshdr, iterations, passwd, passlen);
+}
+
+
+/*
+ *  authenticate_body
+ *
+ *  Description:
+ *      Authenticate the ciphertext of an existing AES Crypt file and
+ *      recover the state needed to continue encrypting where it ends.
+ *
+ *  Parameters:
+ *      fp [in]
+ *          The AES Crypt file.  Its position is not changed.
+ *
+ *      header [in]
+ *          The header read from the file by read_header().
+ *
+ *      aes_ctx [in]
+ *          The key schedule for the session key.
+ *
+ *      iv_key [in]
+ *          The session IV and key.
+ *
+ *      hmac_ctx [out]
+ *          The running HMAC over the ciphertext before the last partial
+ *          block.
+ *
+ *      IV [out]
+ *          The CBC chaining value before the last partial block.
+ *
+ *      pending [out]
+ *          The plaintext of the last partial block.
+ *
+ *      pending_length [out]
+ *          The number of octets in pending, or 0 if the last block is full.
+ *
+ *      offset [out]
+ *          The offset of the last partial block or, if there is none, of
+ *          the file size modulo.
+ *
+ *  Returns:
+ *      0 if successful, otherwise the file could not be authenticated.
+ *
+ *  Comments:
+ *      Only the last partial block is decrypted; the rest of the
+ *      ciphertext is only hashed.
+ */
+static int authenticate_body(FILE *fp,
+                             const aescrypt_header *header,
+                             aes_context *aes_ctx,
+                             const unsigned char iv_key[48],
+                             hmac_sha256_context *hmac_ctx,
+                             unsigned char IV[16],
+                             unsigned char pending[16],
+                             unsigned *pending_length,
+                             off_t *offset)
+{
+    aescrypt_sizes sizes;
+    hmac_sha256_context final_ctx;
+    sha256_t digest;
+    unsigned char stored[32];
+    unsigned char buffer[65536];
+    off_t position;
+    off_t end;
+    size_t length;
+    unsigned i;
+    int authentic;
+
+    if (read_sizes(fp, header, &sizes)) return -1;
+
+    // Everything but the last partial block is kept as it is
+    end = sizes.body_offset + sizes.body_length;
+    *offset = end;
+    *pending_length = 0;
+    if ((sizes.body_length > 0) && sizes.last_block_size)
+    {
+        *offset -= 16;
+        *pending_length = sizes.last_block_size;
+    }
+
+    hmac_sha256_starts(hmac_ctx, iv_key + 16, 32);
+    memcpy(IV, iv_key, 16);
+    for (position = sizes.body_offset; position < *offset; position += length)
+    {
+        length = sizeof(buffer);
+        if (*offset - position < (off_t) length)
+        {
+            length = (size_t) (*offset - position);
+        }
+        if (pread(fileno(fp), buffer, length, position) != (ssize_t) length)
+        {
+            fprintf(stderr, "Error: Could not read the output file\n");
+            return -1;
+        }
+        hmac_sha256_update(hmac_ctx, buffer, length);
+        memcpy(IV, buffer + length - 16, 16);
+    }
+
+    // Hash and decrypt the last partial block, then check the HMAC
+    final_ctx = *hmac_ctx;
+    if (*pending_length)
+    {
+        if (pread(fileno(fp), buffer, 16, *offset) != 16)
+        {
+            fprintf(stderr, "Error: Could not read the output file\n");
+            return -1;
+        }
+        hmac_sha256_update(&final_ctx, buffer, 16);
+        aes_decrypt(aes_ctx, buffer, pending);
+        for (i = 0; i < 16; i++) pending[i] ^= IV[i];
+    }
+    hmac_sha256_finish(&final_ctx, digest);
+
+    if (pread(fileno(fp), stored, 32, end + 1) != 32)
+    {
+        fprintf(stderr, "Error: Could not read the output file HMAC\n");
+        secure_erase(buffer, 16);
+        return -1;
+    }
+    secure_erase(buffer, 16);
+
+    authentic = !memcmp(digest, stored, 32);
+    AESCRYPT_PROBE1(hmac_verify, authentic);
+    if (!authentic)
+    {
+        fprintf(stderr,
+                "Error: Message has been altered or password is "
+                "incorrect\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  append_stream
+ *
+ *  Description:
+ *      Encrypt the input stream onto the end of an existing AES Crypt
+ *      file without re-encrypting what the file already holds.
+ *
+ *  Parameters:
+ *      infp [in]
+ *          The input file stream to encrypt.
+ *
+ *      outfp [in]
+ *          The existing AES Crypt file, opened for reading and writing.
+ *
+ *      outfile [in]
+ *          The name of the existing file, used to name its journal.
+ *
+ *      passwd [in]
+ *          The password of the existing file.
+ *
+ *      passlen [in]
+ *          The length of the password.
+ *
+ *      options [in]
+ *          Optional behavior, or NULL for the defaults.
+ *
+ *  Returns:
+ *      0 if successful, otherwise there was an error and the file is left
+ *      as it was.
+ *
+ *  Comments:
+ *      The existing ciphertext is authenticated, which requires hashing
+ *      but not decrypting it.  The last partial block, if any, is
+ *      decrypted and rewritten with the start of the new input, and the
+ *      CBC chain and HMAC continue from there.  Before the file is
+ *      truncated, its tail is saved in a journal; if an append is
+ *      interrupted, the next append finds the journal and either rolls the
+ *      file back or, if the interrupted append had completed, discards
+ *      the journal.
+ */
+int append_stream(FILE *infp,
+                  FILE *outfp,
+                  const char *outfile,
+                  unsigned char *passwd,
+                  int passlen,
+                  const stream_options *options)
+{
+    crypto_context crypto;
+    aescrypt_header header;
+    char journal[AES_CRYPT_MAX_PATH];
+    unsigned char buffer[16 + 48 + 32];
+    unsigned char iv_key[48];
+    unsigned char key[32];
+    unsigned char block[16];
+    unsigned char pending[16];
+    unsigned pending_length;
+    off_t offset;
+    size_t bytes_read;
+    int restored;
+    int finished = 0;
+    int rc = 0;
+
+    if (snprintf(journal,
+                 AES_CRYPT_MAX_PATH,
+                 JOURNAL_FILE_FORMAT,
+                 outfile) >= AES_CRYPT_MAX_PATH)
+    {
+        fprintf(stderr, "Journal file pathname too long\n");
+        return -1;
+    }
+
+    // Read the header, IV, and wrapped session key; an append never
+    // changes these, so they are intact even if an append was interrupted
+    if (read_header(outfp, &header))
+    {
+        free_header(&header);
+        return -1;
+    }
+
+    if ((header.hdr.version < 0x01) || (header.hdr.version > 0x02) ||
+        (find_extension(&header, MERKLE_EXTENSION_ID) != NULL) ||
+        (find_extension(&header, COMPRESS_EXTENSION_ID) != NULL))
+    {
+        fprintf(stderr, "Error: The output file cannot be appended to\n");
+        free_header(&header);
+        return -1;
+    }
+
+    if (fread(buffer, 1, sizeof(buffer), outfp) != sizeof(buffer))
+    {
+        fprintf(stderr, "Error: The output file is too short\n");
+        free_header(&header);
+        return -1;
+    }
+
+    derive_key(buffer, passwd, passlen, 0, key);
+
+    rc = unwrap_session_key(key,
+                            buffer,
+                            header.hdr.version,
+                            buffer + 16,
+                            buffer + 64,
+                            iv_key);
+    secure_erase(key, 32);
+    if (rc)
+    {
+        fprintf(stderr,
+                "Error: Message has been altered or password is "
+                "incorrect\n");
+        free_header(&header);
+        return -1;
+    }
+
+    // The HMAC is resumed from the state of the built-in provider
+    if (crypto_start(&crypto,
+                     provider_find(PROVIDER_BUILTIN),
+                     iv_key + 16,
+                     iv_key,
+                     1))
+    {
+        secure_erase(iv_key, 48);
+        free_header(&header);
+        return -1;
+    }
+
+    // Authenticate the file; if that fails and an earlier append left a
+    // journal, roll that append back and try again.  If it succeeds, any
+    // journal belongs to an append that completed.
+    for (restored = 0; ; restored = 1)
+    {
+        rc = authenticate_body(outfp,
+                               &header,
+                               &crypto.aes_ctx,
+                               iv_key,
+                               &crypto.hmac_ctx,
+                               crypto.IV,
+                               pending,
+                               &pending_length,
+                               &offset);
+        if (!rc || restored) break;
+
+        if (restore_journal(journal, outfp)) break;
+        fprintf(stderr, "Restored %s after an interrupted append\n", outfile);
+    }
+    free_header(&header);
+
+    if (!rc && (unlink(journal) != 0) && (errno != ENOENT))
+    {
+        fprintf(stderr, "Error removing journal file %s : ", journal);
+        perror("");
+        rc = -1;
+    }
+
+    if (!rc) rc = save_journal(journal, outfp, offset);
+
+    if (!rc && (ftruncate(fileno(outfp), offset) ||
+                fseeko(outfp, offset, SEEK_SET)))
+    {
+        perror("Error truncating output file");
+        rc = -1;
+    }
+
+    // Complete the last partial block with the start of the new input
+    if (!rc && pending_length)
+    {
+        bytes_read = fread(pending + pending_length,
+                           1,
+                           16 - pending_length,
+                           infp);
+        pending_length += bytes_read;
+
+        if (ferror(infp))
+        {
+            fprintf(stderr, "Error: Couldn't read input file\n");
+            rc = -1;
+        }
+
+        if (!rc)
+        {
+            if (crypto_cipher(&crypto, pending, block, 16) ||
+                crypto_mac(&crypto, block, 16))
+            {
+                rc = -1;
+            }
+            else if (fwrite(block, 1, 16, outfp) != 16)
+            {
+                fprintf(stderr, "Error: Could not write to output file\n");
+                rc = -1;
+            }
+        }
+
+        // If the input ended within the block, only the trailer remains
+        if (!rc && (pending_length < 16))
+        {
+            rc = write_trailer(outfp,
+                               &crypto,
+                               header.hdr.version,
+                               pending_length);
+            finished = 1;
+        }
+    }
+
+    if (!rc && !finished)
+    {
+        rc = encrypt_blocks(infp,
+                            outfp,
+                            &crypto,
+                            NULL,
+                            options,
+                            NULL,
+                            0);
+    }
+
+    // The append is complete once the file is on disk
+    if (!rc && (fflush(outfp) || fsync(fileno(outfp))))
+    {
+        fprintf(stderr, "Error: Could not flush output file\n");
+        rc = -1;
+    }
+
+    if (!rc)
+    {
+        unlink(journal);
+    }
+    else if (!restore_journal(journal, outfp))
+    {
+        fprintf(stderr, "Restored %s to its state before the append\n",
+                outfile);
+    }
+
+    secure_erase(iv_key, 48);
+    secure_erase(pending, 16);
+    crypto_end(&crypto);
+
+    return rc;
+}
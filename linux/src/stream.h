@@ -0,0 +1,73 @@
+/*
+ *  stream.h
+ *
+ *  Stream Encryption and Decryption for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      Functions to encrypt and decrypt data streams in the AES Crypt
+ *      file format.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#ifndef AESCRYPT_STREAM_H
+#define AESCRYPT_STREAM_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "digest.h"
+
+// Digests computed by encrypt_stream() as it encrypts
+typedef struct {
+    const digest_algorithm *plain_algorithm;    // Or NULL for none
+    unsigned char plain[DIGEST_MAX_SIZE];       // Digest of the plaintext
+    const digest_algorithm *cipher_algorithm;   // Or NULL for none
+    unsigned char cipher[DIGEST_MAX_SIZE];      // Digest of the output
+} stream_digests;
+
+// Optional behavior of encrypt_stream()
+typedef struct {
+    unsigned merkle_chunk_size;     // Non-zero to add a Merkle tree
+    FILE *merkle_sidecar;           // Receives the tree leaves, or NULL
+    off_t input_limit;              // Octets to read from infp, or 0 for all
+    unsigned chunk_size;            // Non-zero to write a chunked stream
+    unsigned jobs;                  // Threads for a chunked stream, 0 default
+    const char *checkpoint;         // File to save progress in, or NULL
+    off_t checkpoint_interval;      // Input octets between checkpoints
+    int compression_level;          // Non-zero to compress the input
+    const char *compressed_codec;   // Codec of compressed input, or NULL
+    stream_digests *digests;        // Digests to compute, or NULL
+    unsigned long kdf_iterations;   // Non-zero to write a version 3 stream
+} stream_options;
+
+// Function prototypes
+int encrypt_stream(FILE *infp,
+                   FILE *outfp,
+                   unsigned char *passwd,
+                   int passlen,
+                   const stream_options *options);
+int resume_stream(FILE *infp,
+                  FILE *outfp,
+                  unsigned char *passwd,
+                  int passlen,
+                  const stream_options *options);
+int append_stream(FILE *infp,
+                  FILE *outfp,
+                  const char *outfile,
+                  unsigned char *passwd,
+                  int passlen,
+                  const stream_options *options);
+int decrypt_stream(FILE *infp,
+                   FILE *outfp,
+                   unsigned char *passwd,
+                   int passlen);
+int decrypt_compressed(FILE *infp,
+                       FILE *outfp,
+                       unsigned char *passwd,
+                       int passlen);
+
+#endif // AESCRYPT_STREAM_H
@@ -14,6 +14,7 @@
 
 #define _POSIX_C_SOURCE 200809L
 
+#include <stdio.h>
 #include <string.h>
 
 /*
@@ -44,3 +45,49 @@ void *secure_erase(void *buffer, unsigned length)
 
     return (*memset_secure)(buffer, 0, length);
 }
+
+/*
+ *  json_print_string
+ *
+ *  Description:
+ *      Write data as a JSON string literal.
+ *
+ *  Parameters:
+ *      fp [in]
+ *          The stream to write to.
+ *
+ *      data [in]
+ *          The characters of the string, assumed to be UTF-8.
+ *
+ *      length [in]
+ *          The length of the string in octets.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      Quotes, backslashes, and control characters are escaped.
+ */
+void json_print_string(FILE *fp, const void *data, size_t length)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    size_t i;
+
+    fputc('"', fp);
+    for (i = 0; i < length; i++)
+    {
+        if ((p[i] == '"') || (p[i] == '\\'))
+        {
+            fprintf(fp, "\\%c", p[i]);
+        }
+        else if (p[i] < 0x20)
+        {
+            fprintf(fp, "\\u%04x", p[i]);
+        }
+        else
+        {
+            fputc(p[i], fp);
+        }
+    }
+    fputc('"', fp);
+}
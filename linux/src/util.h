@@ -15,7 +15,12 @@
 #ifndef AESCRYPT_UTIL_H
 #define AESCRYPT_UTIL_H
 
+#include <stdio.h>
+
 // Securely erase memory
 void *secure_erase(void *buffer, unsigned length);
 
+// Write data as a JSON string literal
+void json_print_string(FILE *fp, const void *data, size_t length);
+
 #endif // AESCRYPT_UTIL_H
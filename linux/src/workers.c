@@ -0,0 +1,176 @@
+/*
+ *  workers.c
+ *
+ *  Worker Pool for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      A simple pool of threads used to process independent work items,
+ *      such as separate files, in parallel.
+ *
+ *  Portability Issues:
+ *      Requires POSIX threads.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>  // malloc
+#include <unistd.h>  // sysconf
+#include <pthread.h>
+
+#include "probes.h"
+#include "workers.h"
+
+typedef struct {
+    pthread_mutex_t mutex;
+    unsigned next_item;
+    unsigned items;
+    unsigned failures;
+    worker_function function;
+    void *context;
+} worker_pool;
+
+/*
+ *  worker_thread
+ *
+ *  Description:
+ *      Thread body that takes work items from the pool until none remain.
+ *
+ *  Parameters:
+ *      arg [in]
+ *          The worker pool.
+ *
+ *  Returns:
+ *      NULL.
+ *
+ *  Comments:
+ *      None.
+ */
+static void *worker_thread(void *arg)
+{
+    worker_pool *pool = (worker_pool *) arg;
+    unsigned item;
+
+    while (1)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        item = pool->next_item;
+        if (item < pool->items) pool->next_item++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (item >= pool->items) break;
+        AESCRYPT_PROBE1(queue_depth, pool->items - item - 1);
+
+        if (pool->function(pool->context, item))
+        {
+            pthread_mutex_lock(&pool->mutex);
+            pool->failures++;
+            pthread_mutex_unlock(&pool->mutex);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ *  default_worker_count
+ *
+ *  Description:
+ *      Determine the default number of worker threads to use.
+ *
+ *  Parameters:
+ *      None.
+ *
+ *  Returns:
+ *      The number of online processors, or 1 if that cannot be determined.
+ *
+ *  Comments:
+ *      None.
+ */
+unsigned default_worker_count(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (cpus > 0) ? (unsigned) cpus : 1;
+}
+
+/*
+ *  run_workers
+ *
+ *  Description:
+ *      Call the given function once for each work item, using up to the
+ *      specified number of threads, and wait for all items to complete.
+ *
+ *  Parameters:
+ *      jobs [in]
+ *          The maximum number of threads to use (0 selects the default).
+ *
+ *      items [in]
+ *          The number of work items.
+ *
+ *      function [in]
+ *          The function to call for each item.
+ *
+ *      context [in]
+ *          Opaque context passed to the function.
+ *
+ *  Returns:
+ *      The number of work items that failed.
+ *
+ *  Comments:
+ *      Items are handed out in order, though they may complete in any
+ *      order.  If threads cannot be created, the remaining items are
+ *      processed by the calling thread.
+ */
+unsigned run_workers(unsigned jobs,
+                     unsigned items,
+                     worker_function function,
+                     void *context)
+{
+    worker_pool pool;
+    pthread_t *threads;
+    unsigned i, started = 0;
+
+    if (jobs == 0) jobs = default_worker_count();
+    if (jobs > items) jobs = items;
+
+    pthread_mutex_init(&pool.mutex, NULL);
+    pool.next_item = 0;
+    pool.items = items;
+    pool.failures = 0;
+    pool.function = function;
+    pool.context = context;
+    AESCRYPT_PROBE1(queue_depth, items);
+
+    if ((jobs > 1) &&
+        ((threads = malloc(jobs * sizeof(pthread_t))) != NULL))
+    {
+        for (started = 0; started < jobs; started++)
+        {
+            if (pthread_create(&threads[started],
+                               NULL,
+                               worker_thread,
+                               &pool))
+            {
+                break;
+            }
+        }
+
+        // The calling thread helps if not all threads could be started
+        if (started < jobs) worker_thread(&pool);
+
+        for (i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+        free(threads);
+    }
+    else
+    {
+        worker_thread(&pool);
+    }
+
+    pthread_mutex_destroy(&pool.mutex);
+
+    return pool.failures;
+}
@@ -0,0 +1,29 @@
+/*
+ *  workers.h
+ *
+ *  Worker Pool for AES Crypt
+ *  Copyright (C) 2022
+ *  Paul E. Jones <paulej@packetizer.com>
+ *
+ *  Description:
+ *      A simple pool of threads used to process independent work items,
+ *      such as separate files, in parallel.
+ *
+ *  Portability Issues:
+ *      Requires POSIX threads.
+ */
+
+#ifndef AESCRYPT_WORKERS_H
+#define AESCRYPT_WORKERS_H
+
+// Function called for each work item; returns 0 on success
+typedef int (*worker_function)(void *context, unsigned item);
+
+// Function prototypes
+unsigned default_worker_count(void);
+unsigned run_workers(unsigned jobs,
+                     unsigned items,
+                     worker_function function,
+                     void *context);
+
+#endif // AESCRYPT_WORKERS_H
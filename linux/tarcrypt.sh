@@ -30,6 +30,9 @@ usage ()
                        : If not specified in the commnand, you'll be prompted for it
 
         -f | --force   : Overwrite existing files
+
+    An archive can be created and extracted by aescrypt itself, without tar,
+    gzip, or a pipeline, using "aescrypt -e -a -z <level>" and "aescrypt -d -a".
 __EOF__
 }
 